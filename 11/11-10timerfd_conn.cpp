@@ -0,0 +1,183 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <libgen.h>
+#include <sys/epoll.h>
+#include "timer_service.h"
+
+// 11-3nonactive_conn.cpp的timerfd/signalfd版本：
+// 不再用alarm + 信号处理函数 + socketpair，每个连接的超时按时到期（最多晚CONN_SLACK，相近的一起处理），
+// 没有连接时epoll_wait一直阻塞
+
+#define FD_LIMIT 65535
+#define MAX_EVENT_NUMBER 1024
+#define BUFFER_SIZE 64
+#define CONN_TIMEOUT 15000000000ll // 连接15秒没有数据就关闭，单位纳秒
+#define CONN_SLACK 1000000000ll    // 关闭空闲连接可以晚1秒，相近的超时合并成一次唤醒
+
+struct client_data {
+    sockaddr_in address;
+    int sockfd;
+    char buf[BUFFER_SIZE];
+    dheap_timer * timer;
+};
+
+static timer_service * timers;
+static int epollfd = 0;
+
+int setnonblocking(int fd) {
+    int old_option = fcntl(fd, F_GETFL);
+    int new_option = old_option | O_NONBLOCK;
+    fcntl(fd, F_SETFL, new_option);
+    return old_option;
+}
+
+void addfd(int epollfd, int fd) {
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = EPOLLIN | EPOLLET;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+    setnonblocking(fd);
+}
+
+void close_conn(client_data * user_data) {
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
+    close(user_data->sockfd);
+    timers->destroy(user_data->timer);
+    user_data->timer = NULL;
+}
+
+// 定时器到期：连接太久没活动，关闭它
+void cb_func(dheap_timer * timer) {
+    client_data * user_data = (client_data *)timer->user_data;
+    assert(user_data);
+    printf("close fd %d\n", user_data->sockfd);
+    close_conn(user_data);
+}
+
+int main(int argc, char * argv[]) {
+    if (argc <= 2) {
+        printf("usage: %s ip_address port_number\n", basename(argv[0]));
+        return 1;
+    }
+    const char * ip = argv[1];
+    int port = atoi(argv[2]);
+
+    int ret = 0;
+    struct sockaddr_in address;
+    bzero(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &address.sin_addr);
+    address.sin_port = htons(port);
+
+    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    assert(listenfd >= 0);
+
+    ret = bind(listenfd, (struct sockaddr *)&address, sizeof(address));
+    assert(ret != -1);
+
+    ret = listen(listenfd, 5);
+    assert(ret != -1);
+
+    epoll_event events[MAX_EVENT_NUMBER];
+    epollfd = epoll_create(5);
+    assert(epollfd != -1);
+    addfd(epollfd, listenfd);
+
+    // 信号和定时器都变成epoll里的普通可读事件
+    signal_channel signals;
+    signals.add(SIGTERM);
+    signals.add(SIGINT);
+    addfd(epollfd, signals.fd());
+
+    timer_service service;
+    timers = &service;
+    addfd(epollfd, service.fd());
+
+    client_data * users = new client_data[FD_LIMIT];
+    bool stop_server = false;
+    int64_t start = dheap::now_ns();
+
+    while (!stop_server) {
+        // 信号被屏蔽并由signalfd接收，这里不会出现EINTR
+        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        if (number < 0) {
+            printf("epoll failure\n");
+            break;
+        }
+
+        for (int i = 0; i < number; i++) {
+
+            int sockfd = events[i].data.fd;
+
+            if (sockfd == listenfd) {
+
+                struct sockaddr_in client_address;
+                socklen_t client_addrlength = sizeof(client_address);
+                int connfd;
+                // 边沿触发，一次把等待的连接全部接受
+                while ((connfd = accept(listenfd, (struct sockaddr *)&client_address, &client_addrlength)) >= 0) {
+                    if (connfd >= FD_LIMIT) {
+                        close(connfd);
+                        continue;
+                    }
+                    addfd(epollfd, connfd);
+                    users[connfd].address = client_address;
+                    users[connfd].sockfd = connfd;
+                    users[connfd].timer = timers->create(cb_func, &users[connfd], CONN_SLACK);
+                    timers->add_timer(users[connfd].timer, CONN_TIMEOUT);
+                }
+
+            } else if (sockfd == service.fd()) {
+                service.handle_expired();
+            } else if (sockfd == signals.fd()) {
+                int sig;
+                while ((sig = signals.read()) > 0) {
+                    if (sig == SIGTERM || sig == SIGINT) {
+                        stop_server = true;
+                    }
+                }
+            } else if (events[i].events & EPOLLIN) {
+                if (!users[sockfd].timer) {
+                    continue; // 本轮中已因超时被关闭
+                }
+                while (true) {
+                    memset(users[sockfd].buf, '\0', BUFFER_SIZE);
+                    ret = recv(sockfd, users[sockfd].buf, BUFFER_SIZE - 1, 0);
+                    if (ret < 0) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                            close_conn(&users[sockfd]);
+                        }
+                        break;
+                    } else if (ret == 0) {
+                        close_conn(&users[sockfd]);
+                        break;
+                    }
+                    printf("get %d bytes of client data %s from %d\n", ret, users[sockfd].buf, sockfd);
+                    // 有数据就把超时往后推，堆中就地调整
+                    timers->add_timer(users[sockfd].timer, CONN_TIMEOUT);
+                }
+            } else {
+                // others
+            }
+        }
+    }
+
+    double seconds = (dheap::now_ns() - start) / 1e9;
+    printf("%lld timer wakeups in %.1f s (%.2f/s), %lld timers fired\n", (long long)service.wakeups(), seconds,
+           seconds > 0 ? service.wakeups() / seconds : 0, (long long)service.fired());
+
+    close(listenfd);
+    close(epollfd);
+    delete[] users;
+    return 0;
+}
@@ -10,17 +10,28 @@
 #include <string.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <libgen.h>
 #include <sys/epoll.h>
-#include <pthread.h>
-#include "lst_timer.h"
+#include "event_loop.h"
+
+// 用event_loop处理非活动连接：每个连接一个定时器，事件循环按最近的到期时刻设置epoll_wait的超时，
+// 不再需要alarm、信号处理函数和socketpair；SIGTERM经signalfd送达
 
 #define FD_LIMIT 65535
-#define MAX_EVENT_NUMBER 1024
+#define BUFFER_SIZE 64
 #define TIMESLOT 5
+#define CONN_TIMEOUT (3 * TIMESLOT * 1000000000ll) // 连接15秒没有数据就关闭，单位纳秒
+
+struct client_data {
+    sockaddr_in address;
+    int sockfd;
+    char buf[BUFFER_SIZE];
+    dheap_timer * timer;
+    event_handler handler;
+};
 
-static int pipefd[2];
-static sort_timer_lst timer_lst;
-static int epollfd = 0;
+static event_loop * loop;
+static client_data * users;
 
 int setnonblocking(int fd) {
     int old_option = fcntl(fd, F_GETFL);
@@ -29,42 +40,64 @@ int setnonblocking(int fd) {
     return old_option;
 }
 
-void addfd(int epollfd, int fd) {
-    epoll_event event;
-    event.data.fd = fd;
-    event.events = EPOLLIN | EPOLLET;
-    epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-    setnonblocking(fd);
-}
-
-// 收到信号就往pipefd[1]中发数据
-void sig_handler(int sig) {
-    int save_errno = errno;
-    int msg = sig;
-    send(pipefd[1], (char *)&msg, 1, 0);
-    errno = save_errno;
+void close_conn(client_data * user_data) {
+    loop->remove(&user_data->handler);
+    close(user_data->sockfd);
+    loop->destroy_timer(user_data->timer);
+    user_data->timer = NULL;
 }
 
-void addsig(int sig) {
-    struct sigaction sa;
-    memset(&sa, '\0', sizeof(sa));
-    sa.sa_handler = sig_handler;
-    sa.sa_flags |= SA_RESTART;
-    sigfillset(&sa.sa_mask);
-    assert(sigaction(sig, &sa, NULL) != -1);
+// 定时器到期：连接太久没活动，关闭它
+void cb_func(dheap_timer * timer) {
+    client_data * user_data = (client_data *)timer->user_data;
+    assert(user_data);
+    printf("close fd %d\n", user_data->sockfd);
+    close_conn(user_data);
 }
 
-void timer_handler() {
-    timer_lst.tick();
-    alarm(TIMESLOT);
+void on_client(event_handler * handler, uint32_t events) {
+    client_data * user_data = (client_data *)handler->user_data;
+    int sockfd = handler->fd;
+    while (true) {
+        memset(user_data->buf, '\0', BUFFER_SIZE);
+        int ret = recv(sockfd, user_data->buf, BUFFER_SIZE - 1, 0);
+        if (ret < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close_conn(user_data);
+            }
+            break;
+        } else if (ret == 0) {
+            close_conn(user_data);
+            break;
+        }
+        printf("get %d bytes of client data %s from %d\n", ret, user_data->buf, sockfd);
+        // 有数据就把超时往后推
+        printf("adjust timer once\n");
+        loop->add_timer(user_data->timer, CONN_TIMEOUT);
+    }
 }
 
-void cb_func(client_data * user_data) {
-    // 删除文件描述符对应的epoll
-    epoll_ctl(epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
-    assert(user_data);
-    close(user_data->sockfd);
-    printf("close fd %d\n", user_data->sockfd);
+void on_accept(event_handler * handler, uint32_t events) {
+    struct sockaddr_in client_address;
+    socklen_t client_addrlength = sizeof(client_address);
+    int connfd;
+    // 边沿触发，一次把等待的连接全部接受
+    while ((connfd = accept(handler->fd, (struct sockaddr *)&client_address, &client_addrlength)) >= 0) {
+        if (connfd >= FD_LIMIT) {
+            close(connfd);
+            continue;
+        }
+        client_data * user_data = &users[connfd];
+        user_data->address = client_address;
+        user_data->sockfd = connfd;
+        user_data->handler.fd = connfd;
+        user_data->handler.handle_event = on_client;
+        user_data->handler.user_data = user_data;
+        setnonblocking(connfd);
+        loop->add(&user_data->handler, EPOLLIN | EPOLLET);
+        user_data->timer = loop->create_timer(cb_func, user_data); // 创建一个定时器
+        loop->add_timer(user_data->timer, CONN_TIMEOUT);
+    }
 }
 
 int main(int argc, char * argv[]) {
@@ -91,126 +124,24 @@ int main(int argc, char * argv[]) {
     ret = listen(listenfd, 5);
     assert(ret != -1);
 
-    epoll_event events[MAX_EVENT_NUMBER];
-    int epollfd = epoll_create(5);
-    assert(epollfd != -1);
-    addfd(epollfd, listenfd);
+    event_loop main_loop;
+    loop = &main_loop;
+    loop->add_signal(SIGTERM, event_loop::quit_on_signal, loop);
 
-    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd);
-    assert(ret != -1);
-    setnonblocking(pipefd[1]);
-    addfd(epollfd, pipefd[0]);
-
-    // add all the interesting signals here
-    addsig(SIGALRM);
-    addsig(SIGTERM);
-    bool stop_server = false;
-
-    client_data * users = new client_data[FD_LIMIT];
-    bool timeout = false;
-    alarm(TIMESLOT);
-
-    while (!stop_server) {
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
-        if ((number < 0) && (errno != EINTR)) { // errno != EINTR 表明不是信号处理产生的软中断
-            printf("epoll failure\n");
-            break;
-        }
+    users = new client_data[FD_LIMIT];
 
-        for (int i = 0; i < number; i++) {
-
-            int sockfd = events[i].data.fd;
-
-            if (sockfd == listenfd) {
-
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-
-                int connfd = accept(listenfd, (struct sockaddr *)&client_address, &client_addrlength);
-                
-                addfd(epollfd, connfd);
-
-                users[connfd].address = client_address;
-                users[connfd].sockfd = connfd;
-
-                util_timer * timer = new util_timer; // 创建一个定时器
-                timer->user_data = &users[connfd]; // 将用户数据传入定时器
-                timer->cb_func = cb_func; // 定义定时器的回调函数
-                time_t cur = time(NULL); // 获取系统当前时间
-                timer->expire = cur + 3 * TIMESLOT; // 设置定时器时间
-                users[connfd].timer = timer;
-                timer_lst.add_timer(timer); // 将定时器加入链表中
-
-            } else if ((sockfd == pipefd[0]) && (events[i].events & EPOLLIN)) {
-                // 收到来着pipefd[1]的数据
-                int sig;
-                char signals[1024];
-                // 接收来了的数据
-                ret = recv(pipefd[0], signals, sizeof(signals), 0);
-                if (ret == -1) {
-                    // handle the error
-                    continue;
-                } else if (ret == 0) {
-                    continue;
-                } else {
-                    for (int i = 0; i < ret; ++i) {
-                        switch (signals[i]) {
-                            case SIGALRM: {
-                                timeout = true;
-                                break;
-                            }
-                            case SIGTERM: {
-                                stop_server = true;
-                            }
-                        }
-                    }
-                }
-            } else if (events[i].events & EPOLLIN) {
-                // 真正的来了数据
-                memset(users[sockfd].buf, '\0', BUFFER_SIZE);
-
-                ret = recv(sockfd, users[sockfd].buf, BUFFER_SIZE - 1, 0);
-                printf("get %d bytes of client data %s from %d\n", ret, users[sockfd].buf, sockfd);
-
-                // 取出此用于通信的描述符对应的定时器
-                util_timer * timer = users[sockfd].timer;
-                if (ret < 0) {
-                    if (errno != EAGAIN) {
-                        cb_func(&users[sockfd]);
-                        if (timer) {
-                            timer_lst.del_timer(timer);
-                        }
-                    }
-                } else if (ret == 0) {
-                    cb_func(&users[sockfd]);
-                    if (timer) {
-                        timer_lst.del_timer(timer);
-                    }
-                } else {
-                    //send( sockfd, users[sockfd].buf, BUFFER_SIZE-1, 0 );
-                    if (timer) {
-                        // 修改定时器时间
-                        time_t cur = time(NULL);
-                        timer->expire = cur + 3 * TIMESLOT;
-                        printf("adjust timer once\n");
-                        timer_lst.adjust_timer(timer);
-                    }
-                }
-            } else {
-                // others
-            }
-        }
+    event_handler listen_handler;
+    listen_handler.fd = listenfd;
+    listen_handler.handle_event = on_accept;
+    listen_handler.user_data = NULL;
+    setnonblocking(listenfd);
+    loop->add(&listen_handler, EPOLLIN | EPOLLET);
 
-        // 太久没活动则处理掉
-        if (timeout) {
-            timer_handler();
-            timeout = false;
-        }
+    if (!loop->run()) {
+        printf("epoll failure\n");
     }
 
     close(listenfd);
-    close(pipefd[1]);
-    close(pipefd[0]);
     delete[] users;
     return 0;
 }
@@ -0,0 +1,253 @@
+#ifndef HIERARCHICAL_WHEEL_TIMER
+#define HIERARCHICAL_WHEEL_TIMER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// 多级时间轮：第0级256个槽，每槽1毫秒；第1~4级各64个槽，每槽的跨度依次乘64，
+// 共覆盖2^32毫秒（约49天）。到达上一级槽的边界时把其中的定时器重新分配（级联）到下级。
+// 定时器节点嵌入在所属对象（如连接）里，添加、删除、重设都是O(1)且不分配内存：
+//     struct client_data { int sockfd; ...; hw_timer timer; };
+//     client_data* user = HW_TIMER_OWNER( timer, client_data, timer );
+#define HW_TIMER_OWNER( ptr, type, member ) ( ( type* )( ( char* )( ptr ) - offsetof( type, member ) ) )
+
+class hw_timer
+{
+public:
+    hw_timer() : next( NULL ), pprev( NULL ), expires( 0 ), cb_func( NULL ) {}
+    bool pending() const { return pprev != NULL; }
+
+public:
+    hw_timer* next;
+    hw_timer** pprev;       // 指向前一个节点的next（或槽头），不在轮中时为NULL
+    uint64_t expires;       // 到期时刻，毫秒
+    void ( *cb_func )( hw_timer* );
+};
+
+class hw_wheel
+{
+public:
+    static uint64_t now_ms()
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+    }
+
+    explicit hw_wheel( uint64_t now = now_ms() ) : m_current( now ), m_count( 0 )
+    {
+        for( int i = 0; i < ROOT_SIZE; ++i )
+        {
+            m_root[i] = NULL;
+        }
+        for( int l = 0; l < LEVELS; ++l )
+        {
+            for( int i = 0; i < LEVEL_SIZE; ++i )
+            {
+                m_level[l][i] = NULL;
+            }
+        }
+    }
+    // 定时器属于使用者，这里只把它们摘下来
+    ~hw_wheel()
+    {
+        for( int i = 0; i < ROOT_SIZE; ++i )
+        {
+            detach_all( &m_root[i] );
+        }
+        for( int l = 0; l < LEVELS; ++l )
+        {
+            for( int i = 0; i < LEVEL_SIZE; ++i )
+            {
+                detach_all( &m_level[l][i] );
+            }
+        }
+    }
+
+    // timeout毫秒后到期；定时器已在轮中时先摘下，即重新设置
+    void add_timer( hw_timer* timer, uint64_t timeout )
+    {
+        if( timer->pending() )
+        {
+            unlink( timer );
+        }
+        timer->expires = m_current + ( timeout > MAX_TIMEOUT ? MAX_TIMEOUT : timeout );
+        insert( timer );
+    }
+    void del_timer( hw_timer* timer )
+    {
+        if( timer->pending() )
+        {
+            unlink( timer );
+        }
+    }
+
+    // 处理到now（含）为止的所有到期定时器，返回触发的个数。回调里可以重新添加或删除任意定时器
+    int tick( uint64_t now = now_ms() )
+    {
+        int fired = 0;
+        if( m_count == 0 )
+        {
+            m_current = now >= m_current ? now + 1 : m_current;
+            return 0;
+        }
+        while( m_current <= now )
+        {
+            int index = m_current & ROOT_MASK;
+            if( index == 0 )
+            {
+                // 依次检查各级是否到了槽边界
+                for( int l = 0; l < LEVELS && cascade( l ) == 0; ++l )
+                {
+                }
+            }
+            // 先把本槽整体移到局部链表再推进时间，回调中新加的定时器不会落回这里
+            hw_timer* work = m_root[ index ];
+            m_root[ index ] = NULL;
+            if( work )
+            {
+                work->pprev = &work;
+            }
+            ++m_current;
+            while( work )
+            {
+                hw_timer* timer = work;
+                unlink( timer );
+                ++fired;
+                timer->cb_func( timer );
+            }
+        }
+        return fired;
+    }
+
+    // 距最近一次到期（或需要级联）的毫秒数，没有定时器时返回-1。可能偏早，但不会晚于真正的到期时间
+    int64_t next_timeout( uint64_t now = now_ms() ) const
+    {
+        if( m_count == 0 )
+        {
+            return -1;
+        }
+        uint64_t next = UINT64_MAX;
+        for( int i = 0; i < ROOT_SIZE; ++i )
+        {
+            if( m_root[ ( m_current + i ) & ROOT_MASK ] )
+            {
+                next = m_current + i;
+                break;
+            }
+        }
+        // 上级槽在边界时刻级联，从最后处理过的那一毫秒之后的边界开始找
+        for( int l = 0; l < LEVELS; ++l )
+        {
+            int shift = ROOT_BITS + l * LEVEL_BITS;
+            uint64_t base = ( m_current - 1 ) >> shift;
+            for( int i = 1; i <= LEVEL_SIZE; ++i )
+            {
+                uint64_t start = ( base + i ) << shift;
+                if( start >= next )
+                {
+                    break;
+                }
+                if( m_level[l][ ( base + i ) & LEVEL_MASK ] )
+                {
+                    next = start;
+                    break;
+                }
+            }
+        }
+        return next <= now ? 0 : ( int64_t )( next - now );
+    }
+
+    size_t size() const { return m_count; }
+
+private:
+    static const int ROOT_BITS = 8;
+    static const int LEVEL_BITS = 6;
+    static const int LEVELS = 4;
+    static const int ROOT_SIZE = 1 << ROOT_BITS;
+    static const int LEVEL_SIZE = 1 << LEVEL_BITS;
+    static const int ROOT_MASK = ROOT_SIZE - 1;
+    static const int LEVEL_MASK = LEVEL_SIZE - 1;
+    static const uint64_t MAX_TIMEOUT = ( 1ull << ( ROOT_BITS + LEVELS * LEVEL_BITS ) ) - 1;
+
+    void insert( hw_timer* timer )
+    {
+        uint64_t expires = timer->expires;
+        uint64_t idx = expires - m_current;
+        hw_timer** slot;
+        if( expires < m_current )
+        {
+            // 已经过期的放到下一个要处理的槽
+            slot = &m_root[ m_current & ROOT_MASK ];
+        }
+        else if( idx < ( 1ull << ROOT_BITS ) )
+        {
+            slot = &m_root[ expires & ROOT_MASK ];
+        }
+        else
+        {
+            int l = 0;
+            while( l < LEVELS - 1 && idx >= ( 1ull << ( ROOT_BITS + ( l + 1 ) * LEVEL_BITS ) ) )
+            {
+                ++l;
+            }
+            slot = &m_level[l][ ( expires >> ( ROOT_BITS + l * LEVEL_BITS ) ) & LEVEL_MASK ];
+        }
+        timer->next = *slot;
+        if( *slot )
+        {
+            ( *slot )->pprev = &timer->next;
+        }
+        timer->pprev = slot;
+        *slot = timer;
+        ++m_count;
+    }
+
+    void unlink( hw_timer* timer )
+    {
+        *timer->pprev = timer->next;
+        if( timer->next )
+        {
+            timer->next->pprev = timer->pprev;
+        }
+        timer->next = NULL;
+        timer->pprev = NULL;
+        --m_count;
+    }
+
+    // 把第l级当前槽的定时器重新插入，返回该槽下标（为0说明上一级也到了边界）
+    int cascade( int l )
+    {
+        int index = ( m_current >> ( ROOT_BITS + l * LEVEL_BITS ) ) & LEVEL_MASK;
+        hw_timer* list = m_level[l][ index ];
+        m_level[l][ index ] = NULL;
+        while( list )
+        {
+            hw_timer* timer = list;
+            list = list->next;
+            --m_count;
+            insert( timer );
+        }
+        return index;
+    }
+
+    static void detach_all( hw_timer** slot )
+    {
+        while( *slot )
+        {
+            hw_timer* timer = *slot;
+            *slot = timer->next;
+            timer->next = NULL;
+            timer->pprev = NULL;
+        }
+    }
+
+private:
+    hw_timer* m_root[ ROOT_SIZE ];
+    hw_timer* m_level[ LEVELS ][ LEVEL_SIZE ];
+    uint64_t m_current;     // 下一个要处理的毫秒
+    size_t m_count;
+};
+
+#endif
@@ -0,0 +1,305 @@
+#ifndef DHEAP_TIMER
+#define DHEAP_TIMER
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// 带索引的4叉最小堆定时器。每个定时器记录自己在堆数组中的下标，
+// 所以删除是真正从堆里移除，调整到期时间（延后或提前）也都是O(log n)。
+// 堆数组里直接存到期时间，上滤/下滤时比较不需要访问定时器本身；数组元素少于容量的1/4时收缩。
+// 时间用CLOCK_MONOTONIC，单位纳秒。定时器节点从定时器池中分配，用完放回池里。
+// 每个定时器可以指定slack（可接受的延迟）：实际到期时刻向上对齐到不超过slack的最大2的幂的整数倍，
+// 仍在[expire, expire + slack]内，到期时间相近的定时器对齐到同一时刻，一次唤醒一起处理
+class dheap_timer
+{
+public:
+    dheap_timer() : expire( 0 ), slack( 0 ), index( -1 ), cb_func( NULL ), user_data( NULL ), next_free( NULL ) {}
+    bool pending() const { return index >= 0; }
+
+public:
+    int64_t expire;         // 到期时刻（已按slack对齐），纳秒
+    int64_t slack;          // 可接受的延迟，纳秒，0表示准时
+    int index;              // 在堆数组中的下标，不在堆中时为-1
+    void ( *cb_func )( dheap_timer* );
+    void* user_data;
+    dheap_timer* next_free;
+};
+
+class dheap_timer_pool
+{
+public:
+    dheap_timer_pool() : m_free( NULL ), m_chunks( NULL ) {}
+    ~dheap_timer_pool()
+    {
+        while( m_chunks )
+        {
+            chunk* next = m_chunks->next;
+            delete m_chunks;
+            m_chunks = next;
+        }
+    }
+
+    dheap_timer* alloc()
+    {
+        if( ! m_free )
+        {
+            chunk* c = new chunk;
+            c->next = m_chunks;
+            m_chunks = c;
+            for( int i = CHUNK_SIZE - 1; i >= 0; --i )
+            {
+                c->timers[i].next_free = m_free;
+                m_free = &c->timers[i];
+            }
+        }
+        dheap_timer* timer = m_free;
+        m_free = timer->next_free;
+        *timer = dheap_timer();
+        return timer;
+    }
+    void free( dheap_timer* timer )
+    {
+        timer->next_free = m_free;
+        m_free = timer;
+    }
+
+private:
+    static const int CHUNK_SIZE = 1024;
+    struct chunk
+    {
+        dheap_timer timers[ CHUNK_SIZE ];
+        chunk* next;
+    };
+
+    dheap_timer* m_free;
+    chunk* m_chunks;
+};
+
+class dheap
+{
+public:
+    static int64_t now_ns()
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+    }
+
+    explicit dheap( int cap = 64 ) : m_array( NULL ), m_capacity( 0 ), m_size( 0 ), m_min_capacity( cap > 4 ? cap : 4 )
+    {
+        reserve( m_min_capacity );
+    }
+    ~dheap()
+    {
+        for( int i = 0; i < m_size; ++i )
+        {
+            m_array[i].timer->index = -1;
+        }
+        delete [] m_array;
+    }
+
+    // 从池中取一个定时器，返回前尚未加入堆
+    dheap_timer* create( void ( *cb_func )( dheap_timer* ), void* user_data, int64_t slack = 0 )
+    {
+        dheap_timer* timer = m_pool.alloc();
+        timer->cb_func = cb_func;
+        timer->user_data = user_data;
+        timer->slack = slack;
+        return timer;
+    }
+    // 从堆中删除（如果还在）并放回池里
+    void destroy( dheap_timer* timer )
+    {
+        del_timer( timer );
+        m_pool.free( timer );
+    }
+
+    // delay纳秒后到期。已在堆中的定时器就地调整位置，相当于reschedule
+    void add_timer( dheap_timer* timer, int64_t delay )
+    {
+        set_expire( timer, now_ns() + delay );
+    }
+    void set_expire( dheap_timer* timer, int64_t expire )
+    {
+        expire = coalesce( expire, timer->slack );
+        timer->expire = expire;
+        if( timer->pending() )
+        {
+            int i = timer->index;
+            m_array[i].expire = expire;
+            if( i > 0 && expire < m_array[ ( i - 1 ) / ARITY ].expire )
+            {
+                sift_up( i );
+            }
+            else
+            {
+                sift_down( i );
+            }
+            return;
+        }
+        if( m_size == m_capacity )
+        {
+            reserve( m_capacity * 2 );
+        }
+        int i = m_size++;
+        m_array[i].expire = expire;
+        m_array[i].timer = timer;
+        timer->index = i;
+        sift_up( i );
+    }
+    void del_timer( dheap_timer* timer )
+    {
+        if( ! timer->pending() )
+        {
+            return;
+        }
+        int i = timer->index;
+        timer->index = -1;
+        if( i != --m_size )
+        {
+            // 用最后一个元素填补空位，再按它的到期时间上滤或下滤
+            m_array[i] = m_array[ m_size ];
+            m_array[i].timer->index = i;
+            if( i > 0 && m_array[i].expire < m_array[ ( i - 1 ) / ARITY ].expire )
+            {
+                sift_up( i );
+            }
+            else
+            {
+                sift_down( i );
+            }
+        }
+        if( m_size < m_capacity / 4 && m_capacity > m_min_capacity )
+        {
+            reserve( m_capacity / 2 );
+        }
+    }
+
+    dheap_timer* top() const
+    {
+        return m_size > 0 ? m_array[0].timer : NULL;
+    }
+
+    // 执行所有到期的定时器，返回个数。回调执行时定时器已出堆，可以在回调里重新添加或destroy
+    int tick( int64_t now = now_ns() )
+    {
+        int fired = 0;
+        while( m_size > 0 && m_array[0].expire <= now )
+        {
+            dheap_timer* timer = m_array[0].timer;
+            del_timer( timer );
+            ++fired;
+            timer->cb_func( timer );
+        }
+        return fired;
+    }
+
+    // 距堆顶到期的毫秒数（向上取整），堆为空时返回-1，可直接作为epoll_wait的超时
+    int next_timeout( int64_t now = now_ns() ) const
+    {
+        if( m_size == 0 )
+        {
+            return -1;
+        }
+        int64_t delta = m_array[0].expire - now;
+        if( delta <= 0 )
+        {
+            return 0;
+        }
+        int64_t ms = ( delta + 999999 ) / 1000000;
+        return ms > 0x7fffffff ? 0x7fffffff : ( int )ms;
+    }
+
+    bool empty() const { return m_size == 0; }
+    int size() const { return m_size; }
+
+    // expire向上对齐到粒度g，g是不超过slack的最大2的幂。唤醒次数由g决定，平均只推迟g/2
+    static int64_t coalesce( int64_t expire, int64_t slack )
+    {
+        if( slack <= 0 )
+        {
+            return expire;
+        }
+        int64_t g = 1ll << ( 63 - __builtin_clzll( slack ) );
+        return ( expire + g - 1 ) / g * g;
+    }
+
+private:
+    static const int ARITY = 4;
+    struct entry
+    {
+        int64_t expire;
+        dheap_timer* timer;
+    };
+
+    void sift_up( int i )
+    {
+        entry e = m_array[i];
+        while( i > 0 )
+        {
+            int parent = ( i - 1 ) / ARITY;
+            if( m_array[ parent ].expire <= e.expire )
+            {
+                break;
+            }
+            m_array[i] = m_array[ parent ];
+            m_array[i].timer->index = i;
+            i = parent;
+        }
+        m_array[i] = e;
+        e.timer->index = i;
+    }
+    void sift_down( int i )
+    {
+        entry e = m_array[i];
+        for( ;; )
+        {
+            int first = i * ARITY + 1;
+            if( first >= m_size )
+            {
+                break;
+            }
+            int last = first + ARITY < m_size ? first + ARITY : m_size;
+            int child = first;
+            for( int c = first + 1; c < last; ++c )
+            {
+                if( m_array[c].expire < m_array[ child ].expire )
+                {
+                    child = c;
+                }
+            }
+            if( m_array[ child ].expire >= e.expire )
+            {
+                break;
+            }
+            m_array[i] = m_array[ child ];
+            m_array[i].timer->index = i;
+            i = child;
+        }
+        m_array[i] = e;
+        e.timer->index = i;
+    }
+
+    // 内存不足时new抛出std::bad_alloc
+    void reserve( int capacity )
+    {
+        entry* temp = new entry[ capacity ];
+        if( m_size > 0 )
+        {
+            memcpy( temp, m_array, m_size * sizeof( entry ) );
+        }
+        delete [] m_array;
+        m_array = temp;
+        m_capacity = capacity;
+    }
+
+private:
+    entry* m_array;
+    int m_capacity;
+    int m_size;
+    int m_min_capacity;
+    dheap_timer_pool m_pool;
+};
+
+#endif
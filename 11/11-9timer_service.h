@@ -0,0 +1,162 @@
+#ifndef TIMER_SERVICE
+#define TIMER_SERVICE
+
+#include <exception>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include "dheap_timer.h"
+
+// 用一个timerfd驱动堆中的所有定时器：timerfd总是设置为堆顶的到期时刻（绝对时间），
+// 堆为空时解除设置，空闲的服务器不会被唤醒。把fd()注册到epoll，可读时调用handle_expired()。
+// 给定时器设置slack可以把相近的到期合并成一次唤醒，wakeups()/fired()用来统计合并的效果
+class timer_service
+{
+public:
+    timer_service() : m_armed( 0 ), m_wakeups( 0 ), m_fired( 0 )
+    {
+        m_timerfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+        if( m_timerfd < 0 )
+        {
+            throw std::exception();
+        }
+    }
+    ~timer_service()
+    {
+        close( m_timerfd );
+    }
+
+    int fd() const { return m_timerfd; }
+
+    // slack为该定时器可接受的延迟，纳秒
+    dheap_timer* create( void ( *cb_func )( dheap_timer* ), void* user_data, int64_t slack = 0 )
+    {
+        return m_heap.create( cb_func, user_data, slack );
+    }
+    void destroy( dheap_timer* timer )
+    {
+        m_heap.destroy( timer );
+        rearm();
+    }
+    // delay纳秒后到期，已在堆中的定时器被重新设置
+    void add_timer( dheap_timer* timer, int64_t delay )
+    {
+        m_heap.add_timer( timer, delay );
+        rearm();
+    }
+    void del_timer( dheap_timer* timer )
+    {
+        m_heap.del_timer( timer );
+        rearm();
+    }
+    // 设置绝对到期时刻（CLOCK_MONOTONIC，纳秒）
+    void set_expire( dheap_timer* timer, int64_t expire )
+    {
+        m_heap.set_expire( timer, expire );
+        rearm();
+    }
+
+    // timerfd可读时调用，执行所有到期的定时器并返回个数
+    int handle_expired()
+    {
+        uint64_t expirations;
+        while( read( m_timerfd, &expirations, sizeof( expirations ) ) < 0 && errno == EINTR )
+        {
+        }
+        // timerfd已经触发，不再处于设置状态
+        m_armed = 0;
+        int fired = m_heap.tick( dheap::now_ns() );
+        rearm();
+        ++m_wakeups;
+        m_fired += fired;
+        return fired;
+    }
+
+    int size() const { return m_heap.size(); }
+    // timerfd的唤醒次数和执行过的定时器个数
+    int64_t wakeups() const { return m_wakeups; }
+    int64_t fired() const { return m_fired; }
+
+private:
+    // 只有最早的到期时刻变化时才调用timerfd_settime
+    void rearm()
+    {
+        dheap_timer* top = m_heap.top();
+        int64_t expire = top ? top->expire : 0;
+        if( expire == m_armed )
+        {
+            return;
+        }
+        struct itimerspec its;
+        memset( &its, 0, sizeof( its ) );
+        if( top )
+        {
+            // 0表示解除设置，已经过期的定时器设为1纳秒，让timerfd立即可读
+            int64_t when = expire > 0 ? expire : 1;
+            its.it_value.tv_sec = when / 1000000000;
+            its.it_value.tv_nsec = when % 1000000000;
+        }
+        timerfd_settime( m_timerfd, TFD_TIMER_ABSTIME, &its, NULL );
+        m_armed = expire;
+    }
+
+private:
+    int m_timerfd;
+    int64_t m_armed;        // timerfd当前设置的到期时刻，0表示未设置
+    int64_t m_wakeups;
+    int64_t m_fired;
+    dheap m_heap;
+};
+
+// 用signalfd接收信号：构造时阻塞这些信号，之后它们只会让fd()可读，
+// 不再有信号处理函数，系统调用也不会因为信号返回EINTR。
+// 需在创建其他线程之前构造，线程会继承信号屏蔽字
+class signal_channel
+{
+public:
+    signal_channel()
+    {
+        sigemptyset( &m_mask );
+        m_sigfd = signalfd( -1, &m_mask, SFD_NONBLOCK | SFD_CLOEXEC );
+        if( m_sigfd < 0 )
+        {
+            throw std::exception();
+        }
+    }
+    ~signal_channel()
+    {
+        close( m_sigfd );
+        pthread_sigmask( SIG_UNBLOCK, &m_mask, NULL );
+    }
+
+    int fd() const { return m_sigfd; }
+
+    void add( int sig )
+    {
+        sigaddset( &m_mask, sig );
+        pthread_sigmask( SIG_BLOCK, &m_mask, NULL );
+        signalfd( m_sigfd, &m_mask, 0 );
+    }
+
+    // fd()可读时循环调用，返回下一个待处理的信号，没有时返回-1
+    int read()
+    {
+        struct signalfd_siginfo info;
+        if( ::read( m_sigfd, &info, sizeof( info ) ) != sizeof( info ) )
+        {
+            return -1;
+        }
+        return info.ssi_signo;
+    }
+
+private:
+    int m_sigfd;
+    sigset_t m_mask;
+};
+
+#endif
@@ -14,6 +14,8 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <libgen.h>
+#include "event_loop.h"
 
 #define USER_LIMIT 5
 #define BUFFER_SIZE 1024
@@ -26,18 +28,18 @@ struct client_data {
     int connfd;
     pid_t pid;
     int pipefd[2];
+    event_handler handler; // 父进程中注册pipefd[0]
 };
 
 static const char * shm_name = "/my_shm";
-int sig_pipefd[2];
-int epollfd;
+event_loop * loop;
 int listenfd;
 int shmfd;
 char * share_mem = 0;
 client_data * users = 0;
 int * sub_process = 0;
 int user_count = 0;
-bool stop_child = false;
+bool terminate = false;
 
 int setnonblocking(int fd) {
     int old_option = fcntl(fd, F_GETFL);
@@ -46,100 +48,196 @@ int setnonblocking(int fd) {
     return old_option;
 }
 
-void addfd(int epollfd, int fd) {
-    epoll_event event;
-    event.data.fd = fd;
-    event.events = EPOLLIN | EPOLLET;
-    epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-    setnonblocking(fd);
-}
-
-void sig_handler(int sig) {
-    int save_errno = errno;
-    int msg = sig;
-    send(sig_pipefd[1], (char *)&msg, 1, 0);
-    errno = save_errno;
-}
-
-void addsig(int sig, void(*handler)(int), bool restart = true) {
-    struct sigaction sa;
-    memset(&sa, '\0', sizeof(sa));
-    sa.sa_handler = handler;
-    if (restart) {
-        sa.sa_flags |= SA_RESTART;
-    }
-    sigfillset(&sa.sa_mask);
-    assert(sigaction(sig, &sa, NULL) != -1);
+void addfd(event_loop * loop, event_handler * handler) {
+    loop->add(handler, EPOLLIN | EPOLLET);
+    setnonblocking(handler->fd);
 }
 
 void del_resource() {
-    close(sig_pipefd[0]);
-    close(sig_pipefd[1]);
     close(listenfd);
-    close(epollfd);
+    delete loop;
     shm_unlink(shm_name);
     delete[] users;
     delete[] sub_process;
 }
 
-void child_term_handler(int sig) {
-    stop_child = true;
+// 子进程：客户连接和与父进程之间的管道
+struct child_context {
+    int idx;
+    int connfd;
+    int pipefd;
+    event_loop * loop;
+};
+
+void on_child_conn(event_handler * handler, uint32_t events) {
+    child_context * ctx = (child_context *)handler->user_data;
+    int idx = ctx->idx;
+    memset(share_mem + idx * BUFFER_SIZE, '\0', BUFFER_SIZE);
+    int ret = recv(ctx->connfd, share_mem + idx * BUFFER_SIZE, BUFFER_SIZE - 1, 0);
+    if (ret < 0) {
+        if (errno != EAGAIN) {
+            ctx->loop->quit();
+        }
+    } else if (ret == 0) {
+        ctx->loop->quit();
+    } else {
+        send(ctx->pipefd, (char *)&idx, sizeof(idx), 0);
+    }
+}
+
+void on_child_pipe(event_handler * handler, uint32_t events) {
+    child_context * ctx = (child_context *)handler->user_data;
+    int client = 0;
+    int ret = recv(ctx->pipefd, (char *)&client, sizeof(client), 0);
+    if (ret < 0) {
+        if (errno != EAGAIN) {
+            ctx->loop->quit();
+        }
+    } else if (ret == 0) {
+        ctx->loop->quit();
+    } else {
+        send(ctx->connfd, share_mem + client * BUFFER_SIZE, BUFFER_SIZE, 0);
+    }
 }
 
 int run_child(int idx, client_data * users, char * share_mem) {
-    epoll_event events[MAX_EVENT_NUMBER];
-    int child_epollfd = epoll_create(5);
-    assert(child_epollfd != -1);
-    int connfd = users[idx].connfd;
-    addfd(child_epollfd, connfd);
-    int pipefd = users[idx].pipefd[1];
-    addfd(child_epollfd, pipefd);
-    int ret;
-    addsig(SIGTERM, child_term_handler, false);
+    event_loop child_loop;
+    child_context ctx;
+    ctx.idx = idx;
+    ctx.connfd = users[idx].connfd;
+    ctx.pipefd = users[idx].pipefd[1];
+    ctx.loop = &child_loop;
 
-    while (!stop_child) {
-        int number = epoll_wait(child_epollfd, events, MAX_EVENT_NUMBER, -1);
-        if ((number < 0) && (errno != EINTR)) {
-            printf("epoll failure\n");
-            break;
+    event_handler conn_handler;
+    conn_handler.fd = ctx.connfd;
+    conn_handler.handle_event = on_child_conn;
+    conn_handler.user_data = &ctx;
+    addfd(&child_loop, &conn_handler);
+    event_handler pipe_handler;
+    pipe_handler.fd = ctx.pipefd;
+    pipe_handler.handle_event = on_child_pipe;
+    pipe_handler.user_data = &ctx;
+    addfd(&child_loop, &pipe_handler);
+    child_loop.add_signal(SIGTERM, event_loop::quit_on_signal, &child_loop);
+
+    if (!child_loop.run()) {
+        printf("epoll failure\n");
+    }
+
+    close(ctx.connfd);
+    close(ctx.pipefd);
+    return 0;
+}
+
+// 父进程：某个子进程的客户发来了数据，通知其他子进程
+void on_parent_pipe(event_handler * handler, uint32_t events) {
+    int sockfd = handler->fd;
+    int child = 0;
+    int ret = recv(sockfd, (char *)&child, sizeof(child), 0);
+    printf("read data from child accross pipe\n");
+    if (ret <= 0) {
+        return;
+    }
+    for (int j = 0; j < user_count; ++j) {
+        if (users[j].pipefd[0] != sockfd) {
+            printf("send data to child accross pipe\n");
+            send(users[j].pipefd[0], (char *)&child, sizeof(child), 0);
         }
+    }
+}
 
-        for (int i = 0; i < number; i++) {
-            int sockfd = events[i].data.fd;
-            if ((sockfd == connfd) && (events[i].events & EPOLLIN)) {
-                memset(share_mem + idx * BUFFER_SIZE, '\0', BUFFER_SIZE);
-                ret = recv(connfd, share_mem + idx * BUFFER_SIZE, BUFFER_SIZE - 1, 0);
-                if (ret < 0) {
-                    if (errno != EAGAIN) {
-                        stop_child = true;
-                    }
-                } else if (ret == 0) {
-                    stop_child = true;
-                } else {
-                    send(pipefd, (char *)&idx, sizeof(idx), 0);
-                }
-            } else if ((sockfd == pipefd) && (events[i].events & EPOLLIN)) {
-                int client = 0;
-                ret = recv(sockfd, (char *)&client, sizeof(client), 0);
-                if (ret < 0) {
-                    if (errno != EAGAIN) {
-                        stop_child = true;
-                    }
-                } else if (ret == 0) {
-                    stop_child = true;
-                } else {
-                    send(connfd, share_mem + client * BUFFER_SIZE, BUFFER_SIZE, 0);
-                }
-            } else {
+void on_accept(event_handler * handler, uint32_t events) {
+    struct sockaddr_in client_address;
+    socklen_t client_addrlength = sizeof(client_address);
+    int connfd = accept(listenfd, (struct sockaddr *)&client_address, &client_addrlength);
+    if (connfd < 0) {
+        printf("errno is: %d\n", errno);
+        return;
+    }
+    if (user_count >= USER_LIMIT) {
+        const char * info = "too many users\n";
+        printf("%s", info);
+        send(connfd, info, strlen(info), 0);
+        close(connfd);
+        return;
+    }
+    users[user_count].address = client_address;
+    users[user_count].connfd = connfd;
+    int ret = socketpair(PF_UNIX, SOCK_STREAM, 0, users[user_count].pipefd);
+    assert(ret != -1);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(connfd);
+        return;
+    } else if (pid == 0) {
+        // 子进程不用父进程的事件循环，释放它（信号屏蔽字随之恢复），run_child再建自己的
+        delete loop;
+        close(listenfd);
+        close(users[user_count].pipefd[0]);
+        run_child(user_count, users, share_mem);
+        munmap((void *)share_mem, USER_LIMIT * BUFFER_SIZE);
+        exit(0);
+    } else {
+        close(connfd);
+        close(users[user_count].pipefd[1]);
+        users[user_count].handler.fd = users[user_count].pipefd[0];
+        users[user_count].handler.handle_event = on_parent_pipe;
+        users[user_count].handler.user_data = NULL;
+        addfd(loop, &users[user_count].handler);
+        users[user_count].pid = pid;
+        sub_process[pid] = user_count;
+        user_count++;
+    }
+}
+
+void on_signal(int sig, void * arg) {
+    switch (sig) {
+    case SIGCHLD:
+    {
+        pid_t pid;
+        int stat;
+        while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
+            int del_user = sub_process[pid];
+            sub_process[pid] = -1;
+            if ((del_user < 0) || (del_user > USER_LIMIT)) {
+                printf("the deleted user was not change\n");
                 continue;
             }
+            loop->remove(&users[del_user].handler);
+            close(users[del_user].pipefd[0]);
+            users[del_user] = users[--user_count];
+            sub_process[users[del_user].pid] = del_user;
+            // 被移动的用户换了位置，epoll_data.ptr要指向新的handler
+            if (del_user != user_count) {
+                loop->modify(&users[del_user].handler, EPOLLIN | EPOLLET);
+            }
+            printf("child %d exit, now we have %d users\n", del_user, user_count);
         }
+        if (terminate && user_count == 0) {
+            loop->quit();
+        }
+        break;
+    }
+    case SIGTERM:
+    case SIGINT:
+    {
+        printf("kill all the clild now\n");
+        if (user_count == 0) {
+            loop->quit();
+            break;
+        }
+        for (int i = 0; i < user_count; ++i) {
+            int pid = users[i].pid;
+            kill(pid, SIGTERM);
+        }
+        terminate = true;
+        break;
+    }
+    default:
+    {
+        break;
+    }
     }
-
-    close(connfd);
-    close(pipefd);
-    close(child_epollfd);
-    return 0;
 }
 
 int main(int argc, char * argv[]) {
@@ -174,25 +272,18 @@ int main(int argc, char * argv[]) {
         sub_process[i] = -1;
     }
 
-    epoll_event events[MAX_EVENT_NUMBER];
-
-    epollfd = epoll_create(5);
-    assert(epollfd != -1);
-
-    addfd(epollfd, listenfd);
-
-    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sig_pipefd);
-    assert(ret != -1);
-    
-    setnonblocking(sig_pipefd[1]);
-    addfd(epollfd, sig_pipefd[0]);
+    // 信号经signalfd成为事件循环中的普通事件
+    loop = new event_loop(MAX_EVENT_NUMBER);
+    event_handler listen_handler;
+    listen_handler.fd = listenfd;
+    listen_handler.handle_event = on_accept;
+    listen_handler.user_data = NULL;
+    loop->add(&listen_handler, EPOLLIN);
 
-    addsig(SIGCHLD, sig_handler);
-    addsig(SIGTERM, sig_handler);
-    addsig(SIGINT, sig_handler);
-    addsig(SIGPIPE, SIG_IGN);
-    bool stop_server = false;
-    bool terminate = false;
+    loop->add_signal(SIGCHLD, on_signal, NULL);
+    loop->add_signal(SIGTERM, on_signal, NULL);
+    loop->add_signal(SIGINT, on_signal, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
     shmfd = shm_open(shm_name, O_CREAT | O_RDWR, 0666);
     assert(shmfd != -1);
@@ -203,130 +294,8 @@ int main(int argc, char * argv[]) {
     assert(share_mem != MAP_FAILED);
     close(shmfd);
 
-    while (!stop_server) {
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
-        if ((number < 0) && (errno != EINTR)) {
-            printf("epoll failure\n");
-            break;
-        }
-
-        for (int i = 0; i < number; i++) {
-            int sockfd = events[i].data.fd;
-            if (sockfd == listenfd) {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr *)&client_address, &client_addrlength);
-                if (connfd < 0) {
-                    printf("errno is: %d\n", errno);
-                    continue;
-                }
-                if (user_count >= USER_LIMIT) {
-                    const char * info = "too many users\n";
-                    printf("%s", info);
-                    send(connfd, info, strlen(info), 0);
-                    close(connfd);
-                    continue;
-                }
-                users[user_count].address = client_address;
-                users[user_count].connfd = connfd;
-                ret = socketpair(PF_UNIX, SOCK_STREAM, 0, users[user_count].pipefd);
-                assert(ret != -1);
-                pid_t pid = fork();
-                if (pid < 0) {
-                    close(connfd);
-                    continue;
-                } else if (pid == 0) {
-                    close(epollfd);
-                    close(listenfd);
-                    close(users[user_count].pipefd[0]);
-                    close(sig_pipefd[0]);
-                    close(sig_pipefd[1]);
-                    run_child(user_count, users, share_mem);
-                    munmap((void *)share_mem, USER_LIMIT * BUFFER_SIZE);
-                    exit(0);
-                } else {
-                    close(connfd);
-                    close(users[user_count].pipefd[1]);
-                    addfd(epollfd, users[user_count].pipefd[0]);
-                    users[user_count].pid = pid;
-                    sub_process[pid] = user_count;
-                    user_count++;
-                }
-            } else if ((sockfd == sig_pipefd[0]) && (events[i].events & EPOLLIN)) {
-                int sig;
-                char signals[1024];
-                ret = recv(sig_pipefd[0], signals, sizeof(signals), 0);
-                if (ret == -1) {
-                    continue;
-                } else if (ret == 0) {
-                    continue;
-                } else {
-                    for (int i = 0; i < ret; ++i) {
-                        switch (signals[i]) {
-                        case SIGCHLD:
-                        {
-                            pid_t pid;
-                            int stat;
-                            while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
-                                int del_user = sub_process[pid];
-                                sub_process[pid] = -1;
-                                if ((del_user < 0) || (del_user > USER_LIMIT)) {
-                                    printf("the deleted user was not change\n");
-                                    continue;
-                                }
-                                epoll_ctl(epollfd, EPOLL_CTL_DEL, users[del_user].pipefd[0], 0);
-                                close(users[del_user].pipefd[0]);
-                                users[del_user] = users[--user_count];
-                                sub_process[users[del_user].pid] = del_user;
-                                printf("child %d exit, now we have %d users\n", del_user, user_count);
-                            }
-                            if (terminate && user_count == 0) {
-                                stop_server = true;
-                            }
-                            break;
-                        }
-                        case SIGTERM:
-                        case SIGINT:
-                        {
-                            printf("kill all the clild now\n");
-                            //addsig( SIGTERM, SIG_IGN );
-                            //addsig( SIGINT, SIG_IGN );
-                            if (user_count == 0) {
-                                stop_server = true;
-                                break;
-                            }
-                            for (int i = 0; i < user_count; ++i) {
-                                int pid = users[i].pid;
-                                kill(pid, SIGTERM);
-                            }
-                            terminate = true;
-                            break;
-                        }
-                        default:
-                        {
-                            break;
-                        }
-                        }
-                    }
-                }
-            } else if (events[i].events & EPOLLIN) {
-                int child = 0;
-                ret = recv(sockfd, (char *)&child, sizeof(child), 0);
-                printf("read data from child accross pipe\n");
-                if (ret == -1) {
-                    continue;
-                } else if (ret == 0) {
-                    continue;
-                } else {
-                    for (int j = 0; j < user_count; ++j) {
-                        if (users[j].pipefd[0] != sockfd) {
-                            printf("send data to child accross pipe\n");
-                            send(users[j].pipefd[0], (char *)&child, sizeof(child), 0);
-                        }
-                    }
-                }
-            }
-        }
+    if (!loop->run()) {
+        printf("epoll failure\n");
     }
 
     del_resource();
@@ -2,8 +2,315 @@
 #define LOCKER_H
 
 #include <exception>
+#include <atomic>
+#include <climits>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#ifdef LOCK_PROFILE
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#endif
+
+static inline void cpu_relax()
+{
+#if defined( __x86_64__ ) || defined( __i386__ )
+    __builtin_ia32_pause();
+#elif defined( __aarch64__ )
+    __asm__ __volatile__( "yield" );
+#endif
+}
+
+// timeout为相对时间，NULL表示一直等
+static inline long futex_wait( void* addr, int expected, const struct timespec* timeout = NULL )
+{
+    return syscall( SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0 );
+}
+
+static inline long futex_wake( void* addr, int n )
+{
+    return syscall( SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0 );
+}
+
+// 单核机器上自旋等锁没有意义
+static inline bool spin_worthwhile()
+{
+    static const bool multi = sysconf( _SC_NPROCESSORS_ONLN ) > 1;
+    return multi;
+}
+
+// 锁竞争剖析：编译时定义LOCK_PROFILE后，每把锁记录加锁次数、竞争次数、等待时间直方图，
+// 以及发生竞争时锁被哪个调用点（文件:行号）持有。加锁接口通过默认参数自动带上调用点，
+// 调用方代码不用改。lock_profile::report()按锁的创建位置汇总输出（只统计仍存活的锁）
+#ifdef LOCK_PROFILE
+#define LOCK_SITE_DECL const char* file = __builtin_FILE(), int line = __builtin_LINE()
+#define LOCK_SITE_MORE , LOCK_SITE_DECL
+
+class lock_profile
+{
+public:
+    static const int BUCKETS = 40;      // 第i个桶为[2^i, 2^(i+1))纳秒
+    static const int SITES = 8;
+
+    lock_profile( const char* kind, const char* file, int line )
+        : m_kind( kind ), m_file( file ), m_line( line ), m_holder_file( NULL ), m_holder_line( 0 ),
+          m_acquires( 0 ), m_contended( 0 ), m_wait_ns( 0 ), m_other( 0 )
+    {
+        for( int i = 0; i < BUCKETS; ++i )
+        {
+            m_hist[i].store( 0 );
+        }
+        for( int i = 0; i < SITES; ++i )
+        {
+            m_sites[i].file.store( NULL );
+            m_sites[i].line = 0;
+            m_sites[i].count.store( 0 );
+        }
+        pthread_mutex_lock( &registry_lock() );
+        m_prev = NULL;
+        m_next = registry();
+        if( m_next )
+        {
+            m_next->m_prev = this;
+        }
+        registry() = this;
+        pthread_mutex_unlock( &registry_lock() );
+    }
+    ~lock_profile()
+    {
+        pthread_mutex_lock( &registry_lock() );
+        if( m_prev )
+        {
+            m_prev->m_next = m_next;
+        }
+        else
+        {
+            registry() = m_next;
+        }
+        if( m_next )
+        {
+            m_next->m_prev = m_prev;
+        }
+        pthread_mutex_unlock( &registry_lock() );
+    }
+
+    void acquired( const char* file, int line )
+    {
+        m_acquires.fetch_add( 1, std::memory_order_relaxed );
+        m_holder_file.store( file, std::memory_order_relaxed );
+        m_holder_line.store( line, std::memory_order_relaxed );
+    }
+
+    // 在竞争路径上构造：记下开始时间和当时的持有者，析构时（已拿到锁）记账
+    class waiter
+    {
+    public:
+        explicit waiter( lock_profile& prof ) : m_prof( prof )
+        {
+            m_file = prof.m_holder_file.load( std::memory_order_relaxed );
+            m_line = prof.m_holder_line.load( std::memory_order_relaxed );
+            m_start = now_ns();
+        }
+        ~waiter()
+        {
+            m_prof.contended( now_ns() - m_start, m_file, m_line );
+        }
+
+    private:
+        lock_profile& m_prof;
+        const char* m_file;
+        int m_line;
+        long m_start;
+    };
+
+    static void report( FILE* out );
+
+private:
+    struct site
+    {
+        std::atomic< const char* > file;
+        int line;
+        std::atomic< unsigned long > count;
+    };
+
+    static long now_ns()
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ts.tv_sec * 1000000000l + ts.tv_nsec;
+    }
+    static pthread_mutex_t& registry_lock()
+    {
+        static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        return mutex;
+    }
+    static lock_profile*& registry()
+    {
+        static lock_profile* head = NULL;
+        return head;
+    }
+    static bool by_origin( const lock_profile* a, const lock_profile* b )
+    {
+        int c = strcmp( a->m_file, b->m_file );
+        if( c != 0 )
+        {
+            return c < 0;
+        }
+        if( a->m_line != b->m_line )
+        {
+            return a->m_line < b->m_line;
+        }
+        return strcmp( a->m_kind, b->m_kind ) < 0;
+    }
+    static const char* basename_of( const char* path )
+    {
+        const char* p = path ? strrchr( path, '/' ) : NULL;
+        return p ? p + 1 : ( path ? path : "?" );
+    }
+
+    void contended( long wait_ns, const char* file, int line )
+    {
+        m_contended.fetch_add( 1, std::memory_order_relaxed );
+        m_wait_ns.fetch_add( wait_ns, std::memory_order_relaxed );
+        int bucket = 0;
+        while( bucket < BUCKETS - 1 && ( 2l << bucket ) <= wait_ns )
+        {
+            ++bucket;
+        }
+        m_hist[ bucket ].fetch_add( 1, std::memory_order_relaxed );
+        // 持有者调用点计数，表满后计入m_other
+        for( int i = 0; i < SITES; ++i )
+        {
+            const char* f = m_sites[i].file.load( std::memory_order_acquire );
+            if( f == NULL )
+            {
+                const char* expected = NULL;
+                if( m_sites[i].file.compare_exchange_strong( expected, file ) )
+                {
+                    m_sites[i].line = line;
+                    f = file;
+                }
+                else
+                {
+                    f = expected;
+                }
+            }
+            if( f == file && m_sites[i].line == line )
+            {
+                m_sites[i].count.fetch_add( 1, std::memory_order_relaxed );
+                return;
+            }
+        }
+        m_other.fetch_add( 1, std::memory_order_relaxed );
+    }
+
+    const char* m_kind;
+    const char* m_file;
+    int m_line;
+    std::atomic< const char* > m_holder_file;
+    std::atomic< int > m_holder_line;
+    std::atomic< unsigned long > m_acquires;
+    std::atomic< unsigned long > m_contended;
+    std::atomic< unsigned long > m_wait_ns;
+    std::atomic< unsigned long > m_hist[ BUCKETS ];
+    site m_sites[ SITES ];
+    std::atomic< unsigned long > m_other;
+    lock_profile* m_prev;
+    lock_profile* m_next;
+};
+
+inline void lock_profile::report( FILE* out )
+{
+    pthread_mutex_lock( &registry_lock() );
+    std::vector< lock_profile* > locks;
+    for( lock_profile* p = registry(); p; p = p->m_next )
+    {
+        locks.push_back( p );
+    }
+    std::sort( locks.begin(), locks.end(), by_origin );
+    fprintf( out, "%-32s %-8s %6s %12s %10s %8s %12s %10s %10s\n", "lock", "kind", "count",
+             "acquires", "contended", "rate", "wait_total", "p50", "p99" );
+    for( size_t i = 0; i < locks.size(); )
+    {
+        // 同一位置创建的锁（如每个连接一把）合并成一行
+        size_t j = i;
+        unsigned long acquires = 0, contended = 0, wait_ns = 0, other = 0, hist[ BUCKETS ] = { 0 };
+        std::vector< std::pair< unsigned long, const site* > > holders;
+        for( ; j < locks.size() && ! by_origin( locks[i], locks[j] ); ++j )
+        {
+            acquires += locks[j]->m_acquires.load();
+            contended += locks[j]->m_contended.load();
+            wait_ns += locks[j]->m_wait_ns.load();
+            other += locks[j]->m_other.load();
+            for( int b = 0; b < BUCKETS; ++b )
+            {
+                hist[b] += locks[j]->m_hist[b].load();
+            }
+            for( int s = 0; s < SITES; ++s )
+            {
+                const site* st = &locks[j]->m_sites[s];
+                unsigned long n = st->count.load();
+                size_t k = 0;
+                for( ; k < holders.size(); ++k )
+                {
+                    if( holders[k].second->file.load() == st->file.load() && holders[k].second->line == st->line )
+                    {
+                        holders[k].first += n;
+                        break;
+                    }
+                }
+                if( n && k == holders.size() )
+                {
+                    holders.push_back( std::make_pair( n, st ) );
+                }
+            }
+        }
+        if( contended > 0 )
+        {
+            long pct[2] = { 0, 0 };
+            unsigned long seen = 0;
+            for( int b = 0; b < BUCKETS; ++b )
+            {
+                seen += hist[b];
+                if( ! pct[0] && seen * 2 >= contended )
+                {
+                    pct[0] = 2l << b;
+                }
+                if( ! pct[1] && seen * 100 >= contended * 99 )
+                {
+                    pct[1] = 2l << b;
+                }
+            }
+            char origin[ 64 ];
+            snprintf( origin, sizeof( origin ), "%s:%d", basename_of( locks[i]->m_file ), locks[i]->m_line );
+            fprintf( out, "%-32s %-8s %6zu %12lu %10lu %7.2f%% %10.3fms %8ldns %8ldns\n", origin, locks[i]->m_kind,
+                     j - i, acquires, contended, 100.0 * contended / ( acquires ? acquires : 1 ),
+                     wait_ns / 1e6, pct[0], pct[1] );
+            std::sort( holders.rbegin(), holders.rend() );
+            for( size_t k = 0; k < holders.size(); ++k )
+            {
+                fprintf( out, "    held at %s:%d  %lu\n", basename_of( holders[k].second->file.load() ),
+                         holders[k].second->line, holders[k].first );
+            }
+            if( other )
+            {
+                fprintf( out, "    held at (other)  %lu\n", other );
+            }
+        }
+        i = j;
+    }
+    pthread_mutex_unlock( &registry_lock() );
+}
+#else
+#define LOCK_SITE_DECL
+#define LOCK_SITE_MORE
+#endif
 
 class sem
 {
@@ -32,10 +339,78 @@ private:
     sem_t m_sem;
 };
 
+// 基于futex的事件计数器：等待方先prepare_wait()取得当前纪元，再检查条件，
+// 条件仍不满足才wait()；通知方修改条件后notify()。没有等待者时notify()不进内核
+class event_count
+{
+public:
+    event_count() : m_epoch( 0 ), m_waiters( 0 ) {}
+
+    unsigned prepare_wait()
+    {
+        m_waiters.fetch_add( 1 );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        return m_epoch.load();
+    }
+    void cancel_wait()
+    {
+        m_waiters.fetch_sub( 1 );
+    }
+    // 返回true表示确实进入内核睡眠过
+    bool wait( unsigned key )
+    {
+        bool slept = false;
+        while( m_epoch.load( std::memory_order_acquire ) == key )
+        {
+            futex_wait( &m_epoch, ( int )key );
+            slept = true;
+        }
+        m_waiters.fetch_sub( 1 );
+        return slept;
+    }
+    // 最多等timeout_ms毫秒，超时且期间没有notify()返回false
+    bool timed_wait( unsigned key, long timeout_ms )
+    {
+        struct timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = ( timeout_ms % 1000 ) * 1000000;
+        if( m_epoch.load( std::memory_order_acquire ) == key )
+        {
+            futex_wait( &m_epoch, ( int )key, &ts );
+        }
+        bool notified = m_epoch.load( std::memory_order_acquire ) != key;
+        m_waiters.fetch_sub( 1 );
+        return notified;
+    }
+    // 唤醒至多n个等待者，返回是否发起了系统调用
+    bool notify( int n = 1 )
+    {
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        if( m_waiters.load( std::memory_order_relaxed ) == 0 )
+        {
+            return false;
+        }
+        m_epoch.fetch_add( 1 );
+        futex_wake( &m_epoch, n );
+        return true;
+    }
+    bool notify_all()
+    {
+        return notify( INT_MAX );
+    }
+
+private:
+    std::atomic< unsigned > m_epoch;
+    std::atomic< int > m_waiters;
+};
+
 class locker
 {
 public:
-    locker()
+    locker( LOCK_SITE_DECL )
+#ifdef LOCK_PROFILE
+        : m_prof( "mutex", file, line )
+#endif
     {
         if( pthread_mutex_init( &m_mutex, NULL ) != 0 )
         {
@@ -46,9 +421,35 @@ public:
     {
         pthread_mutex_destroy( &m_mutex );
     }
-    bool lock()
+    bool lock( LOCK_SITE_DECL )
     {
+#ifdef LOCK_PROFILE
+        if( pthread_mutex_trylock( &m_mutex ) != 0 )
+        {
+            lock_profile::waiter w( m_prof );
+            if( pthread_mutex_lock( &m_mutex ) != 0 )
+            {
+                return false;
+            }
+        }
+        m_prof.acquired( file, line );
+        return true;
+#else
         return pthread_mutex_lock( &m_mutex ) == 0;
+#endif
+    }
+    bool try_lock( LOCK_SITE_DECL )
+    {
+#ifdef LOCK_PROFILE
+        if( pthread_mutex_trylock( &m_mutex ) != 0 )
+        {
+            return false;
+        }
+        m_prof.acquired( file, line );
+        return true;
+#else
+        return pthread_mutex_trylock( &m_mutex ) == 0;
+#endif
     }
     bool unlock()
     {
@@ -56,9 +457,237 @@ public:
     }
 
 private:
+    friend class cond_var;
     pthread_mutex_t m_mutex;
+#ifdef LOCK_PROFILE
+    lock_profile m_prof;
+#endif
+};
+
+// futex互斥锁：0未上锁，1已上锁无等待者，2已上锁且可能有等待者。
+// 抢不到先自旋，自旋上限跟踪最近几次实际需要的自旋次数（同glibc的adaptive mutex），再睡到futex上
+class fast_mutex
+{
+public:
+    fast_mutex( LOCK_SITE_DECL ) : m_state( 0 ), m_spins( 0 )
+#ifdef LOCK_PROFILE
+        , m_prof( "futex", file, line )
+#endif
+    {
+    }
+    bool lock( LOCK_SITE_DECL )
+    {
+        int c = 0;
+        if( ! m_state.compare_exchange_strong( c, 1, std::memory_order_acquire ) )
+        {
+#ifdef LOCK_PROFILE
+            lock_profile::waiter w( m_prof );
+#endif
+            lock_slow( c );
+        }
+#ifdef LOCK_PROFILE
+        m_prof.acquired( file, line );
+#endif
+        return true;
+    }
+    bool try_lock( LOCK_SITE_DECL )
+    {
+        int c = 0;
+        if( ! m_state.compare_exchange_strong( c, 1, std::memory_order_acquire ) )
+        {
+            return false;
+        }
+#ifdef LOCK_PROFILE
+        m_prof.acquired( file, line );
+#endif
+        return true;
+    }
+    bool unlock()
+    {
+        if( m_state.exchange( 0, std::memory_order_release ) == 2 )
+        {
+            futex_wake( &m_state, 1 );
+        }
+        return true;
+    }
+
+private:
+    static const int MAX_SPIN = 1000;
+
+    void lock_slow( int c )
+    {
+        if( spin_worthwhile() )
+        {
+            int spins = m_spins.load( std::memory_order_relaxed );
+            int limit = spins * 2 + 10 < MAX_SPIN ? spins * 2 + 10 : MAX_SPIN;
+            for( int i = 0; i < limit; ++i )
+            {
+                cpu_relax();
+                c = 0;
+                if( m_state.load( std::memory_order_relaxed ) == 0
+                    && m_state.compare_exchange_strong( c, 1, std::memory_order_acquire ) )
+                {
+                    m_spins.store( spins + ( i - spins ) / 8, std::memory_order_relaxed );
+                    return;
+                }
+            }
+            m_spins.store( spins + ( limit - spins ) / 8, std::memory_order_relaxed );
+        }
+        c = m_state.exchange( 2, std::memory_order_acquire );
+        while( c != 0 )
+        {
+            futex_wait( &m_state, 2 );
+            c = m_state.exchange( 2, std::memory_order_acquire );
+        }
+    }
+
+    std::atomic< int > m_state;
+    std::atomic< int > m_spins;
+#ifdef LOCK_PROFILE
+    lock_profile m_prof;
+#endif
+};
+
+// 只用于极短的临界区（几条指令）；test-and-test-and-set，单核上自旋不久就让出CPU
+class spinlock
+{
+public:
+    spinlock( LOCK_SITE_DECL ) : m_locked( false )
+#ifdef LOCK_PROFILE
+        , m_prof( "spin", file, line )
+#endif
+    {
+    }
+    bool lock( LOCK_SITE_DECL )
+    {
+        if( m_locked.exchange( true, std::memory_order_acquire ) )
+        {
+#ifdef LOCK_PROFILE
+            lock_profile::waiter w( m_prof );
+#endif
+            int spins = 0;
+            do
+            {
+                while( m_locked.load( std::memory_order_relaxed ) )
+                {
+                    if( ++spins >= 64 && ( ! spin_worthwhile() || spins % 1024 == 0 ) )
+                    {
+                        sched_yield();
+                    }
+                    else
+                    {
+                        cpu_relax();
+                    }
+                }
+            } while( m_locked.exchange( true, std::memory_order_acquire ) );
+        }
+#ifdef LOCK_PROFILE
+        m_prof.acquired( file, line );
+#endif
+        return true;
+    }
+    bool try_lock( LOCK_SITE_DECL )
+    {
+        if( m_locked.load( std::memory_order_relaxed ) || m_locked.exchange( true, std::memory_order_acquire ) )
+        {
+            return false;
+        }
+#ifdef LOCK_PROFILE
+        m_prof.acquired( file, line );
+#endif
+        return true;
+    }
+    bool unlock()
+    {
+        m_locked.store( false, std::memory_order_release );
+        return true;
+    }
+
+private:
+    std::atomic< bool > m_locked;
+#ifdef LOCK_PROFILE
+    lock_profile m_prof;
+#endif
+};
+
+// 读写锁，写者优先（避免读多写少时写者饿死）
+class rwlock
+{
+public:
+    rwlock( LOCK_SITE_DECL )
+#ifdef LOCK_PROFILE
+        : m_prof( "rwlock", file, line )
+#endif
+    {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init( &attr );
+        pthread_rwlockattr_setkind_np( &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP );
+        int ret = pthread_rwlock_init( &m_rwlock, &attr );
+        pthread_rwlockattr_destroy( &attr );
+        if( ret != 0 )
+        {
+            throw std::exception();
+        }
+    }
+    ~rwlock()
+    {
+        pthread_rwlock_destroy( &m_rwlock );
+    }
+    bool rdlock( LOCK_SITE_DECL )
+    {
+#ifdef LOCK_PROFILE
+        if( pthread_rwlock_tryrdlock( &m_rwlock ) != 0 )
+        {
+            lock_profile::waiter w( m_prof );
+            if( pthread_rwlock_rdlock( &m_rwlock ) != 0 )
+            {
+                return false;
+            }
+        }
+        m_prof.acquired( file, line );
+        return true;
+#else
+        return pthread_rwlock_rdlock( &m_rwlock ) == 0;
+#endif
+    }
+    bool wrlock( LOCK_SITE_DECL )
+    {
+#ifdef LOCK_PROFILE
+        if( pthread_rwlock_trywrlock( &m_rwlock ) != 0 )
+        {
+            lock_profile::waiter w( m_prof );
+            if( pthread_rwlock_wrlock( &m_rwlock ) != 0 )
+            {
+                return false;
+            }
+        }
+        m_prof.acquired( file, line );
+        return true;
+#else
+        return pthread_rwlock_wrlock( &m_rwlock ) == 0;
+#endif
+    }
+    bool try_rdlock()
+    {
+        return pthread_rwlock_tryrdlock( &m_rwlock ) == 0;
+    }
+    bool try_wrlock()
+    {
+        return pthread_rwlock_trywrlock( &m_rwlock ) == 0;
+    }
+    bool unlock()
+    {
+        return pthread_rwlock_unlock( &m_rwlock ) == 0;
+    }
+
+private:
+    pthread_rwlock_t m_rwlock;
+#ifdef LOCK_PROFILE
+    lock_profile m_prof;
+#endif
 };
 
+// 注意：cond使用自己内部的互斥锁，无法与调用者保护谓词的锁配合，新代码请用cond_var
 class cond
 {
 public:
@@ -97,4 +726,68 @@ private:
     pthread_cond_t m_cond;
 };
 
+// 配合外部locker使用的条件变量，典型用法：
+//     lock.lock();
+//     while( ! predicate ) cv.wait( lock );
+//     lock.unlock();
+class cond_var
+{
+public:
+    cond_var()
+    {
+        // 超时按CLOCK_MONOTONIC计算，不受系统时间调整影响
+        pthread_condattr_t attr;
+        pthread_condattr_init( &attr );
+        pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+        int ret = pthread_cond_init( &m_cond, &attr );
+        pthread_condattr_destroy( &attr );
+        if( ret != 0 )
+        {
+            throw std::exception();
+        }
+    }
+    ~cond_var()
+    {
+        pthread_cond_destroy( &m_cond );
+    }
+    // 调用前必须持有lock，返回时重新持有
+    bool wait( locker& lock LOCK_SITE_MORE )
+    {
+        int ret = pthread_cond_wait( &m_cond, &lock.m_mutex );
+#ifdef LOCK_PROFILE
+        lock.m_prof.acquired( file, line );
+#endif
+        return ret == 0;
+    }
+    // 超时返回false
+    bool timed_wait( locker& lock, long timeout_ms LOCK_SITE_MORE )
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += ( timeout_ms % 1000 ) * 1000000;
+        if( ts.tv_nsec >= 1000000000 )
+        {
+            ++ts.tv_sec;
+            ts.tv_nsec -= 1000000000;
+        }
+        int ret = pthread_cond_timedwait( &m_cond, &lock.m_mutex, &ts );
+#ifdef LOCK_PROFILE
+        lock.m_prof.acquired( file, line );
+#endif
+        return ret == 0;
+    }
+    bool signal()
+    {
+        return pthread_cond_signal( &m_cond ) == 0;
+    }
+    bool broadcast()
+    {
+        return pthread_cond_broadcast( &m_cond ) == 0;
+    }
+
+private:
+    pthread_cond_t m_cond;
+};
+
 #endif
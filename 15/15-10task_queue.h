@@ -0,0 +1,230 @@
+#ifndef TASK_QUEUE_H
+#define TASK_QUEUE_H
+
+#include <list>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include "locker.h"
+
+// threadpool的任务队列策略，统一接口：
+//     explicit Q( int capacity );
+//     bool push( const E& item );   // 队列满返回false
+//     bool pop( E& item );          // 队列空返回false
+//     int push_batch( const E* items, int n );  // 返回实际入队个数
+//     int pop_batch( E* items, int n );         // 返回实际出队个数
+//     size_t size() const;          // 近似值
+
+// 默认策略：互斥锁保护的std::list，每个任务分配一个链表节点
+template< typename E >
+class locked_queue
+{
+public:
+    explicit locked_queue( int capacity ) : m_capacity( capacity ), m_size( 0 ) {}
+
+    bool push( const E& item )
+    {
+        m_locker.lock();
+        size_t size = m_size.load( std::memory_order_relaxed );
+        if( size >= m_capacity )
+        {
+            m_locker.unlock();
+            return false;
+        }
+        m_queue.push_back( item );
+        m_size.store( size + 1, std::memory_order_relaxed );
+        m_locker.unlock();
+        return true;
+    }
+
+    bool pop( E& item )
+    {
+        m_locker.lock();
+        if( m_queue.empty() )
+        {
+            m_locker.unlock();
+            return false;
+        }
+        item = m_queue.front();
+        m_queue.pop_front();
+        m_size.store( m_size.load( std::memory_order_relaxed ) - 1, std::memory_order_relaxed );
+        m_locker.unlock();
+        return true;
+    }
+
+    int push_batch( const E* items, int n )
+    {
+        int i = 0;
+        m_locker.lock();
+        size_t size = m_size.load( std::memory_order_relaxed );
+        for( ; i < n && size < m_capacity; ++i )
+        {
+            m_queue.push_back( items[i] );
+            ++size;
+        }
+        m_size.store( size, std::memory_order_relaxed );
+        m_locker.unlock();
+        return i;
+    }
+
+    int pop_batch( E* items, int n )
+    {
+        int i = 0;
+        m_locker.lock();
+        for( ; i < n && !m_queue.empty(); ++i )
+        {
+            items[i] = m_queue.front();
+            m_queue.pop_front();
+        }
+        m_size.store( m_size.load( std::memory_order_relaxed ) - i, std::memory_order_relaxed );
+        m_locker.unlock();
+        return i;
+    }
+
+    // 不加锁，供其他线程判断队列是否为空、估计积压
+    size_t size() const { return m_size.load( std::memory_order_acquire ); }
+
+private:
+    std::list< E > m_queue;
+    locker m_locker;
+    size_t m_capacity;
+    std::atomic< size_t > m_size;   // 只在持锁时修改
+};
+
+// Dmitry Vyukov 的有界无锁MPMC环形队列
+// 每个槽位带一个序号：seq == pos 表示可写，seq == pos + 1 表示可读
+// 入队/出队各只需一次CAS，不分配内存；容量向上取整为2的幂
+template< typename E >
+class mpmc_ring
+{
+public:
+    explicit mpmc_ring( int capacity ) : m_enqueue_pos( 0 ), m_dequeue_pos( 0 )
+    {
+        if( capacity <= 0 )
+        {
+            throw std::exception();
+        }
+        size_t cap = 2;
+        while( cap < ( size_t )capacity )
+        {
+            cap <<= 1;
+        }
+        m_mask = cap - 1;
+        m_cells = new cell[ cap ];
+        for( size_t i = 0; i < cap; ++i )
+        {
+            m_cells[i].seq.store( i, std::memory_order_relaxed );
+        }
+    }
+    ~mpmc_ring()
+    {
+        delete [] m_cells;
+    }
+
+    bool push( const E& item )
+    {
+        size_t pos = m_enqueue_pos.load( std::memory_order_relaxed );
+        cell* c;
+        for( ; ; )
+        {
+            c = &m_cells[ pos & m_mask ];
+            size_t seq = c->seq.load( std::memory_order_acquire );
+            long diff = ( long )seq - ( long )pos;
+            if( diff == 0 )
+            {
+                if( m_enqueue_pos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+                {
+                    break;
+                }
+            }
+            else if( diff < 0 )
+            {
+                return false;
+            }
+            else
+            {
+                pos = m_enqueue_pos.load( std::memory_order_relaxed );
+            }
+        }
+        c->data = item;
+        c->seq.store( pos + 1, std::memory_order_release );
+        return true;
+    }
+
+    bool pop( E& item )
+    {
+        size_t pos = m_dequeue_pos.load( std::memory_order_relaxed );
+        cell* c;
+        for( ; ; )
+        {
+            c = &m_cells[ pos & m_mask ];
+            size_t seq = c->seq.load( std::memory_order_acquire );
+            long diff = ( long )seq - ( long )( pos + 1 );
+            if( diff == 0 )
+            {
+                if( m_dequeue_pos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+                {
+                    break;
+                }
+            }
+            else if( diff < 0 )
+            {
+                return false;
+            }
+            else
+            {
+                pos = m_dequeue_pos.load( std::memory_order_relaxed );
+            }
+        }
+        item = c->data;
+        c->seq.store( pos + m_mask + 1, std::memory_order_release );
+        return true;
+    }
+
+    int push_batch( const E* items, int n )
+    {
+        int i = 0;
+        while( i < n && push( items[i] ) )
+        {
+            ++i;
+        }
+        return i;
+    }
+
+    int pop_batch( E* items, int n )
+    {
+        int i = 0;
+        while( i < n && pop( items[i] ) )
+        {
+            ++i;
+        }
+        return i;
+    }
+
+    size_t size() const
+    {
+        size_t tail = m_enqueue_pos.load( std::memory_order_relaxed );
+        size_t head = m_dequeue_pos.load( std::memory_order_relaxed );
+        return tail > head ? tail - head : 0;
+    }
+
+    size_t capacity() const { return m_mask + 1; }
+
+private:
+    struct cell
+    {
+        std::atomic< size_t > seq;
+        E data;
+    };
+
+    char m_pad0[ 64 ];
+    cell* m_cells;
+    size_t m_mask;
+    char m_pad1[ 64 - sizeof( cell* ) - sizeof( size_t ) ];
+    std::atomic< size_t > m_enqueue_pos;
+    char m_pad2[ 64 - sizeof( size_t ) ];
+    std::atomic< size_t > m_dequeue_pos;
+    char m_pad3[ 64 - sizeof( size_t ) ];
+};
+
+#endif
@@ -0,0 +1,481 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <new>
+#include <memory>
+#include <future>
+#include <utility>
+#include <exception>
+#include <type_traits>
+#include <atomic>
+#include <sched.h>
+#include "threadpool.h"
+#include "task_queue.h"
+
+// 只能移动的可调用对象（void()），不超过INLINE_SIZE的闭包直接放在对象内部，不分配堆内存
+class task
+{
+public:
+    static const size_t INLINE_SIZE = 48;
+
+    task() : m_ops( NULL ) {}
+    template< typename F, typename = typename std::enable_if<
+        ! std::is_same< typename std::decay< F >::type, task >::value >::type >
+    task( F&& f ) : m_ops( NULL )
+    {
+        typedef typename std::decay< F >::type Fn;
+        emplace< Fn >( std::forward< F >( f ), std::integral_constant< bool, fits< Fn >::value >() );
+    }
+    task( task&& other ) : m_ops( other.m_ops )
+    {
+        if( m_ops )
+        {
+            m_ops->move( &m_buf, &other.m_buf );
+            other.m_ops = NULL;
+        }
+    }
+    task& operator=( task&& other )
+    {
+        if( this != &other )
+        {
+            reset();
+            m_ops = other.m_ops;
+            if( m_ops )
+            {
+                m_ops->move( &m_buf, &other.m_buf );
+                other.m_ops = NULL;
+            }
+        }
+        return *this;
+    }
+    ~task()
+    {
+        reset();
+    }
+
+    void operator()()
+    {
+        m_ops->call( &m_buf );
+    }
+    explicit operator bool() const { return m_ops != NULL; }
+    bool is_inline() const { return m_ops && m_ops->inline_storage; }
+    void reset()
+    {
+        if( m_ops )
+        {
+            m_ops->destroy( &m_buf );
+            m_ops = NULL;
+        }
+    }
+
+private:
+    task( const task& ) = delete;
+    task& operator=( const task& ) = delete;
+
+    template< typename Fn >
+    struct fits
+    {
+        static const bool value = sizeof( Fn ) <= INLINE_SIZE && std::alignment_of< Fn >::value <= 16
+                                  && std::is_nothrow_move_constructible< Fn >::value;
+    };
+
+    template< typename Fn, typename F >
+    void emplace( F&& f, std::true_type )
+    {
+        new ( &m_buf ) Fn( std::forward< F >( f ) );
+        m_ops = &inline_ops< Fn >::table;
+    }
+    // 大闭包放在堆上，缓冲区里只存指针
+    template< typename Fn, typename F >
+    void emplace( F&& f, std::false_type )
+    {
+        new ( &m_buf ) Fn*( new Fn( std::forward< F >( f ) ) );
+        m_ops = &heap_ops< Fn >::table;
+    }
+
+    struct ops
+    {
+        void ( *call )( void* buf );
+        void ( *move )( void* dst, void* src );     // 移动到dst并析构src
+        void ( *destroy )( void* buf );
+        bool inline_storage;
+    };
+
+    template< typename Fn >
+    struct inline_ops
+    {
+        static void call( void* buf ) { ( *static_cast< Fn* >( buf ) )(); }
+        static void move( void* dst, void* src )
+        {
+            Fn* from = static_cast< Fn* >( src );
+            new ( dst ) Fn( std::move( *from ) );
+            from->~Fn();
+        }
+        static void destroy( void* buf ) { static_cast< Fn* >( buf )->~Fn(); }
+        static const ops table;
+    };
+
+    template< typename Fn >
+    struct heap_ops
+    {
+        static void call( void* buf ) { ( **static_cast< Fn** >( buf ) )(); }
+        static void move( void* dst, void* src ) { new ( dst ) Fn*( *static_cast< Fn** >( src ) ); }
+        static void destroy( void* buf ) { delete *static_cast< Fn** >( buf ); }
+        static const ops table;
+    };
+
+    const ops* m_ops;
+    std::aligned_storage< INLINE_SIZE, 16 >::type m_buf;
+};
+
+template< typename Fn >
+const task::ops task::inline_ops< Fn >::table = { &call, &move, &destroy, true };
+
+template< typename Fn >
+const task::ops task::heap_ops< Fn >::table = { &call, &move, &destroy, false };
+
+// 把函数的返回值交给promise
+template< typename R >
+struct promise_setter
+{
+    template< typename Fn >
+    static void run( std::promise< R >& promise, Fn& func ) { promise.set_value( func() ); }
+};
+
+template<>
+struct promise_setter< void >
+{
+    template< typename Fn >
+    static void run( std::promise< void >& promise, Fn& func )
+    {
+        func();
+        promise.set_value();
+    }
+};
+
+// 在threadpool的工作线程上执行任意任务，与请求共用同一组线程：
+// post()不关心结果，submit()返回std::future，parallel_for()把区间切块分发，调用线程也参与计算。
+// 任务节点来自预分配的无锁池，小闭包投递时不分配堆内存（submit的future共享状态除外）
+template< typename T, template< typename > class Q = locked_queue >
+class executor
+{
+public:
+    typedef threadpool< T, Q > pool_type;
+
+    // lane为任务进入的通道；capacity为预分配的任务节点数，用完后临时从堆上分配
+    explicit executor( pool_type& pool, int lane = 0, int capacity = 1024 );
+    // 等待所有已投递的任务执行完
+    ~executor();
+
+    // T*仍走线程池原来的路径，不经过task包装
+    bool post( T* request ) { return m_pool.append( request ); }
+    template< typename F >
+    bool post( F&& func );
+    // 队列满时返回的future会抛出broken_promise
+    template< typename F >
+    std::future< typename std::result_of< typename std::decay< F >::type&() >::type > submit( F&& func );
+    // 批量投递[first, last)中的可调用对象（会被移走），只唤醒一次，返回成功投递的个数
+    template< typename It >
+    int post_bulk( It first, It last );
+    // 把[begin, end)按grain切块，每块调用一次func( lo, hi )；返回时所有块都已完成。
+    // grain <= 0时按线程数自动切分。func抛出的第一个异常在调用线程中重新抛出
+    template< typename F >
+    void parallel_for( long begin, long end, long grain, F func );
+
+    long pending() const { return m_pending.load( std::memory_order_relaxed ); }
+    unsigned long failed() const { return m_failed.load( std::memory_order_relaxed ); }
+    unsigned long spills() const { return m_spills.load( std::memory_order_relaxed ); }
+
+private:
+    static const int BULK = 64;
+
+    struct node : public runnable
+    {
+        executor* owner;
+        task func;
+    };
+
+    template< typename Fn, typename R >
+    struct bound_call
+    {
+        Fn func;
+        std::promise< R > promise;
+
+        bound_call( Fn&& f, std::promise< R >&& p ) : func( std::move( f ) ), promise( std::move( p ) ) {}
+        bound_call( const Fn& f, std::promise< R >&& p ) : func( f ), promise( std::move( p ) ) {}
+        void operator()()
+        {
+            try
+            {
+                promise_setter< R >::run( promise, func );
+            }
+            catch( ... )
+            {
+                promise.set_exception( std::current_exception() );
+            }
+        }
+    };
+
+    struct range_state
+    {
+        std::atomic< long > next;
+        long end;
+        long grain;
+        std::atomic< long > left;       // 尚未完成的块数
+        event_count done;
+        void ( *body )( void* func, long lo, long hi );
+        void* func;
+        std::atomic< bool > failed;
+        std::exception_ptr error;
+    };
+
+    template< typename F >
+    static void call_range( void* func, long lo, long hi )
+    {
+        ( *static_cast< F* >( func ) )( lo, hi );
+    }
+    static void run_chunks( range_state& state );
+    static void invoke( runnable* job );
+    node* acquire();
+    void release( node* n );
+
+private:
+    pool_type& m_pool;
+    int m_lane;
+    int m_capacity;
+    node* m_nodes;
+    mpmc_ring< node* > m_free;
+    std::atomic< long > m_pending;
+    std::atomic< unsigned long > m_failed;
+    std::atomic< unsigned long > m_spills;
+};
+
+template< typename T, template< typename > class Q >
+executor< T, Q >::executor( pool_type& pool, int lane, int capacity ) :
+        m_pool( pool ), m_lane( lane ), m_capacity( capacity ), m_nodes( NULL ), m_free( capacity > 0 ? capacity : 1 ),
+        m_pending( 0 ), m_failed( 0 ), m_spills( 0 )
+{
+    if( capacity <= 0 )
+    {
+        throw std::exception();
+    }
+    m_nodes = new node[ capacity ];
+    for( int i = 0; i < capacity; ++i )
+    {
+        m_nodes[i].invoke = invoke;
+        m_nodes[i].owner = this;
+        m_free.push( m_nodes + i );
+    }
+}
+
+template< typename T, template< typename > class Q >
+executor< T, Q >::~executor()
+{
+    // 工作线程对executor的最后一次访问是递减m_pending，之后才可以释放
+    while( m_pending.load( std::memory_order_acquire ) > 0 )
+    {
+        sched_yield();
+    }
+    delete [] m_nodes;
+}
+
+template< typename T, template< typename > class Q >
+typename executor< T, Q >::node* executor< T, Q >::acquire()
+{
+    node* n = NULL;
+    if( ! m_free.pop( n ) )
+    {
+        n = new node;
+        n->invoke = invoke;
+        n->owner = this;
+        m_spills.fetch_add( 1, std::memory_order_relaxed );
+    }
+    return n;
+}
+
+template< typename T, template< typename > class Q >
+void executor< T, Q >::release( node* n )
+{
+    n->func.reset();
+    if( n >= m_nodes && n < m_nodes + m_capacity )
+    {
+        m_free.push( n );
+    }
+    else
+    {
+        delete n;
+    }
+}
+
+template< typename T, template< typename > class Q >
+void executor< T, Q >::invoke( runnable* job )
+{
+    node* n = static_cast< node* >( job );
+    executor* self = n->owner;
+    try
+    {
+        n->func();
+    }
+    catch( ... )
+    {
+        self->m_failed.fetch_add( 1, std::memory_order_relaxed );
+    }
+    self->release( n );
+    self->m_pending.fetch_sub( 1, std::memory_order_release );
+}
+
+template< typename T, template< typename > class Q >
+template< typename F >
+bool executor< T, Q >::post( F&& func )
+{
+    node* n = acquire();
+    n->func = task( std::forward< F >( func ) );
+    m_pending.fetch_add( 1, std::memory_order_relaxed );
+    if( ! m_pool.append_job( n, m_lane ) )
+    {
+        release( n );
+        m_pending.fetch_sub( 1, std::memory_order_release );
+        return false;
+    }
+    return true;
+}
+
+template< typename T, template< typename > class Q >
+template< typename F >
+std::future< typename std::result_of< typename std::decay< F >::type&() >::type > executor< T, Q >::submit( F&& func )
+{
+    typedef typename std::decay< F >::type Fn;
+    typedef typename std::result_of< Fn&() >::type R;
+    std::promise< R > promise;
+    std::future< R > future = promise.get_future();
+    post( bound_call< Fn, R >( std::forward< F >( func ), std::move( promise ) ) );
+    return future;
+}
+
+template< typename T, template< typename > class Q >
+template< typename It >
+int executor< T, Q >::post_bulk( It first, It last )
+{
+    runnable* jobs[ BULK ];
+    int posted = 0;
+    while( first != last )
+    {
+        int count = 0;
+        for( ; first != last && count < BULK; ++first )
+        {
+            node* n = acquire();
+            n->func = task( std::move( *first ) );
+            jobs[ count++ ] = n;
+        }
+        m_pending.fetch_add( count, std::memory_order_relaxed );
+        int done = m_pool.append_jobs( jobs, count, m_lane );
+        posted += done;
+        if( done < count )
+        {
+            for( int i = done; i < count; ++i )
+            {
+                release( static_cast< node* >( jobs[i] ) );
+            }
+            m_pending.fetch_sub( count - done, std::memory_order_release );
+            break;
+        }
+    }
+    return posted;
+}
+
+// 各线程（包括调用线程）抢块执行，直到区间取完
+template< typename T, template< typename > class Q >
+void executor< T, Q >::run_chunks( range_state& state )
+{
+    for( ; ; )
+    {
+        long lo = state.next.fetch_add( state.grain );
+        if( lo >= state.end )
+        {
+            return;
+        }
+        long hi = state.end - lo > state.grain ? lo + state.grain : state.end;
+        if( ! state.failed.load( std::memory_order_relaxed ) )
+        {
+            try
+            {
+                state.body( state.func, lo, hi );
+            }
+            catch( ... )
+            {
+                bool expected = false;
+                if( state.failed.compare_exchange_strong( expected, true ) )
+                {
+                    state.error = std::current_exception();
+                }
+            }
+        }
+        if( state.left.fetch_sub( 1 ) == 1 )
+        {
+            state.done.notify_all();
+        }
+    }
+}
+
+template< typename T, template< typename > class Q >
+template< typename F >
+void executor< T, Q >::parallel_for( long begin, long end, long grain, F func )
+{
+    if( begin >= end )
+    {
+        return;
+    }
+    int threads = m_pool.threads();
+    if( grain <= 0 )
+    {
+        grain = ( end - begin ) / ( threads * 4 );
+        grain = grain > 0 ? grain : 1;
+    }
+    long chunks = ( end - begin + grain - 1 ) / grain;
+
+    // 调用方可能先于迟到的辅助任务返回，状态由shared_ptr托管；func只在还有块可取时才被访问
+    std::shared_ptr< range_state > state = std::make_shared< range_state >();
+    state->next.store( begin );
+    state->end = end;
+    state->grain = grain;
+    state->left.store( chunks );
+    state->body = call_range< F >;
+    state->func = &func;
+    state->failed.store( false );
+
+    long helpers = chunks - 1 < threads ? chunks - 1 : threads;
+    runnable* jobs[ BULK ];
+    int count = 0;
+    for( long i = 0; i < helpers && i < BULK; ++i )
+    {
+        node* n = acquire();
+        std::shared_ptr< range_state > ref = state;
+        n->func = task( [ ref ]() { run_chunks( *ref ); } );
+        jobs[ count++ ] = n;
+    }
+    m_pending.fetch_add( count, std::memory_order_relaxed );
+    int done = m_pool.append_jobs( jobs, count, m_lane );
+    for( int i = done; i < count; ++i )
+    {
+        release( static_cast< node* >( jobs[i] ) );
+    }
+    m_pending.fetch_sub( count - done, std::memory_order_release );
+
+    run_chunks( *state );
+    while( state->left.load() > 0 )
+    {
+        unsigned key = state->done.prepare_wait();
+        if( state->left.load() == 0 )
+        {
+            state->done.cancel_wait();
+            break;
+        }
+        state->done.wait( key );
+    }
+    if( state->error )
+    {
+        std::rethrow_exception( state->error );
+    }
+}
+
+#endif
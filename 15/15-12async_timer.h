@@ -0,0 +1,232 @@
+#ifndef ASYNC_TIMER_H
+#define ASYNC_TIMER_H
+
+#include <atomic>
+#include <exception>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "threadpool.h"
+#include "timer_service.h"
+
+// 可以在任意线程中设置和取消的定时器，嵌入在所属对象（如http_conn）里，
+// 节点的生存期不能短于async_timer_service。到期后cb_func在设置它的工作线程中执行
+struct async_timer : public runnable
+{
+    async_timer() : cb_func( NULL ), user_data( NULL ), lane( 0 ), slack( 0 ), deadline( 0 ), gen( 0 ), fired_gen( 0 ),
+                    owner( -1 ), queued( false ), dispatched( false ), next( NULL ), heap_timer( NULL ), armed_gen( 0 ),
+                    service( NULL )
+    {
+        invoke = run;
+    }
+
+    void ( *cb_func )( async_timer* );
+    void* user_data;
+    int lane;                           // 回调不能送回设置者（不是工作线程或其私有队列已满）时投递到的线程池通道
+    int64_t slack;                      // 可接受的延迟（纳秒），相近的到期合并成一次唤醒
+
+    // 以下由async_timer_service使用。deadline/gen/owner是调用者最近一次请求的状态，
+    // 节点在队列中时后来的请求直接覆盖它们，事件循环只处理最新的一次
+    std::atomic< int64_t > deadline;    // 0表示取消
+    std::atomic< uint32_t > gen;        // 每次schedule/cancel加1
+    std::atomic< uint32_t > fired_gen;  // 到期时的gen，执行回调前与gen比较，不等说明之后又被取消或重设
+    std::atomic< int > owner;           // 回调投递到的工作线程下标，-1表示共享通道
+    std::atomic< bool > queued;         // 已在请求队列中
+    std::atomic< bool > dispatched;     // 已投递给线程池、尚未执行
+    std::atomic< async_timer* > next;   // 请求队列的链接
+    dheap_timer* heap_timer;            // 以下只有事件循环线程访问
+    uint32_t armed_gen;
+    void* service;
+
+private:
+    // 在工作线程中执行
+    static void run( runnable* job )
+    {
+        async_timer* timer = static_cast< async_timer* >( job );
+        timer->dispatched.store( false );
+        if( timer->fired_gen.load() == timer->gen.load() )
+        {
+            timer->cb_func( timer );
+        }
+    }
+};
+
+// 跨线程的定时器服务。schedule()/cancel()只修改定时器节点并把它放进无锁的多生产者单消费者队列，
+// 没有全局锁，同一节点在被处理前多次修改只入队一次；事件循环线程把event_fd()和timer_fd()注册到epoll，
+// 前者可读时调用handle_requests()把请求应用到堆上，后者可读时调用handle_expired()。
+// 到期的定时器作为runnable投递回设置它的工作线程（Pool需提供append_job_to/append_job/worker_index，
+// 见threadpool），投递失败时1毫秒后重试。回调开始执行前的cancel()都能阻止它，之后的则不能。
+// 队列头按缓存行对齐，C++17之前在堆上创建要用posix_memalign加placement new
+template< typename Pool >
+class async_timer_service
+{
+public:
+    explicit async_timer_service( Pool& pool ) : m_pool( pool ), m_tail( &m_stub ), m_head( &m_stub ), m_wake( false )
+    {
+        m_eventfd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+        if( m_eventfd < 0 )
+        {
+            throw std::exception();
+        }
+    }
+    ~async_timer_service()
+    {
+        close( m_eventfd );
+    }
+
+    int event_fd() const { return m_eventfd; }
+    int timer_fd() const { return m_timers.fd(); }
+
+    // 任意线程：delay纳秒后到期，已设置的定时器被重新设置
+    void schedule( async_timer* timer, int64_t delay )
+    {
+        timer->owner.store( m_pool.worker_index() );
+        timer->deadline.store( dheap::now_ns() + ( delay > 0 ? delay : 0 ) + 1 );
+        timer->gen.fetch_add( 1 );
+        enqueue( timer );
+    }
+    // 任意线程
+    void cancel( async_timer* timer )
+    {
+        timer->deadline.store( 0 );
+        timer->gen.fetch_add( 1 );
+        enqueue( timer );
+    }
+
+    // 事件循环线程：event_fd()可读时调用
+    void handle_requests()
+    {
+        uint64_t count;
+        while( read( m_eventfd, &count, sizeof( count ) ) < 0 && errno == EINTR )
+        {
+        }
+        // 先清标志再取队列，之后入队的请求会重新写eventfd
+        m_wake.store( false );
+        async_timer* timer;
+        while( ( timer = pop() ) != NULL )
+        {
+            apply( timer );
+        }
+    }
+    // 事件循环线程：timer_fd()可读时调用
+    int handle_expired()
+    {
+        return m_timers.handle_expired();
+    }
+
+    int64_t wakeups() const { return m_timers.wakeups(); }
+
+private:
+    static const int64_t RETRY_NS = 1000000;
+
+    void enqueue( async_timer* timer )
+    {
+        if( timer->queued.exchange( true ) )
+        {
+            return;
+        }
+        push( timer );
+        if( ! m_wake.exchange( true ) )
+        {
+            uint64_t one = 1;
+            while( write( m_eventfd, &one, sizeof( one ) ) < 0 && errno == EINTR )
+            {
+            }
+        }
+    }
+
+    // 先清queued再读状态：读之后的修改一定会让节点重新入队
+    void apply( async_timer* timer )
+    {
+        timer->queued.store( false );
+        uint32_t gen = timer->gen.load();
+        int64_t deadline = timer->deadline.load();
+        if( ! timer->heap_timer )
+        {
+            timer->heap_timer = m_timers.create( expired, timer, timer->slack );
+            timer->service = this;
+        }
+        timer->armed_gen = gen;
+        if( deadline == 0 )
+        {
+            m_timers.del_timer( timer->heap_timer );
+        }
+        else
+        {
+            m_timers.set_expire( timer->heap_timer, deadline );
+        }
+    }
+
+    static void expired( dheap_timer* heap_timer )
+    {
+        async_timer* timer = ( async_timer* )heap_timer->user_data;
+        async_timer_service* self = ( async_timer_service* )timer->service;
+        timer->fired_gen.store( timer->armed_gen );
+        // 上一次投递还没执行时不再投递，它执行时会看到新的fired_gen
+        if( timer->dispatched.exchange( true ) )
+        {
+            return;
+        }
+        int owner = timer->owner.load();
+        bool ok = owner >= 0 ? self->m_pool.append_job_to( timer, owner, timer->lane )
+                             : self->m_pool.append_job( timer, timer->lane );
+        if( ! ok )
+        {
+            timer->dispatched.store( false );
+            self->m_timers.add_timer( heap_timer, RETRY_NS );
+        }
+    }
+
+    // Dmitry Vyukov的侵入式MPSC队列：入队只有一次exchange，m_stub保证队列永不为空
+    void push( async_timer* timer )
+    {
+        timer->next.store( NULL, std::memory_order_relaxed );
+        async_timer* prev = m_head.exchange( timer, std::memory_order_acq_rel );
+        prev->next.store( timer, std::memory_order_release );
+    }
+    // 只在事件循环线程调用。某个生产者入队到一半时返回NULL，它随后会再写eventfd
+    async_timer* pop()
+    {
+        async_timer* tail = m_tail;
+        async_timer* next = tail->next.load( std::memory_order_acquire );
+        if( tail == &m_stub )
+        {
+            if( ! next )
+            {
+                return NULL;
+            }
+            m_tail = next;
+            tail = next;
+            next = next->next.load( std::memory_order_acquire );
+        }
+        if( next )
+        {
+            m_tail = next;
+            return tail;
+        }
+        if( tail != m_head.load( std::memory_order_acquire ) )
+        {
+            return NULL;
+        }
+        push( &m_stub );
+        next = tail->next.load( std::memory_order_acquire );
+        if( next )
+        {
+            m_tail = next;
+            return tail;
+        }
+        return NULL;
+    }
+
+private:
+    Pool& m_pool;
+    timer_service m_timers;
+    int m_eventfd;
+    async_timer m_stub;
+    async_timer* m_tail;
+    std::atomic< async_timer* > m_head __attribute__( ( aligned( 64 ) ) );
+    std::atomic< bool > m_wake;
+};
+
+#endif
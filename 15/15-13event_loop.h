@@ -0,0 +1,311 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <atomic>
+#include <exception>
+#include <vector>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "locker.h"
+#include "timer_service.h"
+
+// 注册到event_loop的fd。epoll_data.ptr直接指向它，就绪时在事件循环线程中调用handle_event，
+// 通常嵌入在所属对象里，user_data指回该对象。没有构造函数，嵌在按fd预分配的大数组
+// （如http_conn users[65536]）里时不会在启动时触及所有页面，注册前由使用者填好各字段
+struct event_handler
+{
+    int fd;
+    void ( *handle_event )( event_handler* self, uint32_t events );
+    void* user_data;
+};
+
+// 各个服务器共用的事件循环，取代每个程序里各写一份的epoll + 信号管道 + switch：
+// fd按event_handler注册，分发时不用按fd比较或查表；定时器放在4叉堆里，epoll_wait的超时取最近的到期时刻
+// （11-4io_timer.cpp的思路），空闲时一直阻塞；信号由signalfd接收；其他线程提交的任务通过eventfd唤醒循环。
+// 回调里删除同一轮中还没分发的handler是安全的，它剩下的事件会被丢弃。
+// 注明“任意线程”的函数之外，其余只能在事件循环线程中调用。事件循环线程就是构造它的线程，
+// 之后不再改变，其他线程调用in_loop_thread()不会与之竞争；run()也必须在这个线程中调用
+class event_loop
+{
+public:
+    typedef void ( *task_func )( void* arg );
+    typedef void ( *signal_func )( int sig, void* arg );
+
+    explicit event_loop( int max_events = 1024 )
+        : m_max_events( max_events > 0 ? max_events : 1024 ), m_ready( 0 ), m_cursor( 0 ), m_signals( NULL ),
+          m_thread( pthread_self() ), m_wake( false ), m_quit( false )
+    {
+        m_epollfd = epoll_create1( EPOLL_CLOEXEC );
+        if( m_epollfd < 0 )
+        {
+            throw std::exception();
+        }
+        m_wakefd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+        if( m_wakefd < 0 )
+        {
+            close( m_epollfd );
+            throw std::exception();
+        }
+        m_events = new epoll_event[ m_max_events ];
+        for( int i = 0; i < _NSIG; ++i )
+        {
+            m_sig_funcs[i] = NULL;
+            m_sig_args[i] = NULL;
+        }
+        m_wake_handler.fd = m_wakefd;
+        m_wake_handler.handle_event = handle_wakeup;
+        m_wake_handler.user_data = this;
+        add( &m_wake_handler, EPOLLIN );
+    }
+    ~event_loop()
+    {
+        delete m_signals;
+        delete [] m_events;
+        close( m_wakefd );
+        close( m_epollfd );
+    }
+
+    int fd() const { return m_epollfd; }
+
+    // 任意线程
+    bool in_loop_thread() const
+    {
+        return pthread_equal( m_thread, pthread_self() ) != 0;
+    }
+
+    // events为EPOLLIN | EPOLLET等，不会修改fd的阻塞属性
+    bool add( event_handler* handler, uint32_t events )
+    {
+        epoll_event event;
+        event.data.ptr = handler;
+        event.events = events;
+        return epoll_ctl( m_epollfd, EPOLL_CTL_ADD, handler->fd, &event ) == 0;
+    }
+    // 任意线程：工作线程处理完请求后可以直接用它重新开启EPOLLONESHOT的fd
+    bool modify( event_handler* handler, uint32_t events )
+    {
+        epoll_event event;
+        event.data.ptr = handler;
+        event.events = events;
+        return epoll_ctl( m_epollfd, EPOLL_CTL_MOD, handler->fd, &event ) == 0;
+    }
+    // 任意线程，只从epoll中删除，不关闭fd。在事件循环线程中调用时同时丢弃本轮中它尚未分发的事件
+    void remove( event_handler* handler )
+    {
+        epoll_ctl( m_epollfd, EPOLL_CTL_DEL, handler->fd, 0 );
+        if( m_ready > 0 && in_loop_thread() )
+        {
+            for( int i = m_cursor + 1; i < m_ready; ++i )
+            {
+                if( m_events[i].data.ptr == handler )
+                {
+                    m_events[i].data.ptr = NULL;
+                }
+            }
+        }
+    }
+
+    // 定时器，时间单位纳秒。回调在事件循环线程中执行，执行时已出堆，可以重新添加或destroy_timer
+    dheap_timer* create_timer( void ( *cb_func )( dheap_timer* ), void* user_data, int64_t slack = 0 )
+    {
+        return m_timers.create( cb_func, user_data, slack );
+    }
+    void destroy_timer( dheap_timer* timer )
+    {
+        m_timers.destroy( timer );
+    }
+    // 已设置的定时器被重新设置
+    void add_timer( dheap_timer* timer, int64_t delay )
+    {
+        m_timers.add_timer( timer, delay );
+    }
+    void del_timer( dheap_timer* timer )
+    {
+        m_timers.del_timer( timer );
+    }
+
+    // 收到sig时在事件循环线程中调用func。这些信号被阻塞，需在创建其他线程之前调用（线程继承信号屏蔽字）
+    void add_signal( int sig, signal_func func, void* arg )
+    {
+        if( ! m_signals )
+        {
+            m_signals = new signal_channel;
+            m_signal_handler.fd = m_signals->fd();
+            m_signal_handler.handle_event = handle_signal;
+            m_signal_handler.user_data = this;
+            add( &m_signal_handler, EPOLLIN );
+        }
+        m_sig_funcs[ sig ] = func;
+        m_sig_args[ sig ] = arg;
+        m_signals->add( sig );
+    }
+    // 可直接作为add_signal的回调，arg为event_loop：收到信号就退出循环
+    static void quit_on_signal( int /* sig */, void* arg )
+    {
+        static_cast< event_loop* >( arg )->quit();
+    }
+
+    // 任意线程：在事件循环线程中执行func，调用者就是事件循环线程时立即执行
+    void run_in_loop( task_func func, void* arg )
+    {
+        if( in_loop_thread() )
+        {
+            func( arg );
+            return;
+        }
+        queue_task( func, arg );
+    }
+    // 任意线程：放到事件循环线程本轮事件处理完之后执行，适合把同一轮中的多个请求合并处理
+    void defer( task_func func, void* arg )
+    {
+        if( in_loop_thread() )
+        {
+            m_deferred.push_back( task( func, arg ) );
+            return;
+        }
+        queue_task( func, arg );
+    }
+
+    // 任意线程：当前这一轮处理完后run()返回
+    void quit()
+    {
+        m_quit.store( true );
+        if( ! in_loop_thread() )
+        {
+            wakeup();
+        }
+    }
+
+    // 运行到quit()后返回true，epoll_wait出错时返回false
+    bool run()
+    {
+        assert( in_loop_thread() );
+        while( ! m_quit.load() )
+        {
+            int timeout = m_deferred.empty() ? m_timers.next_timeout() : 0;
+            int number = epoll_wait( m_epollfd, m_events, m_max_events, timeout );
+            if( number < 0 )
+            {
+                if( errno == EINTR )
+                {
+                    continue;
+                }
+                return false;
+            }
+
+            m_ready = number;
+            for( m_cursor = 0; m_cursor < m_ready; ++m_cursor )
+            {
+                event_handler* handler = static_cast< event_handler* >( m_events[ m_cursor ].data.ptr );
+                if( handler )
+                {
+                    handler->handle_event( handler, m_events[ m_cursor ].events );
+                }
+            }
+            m_ready = 0;
+
+            if( ! m_timers.empty() )
+            {
+                m_timers.tick( dheap::now_ns() );
+            }
+            // 执行时新defer的任务留到下一轮，epoll_wait不阻塞
+            if( ! m_deferred.empty() )
+            {
+                m_running.swap( m_deferred );
+                for( size_t i = 0; i < m_running.size(); ++i )
+                {
+                    m_running[i].func( m_running[i].arg );
+                }
+                m_running.clear();
+            }
+        }
+        return true;
+    }
+
+private:
+    struct task
+    {
+        task( task_func f, void* a ) : func( f ), arg( a ) {}
+        task_func func;
+        void* arg;
+    };
+
+    void queue_task( task_func func, void* arg )
+    {
+        m_task_lock.lock();
+        m_tasks.push_back( task( func, arg ) );
+        m_task_lock.unlock();
+        wakeup();
+    }
+    // 循环被唤醒前只写一次eventfd
+    void wakeup()
+    {
+        if( ! m_wake.exchange( true ) )
+        {
+            uint64_t one = 1;
+            while( write( m_wakefd, &one, sizeof( one ) ) < 0 && errno == EINTR )
+            {
+            }
+        }
+    }
+
+    static void handle_wakeup( event_handler* handler, uint32_t /* events */ )
+    {
+        event_loop* loop = static_cast< event_loop* >( handler->user_data );
+        uint64_t count;
+        while( read( loop->m_wakefd, &count, sizeof( count ) ) < 0 && errno == EINTR )
+        {
+        }
+        // 先清标志再取任务，之后提交的任务会重新唤醒
+        loop->m_wake.store( false );
+        std::vector< task > tasks;
+        loop->m_task_lock.lock();
+        tasks.swap( loop->m_tasks );
+        loop->m_task_lock.unlock();
+        for( size_t i = 0; i < tasks.size(); ++i )
+        {
+            tasks[i].func( tasks[i].arg );
+        }
+    }
+    static void handle_signal( event_handler* handler, uint32_t /* events */ )
+    {
+        event_loop* loop = static_cast< event_loop* >( handler->user_data );
+        int sig;
+        while( ( sig = loop->m_signals->read() ) > 0 )
+        {
+            if( loop->m_sig_funcs[ sig ] )
+            {
+                loop->m_sig_funcs[ sig ]( sig, loop->m_sig_args[ sig ] );
+            }
+        }
+    }
+
+private:
+    int m_epollfd;
+    int m_wakefd;
+    epoll_event* m_events;
+    int m_max_events;
+    int m_ready;                // 本轮epoll_wait返回的事件数，分发完后清0
+    int m_cursor;               // 正在分发的事件下标
+    event_handler m_wake_handler;
+    event_handler m_signal_handler;
+    signal_channel* m_signals;
+    signal_func m_sig_funcs[ _NSIG ];
+    void* m_sig_args[ _NSIG ];
+    dheap m_timers;
+    std::vector< task > m_deferred;     // 只有事件循环线程访问
+    std::vector< task > m_running;
+    locker m_task_lock;
+    std::vector< task > m_tasks;        // 其他线程提交的任务
+    const pthread_t m_thread;
+    std::atomic< bool > m_wake;
+    std::atomic< bool > m_quit;
+};
+
+#endif
@@ -16,6 +16,7 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include "event_loop.h"
 
 class process
 {
@@ -48,9 +49,14 @@ public:
     void run();
 
 private:
-    void setup_sig_pipe();
+    void setup_loop();
     void run_parent();
     void run_child();
+    static void on_new_conn( event_handler* handler, uint32_t events );
+    static void on_conn_event( event_handler* handler, uint32_t events );
+    static void on_listen( event_handler* handler, uint32_t events );
+    static void on_child_signal( int sig, void* arg );
+    static void on_parent_signal( int sig, void* arg );
 
 private:
     static const int MAX_PROCESS_NUMBER = 16;
@@ -58,17 +64,17 @@ private:
     static const int MAX_EVENT_NUMBER = 10000;
     int m_process_number;
     int m_idx;
-    int m_epollfd;
     int m_listenfd;
-    int m_stop;
+    int m_sub_process_counter;
+    event_loop* m_loop;
     process* m_sub_process;
+    T* m_users;
+    event_handler* m_handlers;
     static processpool< T >* m_instance;
 };
 template< typename T >
 processpool< T >* processpool< T >::m_instance = NULL;
 
-static int sig_pipefd[2];
-
 static int setnonblocking( int fd )
 {
     int old_option = fcntl( fd, F_GETFL );
@@ -77,29 +83,12 @@ static int setnonblocking( int fd )
     return old_option;
 }
 
-static void addfd( int epollfd, int fd )
-{
-    epoll_event event;
-    event.data.fd = fd;
-    event.events = EPOLLIN | EPOLLET;
-    epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event );
-    setnonblocking( fd );
-}
-
 static void removefd( int epollfd, int fd )
 {
     epoll_ctl( epollfd, EPOLL_CTL_DEL, fd, 0 );
     close( fd );
 }
 
-static void sig_handler( int sig )
-{
-    int save_errno = errno;
-    int msg = sig;
-    send( sig_pipefd[1], ( char* )&msg, 1, 0 );
-    errno = save_errno;
-}
-
 static void addsig( int sig, void( handler )(int), bool restart = true )
 {
     struct sigaction sa;
@@ -115,7 +104,8 @@ static void addsig( int sig, void( handler )(int), bool restart = true )
 
 template< typename T >
 processpool< T >::processpool( int listenfd, int process_number ) 
-    : m_listenfd( listenfd ), m_process_number( process_number ), m_idx( -1 ), m_stop( false )
+    : m_process_number( process_number ), m_idx( -1 ), m_listenfd( listenfd ), m_sub_process_counter( 0 ),
+      m_loop( NULL ), m_users( NULL ), m_handlers( NULL )
 {
     assert( ( process_number > 0 ) && ( process_number <= MAX_PROCESS_NUMBER ) );
 
@@ -143,21 +133,14 @@ processpool< T >::processpool( int listenfd, int process_number )
     }
 }
 
+// 父子进程各自有一个事件循环，信号通过signalfd变成普通事件
 template< typename T >
-void processpool< T >::setup_sig_pipe()
+void processpool< T >::setup_loop()
 {
-    m_epollfd = epoll_create( 5 );
-    assert( m_epollfd != -1 );
-
-    int ret = socketpair( PF_UNIX, SOCK_STREAM, 0, sig_pipefd );
-    assert( ret != -1 );
-
-    setnonblocking( sig_pipefd[1] );
-    addfd( m_epollfd, sig_pipefd[0] );
-
-    addsig( SIGCHLD, sig_handler );
-    addsig( SIGTERM, sig_handler );
-    addsig( SIGINT, sig_handler );
+    m_loop = new event_loop( MAX_EVENT_NUMBER );
+    m_loop->add_signal( SIGCHLD, m_idx == -1 ? on_parent_signal : on_child_signal, this );
+    m_loop->add_signal( SIGTERM, m_idx == -1 ? on_parent_signal : on_child_signal, this );
+    m_loop->add_signal( SIGINT, m_idx == -1 ? on_parent_signal : on_child_signal, this );
     addsig( SIGPIPE, SIG_IGN );
 }
 
@@ -173,231 +156,222 @@ void processpool< T >::run()
 }
 
 template< typename T >
-void processpool< T >::run_child()
+void processpool< T >::on_child_signal( int sig, void* arg )
 {
-    setup_sig_pipe();
-
-    int pipefd = m_sub_process[m_idx].m_pipefd[ 1 ];
-    addfd( m_epollfd, pipefd );
-
-    epoll_event events[ MAX_EVENT_NUMBER ];
-    T* users = new T [ USER_PER_PROCESS ];
-    assert( users );
-    int number = 0;
-    int ret = -1;
-
-    while( ! m_stop )
+    processpool< T >* pool = static_cast< processpool< T >* >( arg );
+    switch( sig )
     {
-        number = epoll_wait( m_epollfd, events, MAX_EVENT_NUMBER, -1 );
-        if ( ( number < 0 ) && ( errno != EINTR ) )
+        case SIGCHLD:
+        {
+            pid_t pid;
+            int stat;
+            while ( ( pid = waitpid( -1, &stat, WNOHANG ) ) > 0 )
+            {
+                continue;
+            }
+            break;
+        }
+        case SIGTERM:
+        case SIGINT:
+        {
+            pool->m_loop->quit();
+            break;
+        }
+        default:
         {
-            printf( "epoll failure\n" );
             break;
         }
+    }
+}
 
-        for ( int i = 0; i < number; i++ )
+// 父进程通知有新连接：接受它并注册到子进程的事件循环
+template< typename T >
+void processpool< T >::on_new_conn( event_handler* handler, uint32_t events )
+{
+    processpool< T >* pool = static_cast< processpool< T >* >( handler->user_data );
+    // 边沿触发，积压的通知一次读完
+    char notify[1024];
+    int ret = recv( handler->fd, notify, sizeof( notify ), 0 );
+    if( ( ( ret < 0 ) && ( errno != EAGAIN ) ) || ret == 0 ) 
+    {
+        return;
+    }
+    // 父进程对一批同时到达的连接只通知一次，这里把等待的连接全部接受
+    while( true )
+    {
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof( client_address );
+        int connfd = accept( pool->m_listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
+        if ( connfd < 0 )
         {
-            int sockfd = events[i].data.fd;
-            if( ( sockfd == pipefd ) && ( events[i].events & EPOLLIN ) )
-            {
-                int client = 0;
-                ret = recv( sockfd, ( char* )&client, sizeof( client ), 0 );
-                if( ( ( ret < 0 ) && ( errno != EAGAIN ) ) || ret == 0 ) 
-                {
-                    continue;
-                }
-                else
-                {
-                    struct sockaddr_in client_address;
-                    socklen_t client_addrlength = sizeof( client_address );
-                    int connfd = accept( m_listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
-                    if ( connfd < 0 )
-                    {
-                        printf( "errno is: %d\n", errno );
-                        continue;
-                    }
-                    addfd( m_epollfd, connfd );
-                    users[connfd].init( m_epollfd, connfd, client_address );
-                }
-            }
-            else if( ( sockfd == sig_pipefd[0] ) && ( events[i].events & EPOLLIN ) )
-            {
-                int sig;
-                char signals[1024];
-                ret = recv( sig_pipefd[0], signals, sizeof( signals ), 0 );
-                if( ret <= 0 )
-                {
-                    continue;
-                }
-                else
-                {
-                    for( int i = 0; i < ret; ++i )
-                    {
-                        switch( signals[i] )
-                        {
-                            case SIGCHLD:
-                            {
-                                pid_t pid;
-                                int stat;
-                                while ( ( pid = waitpid( -1, &stat, WNOHANG ) ) > 0 )
-                                {
-                                    continue;
-                                }
-                                break;
-                            }
-                            case SIGTERM:
-                            case SIGINT:
-                            {
-                                m_stop = true;
-                                break;
-                            }
-                            default:
-                            {
-                                break;
-                            }
-                        }
-                    }
-                }
-            }
-            else if( events[i].events & EPOLLIN )
+            if( errno != EAGAIN && errno != EWOULDBLOCK )
             {
-                 users[sockfd].process();
-            }
-            else
-            {
-                continue;
+                printf( "errno is: %d\n", errno );
             }
+            return;
         }
+        if( connfd >= USER_PER_PROCESS )
+        {
+            close( connfd );
+            continue;
+        }
+        event_handler* conn_handler = &pool->m_handlers[ connfd ];
+        conn_handler->fd = connfd;
+        conn_handler->handle_event = on_conn_event;
+        conn_handler->user_data = &pool->m_users[ connfd ];
+        setnonblocking( connfd );
+        pool->m_loop->add( conn_handler, EPOLLIN | EPOLLET );
+        pool->m_users[ connfd ].init( pool->m_loop->fd(), connfd, client_address );
     }
+}
 
-    delete [] users;
-    users = NULL;
-    close( pipefd );
-    //close( m_listenfd );
-    close( m_epollfd );
+template< typename T >
+void processpool< T >::on_conn_event( event_handler* handler, uint32_t events )
+{
+    if( events & EPOLLIN )
+    {
+        static_cast< T* >( handler->user_data )->process();
+    }
 }
 
 template< typename T >
-void processpool< T >::run_parent()
+void processpool< T >::run_child()
 {
-    setup_sig_pipe();
+    setup_loop();
 
-    addfd( m_epollfd, m_listenfd );
+    event_handler pipe_handler;
+    pipe_handler.fd = m_sub_process[m_idx].m_pipefd[ 1 ];
+    pipe_handler.handle_event = on_new_conn;
+    pipe_handler.user_data = this;
+    setnonblocking( pipe_handler.fd );
+    m_loop->add( &pipe_handler, EPOLLIN | EPOLLET );
 
-    epoll_event events[ MAX_EVENT_NUMBER ];
-    int sub_process_counter = 0;
-    int new_conn = 1;
-    int number = 0;
-    int ret = -1;
+    m_users = new T [ USER_PER_PROCESS ];
+    assert( m_users );
+    m_handlers = new event_handler[ USER_PER_PROCESS ];
 
-    while( ! m_stop )
+    if( ! m_loop->run() )
     {
-        number = epoll_wait( m_epollfd, events, MAX_EVENT_NUMBER, -1 );
-        if ( ( number < 0 ) && ( errno != EINTR ) )
-        {
-            printf( "epoll failure\n" );
-            break;
-        }
+        printf( "epoll failure\n" );
+    }
 
-        for ( int i = 0; i < number; i++ )
+    delete [] m_users;
+    m_users = NULL;
+    delete [] m_handlers;
+    m_handlers = NULL;
+    close( pipe_handler.fd );
+    //close( m_listenfd );
+    delete m_loop;
+    m_loop = NULL;
+}
+
+template< typename T >
+void processpool< T >::on_parent_signal( int sig, void* arg )
+{
+    processpool< T >* pool = static_cast< processpool< T >* >( arg );
+    switch( sig )
+    {
+        case SIGCHLD:
         {
-            int sockfd = events[i].data.fd;
-            if( sockfd == m_listenfd )
+            pid_t pid;
+            int stat;
+            while ( ( pid = waitpid( -1, &stat, WNOHANG ) ) > 0 )
             {
-                int i =  sub_process_counter;
-                do
+                for( int i = 0; i < pool->m_process_number; ++i )
                 {
-                    if( m_sub_process[i].m_pid != -1 )
+                    if( pool->m_sub_process[i].m_pid == pid )
                     {
-                        break;
+                        printf( "child %d join\n", i );
+                        close( pool->m_sub_process[i].m_pipefd[0] );
+                        pool->m_sub_process[i].m_pid = -1;
                     }
-                    i = (i+1)%m_process_number;
-                }
-                while( i != sub_process_counter );
-                
-                if( m_sub_process[i].m_pid == -1 )
-                {
-                    m_stop = true;
-                    break;
                 }
-                sub_process_counter = (i+1)%m_process_number;
-                //send( m_sub_process[sub_process_counter++].m_pipefd[0], ( char* )&new_conn, sizeof( new_conn ), 0 );
-                send( m_sub_process[i].m_pipefd[0], ( char* )&new_conn, sizeof( new_conn ), 0 );
-                printf( "send request to child %d\n", i );
-                //sub_process_counter %= m_process_number;
             }
-            else if( ( sockfd == sig_pipefd[0] ) && ( events[i].events & EPOLLIN ) )
+            // 所有子进程都退出了，父进程也退出
+            bool alive = false;
+            for( int i = 0; i < pool->m_process_number; ++i )
             {
-                int sig;
-                char signals[1024];
-                ret = recv( sig_pipefd[0], signals, sizeof( signals ), 0 );
-                if( ret <= 0 )
+                if( pool->m_sub_process[i].m_pid != -1 )
                 {
-                    continue;
-                }
-                else
-                {
-                    for( int i = 0; i < ret; ++i )
-                    {
-                        switch( signals[i] )
-                        {
-                            case SIGCHLD:
-                            {
-                                pid_t pid;
-                                int stat;
-                                while ( ( pid = waitpid( -1, &stat, WNOHANG ) ) > 0 )
-                                {
-                                    for( int i = 0; i < m_process_number; ++i )
-                                    {
-                                        if( m_sub_process[i].m_pid == pid )
-                                        {
-                                            printf( "child %d join\n", i );
-                                            close( m_sub_process[i].m_pipefd[0] );
-                                            m_sub_process[i].m_pid = -1;
-                                        }
-                                    }
-                                }
-                                m_stop = true;
-                                for( int i = 0; i < m_process_number; ++i )
-                                {
-                                    if( m_sub_process[i].m_pid != -1 )
-                                    {
-                                        m_stop = false;
-                                    }
-                                }
-                                break;
-                            }
-                            case SIGTERM:
-                            case SIGINT:
-                            {
-                                printf( "kill all the clild now\n" );
-                                for( int i = 0; i < m_process_number; ++i )
-                                {
-                                    int pid = m_sub_process[i].m_pid;
-                                    if( pid != -1 )
-                                    {
-                                        kill( pid, SIGTERM );
-                                    }
-                                }
-                                break;
-                            }
-                            default:
-                            {
-                                break;
-                            }
-                        }
-                    }
+                    alive = true;
                 }
             }
-            else
+            if( ! alive )
             {
-                continue;
+                pool->m_loop->quit();
+            }
+            break;
+        }
+        case SIGTERM:
+        case SIGINT:
+        {
+            printf( "kill all the clild now\n" );
+            for( int i = 0; i < pool->m_process_number; ++i )
+            {
+                int pid = pool->m_sub_process[i].m_pid;
+                if( pid != -1 )
+                {
+                    kill( pid, SIGTERM );
+                }
             }
+            break;
+        }
+        default:
+        {
+            break;
+        }
+    }
+}
+
+// 新连接到来时以Round Robin方式选一个子进程，让它去accept
+template< typename T >
+void processpool< T >::on_listen( event_handler* handler, uint32_t events )
+{
+    processpool< T >* pool = static_cast< processpool< T >* >( handler->user_data );
+    int i = pool->m_sub_process_counter;
+    do
+    {
+        if( pool->m_sub_process[i].m_pid != -1 )
+        {
+            break;
         }
+        i = (i+1)%pool->m_process_number;
+    }
+    while( i != pool->m_sub_process_counter );
+
+    if( pool->m_sub_process[i].m_pid == -1 )
+    {
+        pool->m_loop->quit();
+        return;
+    }
+    pool->m_sub_process_counter = (i+1)%pool->m_process_number;
+    int new_conn = 1;
+    send( pool->m_sub_process[i].m_pipefd[0], ( char* )&new_conn, sizeof( new_conn ), 0 );
+    printf( "send request to child %d\n", i );
+}
+
+template< typename T >
+void processpool< T >::run_parent()
+{
+    setup_loop();
+
+    // 监听socket是非阻塞的（子进程共享这一属性），被通知的子进程发现连接已被别人接受时不会阻塞
+    event_handler listen_handler;
+    listen_handler.fd = m_listenfd;
+    listen_handler.handle_event = on_listen;
+    listen_handler.user_data = this;
+    setnonblocking( m_listenfd );
+    m_loop->add( &listen_handler, EPOLLIN | EPOLLET );
+
+    if( ! m_loop->run() )
+    {
+        printf( "epoll failure\n" );
     }
 
+    m_loop->remove( &listen_handler );
     //close( m_listenfd );
-    close( m_epollfd );
+    delete m_loop;
+    m_loop = NULL;
 }
 
 #endif
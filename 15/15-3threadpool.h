@@ -1,116 +1,1100 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <list>
 #include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <new>
 #include <exception>
+#include <atomic>
 #include <pthread.h>
 #include "locker.h"
+#include "cpu_topology.h"
+#include "task_queue.h"
 
-template< typename T >
+// 任务分发方式
+enum DISPATCH
+{
+    DISPATCH_SHARED = 0,    // 所有线程共享一个队列
+    DISPATCH_AFFINE         // 按连接哈希到固定的“主”线程，主线程积压过多时才溢出到其他线程
+};
+
+// 弹性模式下的扩缩容事件
+enum RESIZE
+{
+    RESIZE_GROW = 0,
+    RESIZE_SHRINK
+};
+
+struct resize_event
+{
+    RESIZE kind;
+    int from;
+    int to;
+    long sojourn_us;        // 做决定时的排队时延估计
+};
+
+// 可能在任意工作线程中被调用
+typedef void ( *resize_hook )( const resize_event& event, void* arg );
+
+// 与请求共用工作线程的通用任务，invoke负责执行并回收自己（见executor.h）
+struct runnable
+{
+    void ( *invoke )( runnable* self );
+};
+
+// Q为任务队列策略（见task_queue.h）：默认locked_queue，可换成无锁的mpmc_ring
+template< typename T, template< typename > class Q = locked_queue >
 class threadpool
 {
 public:
-    threadpool( int thread_number = 8, int max_requests = 10000 );
+    threadpool( int thread_number = 8, int max_requests = 10000,
+                PLACEMENT placement = PLACE_NONE, int numa_node = 0 );
     ~threadpool();
     bool append( T* request );
+    // key标识请求所属的连接，亲和模式下同一个key总是优先落到同一个线程
+    bool append( T* request, unsigned long key );
+    // 一次投递一批请求（如一轮epoll_wait的全部就绪连接），只做一次唤醒
+    int append_batch( T** requests, int n );
+    // 每次唤醒最多连续取出的任务数
+    void set_batch_size( int n ) { m_batch = n < 1 ? 1 : ( n > MAX_BATCH ? MAX_BATCH : n ); }
+    // overflow：主线程私有队列超过这个长度时溢出到其他线程
+    void set_dispatch( DISPATCH mode, int overflow = 32 );
+
+    // 优先级通道：count个通道按weights加权公平出队，reserved[i]个线程只服务通道i
+    // 需在投递任务之前调用；append()/append_batch()进入通道0
+    bool set_lanes( int count, const int* weights, const int* reserved );
+    bool append_lane( T* request, int lane );
+    // 通用任务总是进共享通道
+    bool append_job( runnable* job, int lane = 0 );
+    int append_jobs( runnable** jobs, int n, int lane = 0 );
+    // 投递到指定工作线程的私有队列（如把定时器回调送回设置它的线程）。
+    // 目标线程不存在、为通道保留或没有私有队列时退回到lane通道
+    bool append_job_to( runnable* job, int worker, int lane = 0 );
+    // 调用线程在本线程池中的下标，不是本池的常驻工作线程时返回-1
+    int worker_index() const
+    {
+        worker* self = current();
+        return self && self->pool == this && ! self->elastic ? self->idx : -1;
+    }
+    size_t lane_length( int lane ) const { return m_lanes[ lane ]->size(); }
+
+    // 弹性模式：线程数在thread_number与max_threads之间伸缩。共享通道的排队时延超过target_us时
+    // 增加线程，多出来的线程空闲cooldown_ms后退出。hook为空时打印到stdout
+    // 需在投递任务之前调用，且只能调用一次
+    bool set_elastic( int max_threads, long target_us, long cooldown_ms,
+                      resize_hook hook = NULL, void* hook_arg = NULL );
+    int threads() const { return m_active.load( std::memory_order_relaxed ); }
+    unsigned long grows() const { return m_grows.load( std::memory_order_relaxed ); }
+    unsigned long shrinks() const { return m_shrinks.load( std::memory_order_relaxed ); }
+    long sojourn_us() const { return m_sojourn.load( std::memory_order_relaxed ) / 1000; }
+
+    // 唤醒统计：wakeups为工作线程真正从futex睡眠中醒来的次数
+    unsigned long tasks() const;
+    unsigned long wakeups() const;
+    unsigned long wake_calls() const { return m_wake_calls.load( std::memory_order_relaxed ); }
+    unsigned long overflows() const { return m_overflows.load( std::memory_order_relaxed ); }
+    double wakeups_per_task() const
+    {
+        unsigned long t = tasks();
+        return t ? ( double )wakeups() / t : 0.0;
+    }
 
 private:
-    static void* worker( void* arg );
-    void run();
+    static const int MAX_BATCH = 64;
+    static const int MAX_THREADS = 1024;
+    static const int MAX_LANES = 4;
+
+    // 弹性模式的槽位状态
+    enum { SLOT_FREE = 0, SLOT_RUNNING, SLOT_RETIRED };
+
+    // 队列元素：request与job二选一，stamp为入队时刻（纳秒），非弹性模式下为0
+    struct item
+    {
+        T* request;
+        runnable* job;
+        long stamp;
+    };
+
+    // 每个工作线程私有的状态，由工作线程自己在绑核之后分配（first-touch落在本地节点）
+    struct worker
+    {
+        threadpool* pool;
+        int idx;
+        int cpu;
+        int node;
+        std::atomic< unsigned long > tasks;
+        std::atomic< unsigned long > wakeups;
+        Q< item >* local;       // 私有队列（亲和模式的任务、append_job_to的任务），弹性扩出的线程没有
+        event_count localstat;
+        int lane;               // >= 0 表示该线程为此通道保留
+        bool elastic;           // 弹性扩出的线程，空闲超时后退出
+        long credit[ MAX_LANES ];
+        item batch[ MAX_BATCH ];
+    } __attribute__( ( aligned( 64 ) ) );
+
+    struct worker_arg
+    {
+        threadpool* pool;
+        int idx;
+        int cpu;
+    };
+
+    static void* worker_main( void* arg );
+    static void* elastic_main( void* arg );
+    static worker*& current()
+    {
+        static thread_local worker* self = NULL;
+        return self;
+    }
+    static worker* new_worker( threadpool* pool, int idx, bool elastic );
+    static void free_worker( worker* w )
+    {
+        if( w )
+        {
+            delete w->local;
+            w->~worker();
+            free( w );
+        }
+    }
+    void run( worker* self );
+    int take( worker* self );
+    bool idle( worker* self ) const;
+    int take_lanes( worker* self );
+    int take_from( Q< item >* queue, worker* self );
+    void wake( int lane, int n );
+    void wake_all();
+    int home_of( unsigned long key ) const
+    {
+        return m_general[ ( ( key * 0x9E3779B97F4A7C15ul ) >> 32 ) % m_general_count ];
+    }
+    int pick_affine( unsigned long key );
+    static unsigned long key_of( T* request )
+    {
+        return ( unsigned long )request / sizeof( T );
+    }
+    static long now_ns()
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ts.tv_sec * 1000000000l + ts.tv_nsec;
+    }
+    long stamp() const { return m_elastic ? now_ns() : 0; }
+    static item make_item( T* request, long stamp )
+    {
+        item it;
+        it.request = request;
+        it.job = NULL;
+        it.stamp = stamp;
+        return it;
+    }
+    static item make_job( runnable* job, long stamp )
+    {
+        item it;
+        it.request = NULL;
+        it.job = job;
+        it.stamp = stamp;
+        return it;
+    }
+    int push_items( Q< item >* queue, T** requests, runnable** jobs, int n );
+    void observe( long stamp );
+    void grow( long sojourn_us );
+    bool retire( worker* self );
+    void notify_resize( RESIZE kind, int from, int to, long sojourn_us );
 
 private:
-    int m_thread_number;
+    int m_thread_number;        // 常驻线程数，也是弹性模式的下限
+    int m_slots;                // 弹性模式的上限
     int m_max_requests;
     pthread_t* m_threads;
-    std::list< T* > m_workqueue;
-    locker m_queuelocker;
-    sem m_queuestat;
-    bool m_stop;
+    worker_arg* m_args;
+    worker** m_workers;
+    Q< item > m_workqueue;
+    event_count m_queuestat;
+    Q< item >* m_lanes[ MAX_LANES ];
+    event_count m_lanestat[ MAX_LANES ];
+    int m_lane_count;
+    int m_weight[ MAX_LANES ];
+    int* m_general;             // 未保留给特定通道的线程
+    int m_general_count;
+    std::atomic< unsigned > m_rr;
+    std::atomic< int > m_sleepers;  // 等在自己事件上的通用线程数
+    sem m_ready;
+    cpu_topology m_topology;
+    int m_batch;
+    int m_spin;
+    std::atomic< bool > m_affine;
+    int m_overflow;
+    std::atomic< unsigned long > m_wake_calls;
+    std::atomic< unsigned long > m_overflows;
+    bool m_elastic;
+    std::atomic< int >* m_state;
+    std::atomic< int > m_active;
+    long m_target_ns;
+    long m_cooldown_ms;
+    long m_grow_interval;
+    std::atomic< long > m_sojourn;
+    std::atomic< long > m_last_grow;
+    locker m_resize;
+    resize_hook m_hook;
+    void* m_hook_arg;
+    std::atomic< unsigned long > m_grows;
+    std::atomic< unsigned long > m_shrinks;
+    std::atomic< bool > m_stop;
 };
 
-template< typename T >
-threadpool< T >::threadpool( int thread_number, int max_requests ) : 
-        m_thread_number( thread_number ), m_max_requests( max_requests ), m_stop( false ), m_threads( NULL )
+template< typename T, template< typename > class Q >
+threadpool< T, Q >::threadpool( int thread_number, int max_requests, PLACEMENT placement, int numa_node ) :
+        m_thread_number( thread_number ), m_slots( thread_number ), m_max_requests( max_requests ), m_threads( NULL ),
+        m_args( NULL ), m_workers( NULL ), m_workqueue( max_requests ), m_lane_count( 1 ),
+        m_general( NULL ), m_general_count( thread_number ), m_rr( 0 ), m_sleepers( 0 ), m_batch( 16 ), m_spin( 0 ), m_affine( false ), m_overflow( 32 ), m_wake_calls( 0 ),
+        m_overflows( 0 ), m_elastic( false ), m_state( NULL ), m_active( thread_number ), m_target_ns( 0 ),
+        m_cooldown_ms( 0 ), m_grow_interval( 0 ), m_sojourn( 0 ), m_last_grow( 0 ), m_hook( NULL ), m_hook_arg( NULL ),
+        m_grows( 0 ), m_shrinks( 0 ), m_stop( false )
 {
-    if( ( thread_number <= 0 ) || ( max_requests <= 0 ) )
+    if( ( thread_number <= 0 ) || ( thread_number > MAX_THREADS ) || ( max_requests <= 0 ) )
+    {
+        throw std::exception();
+    }
+    if( placement == PLACE_NUMA_NODE && ( numa_node < 0 || numa_node >= m_topology.node_count() ) )
     {
         throw std::exception();
     }
 
     m_threads = new pthread_t[ m_thread_number ];
-    if( ! m_threads )
+    m_args = new worker_arg[ m_thread_number ];
+    m_workers = new worker*[ m_thread_number ];
+    m_general = new int[ m_thread_number ];
+    for( int i = 0; i < m_thread_number; ++i )
     {
-        throw std::exception();
+        m_general[i] = i;
     }
+    m_lanes[0] = &m_workqueue;
+    m_weight[0] = 1;
+    for( int i = 1; i < MAX_LANES; ++i )
+    {
+        m_lanes[i] = NULL;
+        m_weight[i] = 0;
+    }
+    m_topology.report( stdout );
+    // 单核上自旋只会抢占生产者
+    m_spin = m_topology.cpu_count() > 1 ? 2000 : 0;
 
     for ( int i = 0; i < thread_number; ++i )
     {
+        pthread_attr_t attr;
+        pthread_attr_init( &attr );
+        cpu_set_t mask;
+        int cpu = -1;
+        if( m_topology.worker_mask( placement, numa_node, i, &mask, &cpu ) )
+        {
+            pthread_attr_setaffinity_np( &attr, sizeof( mask ), &mask );
+        }
+        m_args[i].pool = this;
+        m_args[i].idx = i;
+        m_args[i].cpu = cpu;
+        m_workers[i] = NULL;
+
         printf( "create the %dth thread\n", i );
-        if( pthread_create( m_threads + i, NULL, worker, this ) != 0 )
+        int ret = pthread_create( m_threads + i, &attr, worker_main, m_args + i );
+        pthread_attr_destroy( &attr );
+        if( ret == 0 )
         {
-            delete [] m_threads;
-            throw std::exception();
+            m_ready.wait();
+            if( !m_workers[i] )
+            {
+                pthread_join( m_threads[i], NULL );
+                ret = -1;
+            }
         }
-        if( pthread_detach( m_threads[i] ) )
+        if( ret != 0 )
         {
+            m_stop = true;
+            m_thread_number = i;
+            m_slots = i;
+            wake_all();
+            for( int j = 0; j < i; ++j )
+            {
+                pthread_join( m_threads[j], NULL );
+                free_worker( m_workers[j] );
+            }
             delete [] m_threads;
+            delete [] m_args;
+            delete [] m_workers;
+            delete [] m_general;
             throw std::exception();
         }
     }
+
+    for( int i = 0; i < m_thread_number; ++i )
+    {
+        worker* w = m_workers[i];
+        if( w->cpu >= 0 )
+        {
+            printf( "worker %d -> cpu %d (node %d)\n", i, w->cpu, w->node );
+        }
+        else if( placement == PLACE_NUMA_NODE )
+        {
+            printf( "worker %d -> node %d\n", i, w->node );
+        }
+    }
 }
 
-template< typename T >
-threadpool< T >::~threadpool()
+template< typename T, template< typename > class Q >
+threadpool< T, Q >::~threadpool()
 {
-    delete [] m_threads;
+    // 持锁置位，保证之后不会再有线程被扩出来
+    m_resize.lock();
     m_stop = true;
+    m_resize.unlock();
+    wake_all();
+    for( int i = 0; i < m_slots; ++i )
+    {
+        if( i < m_thread_number || m_state[i].load() != SLOT_FREE )
+        {
+            pthread_join( m_threads[i], NULL );
+        }
+        free_worker( m_workers[i] );
+    }
+    delete [] m_state;
+    for( int i = 1; i < MAX_LANES; ++i )
+    {
+        delete m_lanes[i];
+    }
+    delete [] m_threads;
+    delete [] m_args;
+    delete [] m_workers;
+    delete [] m_general;
+}
+
+template< typename T, template< typename > class Q >
+void threadpool< T, Q >::set_dispatch( DISPATCH mode, int overflow )
+{
+    m_overflow = overflow < 1 ? 1 : overflow;
+    m_affine = ( mode == DISPATCH_AFFINE );
+    // 让所有线程按新模式重新选择等待对象
+    wake_all();
+}
+
+template< typename T, template< typename > class Q >
+bool threadpool< T, Q >::set_lanes( int count, const int* weights, const int* reserved )
+{
+    if( count < 1 || count > MAX_LANES )
+    {
+        return false;
+    }
+    int total = 0;
+    for( int i = 0; i < count; ++i )
+    {
+        if( weights[i] <= 0 || reserved[i] < 0 )
+        {
+            return false;
+        }
+        total += reserved[i];
+    }
+    // 至少留一个线程给所有通道共用
+    if( total >= m_thread_number )
+    {
+        return false;
+    }
+
+    for( int i = 1; i < count; ++i )
+    {
+        if( ! m_lanes[i] )
+        {
+            m_lanes[i] = new Q< item >( m_max_requests );
+        }
+    }
+    int next = 0;
+    m_general_count = 0;
+    for( int i = 0; i < count; ++i )
+    {
+        m_weight[i] = weights[i];
+        for( int j = 0; j < reserved[i]; ++j )
+        {
+            m_workers[ next++ ]->lane = i;
+        }
+    }
+    for( ; next < m_thread_number; ++next )
+    {
+        m_workers[ next ]->lane = -1;
+        m_general[ m_general_count++ ] = next;
+    }
+    m_lane_count = count;
+    for( int i = 0; i < m_thread_number; ++i )
+    {
+        if( m_workers[i]->lane >= 0 )
+        {
+            printf( "worker %d reserved for lane %d\n", i, m_workers[i]->lane );
+        }
+    }
+    wake_all();
+    return true;
+}
+
+template< typename T, template< typename > class Q >
+bool threadpool< T, Q >::append_lane( T* request, int lane )
+{
+    if( lane < 0 || lane >= m_lane_count )
+    {
+        return false;
+    }
+    if( ! m_lanes[ lane ]->push( make_item( request, stamp() ) ) )
+    {
+        return false;
+    }
+    wake( lane, 1 );
+    return true;
+}
+
+template< typename T, template< typename > class Q >
+bool threadpool< T, Q >::append( T* request )
+{
+    return append( request, key_of( request ) );
 }
 
-template< typename T >
-bool threadpool< T >::append( T* request )
+template< typename T, template< typename > class Q >
+bool threadpool< T, Q >::append( T* request, unsigned long key )
 {
-    m_queuelocker.lock();
-    if ( m_workqueue.size() > m_max_requests )
+    if( m_affine )
+    {
+        int idx = pick_affine( key );
+        if( ! m_workers[idx]->local->push( make_item( request, 0 ) ) )
+        {
+            return false;
+        }
+        if( m_workers[idx]->localstat.notify( 1 ) )
+        {
+            m_wake_calls.fetch_add( 1, std::memory_order_relaxed );
+        }
+        return true;
+    }
+
+    if ( ! m_workqueue.push( make_item( request, stamp() ) ) )
     {
-        m_queuelocker.unlock();
         return false;
     }
-    m_workqueue.push_back( request );
-    m_queuelocker.unlock();
-    m_queuestat.post();
+    wake( 0, 1 );
     return true;
 }
 
-template< typename T >
-void* threadpool< T >::worker( void* arg )
+template< typename T, template< typename > class Q >
+int threadpool< T, Q >::append_batch( T** requests, int n )
+{
+    if( m_affine )
+    {
+        // 先全部入队，最后每个收到任务的线程只唤醒一次
+        unsigned long touched[ MAX_THREADS / 64 ] = { 0 };
+        int pushed = 0;
+        for( ; pushed < n; ++pushed )
+        {
+            int idx = pick_affine( key_of( requests[ pushed ] ) );
+            if( ! m_workers[idx]->local->push( make_item( requests[ pushed ], 0 ) ) )
+            {
+                break;
+            }
+            touched[ idx / 64 ] |= 1ul << ( idx % 64 );
+        }
+        for( int i = 0; i < m_thread_number; ++i )
+        {
+            if( ( touched[ i / 64 ] & ( 1ul << ( i % 64 ) ) ) && m_workers[i]->localstat.notify( 1 ) )
+            {
+                m_wake_calls.fetch_add( 1, std::memory_order_relaxed );
+            }
+        }
+        return pushed;
+    }
+
+    int pushed = push_items( &m_workqueue, requests, NULL, n );
+    if( pushed > 0 )
+    {
+        wake( 0, pushed );
+    }
+    return pushed;
+}
+
+template< typename T, template< typename > class Q >
+bool threadpool< T, Q >::append_job( runnable* job, int lane )
+{
+    if( lane < 0 || lane >= m_lane_count )
+    {
+        return false;
+    }
+    if( ! m_lanes[ lane ]->push( make_job( job, stamp() ) ) )
+    {
+        return false;
+    }
+    wake( lane, 1 );
+    return true;
+}
+
+template< typename T, template< typename > class Q >
+bool threadpool< T, Q >::append_job_to( runnable* job, int idx, int lane )
+{
+    if( idx < 0 || idx >= m_thread_number || ! m_workers[idx] || ! m_workers[idx]->local || m_workers[idx]->lane >= 0 )
+    {
+        return append_job( job, lane );
+    }
+    if( ! m_workers[idx]->local->push( make_job( job, 0 ) ) )
+    {
+        return append_job( job, lane );
+    }
+    // 通用线程在两种模式下都等在自己的事件上，只叫醒目标线程
+    if( m_workers[idx]->localstat.notify( 1 ) )
+    {
+        m_wake_calls.fetch_add( 1, std::memory_order_relaxed );
+    }
+    return true;
+}
+
+template< typename T, template< typename > class Q >
+int threadpool< T, Q >::append_jobs( runnable** jobs, int n, int lane )
+{
+    if( lane < 0 || lane >= m_lane_count )
+    {
+        return 0;
+    }
+    int pushed = push_items( m_lanes[ lane ], NULL, jobs, n );
+    if( pushed > 0 )
+    {
+        wake( lane, pushed );
+    }
+    return pushed;
+}
+
+// 分段转换成队列元素，整批共用一个时间戳；requests与jobs二选一
+template< typename T, template< typename > class Q >
+int threadpool< T, Q >::push_items( Q< item >* queue, T** requests, runnable** jobs, int n )
+{
+    long now = stamp();
+    item items[ MAX_BATCH ];
+    int pushed = 0;
+    while( pushed < n )
+    {
+        int count = n - pushed < MAX_BATCH ? n - pushed : MAX_BATCH;
+        for( int i = 0; i < count; ++i )
+        {
+            items[i] = requests ? make_item( requests[ pushed + i ], now ) : make_job( jobs[ pushed + i ], now );
+        }
+        int done = queue->push_batch( items, count );
+        pushed += done;
+        if( done < count )
+        {
+            break;
+        }
+    }
+    return pushed;
+}
+
+// 主线程不忙就交给主线程；否则在另外两个随机线程里选积压少的（power of two choices）
+template< typename T, template< typename > class Q >
+int threadpool< T, Q >::pick_affine( unsigned long key )
+{
+    int home = home_of( key );
+    size_t len = m_workers[home]->local->size();
+    if( len < ( size_t )m_overflow || m_general_count == 1 )
+    {
+        return home;
+    }
+    unsigned long h = key * 0xC2B2AE3D27D4EB4Ful + len;
+    int a = m_general[ ( h >> 16 ) % m_general_count ];
+    int b = m_general[ ( h >> 40 ) % m_general_count ];
+    int best = m_workers[a]->local->size() <= m_workers[b]->local->size() ? a : b;
+    if( m_workers[best]->local->size() >= len )
+    {
+        return home;
+    }
+    m_overflows.fetch_add( 1, std::memory_order_relaxed );
+    return best;
+}
+
+// 共享通道来了任务：优先叫醒为该通道保留的线程，否则叫醒通用线程
+template< typename T, template< typename > class Q >
+void threadpool< T, Q >::wake( int lane, int n )
+{
+    if( m_lanestat[ lane ].notify( n ) )
+    {
+        m_wake_calls.fetch_add( 1, std::memory_order_relaxed );
+        if( n == 1 )
+        {
+            return;
+        }
+    }
+    bool called = false;
+    if( m_affine )
+    {
+        // 亲和模式下通用线程都等在各自的事件上，轮流叫醒
+        for( int i = 0; i < n && i < m_general_count; ++i )
+        {
+            int idx = m_general[ m_rr.fetch_add( 1, std::memory_order_relaxed ) % m_general_count ];
+            called |= m_workers[ idx ]->localstat.notify( 1 );
+        }
+    }
+    else
+    {
+        // 从上次的位置开始找正在睡眠的通用线程，叫醒n个；都在忙时只读一次计数
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        if( m_sleepers.load( std::memory_order_relaxed ) > 0 )
+        {
+            unsigned start = m_rr.fetch_add( 1, std::memory_order_relaxed );
+            int woken = 0;
+            for( int i = 0; i < m_general_count && woken < n; ++i )
+            {
+                if( m_workers[ m_general[ ( start + i ) % m_general_count ] ]->localstat.notify( 1 ) )
+                {
+                    ++woken;
+                }
+            }
+            called = woken > 0;
+        }
+    }
+    // 弹性扩出的线程没有私有队列，始终等在共享事件上
+    if( m_active.load( std::memory_order_relaxed ) > m_thread_number )
+    {
+        called |= m_queuestat.notify( n );
+    }
+    if( called )
+    {
+        m_wake_calls.fetch_add( 1, std::memory_order_relaxed );
+    }
+}
+
+template< typename T, template< typename > class Q >
+void threadpool< T, Q >::wake_all()
 {
-    threadpool* pool = ( threadpool* )arg;
-    pool->run();
+    m_queuestat.notify_all();
+    for( int i = 0; i < MAX_LANES; ++i )
+    {
+        m_lanestat[i].notify_all();
+    }
+    for( int i = 0; i < m_slots; ++i )
+    {
+        if( m_workers[i] )
+        {
+            m_workers[i]->localstat.notify_all();
+        }
+    }
+}
+
+template< typename T, template< typename > class Q >
+unsigned long threadpool< T, Q >::tasks() const
+{
+    unsigned long sum = 0;
+    for( int i = 0; i < m_slots; ++i )
+    {
+        sum += m_workers[i]->tasks.load( std::memory_order_relaxed );
+    }
+    return sum;
+}
+
+template< typename T, template< typename > class Q >
+unsigned long threadpool< T, Q >::wakeups() const
+{
+    unsigned long sum = 0;
+    for( int i = 0; i < m_slots; ++i )
+    {
+        sum += m_workers[i]->wakeups.load( std::memory_order_relaxed );
+    }
+    return sum;
+}
+
+template< typename T, template< typename > class Q >
+typename threadpool< T, Q >::worker* threadpool< T, Q >::new_worker( threadpool* pool, int idx, bool elastic )
+{
+    void* mem = NULL;
+    if( posix_memalign( &mem, 64, sizeof( worker ) ) != 0 )
+    {
+        return NULL;
+    }
+    worker* self = new ( mem ) worker;
+    self->local = NULL;
+    if( ! elastic )
+    {
+        try
+        {
+            self->local = new Q< item >( pool->m_max_requests );
+        }
+        catch( ... )
+        {
+            free_worker( self );
+            return NULL;
+        }
+    }
+    self->pool = pool;
+    self->idx = idx;
+    self->cpu = -1;
+    self->node = 0;
+    self->tasks.store( 0 );
+    self->wakeups.store( 0 );
+    self->lane = -1;
+    self->elastic = elastic;
+    for( int i = 0; i < MAX_LANES; ++i )
+    {
+        self->credit[i] = 0;
+    }
+    return self;
+}
+
+template< typename T, template< typename > class Q >
+void* threadpool< T, Q >::worker_main( void* arg )
+{
+    worker_arg* wa = ( worker_arg* )arg;
+    threadpool* pool = wa->pool;
+
+    // 线程已在目标CPU上运行，此时分配的内存按first-touch落在本地NUMA节点
+    worker* self = new_worker( pool, wa->idx, false );
+    if( ! self )
+    {
+        pool->m_ready.post();
+        return NULL;
+    }
+    self->cpu = wa->cpu >= 0 ? sched_getcpu() : -1;
+    const cpu_info* info = pool->m_topology.find( sched_getcpu() );
+    self->node = info ? info->node : 0;
+    pool->m_workers[ wa->idx ] = self;
+    pool->m_ready.post();
+
+    pool->run( self );
     return pool;
 }
 
-template< typename T >
-void threadpool< T >::run()
+// 弹性线程不绑核，worker结构在set_elastic()中预先分配，退出后留给下一个线程复用
+template< typename T, template< typename > class Q >
+void* threadpool< T, Q >::elastic_main( void* arg )
+{
+    worker* self = ( worker* )arg;
+    self->pool->run( self );
+    return NULL;
+}
+
+template< typename T, template< typename > class Q >
+bool threadpool< T, Q >::set_elastic( int max_threads, long target_us, long cooldown_ms,
+                                      resize_hook hook, void* hook_arg )
+{
+    if( m_elastic || max_threads <= m_thread_number || max_threads > MAX_THREADS
+        || target_us <= 0 || cooldown_ms <= 0 )
+    {
+        return false;
+    }
+    pthread_t* threads = new pthread_t[ max_threads ];
+    worker_arg* args = new worker_arg[ max_threads ];
+    worker** workers = new worker*[ max_threads ];
+    std::atomic< int >* state = new std::atomic< int >[ max_threads ];
+    for( int i = 0; i < max_threads; ++i )
+    {
+        workers[i] = i < m_thread_number ? m_workers[i] : new_worker( this, i, true );
+        state[i].store( i < m_thread_number ? SLOT_RUNNING : SLOT_FREE );
+        if( ! workers[i] )
+        {
+            for( int j = m_thread_number; j < i; ++j )
+            {
+                free_worker( workers[j] );
+            }
+            delete [] threads;
+            delete [] args;
+            delete [] workers;
+            delete [] state;
+            return false;
+        }
+        if( i < m_thread_number )
+        {
+            threads[i] = m_threads[i];
+            args[i] = m_args[i];
+        }
+    }
+    delete [] m_threads;
+    delete [] m_args;
+    delete [] m_workers;
+    m_threads = threads;
+    m_args = args;
+    m_workers = workers;
+    m_state = state;
+    m_slots = max_threads;
+    m_target_ns = target_us * 1000;
+    m_cooldown_ms = cooldown_ms;
+    // 新线程需要一点时间才能把积压消化掉，两次扩容之间至少隔4个目标时延（不少于1ms）
+    m_grow_interval = m_target_ns * 4 > 1000000 ? m_target_ns * 4 : 1000000;
+    m_hook = hook;
+    m_hook_arg = hook_arg;
+    m_elastic = true;
+    return true;
+}
+
+// 用出队任务的排队时间更新EWMA，持续超标就扩容
+template< typename T, template< typename > class Q >
+void threadpool< T, Q >::observe( long stamp )
 {
+    long age = now_ns() - stamp;
+    long s = m_sojourn.load( std::memory_order_relaxed );
+    s += ( age - s ) / 8;
+    m_sojourn.store( s, std::memory_order_relaxed );
+    if( s > m_target_ns && age > m_target_ns && m_active.load( std::memory_order_relaxed ) < m_slots )
+    {
+        grow( s / 1000 );
+    }
+}
+
+template< typename T, template< typename > class Q >
+void threadpool< T, Q >::grow( long sojourn_us )
+{
+    long now = now_ns();
+    long last = m_last_grow.load( std::memory_order_relaxed );
+    if( now - last < m_grow_interval || ! m_last_grow.compare_exchange_strong( last, now ) )
+    {
+        return;
+    }
+    // 别的线程正在扩容或者线程池正在析构
+    if( ! m_resize.try_lock() )
+    {
+        return;
+    }
+    int slot = -1;
+    for( int i = m_thread_number; i < m_slots && ! m_stop; ++i )
+    {
+        int state = m_state[i].load( std::memory_order_acquire );
+        if( state == SLOT_RETIRED )
+        {
+            pthread_join( m_threads[i], NULL );
+            m_state[i].store( SLOT_FREE );
+            state = SLOT_FREE;
+        }
+        if( state == SLOT_FREE )
+        {
+            slot = i;
+            break;
+        }
+    }
+    int from = 0;
+    if( slot >= 0 )
+    {
+        m_state[ slot ].store( SLOT_RUNNING );
+        from = m_active.fetch_add( 1 );
+        if( pthread_create( m_threads + slot, NULL, elastic_main, m_workers[ slot ] ) != 0 )
+        {
+            m_active.fetch_sub( 1 );
+            m_state[ slot ].store( SLOT_FREE );
+            slot = -1;
+        }
+    }
+    m_resize.unlock();
+    if( slot >= 0 )
+    {
+        m_grows.fetch_add( 1, std::memory_order_relaxed );
+        notify_resize( RESIZE_GROW, from, from + 1, sojourn_us );
+    }
+}
+
+// 空闲超时的弹性线程退出；超时之后又来了任务就继续干活
+template< typename T, template< typename > class Q >
+bool threadpool< T, Q >::retire( worker* self )
+{
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    if( ! idle( self ) )
+    {
+        return false;
+    }
+    int from = m_active.fetch_sub( 1 );
+    m_shrinks.fetch_add( 1, std::memory_order_relaxed );
+    notify_resize( RESIZE_SHRINK, from, from - 1, sojourn_us() );
+    m_state[ self->idx ].store( SLOT_RETIRED, std::memory_order_release );
+    return true;
+}
+
+template< typename T, template< typename > class Q >
+void threadpool< T, Q >::notify_resize( RESIZE kind, int from, int to, long sojourn_us )
+{
+    resize_event event;
+    event.kind = kind;
+    event.from = from;
+    event.to = to;
+    event.sojourn_us = sojourn_us;
+    if( m_hook )
+    {
+        m_hook( event, m_hook_arg );
+    }
+    else
+    {
+        printf( "threadpool %s: %d -> %d threads (sojourn %ldus)\n",
+                kind == RESIZE_GROW ? "grow" : "shrink", from, to, sojourn_us );
+    }
+}
+
+template< typename T, template< typename > class Q >
+void threadpool< T, Q >::run( worker* self )
+{
+    current() = self;
     while ( ! m_stop )
     {
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if ( m_workqueue.empty() )
+        int n = take( self );
+        if( n == 0 )
         {
-            m_queuelocker.unlock();
-            continue;
+            // 先自旋一会儿，背靠背到达的任务不必进内核
+            for( int i = 0; i < m_spin && idle( self ) && ! m_stop; ++i )
+            {
+                cpu_relax();
+            }
+            n = take( self );
         }
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
-        if ( ! request )
+        if( n == 0 )
         {
-            continue;
+            // 保留线程等在所属通道上；通用线程等在自己的事件上，append_job_to可以只叫醒它；
+            // 弹性扩出的线程等在共享事件上。计数要在再次检查队列之前加上，与wake()中的读配对
+            int lane = self->lane;
+            bool own = lane < 0 && self->local;
+            event_count& stat = lane >= 0 ? m_lanestat[ lane ] : ( own ? self->localstat : m_queuestat );
+            if( own )
+            {
+                m_sleepers.fetch_add( 1 );
+            }
+            unsigned key = stat.prepare_wait();
+            n = take( self );
+            if( n == 0 && ! m_stop && lane == self->lane )
+            {
+                if( self->elastic )
+                {
+                    if( stat.timed_wait( key, m_cooldown_ms ) )
+                    {
+                        self->wakeups.store( self->wakeups.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+                    }
+                    else if( retire( self ) )
+                    {
+                        return;
+                    }
+                    continue;
+                }
+                if( stat.wait( key ) )
+                {
+                    self->wakeups.store( self->wakeups.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+                }
+                if( own )
+                {
+                    m_sleepers.fetch_sub( 1 );
+                }
+                continue;
+            }
+            stat.cancel_wait();
+            if( own )
+            {
+                m_sleepers.fetch_sub( 1 );
+            }
         }
-        request->process();
+
+        for( int i = 0; i < n; ++i )
+        {
+            item& it = self->batch[i];
+            if( it.request )
+            {
+                it.request->process();
+            }
+            else if( it.job )
+            {
+                it.job->invoke( it.job );
+            }
+        }
+        self->tasks.store( self->tasks.load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
     }
 }
 
+// 一次最多取m_batch个任务，但不超过平均每个线程的份额，避免一个线程把别人的活都拿走
+template< typename T, template< typename > class Q >
+int threadpool< T, Q >::take_from( Q< item >* queue, worker* self )
+{
+    int want = 1 + ( int )( queue->size() / m_active.load( std::memory_order_relaxed ) );
+    if( want > m_batch )
+    {
+        want = m_batch;
+    }
+    int n = queue->pop_batch( self->batch, want );
+    // 批内第一个任务排队最久
+    if( n > 0 && self->batch[0].stamp )
+    {
+        observe( self->batch[0].stamp );
+    }
+    return n;
+}
+
+template< typename T, template< typename > class Q >
+int threadpool< T, Q >::take( worker* self )
+{
+    if( self->lane >= 0 )
+    {
+        return take_from( m_lanes[ self->lane ], self );
+    }
+    int n = self->local ? self->local->pop_batch( self->batch, m_batch ) : 0;
+    if( n > 0 )
+    {
+        return n;
+    }
+    if( m_lane_count == 1 )
+    {
+        return take_from( &m_workqueue, self );
+    }
+    return take_lanes( self );
+}
+
+// 平滑加权轮询：每个非空通道累加自己的权重，取累计值最大的通道，
+// 被选中的通道扣掉所有非空通道的权重和。按任务数记账，批量出队也保持比例
+template< typename T, template< typename > class Q >
+int threadpool< T, Q >::take_lanes( worker* self )
+{
+    int ready[ MAX_LANES ];
+    int count = 0;
+    long total = 0;
+    for( int i = 0; i < m_lane_count; ++i )
+    {
+        if( m_lanes[i]->size() > 0 )
+        {
+            ready[ count++ ] = i;
+            total += m_weight[i];
+        }
+    }
+    while( count > 0 )
+    {
+        int best = 0;
+        for( int i = 1; i < count; ++i )
+        {
+            if( self->credit[ ready[i] ] + m_weight[ ready[i] ] > self->credit[ ready[best] ] + m_weight[ ready[best] ] )
+            {
+                best = i;
+            }
+        }
+        int lane = ready[ best ];
+        int n = take_from( m_lanes[ lane ], self );
+        if( n > 0 )
+        {
+            for( int i = 0; i < count; ++i )
+            {
+                self->credit[ ready[i] ] += ( long )m_weight[ ready[i] ] * n;
+            }
+            self->credit[ lane ] -= total * n;
+            return n;
+        }
+        // 被别的线程抢空了，换下一个通道
+        total -= m_weight[ lane ];
+        ready[ best ] = ready[ --count ];
+    }
+    return 0;
+}
+
+template< typename T, template< typename > class Q >
+bool threadpool< T, Q >::idle( worker* self ) const
+{
+    if( self->lane >= 0 )
+    {
+        return m_lanes[ self->lane ]->size() == 0;
+    }
+    if( self->local && self->local->size() != 0 )
+    {
+        return false;
+    }
+    for( int i = 0; i < m_lane_count; ++i )
+    {
+        if( m_lanes[i]->size() != 0 )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
 #endif
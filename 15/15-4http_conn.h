@@ -16,12 +16,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <stdarg.h>
 #include <errno.h>
 #include "locker.h"
+#include "event_loop.h"
 
 class http_conn
 {
+    // bench/中的微基准直接驱动解析和组包的私有函数
+    friend class http_conn_bench;
+
 public:
     static const int FILENAME_LEN = 200;
     static const int READ_BUFFER_SIZE = 2048;
@@ -30,6 +35,8 @@ public:
     enum CHECK_STATE { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT };
     enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+    // 请求解析完成后的分类，对应线程池的优先级通道
+    enum REQUEST_CLASS { CLASS_STATIC = 0, CLASS_DYNAMIC, CLASS_COUNT };
 
 public:
     http_conn(){}
@@ -51,6 +58,7 @@ private:
     HTTP_CODE parse_headers( char* text );
     HTTP_CODE parse_content( char* text );
     HTTP_CODE do_request();
+    REQUEST_CLASS classify() const;
     char* get_line() { return m_read_buf + m_start_line; }
     LINE_STATUS parse_line();
 
@@ -64,10 +72,15 @@ private:
     bool add_blank_line();
 
 public:
-    static int m_epollfd;
+    static event_loop* m_loop;
+    // 连接上的事件由它处理，m_handler.user_data指向连接本身
+    static void ( *m_handle_event )( event_handler* handler, uint32_t events );
     static int m_user_count;
+    // 解析出非静态请求时调用，把连接转投到对应通道；返回false则就地处理
+    static bool ( *m_requeue )( http_conn* conn, REQUEST_CLASS cls );
 
 private:
+    event_handler m_handler;
     int m_sockfd;
     sockaddr_in m_address;
 
@@ -87,6 +100,7 @@ private:
     char* m_host;
     int m_content_length;
     bool m_linger;
+    bool m_deferred;
 
     char* m_file_address;
     struct stat m_file_stat;
@@ -19,42 +19,42 @@ int setnonblocking( int fd )
     return old_option;
 }
 
-void addfd( int epollfd, int fd, bool one_shot )
+// 连接的fd通过m_handler注册，epoll_data.ptr指向它，事件由m_handle_event分发
+static void addfd( event_handler* handler, bool one_shot )
 {
-    epoll_event event;
-    event.data.fd = fd;
-    event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+    uint32_t events = EPOLLIN | EPOLLET | EPOLLRDHUP;
     if( one_shot )
     {
-        event.events |= EPOLLONESHOT;
+        events |= EPOLLONESHOT;
     }
-    epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event );
-    setnonblocking( fd );
+    http_conn::m_loop->add( handler, events );
+    setnonblocking( handler->fd );
 }
 
-void removefd( int epollfd, int fd )
+static void removefd( event_handler* handler )
 {
-    epoll_ctl( epollfd, EPOLL_CTL_DEL, fd, 0 );
-    close( fd );
+    http_conn::m_loop->remove( handler );
+    close( handler->fd );
+    handler->fd = -1;
 }
 
-void modfd( int epollfd, int fd, int ev )
+// 工作线程中也会调用，event_loop::modify是线程安全的
+static void modfd( event_handler* handler, int ev )
 {
-    epoll_event event;
-    event.data.fd = fd;
-    event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
-    epoll_ctl( epollfd, EPOLL_CTL_MOD, fd, &event );
+    http_conn::m_loop->modify( handler, ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP );
 }
 
 int http_conn::m_user_count = 0;
-int http_conn::m_epollfd = -1;
+event_loop* http_conn::m_loop = NULL;
+void ( *http_conn::m_handle_event )( event_handler* handler, uint32_t events ) = NULL;
+bool ( *http_conn::m_requeue )( http_conn* conn, REQUEST_CLASS cls ) = NULL;
 
 void http_conn::close_conn( bool real_close )
 {
     if( real_close && ( m_sockfd != -1 ) )
     {
-        //modfd( m_epollfd, m_sockfd, EPOLLIN );
-        removefd( m_epollfd, m_sockfd );
+        //modfd( &m_handler, EPOLLIN );
+        removefd( &m_handler );
         m_sockfd = -1;
         m_user_count--;
     }
@@ -69,7 +69,10 @@ void http_conn::init( int sockfd, const sockaddr_in& addr )
     getsockopt( m_sockfd, SOL_SOCKET, SO_ERROR, &error, &len );
     int reuse = 1;
     setsockopt( m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
-    addfd( m_epollfd, sockfd, true );
+    m_handler.fd = sockfd;
+    m_handler.handle_event = m_handle_event;
+    m_handler.user_data = this;
+    addfd( &m_handler, true );
     m_user_count++;
 
     init();
@@ -85,6 +88,7 @@ void http_conn::init()
     m_version = 0;
     m_content_length = 0;
     m_host = 0;
+    m_deferred = false;
     m_start_line = 0;
     m_checked_idx = 0;
     m_read_idx = 0;
@@ -297,7 +301,7 @@ http_conn::HTTP_CODE http_conn::process_read()
                 }
                 else if ( ret == GET_REQUEST )
                 {
-                    return do_request();
+                    return GET_REQUEST;
                 }
                 break;
             }
@@ -306,7 +310,7 @@ http_conn::HTTP_CODE http_conn::process_read()
                 ret = parse_content( text );
                 if ( ret == GET_REQUEST )
                 {
-                    return do_request();
+                    return GET_REQUEST;
                 }
                 line_status = LINE_OPEN;
                 break;
@@ -321,6 +325,16 @@ http_conn::HTTP_CODE http_conn::process_read()
     return NO_REQUEST;
 }
 
+// 带查询串、cgi路径或请求体的视为动态请求，其余为静态文件
+http_conn::REQUEST_CLASS http_conn::classify() const
+{
+    if ( m_content_length != 0 || strchr( m_url, '?' ) || strncmp( m_url, "/cgi-bin/", 9 ) == 0 )
+    {
+        return CLASS_DYNAMIC;
+    }
+    return CLASS_STATIC;
+}
+
 http_conn::HTTP_CODE http_conn::do_request()
 {
     strcpy( m_real_file, doc_root );
@@ -363,7 +377,7 @@ bool http_conn::write()
     int bytes_to_send = m_write_idx;
     if ( bytes_to_send == 0 )
     {
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        modfd( &m_handler, EPOLLIN );
         init();
         return true;
     }
@@ -375,7 +389,7 @@ bool http_conn::write()
         {
             if( errno == EAGAIN )
             {
-                modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                modfd( &m_handler, EPOLLOUT );
                 return true;
             }
             unmap();
@@ -390,12 +404,12 @@ bool http_conn::write()
             if( m_linger )
             {
                 init();
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
+                modfd( &m_handler, EPOLLIN );
                 return true;
             }
             else
             {
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
+                modfd( &m_handler, EPOLLIN );
                 return false;
             } 
         }
@@ -427,9 +441,7 @@ bool http_conn::add_status_line( int status, const char* title )
 
 bool http_conn::add_headers( int content_len )
 {
-    add_content_length( content_len );
-    add_linger();
-    add_blank_line();
+    return add_content_length( content_len ) && add_linger() && add_blank_line();
 }
 
 bool http_conn::add_content_length( int content_len )
@@ -533,19 +545,40 @@ bool http_conn::process_write( HTTP_CODE ret )
 
 void http_conn::process()
 {
-    HTTP_CODE read_ret = process_read();
+    HTTP_CODE read_ret = m_deferred ? GET_REQUEST : process_read();
     if ( read_ret == NO_REQUEST )
     {
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        modfd( &m_handler, EPOLLIN );
         return;
     }
 
+    if ( read_ret == GET_REQUEST )
+    {
+        // 慢请求转到自己的通道，不占用处理静态文件的线程
+        if ( ! m_deferred && m_requeue )
+        {
+            REQUEST_CLASS cls = classify();
+            if ( cls != CLASS_STATIC )
+            {
+                // 必须在入队之前设置：入队后目标通道的线程可能立即执行process()，
+                // 入队本身保证它能看到这次写入
+                m_deferred = true;
+                if ( m_requeue( this, cls ) )
+                {
+                    return;
+                }
+            }
+        }
+        m_deferred = false;
+        read_ret = do_request();
+    }
+
     bool write_ret = process_write( read_ret );
     if ( ! write_ret )
     {
         close_conn();
     }
 
-    modfd( m_epollfd, m_sockfd, EPOLLOUT );
+    modfd( &m_handler, EPOLLOUT );
 }
 
@@ -12,13 +12,24 @@
 
 #include "locker.h"
 #include "threadpool.h"
+#include "ws_threadpool.h"
 #include "http_conn.h"
 
+// 编译时加 -DWS_POOL 切换为工作窃取线程池，-DRING_QUEUE 使用无锁环形任务队列，
+// -DAFFINE_DISPATCH 按连接亲和分发
+#if defined( WS_POOL )
+typedef ws_threadpool< http_conn > http_pool;
+#elif defined( RING_QUEUE )
+typedef threadpool< http_conn, mpmc_ring > http_pool;
+#else
+typedef threadpool< http_conn > http_pool;
+#endif
+
 #define MAX_FD 65536
 #define MAX_EVENT_NUMBER 10000
 
-extern int addfd( int epollfd, int fd, bool one_shot );
-extern int removefd( int epollfd, int fd );
+extern const char* doc_root;
+extern int setnonblocking( int fd );
 
 void addsig( int sig, void( handler )(int), bool restart = true )
 {
@@ -33,6 +44,15 @@ void addsig( int sig, void( handler )(int), bool restart = true )
     assert( sigaction( sig, &sa, NULL ) != -1 );
 }
 
+static http_pool* g_pool = NULL;
+
+#ifndef WS_POOL
+static bool requeue( http_conn* conn, http_conn::REQUEST_CLASS cls )
+{
+    return g_pool->append_lane( conn, cls );
+}
+#endif
+
 void show_error( int connfd, const char* info )
 {
     printf( "%s", info );
@@ -40,32 +60,150 @@ void show_error( int connfd, const char* info )
     close( connfd );
 }
 
+static event_loop* g_loop = NULL;
+static http_conn* users = NULL;
+static http_conn* ready[ MAX_EVENT_NUMBER ];
+static int ready_count = 0;
+
+// 本轮所有读就绪的连接一次性投递给线程池，只唤醒一次
+static void flush_ready( void* arg )
+{
+    g_pool->append_batch( ready, ready_count );
+    ready_count = 0;
+}
+
+static void on_conn_event( event_handler* handler, uint32_t events )
+{
+    http_conn* conn = static_cast< http_conn* >( handler->user_data );
+    if( events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
+    {
+        conn->close_conn();
+    }
+    else if( events & EPOLLIN )
+    {
+        if( conn->read() )
+        {
+            if( ready_count == 0 )
+            {
+                g_loop->defer( flush_ready, NULL );
+            }
+            ready[ ready_count++ ] = conn;
+        }
+        else
+        {
+            conn->close_conn();
+        }
+    }
+    else if( events & EPOLLOUT )
+    {
+        if( !conn->write() )
+        {
+            conn->close_conn();
+        }
+    }
+}
+
+// 监听socket是边沿触发的，一次把等待的连接全部接受
+static void on_accept( event_handler* handler, uint32_t events )
+{
+    while( true )
+    {
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof( client_address );
+        int connfd = accept( handler->fd, ( struct sockaddr* )&client_address, &client_addrlength );
+        if ( connfd < 0 )
+        {
+            if( errno != EAGAIN && errno != EWOULDBLOCK )
+            {
+                printf( "errno is: %d\n", errno );
+            }
+            break;
+        }
+        if( http_conn::m_user_count >= MAX_FD || connfd >= MAX_FD )
+        {
+            show_error( connfd, "Internal server busy" );
+            continue;
+        }
+        users[connfd].init( connfd, client_address );
+    }
+}
+
 
 int main( int argc, char* argv[] )
 {
     if( argc <= 2 )
     {
-        printf( "usage: %s ip_address port_number\n", basename( argv[0] ) );
+        printf( "usage: %s ip_address port_number [threads] [none|core|physical|numa] [doc_root]\n",
+                basename( argv[0] ) );
         return 1;
     }
     const char* ip = argv[1];
     int port = atoi( argv[2] );
+    // 可选参数便于压测时扫描线程数和绑核策略
+    int thread_number = argc > 3 ? atoi( argv[3] ) : 8;
+    if( thread_number <= 0 )
+    {
+        thread_number = 8;
+    }
+    PLACEMENT placement = PLACE_NONE;
+    if( argc > 4 )
+    {
+        if( strcmp( argv[4], "core" ) == 0 ) placement = PLACE_CORE;
+        else if( strcmp( argv[4], "physical" ) == 0 ) placement = PLACE_PHYSICAL_CORE;
+        else if( strcmp( argv[4], "numa" ) == 0 ) placement = PLACE_NUMA_NODE;
+    }
+    if( argc > 5 )
+    {
+        doc_root = argv[5];
+    }
 
     addsig( SIGPIPE, SIG_IGN );
 
-    threadpool< http_conn >* pool = NULL;
+    // 信号由事件循环通过signalfd接收，要在创建线程池之前屏蔽
+    event_loop loop( MAX_EVENT_NUMBER );
+    loop.add_signal( SIGTERM, event_loop::quit_on_signal, &loop );
+    loop.add_signal( SIGINT, event_loop::quit_on_signal, &loop );
+    g_loop = &loop;
+
+    http_pool* pool = NULL;
     try
     {
-        pool = new threadpool< http_conn >;
+        pool = new http_pool( thread_number, 10000, placement );
+#ifndef WS_POOL
+#ifdef AFFINE_DISPATCH
+        // 同一个keep-alive连接上的请求尽量留在同一个线程，http_conn对象保持在该核的缓存中
+        pool->set_dispatch( DISPATCH_AFFINE );
+#endif
+        // 静态请求权重4，动态请求权重1；保留2个线程只处理静态请求，线程太少时至少留一个线程给所有通道共用
+        int weights[ http_conn::CLASS_COUNT ] = { 4, 1 };
+        int reserved[ http_conn::CLASS_COUNT ] = { 2, 0 };
+        if( reserved[0] > thread_number - 1 )
+        {
+            reserved[0] = thread_number - 1;
+        }
+        bool lanes = pool->set_lanes( http_conn::CLASS_COUNT, weights, reserved );
+        if( ! lanes )
+        {
+            printf( "set_lanes failed, all requests share one lane\n" );
+        }
+#ifdef ELASTIC_POOL
+        // 排队超过2ms就加线程，最多32个；多出来的线程空闲5秒后退出
+        pool->set_elastic( 32, 2000, 5000 );
+#endif
+        if( lanes )
+        {
+            http_conn::m_requeue = requeue;
+        }
+#endif
     }
     catch( ... )
     {
         return 1;
     }
+    g_pool = pool;
 
-    http_conn* users = new http_conn[ MAX_FD ];
+    users = new http_conn[ MAX_FD ];
     assert( users );
-    int user_count = 0;
 
     int listenfd = socket( PF_INET, SOCK_STREAM, 0 );
     assert( listenfd >= 0 );
@@ -85,72 +223,26 @@ int main( int argc, char* argv[] )
     ret = listen( listenfd, 5 );
     assert( ret >= 0 );
 
-    epoll_event events[ MAX_EVENT_NUMBER ];
-    int epollfd = epoll_create( 5 );
-    assert( epollfd != -1 );
-    addfd( epollfd, listenfd, false );
-    http_conn::m_epollfd = epollfd;
+    event_handler listen_handler;
+    listen_handler.fd = listenfd;
+    listen_handler.handle_event = on_accept;
+    listen_handler.user_data = NULL;
+    setnonblocking( listenfd );
+    loop.add( &listen_handler, EPOLLIN | EPOLLET );
+    http_conn::m_loop = &loop;
+    http_conn::m_handle_event = on_conn_event;
 
-    while( true )
+    if( ! loop.run() )
     {
-        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, -1 );
-        if ( ( number < 0 ) && ( errno != EINTR ) )
-        {
-            printf( "epoll failure\n" );
-            break;
-        }
-
-        for ( int i = 0; i < number; i++ )
-        {
-            int sockfd = events[i].data.fd;
-            if( sockfd == listenfd )
-            {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof( client_address );
-                int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
-                if ( connfd < 0 )
-                {
-                    printf( "errno is: %d\n", errno );
-                    continue;
-                }
-                if( http_conn::m_user_count >= MAX_FD )
-                {
-                    show_error( connfd, "Internal server busy" );
-                    continue;
-                }
-                
-                users[connfd].init( connfd, client_address );
-            }
-            else if( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
-            {
-                users[sockfd].close_conn();
-            }
-            else if( events[i].events & EPOLLIN )
-            {
-                if( users[sockfd].read() )
-                {
-                    pool->append( users + sockfd );
-                }
-                else
-                {
-                    users[sockfd].close_conn();
-                }
-            }
-            else if( events[i].events & EPOLLOUT )
-            {
-                if( !users[sockfd].write() )
-                {
-                    users[sockfd].close_conn();
-                }
-            }
-            else
-            {}
-        }
+        printf( "epoll failure\n" );
     }
 
-    close( epollfd );
     close( listenfd );
-    delete [] users;
+    // 先销毁线程池，等工作线程都退出后才能释放它们可能还在处理的users
     delete pool;
+    delete [] users;
+#ifdef LOCK_PROFILE
+    lock_profile::report( stdout );
+#endif
     return 0;
 }
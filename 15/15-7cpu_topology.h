@@ -0,0 +1,275 @@
+#ifndef CPU_TOPOLOGY_H
+#define CPU_TOPOLOGY_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+
+// 线程放置策略
+enum PLACEMENT
+{
+    PLACE_NONE = 0,         // 不绑核，交给调度器
+    PLACE_CORE,             // 每个线程绑定到一个逻辑CPU，轮流分配
+    PLACE_PHYSICAL_CORE,    // 每个物理核只放一个线程（跳过超线程兄弟）
+    PLACE_NUMA_NODE         // 线程限制在某个NUMA节点的CPU集合内
+};
+
+struct cpu_info
+{
+    int cpu;
+    int core;
+    int package;
+    int node;
+};
+
+// 通过sysfs读取CPU拓扑，不依赖libnuma
+class cpu_topology
+{
+public:
+    cpu_topology() : m_cores( 0 ), m_packages( 0 ), m_nodes( 0 )
+    {
+        load();
+    }
+
+    int cpu_count() const { return m_cpus.size(); }
+    int core_count() const { return m_cores; }
+    int package_count() const { return m_packages; }
+    int node_count() const { return m_nodes; }
+    const cpu_info* find( int cpu ) const
+    {
+        for( size_t i = 0; i < m_cpus.size(); ++i )
+        {
+            if( m_cpus[i].cpu == cpu )
+            {
+                return &m_cpus[i];
+            }
+        }
+        return NULL;
+    }
+
+    // 为第idx个工作线程计算CPU掩码，返回false表示不需要设置亲和性
+    bool worker_mask( PLACEMENT policy, int numa_node, int idx, cpu_set_t* mask, int* cpu ) const
+    {
+        CPU_ZERO( mask );
+        *cpu = -1;
+        if( policy == PLACE_NONE || m_cpus.empty() )
+        {
+            return false;
+        }
+        if( policy == PLACE_NUMA_NODE )
+        {
+            bool any = false;
+            for( size_t i = 0; i < m_cpus.size(); ++i )
+            {
+                if( m_cpus[i].node == numa_node )
+                {
+                    CPU_SET( m_cpus[i].cpu, mask );
+                    any = true;
+                }
+            }
+            return any;
+        }
+
+        std::vector< int > order;
+        if( policy == PLACE_PHYSICAL_CORE )
+        {
+            physical_cores( order );
+        }
+        else
+        {
+            spread_order( order );
+        }
+        *cpu = order[ idx % order.size() ];
+        CPU_SET( *cpu, mask );
+        return true;
+    }
+
+    void report( FILE* out ) const
+    {
+        fprintf( out, "topology: %d cpus, %d physical cores, %d packages, %d numa nodes\n",
+                 cpu_count(), m_cores, m_packages, m_nodes );
+    }
+
+private:
+    static int read_int( const char* path, int def )
+    {
+        FILE* fp = fopen( path, "r" );
+        if( !fp )
+        {
+            return def;
+        }
+        int value = def;
+        if( fscanf( fp, "%d", &value ) != 1 )
+        {
+            value = def;
+        }
+        fclose( fp );
+        return value;
+    }
+
+    // 解析形如 "0-3,8-11" 的cpulist
+    static void parse_cpulist( const char* path, std::vector< int >& cpus )
+    {
+        FILE* fp = fopen( path, "r" );
+        if( !fp )
+        {
+            return;
+        }
+        char buf[ 4096 ];
+        if( !fgets( buf, sizeof( buf ), fp ) )
+        {
+            fclose( fp );
+            return;
+        }
+        fclose( fp );
+        char* save = NULL;
+        for( char* tok = strtok_r( buf, ",\n", &save ); tok; tok = strtok_r( NULL, ",\n", &save ) )
+        {
+            int lo = 0, hi = 0;
+            int n = sscanf( tok, "%d-%d", &lo, &hi );
+            if( n == 1 )
+            {
+                hi = lo;
+            }
+            else if( n != 2 )
+            {
+                continue;
+            }
+            for( int c = lo; c <= hi; ++c )
+            {
+                cpus.push_back( c );
+            }
+        }
+    }
+
+    static bool by_place( const cpu_info& a, const cpu_info& b )
+    {
+        if( a.package != b.package ) return a.package < b.package;
+        if( a.core != b.core ) return a.core < b.core;
+        return a.cpu < b.cpu;
+    }
+
+    void load()
+    {
+        cpu_set_t allowed;
+        CPU_ZERO( &allowed );
+        bool have_mask = sched_getaffinity( 0, sizeof( allowed ), &allowed ) == 0;
+
+        std::vector< int > online;
+        parse_cpulist( "/sys/devices/system/cpu/online", online );
+        if( online.empty() )
+        {
+            long n = sysconf( _SC_NPROCESSORS_ONLN );
+            for( long i = 0; i < n; ++i )
+            {
+                online.push_back( i );
+            }
+        }
+
+        char path[ 256 ];
+        for( size_t i = 0; i < online.size(); ++i )
+        {
+            int c = online[i];
+            if( have_mask && !CPU_ISSET( c, &allowed ) )
+            {
+                continue;
+            }
+            cpu_info info;
+            info.cpu = c;
+            snprintf( path, sizeof( path ), "/sys/devices/system/cpu/cpu%d/topology/core_id", c );
+            info.core = read_int( path, c );
+            snprintf( path, sizeof( path ), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", c );
+            info.package = read_int( path, 0 );
+            info.node = 0;
+            m_cpus.push_back( info );
+        }
+
+        DIR* dir = opendir( "/sys/devices/system/node" );
+        if( dir )
+        {
+            struct dirent* ent;
+            while( ( ent = readdir( dir ) ) != NULL )
+            {
+                int node = 0;
+                if( sscanf( ent->d_name, "node%d", &node ) != 1 )
+                {
+                    continue;
+                }
+                std::vector< int > cpus;
+                snprintf( path, sizeof( path ), "/sys/devices/system/node/node%d/cpulist", node );
+                parse_cpulist( path, cpus );
+                for( size_t i = 0; i < cpus.size(); ++i )
+                {
+                    for( size_t j = 0; j < m_cpus.size(); ++j )
+                    {
+                        if( m_cpus[j].cpu == cpus[i] )
+                        {
+                            m_cpus[j].node = node;
+                        }
+                    }
+                }
+                m_nodes = std::max( m_nodes, node + 1 );
+            }
+            closedir( dir );
+        }
+        if( m_nodes == 0 )
+        {
+            m_nodes = 1;
+        }
+
+        std::sort( m_cpus.begin(), m_cpus.end(), by_place );
+        for( size_t i = 0; i < m_cpus.size(); ++i )
+        {
+            if( i == 0 || m_cpus[i].package != m_cpus[i-1].package )
+            {
+                ++m_packages;
+            }
+            if( i == 0 || m_cpus[i].package != m_cpus[i-1].package || m_cpus[i].core != m_cpus[i-1].core )
+            {
+                ++m_cores;
+            }
+        }
+    }
+
+    // 每个物理核取第一个逻辑CPU
+    void physical_cores( std::vector< int >& order ) const
+    {
+        for( size_t i = 0; i < m_cpus.size(); ++i )
+        {
+            if( i == 0 || m_cpus[i].package != m_cpus[i-1].package || m_cpus[i].core != m_cpus[i-1].core )
+            {
+                order.push_back( m_cpus[i].cpu );
+            }
+        }
+    }
+
+    // 先铺满所有物理核，再使用超线程兄弟
+    void spread_order( std::vector< int >& order ) const
+    {
+        physical_cores( order );
+        for( size_t i = 0; i < m_cpus.size(); ++i )
+        {
+            if( std::find( order.begin(), order.end(), m_cpus[i].cpu ) == order.end() )
+            {
+                order.push_back( m_cpus[i].cpu );
+            }
+        }
+    }
+
+private:
+    std::vector< cpu_info > m_cpus;
+    int m_cores;
+    int m_packages;
+    int m_nodes;
+};
+
+#endif
@@ -0,0 +1,450 @@
+#ifndef WS_THREADPOOL_H
+#define WS_THREADPOOL_H
+
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <new>
+#include <atomic>
+#include <pthread.h>
+#include "locker.h"
+#include "cpu_topology.h"
+
+// Chase-Lev 双端队列（Lê et al. 2013 的C11内存序版本）
+// 只有所属线程可以push/pop（底部，LIFO），其他线程从顶部steal（FIFO）
+template< typename T >
+class ws_deque
+{
+public:
+    explicit ws_deque( long capacity ) : m_top( 0 ), m_bottom( 0 )
+    {
+        long cap = 1;
+        while( cap < capacity )
+        {
+            cap <<= 1;
+        }
+        m_mask = cap - 1;
+        m_buffer = new std::atomic< T* >[ cap ];
+    }
+    ~ws_deque()
+    {
+        delete [] m_buffer;
+    }
+
+    bool push( T* item )
+    {
+        long b = m_bottom.load( std::memory_order_relaxed );
+        long t = m_top.load( std::memory_order_acquire );
+        if( b - t > m_mask )
+        {
+            return false;
+        }
+        m_buffer[ b & m_mask ].store( item, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_release );
+        m_bottom.store( b + 1, std::memory_order_relaxed );
+        return true;
+    }
+
+    T* pop()
+    {
+        long b = m_bottom.load( std::memory_order_relaxed ) - 1;
+        m_bottom.store( b, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        long t = m_top.load( std::memory_order_relaxed );
+        T* item = NULL;
+        if( t <= b )
+        {
+            item = m_buffer[ b & m_mask ].load( std::memory_order_relaxed );
+            if( t == b )
+            {
+                // 只剩最后一个元素，和窃取者竞争
+                if( !m_top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed ) )
+                {
+                    item = NULL;
+                }
+                m_bottom.store( b + 1, std::memory_order_relaxed );
+            }
+        }
+        else
+        {
+            m_bottom.store( b + 1, std::memory_order_relaxed );
+        }
+        return item;
+    }
+
+    T* steal()
+    {
+        long t = m_top.load( std::memory_order_acquire );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        long b = m_bottom.load( std::memory_order_acquire );
+        if( t >= b )
+        {
+            return NULL;
+        }
+        T* item = m_buffer[ t & m_mask ].load( std::memory_order_relaxed );
+        if( !m_top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed ) )
+        {
+            return NULL;
+        }
+        return item;
+    }
+
+    bool empty() const
+    {
+        return m_bottom.load( std::memory_order_relaxed ) <= m_top.load( std::memory_order_relaxed );
+    }
+
+private:
+    std::atomic< long > m_top __attribute__( ( aligned( 64 ) ) );
+    std::atomic< long > m_bottom __attribute__( ( aligned( 64 ) ) );
+    std::atomic< T* >* m_buffer;
+    long m_mask;
+};
+
+// 工作窃取线程池：接口与threadpool<T>相同
+// 外部线程append的任务轮流投递到各工作线程的收件箱，工作线程append的任务直接压入自己的deque
+template< typename T >
+class ws_threadpool
+{
+public:
+    ws_threadpool( int thread_number = 8, int max_requests = 10000,
+                   PLACEMENT placement = PLACE_NONE, int numa_node = 0 );
+    ~ws_threadpool();
+    bool append( T* request );
+    int append_batch( T** requests, int n );
+
+    unsigned long tasks() const;
+    unsigned long wakeups() const;
+    double wakeups_per_task() const
+    {
+        unsigned long t = tasks();
+        return t ? ( double )wakeups() / t : 0.0;
+    }
+
+private:
+    struct worker
+    {
+        worker( ws_threadpool* p, int i, long cap )
+            : pool( p ), idx( i ), seed( i * 2654435761u + 1 ), tasks( 0 ), wakeups( 0 ), deque( cap ) {}
+        ws_threadpool* pool;
+        int idx;
+        unsigned seed;
+        std::atomic< unsigned long > tasks;
+        std::atomic< unsigned long > wakeups;
+        ws_deque< T > deque;
+        locker inbox_locker;
+        std::vector< T* > inbox;
+        std::vector< T* > drained;
+    } __attribute__( ( aligned( 64 ) ) );
+
+    static void* worker_main( void* arg );
+    static void free_worker( worker* w )
+    {
+        w->~worker();
+        free( w );
+    }
+    void run( worker* self );
+    T* find_work( worker* self );
+    T* take_inbox( worker* self, worker* victim );
+    bool enqueue( T* request );
+    void wake( int n );
+
+private:
+    int m_thread_number;
+    int m_max_requests;
+    pthread_t* m_threads;
+    worker** m_workers;
+    std::atomic< long > m_pending;
+    std::atomic< unsigned > m_next;
+    std::atomic< int > m_idle;
+    sem m_parked;
+    cpu_topology m_topology;
+    std::atomic< bool > m_stop;
+    static __thread worker* t_self;
+};
+
+template< typename T >
+__thread typename ws_threadpool< T >::worker* ws_threadpool< T >::t_self = NULL;
+
+template< typename T >
+ws_threadpool< T >::ws_threadpool( int thread_number, int max_requests, PLACEMENT placement, int numa_node ) :
+        m_thread_number( thread_number ), m_max_requests( max_requests ), m_threads( NULL ),
+        m_workers( NULL ), m_pending( 0 ), m_next( 0 ), m_idle( 0 ), m_stop( false )
+{
+    if( ( thread_number <= 0 ) || ( max_requests <= 0 ) )
+    {
+        throw std::exception();
+    }
+
+    m_threads = new pthread_t[ m_thread_number ];
+    m_workers = new worker*[ m_thread_number ];
+    for( int i = 0; i < m_thread_number; ++i )
+    {
+        void* mem = NULL;
+        if( posix_memalign( &mem, 64, sizeof( worker ) ) != 0 )
+        {
+            for( int j = 0; j < i; ++j )
+            {
+                free_worker( m_workers[j] );
+            }
+            delete [] m_threads;
+            delete [] m_workers;
+            throw std::exception();
+        }
+        m_workers[i] = new ( mem ) worker( this, i, max_requests + 1 );
+        m_workers[i]->inbox.reserve( 64 );
+    }
+
+    for ( int i = 0; i < thread_number; ++i )
+    {
+        pthread_attr_t attr;
+        pthread_attr_init( &attr );
+        cpu_set_t mask;
+        int cpu = -1;
+        if( m_topology.worker_mask( placement, numa_node, i, &mask, &cpu ) )
+        {
+            pthread_attr_setaffinity_np( &attr, sizeof( mask ), &mask );
+        }
+        printf( "create the %dth thread\n", i );
+        int ret = pthread_create( m_threads + i, &attr, worker_main, m_workers[i] );
+        pthread_attr_destroy( &attr );
+        if( ret != 0 )
+        {
+            m_stop = true;
+            for( int j = 0; j < i; ++j )
+            {
+                m_parked.post();
+            }
+            for( int j = 0; j < i; ++j )
+            {
+                pthread_join( m_threads[j], NULL );
+            }
+            for( int j = 0; j < m_thread_number; ++j )
+            {
+                free_worker( m_workers[j] );
+            }
+            delete [] m_threads;
+            delete [] m_workers;
+            throw std::exception();
+        }
+    }
+}
+
+template< typename T >
+ws_threadpool< T >::~ws_threadpool()
+{
+    m_stop = true;
+    for( int i = 0; i < m_thread_number; ++i )
+    {
+        m_parked.post();
+    }
+    for( int i = 0; i < m_thread_number; ++i )
+    {
+        pthread_join( m_threads[i], NULL );
+        free_worker( m_workers[i] );
+    }
+    delete [] m_threads;
+    delete [] m_workers;
+}
+
+template< typename T >
+bool ws_threadpool< T >::append( T* request )
+{
+    if( !enqueue( request ) )
+    {
+        return false;
+    }
+    wake( 1 );
+    return true;
+}
+
+template< typename T >
+int ws_threadpool< T >::append_batch( T** requests, int n )
+{
+    int i = 0;
+    while( i < n && enqueue( requests[i] ) )
+    {
+        ++i;
+    }
+    wake( i );
+    return i;
+}
+
+template< typename T >
+bool ws_threadpool< T >::enqueue( T* request )
+{
+    if( m_pending.fetch_add( 1 ) >= m_max_requests )
+    {
+        m_pending.fetch_sub( 1 );
+        return false;
+    }
+
+    worker* self = t_self;
+    if( !self || self->pool != this || !self->deque.push( request ) )
+    {
+        worker* target = m_workers[ m_next.fetch_add( 1, std::memory_order_relaxed ) % m_thread_number ];
+        target->inbox_locker.lock();
+        target->inbox.push_back( request );
+        target->inbox_locker.unlock();
+    }
+    return true;
+}
+
+template< typename T >
+void ws_threadpool< T >::wake( int n )
+{
+    // 与run()中的m_idle自增+复查配对，避免丢失唤醒
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    int idle = m_idle.load();
+    while( idle > 0 && n > 0 )
+    {
+        if( m_idle.compare_exchange_weak( idle, idle - 1 ) )
+        {
+            m_parked.post();
+            --n;
+            idle = m_idle.load();
+        }
+    }
+}
+
+template< typename T >
+void* ws_threadpool< T >::worker_main( void* arg )
+{
+    worker* self = ( worker* )arg;
+    t_self = self;
+    self->pool->run( self );
+    return self->pool;
+}
+
+template< typename T >
+T* ws_threadpool< T >::take_inbox( worker* self, worker* victim )
+{
+    if( victim != self )
+    {
+        if( !victim->inbox_locker.try_lock() )
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        victim->inbox_locker.lock();
+    }
+    self->drained.swap( victim->inbox );
+    victim->inbox_locker.unlock();
+
+    T* first = NULL;
+    for( size_t i = 0; i < self->drained.size(); ++i )
+    {
+        if( !first )
+        {
+            first = self->drained[i];
+        }
+        else if( !self->deque.push( self->drained[i] ) )
+        {
+            // deque容量按max_requests分配，正常不会满；满了就放回收件箱
+            victim->inbox_locker.lock();
+            victim->inbox.push_back( self->drained[i] );
+            victim->inbox_locker.unlock();
+        }
+    }
+    self->drained.clear();
+    return first;
+}
+
+template< typename T >
+T* ws_threadpool< T >::find_work( worker* self )
+{
+    T* request = self->deque.pop();
+    if( request )
+    {
+        return request;
+    }
+    request = take_inbox( self, self );
+    if( request )
+    {
+        return request;
+    }
+
+    // 随机选择受害者：先偷deque，再偷收件箱
+    for( int round = 0; round < 2 * m_thread_number; ++round )
+    {
+        self->seed ^= self->seed << 13;
+        self->seed ^= self->seed >> 17;
+        self->seed ^= self->seed << 5;
+        worker* victim = m_workers[ self->seed % m_thread_number ];
+        if( victim == self )
+        {
+            continue;
+        }
+        request = victim->deque.steal();
+        if( !request )
+        {
+            request = take_inbox( self, victim );
+        }
+        if( request )
+        {
+            return request;
+        }
+    }
+    return NULL;
+}
+
+template< typename T >
+void ws_threadpool< T >::run( worker* self )
+{
+    while ( ! m_stop )
+    {
+        T* request = find_work( self );
+        if( !request )
+        {
+            m_idle.fetch_add( 1 );
+            request = find_work( self );
+            if( !request )
+            {
+                m_parked.wait();
+                self->wakeups.store( self->wakeups.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+                continue;
+            }
+            int idle = m_idle.load();
+            bool cancelled = false;
+            while( idle > 0 && !cancelled )
+            {
+                cancelled = m_idle.compare_exchange_weak( idle, idle - 1 );
+            }
+            if( !cancelled )
+            {
+                // 已经有生产者替我们消费了idle计数并post，把这个信号吃掉
+                m_parked.wait();
+            }
+        }
+        m_pending.fetch_sub( 1, std::memory_order_relaxed );
+        request->process();
+        self->tasks.store( self->tasks.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+    }
+}
+
+template< typename T >
+unsigned long ws_threadpool< T >::tasks() const
+{
+    unsigned long sum = 0;
+    for( int i = 0; i < m_thread_number; ++i )
+    {
+        sum += m_workers[i]->tasks.load( std::memory_order_relaxed );
+    }
+    return sum;
+}
+
+template< typename T >
+unsigned long ws_threadpool< T >::wakeups() const
+{
+    unsigned long sum = 0;
+    for( int i = 0; i < m_thread_number; ++i )
+    {
+        sum += m_workers[i]->wakeups.load( std::memory_order_relaxed );
+    }
+    return sum;
+}
+
+#endif
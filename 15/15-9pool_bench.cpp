@@ -0,0 +1,143 @@
+// 线程池扩展性测试：threadpool（单队列+互斥锁 / 无锁环形队列） vs ws_threadpool（工作窃取）
+// 用法: pool_bench [tasks] [work] [max_threads]
+// 编译: g++ -std=c++11 -O2 -pthread 15-9pool_bench.cpp -o pool_bench（threadpool.h、ws_threadpool.h、locker.h需在包含路径中）
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <vector>
+#include "threadpool.h"
+#include "ws_threadpool.h"
+
+static std::atomic< long > g_done( 0 );
+static volatile unsigned long g_sink = 0;
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void spin( int work )
+{
+    unsigned long x = 0;
+    for( int i = 0; i < work; ++i )
+    {
+        x = x * 6364136223846793005ul + 1442695040888963407ul;
+    }
+    g_sink += x;
+}
+
+// fanout > 0 时，任务在工作线程内部继续append子任务（模拟递归拆分的CPU工作）
+struct bench_task
+{
+    void* pool;
+    bool ( *append )( void* pool, bench_task* task );
+    int work;
+    int fanout;
+    std::vector< bench_task >* children;
+    std::atomic< long >* next_child;
+
+    void process()
+    {
+        spin( work );
+        for( int i = 0; i < fanout; ++i )
+        {
+            long idx = next_child->fetch_add( 1 );
+            if( idx >= ( long )children->size() )
+            {
+                break;
+            }
+            while( !append( pool, &( *children )[ idx ] ) )
+            {
+                sched_yield();
+            }
+        }
+        g_done.fetch_add( 1 );
+    }
+};
+
+template< typename P >
+static bool append_to( void* pool, bench_task* task )
+{
+    return ( ( P* )pool )->append( task );
+}
+
+template< typename P >
+static double run_once( int threads, long tasks, int work, int fanout, double* wakeups_per_task )
+{
+    P pool( threads, tasks + 1 );
+    // 每个根任务恰好append fanout个子任务，除不尽的零头不计入
+    long roots = fanout ? tasks / ( fanout + 1 ) : tasks;
+    long total = roots * ( fanout + 1 );
+    std::vector< bench_task > rootv( roots );
+    std::vector< bench_task > children( roots * fanout );
+    std::atomic< long > next_child( 0 );
+    for( size_t i = 0; i < children.size(); ++i )
+    {
+        bench_task t = { &pool, append_to< P >, work, 0, &children, &next_child };
+        children[i] = t;
+    }
+    for( long i = 0; i < roots; ++i )
+    {
+        bench_task t = { &pool, append_to< P >, work, fanout, &children, &next_child };
+        rootv[i] = t;
+    }
+
+    g_done = 0;
+    double start = now_sec();
+    for( long i = 0; i < roots; ++i )
+    {
+        while( !pool.append( &rootv[i] ) )
+        {
+            sched_yield();
+        }
+    }
+    while( g_done.load() < total )
+    {
+        sched_yield();
+    }
+    double elapsed = now_sec() - start;
+    *wakeups_per_task = pool.wakeups_per_task();
+    return total / elapsed;
+}
+
+int main( int argc, char* argv[] )
+{
+    long tasks = argc > 1 ? atol( argv[1] ) : 200000;
+    int work = argc > 2 ? atoi( argv[2] ) : 200;
+    int max_threads = argc > 3 ? atoi( argv[3] ) : sysconf( _SC_NPROCESSORS_ONLN );
+    if( max_threads <= 0 )
+    {
+        max_threads = 1;
+    }
+
+    // 屏蔽线程池构造时的打印
+    fflush( stdout );
+    FILE* report = fdopen( dup( 1 ), "w" );
+    if( !freopen( "/dev/null", "w", stdout ) )
+    {
+        return 1;
+    }
+
+    const char* scenarios[] = { "flat", "fanout" };
+    int fanouts[] = { 0, 4 };
+    fprintf( report, "%-16s %-8s %-8s %14s %14s\n", "pool", "scenario", "threads", "tasks/s", "wakeups/task" );
+    for( int threads = 1; threads <= max_threads; threads *= 2 )
+    {
+        for( int s = 0; s < 2; ++s )
+        {
+            double tp, wpt;
+            tp = run_once< threadpool< bench_task > >( threads, tasks, work, fanouts[s], &wpt );
+            fprintf( report, "%-16s %-8s %-8d %14.0f %14.4f\n", "threadpool", scenarios[s], threads, tp, wpt );
+            tp = run_once< threadpool< bench_task, mpmc_ring > >( threads, tasks, work, fanouts[s], &wpt );
+            fprintf( report, "%-16s %-8s %-8d %14.0f %14.4f\n", "threadpool+ring", scenarios[s], threads, tp, wpt );
+            tp = run_once< ws_threadpool< bench_task > >( threads, tasks, work, fanouts[s], &wpt );
+            fprintf( report, "%-16s %-8s %-8d %14.0f %14.4f\n", "ws_threadpool", scenarios[s], threads, tp, wpt );
+            fflush( report );
+        }
+    }
+    return 0;
+}
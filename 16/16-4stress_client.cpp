@@ -1,6 +1,5 @@
 #include <stdlib.h>
 #include <stdio.h>
-#include <assert.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
@@ -9,8 +8,107 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <libgen.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include "hdr_histogram.h"
+#include "http_response.h"
+#include "workload.h"
 
-static const char* request = "GET http://localhost/index.html HTTP/1.1\r\nConnection: keep-alive\r\n\r\nxxxxxxxxxxxx";
+// 开环压测：请求按目标速率排定发送时刻，不因服务器变慢而推迟后续请求。
+// 延迟从计划发送时刻算起，连接全忙时排队等待的时间也计入，避免协调遗漏（coordinated omission）
+// 用法: stress_client [-t 线程数] [-r 总请求速率/秒] [-d 持续秒数] [-o 百分位分布文件]
+//                     [-m fixed|keepalive|close] [-p 流水线深度] [-T 超时秒数]
+//                     [-u URL路径 | -w URL列表文件 | -l 访问日志 [-s 时间缩放]] ip port 连接数
+//   不指定-r时为闭环模式：每个连接收到响应后立即发下一个请求，此时只有实际服务时间
+//   -j 只输出一行JSON汇总，供压测脚本收集
+//   -w 按权重从URL列表中抽取请求；-l 回放访问日志，按日志中的原始间隔除以-s发出，
+//      指定-r时改为按该速率依次发出；回放时不指定-d则一直运行到日志结束
+//   fixed      启动时建立固定数量的长连接，被关闭的连接立即重建，请求排队等空闲连接（默认）
+//   keepalive  按需建立长连接并复用，连接数随并发增长，"连接数"参数为上限
+//   close      每个请求一个新连接（Connection: close），建连时间计入延迟，"连接数"参数为并发上限
+// 应答经完整解析（状态码、Content-Length/chunked），延迟统计只包含2xx/3xx应答
+
+enum MODE { FIXED = 0, KEEP_ALIVE, CLOSE };
+
+static const int MAX_EVENT_NUMBER = 1024;
+static const int BUFFER_SIZE = 16384;
+static const int64_t LATENCY_MAX_US = 60 * 1000000ll;
+static const int64_t SCAN_INTERVAL = 100 * 1000000ll;
+
+// 一个已排定的请求
+struct pending
+{
+    int64_t intended;       // 计划发送时刻
+    int64_t sent;           // 开始处理时刻（close模式下包含建连）
+    const char* url;        // 指向workload映射区或命令行参数，不以'\0'结尾
+    int url_len;
+};
+
+struct client_conn
+{
+    int sockfd;             // -1表示未打开
+    bool connected;
+    bool ready;             // 在ready栈中
+    int unsent;             // 连接建立前排队的请求数
+    pending* inflight;      // 环形队列，容量为流水线深度，按发送顺序等待应答
+    int head;
+    int count;
+    http_response parser;
+};
+
+struct worker
+{
+    pthread_t tid;
+    int epollfd;
+    client_conn* conns;
+    int conn_number;
+    int* ready;             // 已连接且流水线未满的连接
+    int ready_count;
+    int* spare;             // 未打开的连接槽（keepalive、close模式按需使用）
+    int spare_count;
+    int64_t start;
+    int64_t end;
+    double interval;        // 本线程相邻请求的计划间隔（纳秒），0表示闭环
+    workload::cursor* cursor;   // 回放访问日志时本线程的读取位置
+    uint64_t rng;
+    bool has_next;          // next中是否已取出下一个请求
+    bool exhausted;         // 日志已回放完
+    pending next;
+    int64_t issued;         // 已发出的计划请求数
+    int64_t responses;
+    int64_t ok;             // 2xx、3xx应答
+    int64_t errors;         // 发送失败或连接断开而丢失的请求
+    int64_t timeouts;
+    int64_t bad;            // 无法解析的应答
+    int64_t conn_errors;
+    int64_t connects;
+    int64_t bytes;          // 应答体字节数
+    int64_t max_lag;        // 请求实际发出比计划晚的最大值（纳秒），连接全忙时增大
+    int64_t status[ 600 ];
+    hdr_histogram* latency; // 从计划时刻算起
+    hdr_histogram* service; // 从实际发送算起
+};
+
+static struct sockaddr_in address;
+static MODE mode = FIXED;
+static int depth = 1;
+static int64_t timeout = 10 * 1000000000ll;
+static workload* source = NULL;
+static double speed = 1;
+static const char* url = "/index.html";
+static int url_len = 0;
+static char request_tail[ 512 ];    // 请求行URL之后的部分
+static int request_tail_len = 0;
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
 
 int setnonblocking( int fd )
 {
@@ -20,131 +118,681 @@ int setnonblocking( int fd )
     return old_option;
 }
 
-void addfd( int epoll_fd, int fd )
+void modfd( int epollfd, int fd, int index, int ev )
 {
     epoll_event event;
-    event.data.fd = fd;
-    event.events = EPOLLOUT | EPOLLET | EPOLLERR;
-    epoll_ctl( epoll_fd, EPOLL_CTL_ADD, fd, &event );
-    setnonblocking( fd );
+    event.data.fd = index;
+    event.events = ev | EPOLLERR | EPOLLRDHUP;
+    epoll_ctl( epollfd, EPOLL_CTL_MOD, fd, &event );
 }
 
 bool write_nbytes( int sockfd, const char* buffer, int len )
 {
     int bytes_write = 0;
-    printf( "write out %d bytes to socket %d\n", len, sockfd );
-    while( 1 ) 
-    {   
-        bytes_write = send( sockfd, buffer, len, 0 );
-        if ( bytes_write == -1 )
-        {   
-            return false;
-        }   
-        else if ( bytes_write == 0 ) 
-        {   
+    while( 1 )
+    {
+        bytes_write = send( sockfd, buffer, len, MSG_NOSIGNAL );
+        if ( bytes_write <= 0 )
+        {
             return false;
-        }   
+        }
 
         len -= bytes_write;
         buffer = buffer + bytes_write;
-        if ( len <= 0 ) 
-        {   
+        if ( len <= 0 )
+        {
             return true;
-        }   
-    }   
+        }
+    }
+}
+
+bool send_request( int sockfd, const pending* p )
+{
+    char buffer[ workload::MAX_URL + sizeof( request_tail ) + 8 ];
+    memcpy( buffer, "GET ", 4 );
+    memcpy( buffer + 4, p->url, p->url_len );
+    memcpy( buffer + 4 + p->url_len, request_tail, request_tail_len );
+    return write_nbytes( sockfd, buffer, 4 + p->url_len + request_tail_len );
 }
 
-bool read_once( int sockfd, char* buffer, int len )
+int conn_depth()
 {
-    int bytes_read = 0;
-    memset( buffer, '\0', len );
-    bytes_read = recv( sockfd, buffer, len, 0 );
-    if ( bytes_read == -1 )
+    return mode == CLOSE ? 1 : depth;
+}
+
+void push_ready( worker* w, int index )
+{
+    client_conn* conn = &w->conns[ index ];
+    if( ! conn->ready && conn->connected && conn->count < conn_depth() )
     {
-        return false;
+        conn->ready = true;
+        w->ready[ w->ready_count++ ] = index;
+    }
+}
+
+void remove_ready( worker* w, int index )
+{
+    client_conn* conn = &w->conns[ index ];
+    if( ! conn->ready )
+    {
+        return;
     }
-    else if ( bytes_read == 0 )
+    conn->ready = false;
+    for( int i = w->ready_count - 1; i >= 0; --i )
     {
+        if( w->ready[i] == index )
+        {
+            w->ready[i] = w->ready[ --w->ready_count ];
+            break;
+        }
+    }
+}
+
+// 发起连接；blocking为false时非阻塞，connect完成时EPOLLOUT就绪
+bool open_conn( worker* w, int index, bool blocking )
+{
+    client_conn* conn = &w->conns[ index ];
+    conn->sockfd = socket( PF_INET, SOCK_STREAM, 0 );
+    conn->connected = false;
+    conn->unsent = 0;
+    conn->parser.reset();
+    if( conn->sockfd < 0 )
+    {
+        ++w->conn_errors;
         return false;
     }
-	printf( "read in %d bytes from socket %d with content: %s\n", bytes_read, sockfd, buffer );
+    ++w->connects;
+    if( blocking )
+    {
+        conn->connected = connect( conn->sockfd, ( struct sockaddr* )&address, sizeof( address ) ) == 0;
+        setnonblocking( conn->sockfd );
+    }
+    else
+    {
+        setnonblocking( conn->sockfd );
+        connect( conn->sockfd, ( struct sockaddr* )&address, sizeof( address ) );
+    }
 
+    epoll_event event;
+    event.data.fd = index;
+    event.events = ( conn->connected ? EPOLLIN : EPOLLOUT ) | EPOLLERR | EPOLLRDHUP;
+    epoll_ctl( w->epollfd, EPOLL_CTL_ADD, conn->sockfd, &event );
+    push_ready( w, index );
     return true;
 }
 
-void start_conn( int epoll_fd, int num, const char* ip, int port )
+// 关闭连接，仍在等待应答的请求计入*lost。fixed模式立即重建，其他模式归还连接槽
+void close_conn( worker* w, int index, int64_t* lost )
 {
-    int ret = 0;
-    struct sockaddr_in address;
-    bzero( &address, sizeof( address ) );
-    address.sin_family = AF_INET;
-    inet_pton( AF_INET, ip, &address.sin_addr );
-    address.sin_port = htons( port );
+    client_conn* conn = &w->conns[ index ];
+    remove_ready( w, index );
+    *lost += conn->count;
+    conn->count = 0;
+    conn->head = 0;
+    if( conn->sockfd >= 0 )
+    {
+        epoll_ctl( w->epollfd, EPOLL_CTL_DEL, conn->sockfd, 0 );
+        close( conn->sockfd );
+        conn->sockfd = -1;
+    }
+    conn->connected = false;
+    if( mode == FIXED )
+    {
+        open_conn( w, index, false );
+    }
+    else
+    {
+        w->spare[ w->spare_count++ ] = index;
+    }
+}
+
+// 取出下一个请求放到w->next；已到计划时刻时返回true
+bool next_due( worker* w, int64_t now )
+{
+    if( ! w->has_next )
+    {
+        pending* p = &w->next;
+        if( w->cursor )
+        {
+            int64_t index;
+            double timestamp;
+            if( ! w->cursor->next( &p->url, &p->url_len, &index, &timestamp ) )
+            {
+                w->exhausted = true;
+                return false;
+            }
+            p->intended = w->interval > 0 ? w->start + ( int64_t )( index * w->interval )
+                : w->start + ( int64_t )( ( timestamp - source->first_timestamp() ) * 1e9 / speed );
+        }
+        else
+        {
+            p->intended = w->start + ( int64_t )( w->issued * w->interval );
+            if( source )
+            {
+                source->pick( &w->rng, &p->url, &p->url_len );
+            }
+            else
+            {
+                p->url = url;
+                p->url_len = url_len;
+            }
+        }
+        w->has_next = true;
+    }
+    if( w->interval <= 0 && ! w->cursor )
+    {
+        w->next.intended = now;
+    }
+    return w->next.intended <= now;
+}
+
+// 把已到计划时刻的请求分配给连接：优先用已连接的，其次按需新建
+void issue( worker* w, int64_t now )
+{
+    while( ( w->ready_count > 0 || ( mode != FIXED && w->spare_count > 0 ) ) && next_due( w, now ) )
+    {
+        int index;
+        if( w->ready_count > 0 )
+        {
+            index = w->ready[ w->ready_count - 1 ];
+        }
+        else
+        {
+            index = w->spare[ --w->spare_count ];
+            if( ! open_conn( w, index, false ) )
+            {
+                w->spare[ w->spare_count++ ] = index;
+                break;
+            }
+        }
+
+        client_conn* conn = &w->conns[ index ];
+        pending* p = &conn->inflight[ ( conn->head + conn->count ) % conn_depth() ];
+        *p = w->next;
+        p->sent = now;
+        w->has_next = false;
+        if( now - p->intended > w->max_lag )
+        {
+            w->max_lag = now - p->intended;
+        }
+        ++conn->count;
+        ++w->issued;
+        if( conn->count >= conn_depth() )
+        {
+            remove_ready( w, index );
+        }
+        if( ! conn->connected )
+        {
+            ++conn->unsent;
+        }
+        else if( ! send_request( conn->sockfd, p ) )
+        {
+            close_conn( w, index, &w->errors );
+        }
+    }
+}
+
+void on_connected( worker* w, int index )
+{
+    client_conn* conn = &w->conns[ index ];
+    int error = 0;
+    socklen_t len = sizeof( error );
+    getsockopt( conn->sockfd, SOL_SOCKET, SO_ERROR, &error, &len );
+    if( error != 0 )
+    {
+        ++w->conn_errors;
+        close_conn( w, index, &w->errors );
+        return;
+    }
+    conn->connected = true;
+    modfd( w->epollfd, conn->sockfd, index, EPOLLIN );
+    for( ; conn->unsent > 0; --conn->unsent )
+    {
+        if( ! send_request( conn->sockfd, &conn->inflight[ ( conn->head + conn->count - conn->unsent ) % conn_depth() ] ) )
+        {
+            close_conn( w, index, &w->errors );
+            return;
+        }
+    }
+    push_ready( w, index );
+}
+
+// 最早发出的请求得到了应答
+void complete( worker* w, int index, int64_t now )
+{
+    client_conn* conn = &w->conns[ index ];
+    pending* p = &conn->inflight[ conn->head ];
+    conn->head = ( conn->head + 1 ) % conn_depth();
+    --conn->count;
+
+    int status = conn->parser.status();
+    ++w->responses;
+    w->bytes += conn->parser.body_bytes();
+    ++w->status[ status >= 0 && status < 600 ? status : 0 ];
+    if( status >= 200 && status < 400 )
+    {
+        ++w->ok;
+        w->latency->record( ( now - p->intended ) / 1000 );
+        w->service->record( ( now - p->sent ) / 1000 );
+    }
+    conn->parser.reset();
+}
+
+// 把收到的数据交给应答解析器；连接因此被关闭时返回false
+bool consume( worker* w, int index, const char* buffer, int len, int64_t now )
+{
+    client_conn* conn = &w->conns[ index ];
+    int pos = 0;
+    while( pos < len )
+    {
+        if( conn->count == 0 )
+        {
+            ++w->bad;
+            close_conn( w, index, &w->errors );
+            return false;
+        }
+        int used = 0;
+        http_response::RESULT ret = conn->parser.parse( buffer + pos, len - pos, &used );
+        pos += used;
+        if( ret == http_response::BAD_RESPONSE )
+        {
+            --conn->count;
+            ++w->bad;
+            close_conn( w, index, &w->errors );
+            return false;
+        }
+        if( ret == http_response::COMPLETE )
+        {
+            bool keep_alive = conn->parser.keep_alive();
+            complete( w, index, now );
+            if( ! keep_alive || mode == CLOSE )
+            {
+                close_conn( w, index, &w->errors );
+                return false;
+            }
+            push_ready( w, index );
+        }
+    }
+    return true;
+}
 
-    for ( int i = 0; i < num; ++i )
+void on_readable( worker* w, int index, char* buffer, int64_t now )
+{
+    client_conn* conn = &w->conns[ index ];
+    while( 1 )
     {
-        sleep( 1 );
-        int sockfd = socket( PF_INET, SOCK_STREAM, 0 );
-        printf( "create 1 sock\n" );
-        if( sockfd < 0 )
+        int bytes_read = recv( conn->sockfd, buffer, BUFFER_SIZE, 0 );
+        if ( bytes_read > 0 )
         {
+            if( ! consume( w, index, buffer, bytes_read, now ) )
+            {
+                return;
+            }
             continue;
         }
+        if ( bytes_read == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+        {
+            return;
+        }
+        if ( bytes_read == -1 && errno == EINTR )
+        {
+            continue;
+        }
+        // 对端关闭：没有长度的应答体到此结束
+        if( bytes_read == 0 && conn->count > 0 && conn->parser.started()
+            && conn->parser.finish() == http_response::COMPLETE )
+        {
+            complete( w, index, now );
+        }
+        close_conn( w, index, &w->errors );
+        return;
+    }
+}
 
-        if (  connect( sockfd, ( struct sockaddr* )&address, sizeof( address ) ) == 0  )
+// 关闭最早的请求已超时的连接
+void expire( worker* w, int64_t now )
+{
+    for( int i = 0; i < w->conn_number; ++i )
+    {
+        client_conn* conn = &w->conns[i];
+        if( conn->count > 0 && now - conn->inflight[ conn->head ].sent > timeout )
         {
-            printf( "build connection %d\n", i );
-            addfd( epoll_fd, sockfd );
+            close_conn( w, i, &w->timeouts );
         }
     }
 }
 
-void close_conn( int epoll_fd, int sockfd )
+// 距下一个计划发送时刻的毫秒数；不足1毫秒时返回0，在epoll_wait上忙等
+int next_timeout( worker* w, int64_t now )
 {
-    epoll_ctl( epoll_fd, EPOLL_CTL_DEL, sockfd, 0 );
-    close( sockfd );
+    int64_t wake = w->end;
+    if( w->has_next && ( w->ready_count > 0 || ( mode != FIXED && w->spare_count > 0 ) ) )
+    {
+        wake = w->next.intended < wake ? w->next.intended : wake;
+    }
+    if( wake <= now )
+    {
+        return 0;
+    }
+    int64_t ms = ( wake - now ) / 1000000;
+    return ms > SCAN_INTERVAL / 1000000 ? SCAN_INTERVAL / 1000000 : ( int )ms;
 }
 
-int main( int argc, char* argv[] )
+// 所有连接上都没有等待应答的请求
+bool idle( worker* w )
+{
+    for( int i = 0; i < w->conn_number; ++i )
+    {
+        if( w->conns[i].count > 0 )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void* worker_main( void* arg )
 {
-    assert( argc == 4 );
-    int epoll_fd = epoll_create( 100 );
-    start_conn( epoll_fd, atoi( argv[ 3 ] ), argv[1], atoi( argv[2] ) );
-    epoll_event events[ 10000 ];
-    char buffer[ 2048 ];
-    while ( 1 )
-    {
-        int fds = epoll_wait( epoll_fd, events, 10000, 2000 );
-        for ( int i = 0; i < fds; i++ )
-        {   
-            int sockfd = events[i].data.fd;
-            if ( events[i].events & EPOLLIN )
-            {   
-                if ( ! read_once( sockfd, buffer, 2048 ) )
-                {
-                    close_conn( epoll_fd, sockfd );
-                }
-                struct epoll_event event;
-                event.events = EPOLLOUT | EPOLLET | EPOLLERR;
-                event.data.fd = sockfd;
-                epoll_ctl( epoll_fd, EPOLL_CTL_MOD, sockfd, &event );
+    worker* w = ( worker* )arg;
+    epoll_event events[ MAX_EVENT_NUMBER ];
+    char* buffer = new char[ BUFFER_SIZE ];
+    int64_t now = now_ns();
+    int64_t next_scan = now + SCAN_INTERVAL;
+    while( now < w->end && ! ( w->exhausted && idle( w ) ) )
+    {
+        issue( w, now );
+        int number = epoll_wait( w->epollfd, events, MAX_EVENT_NUMBER, next_timeout( w, now ) );
+        if( number < 0 && errno != EINTR )
+        {
+            break;
+        }
+        now = now_ns();
+        for( int i = 0; i < number; i++ )
+        {
+            int index = events[i].data.fd;
+            if( w->conns[ index ].sockfd < 0 )
+            {
+                continue;
             }
-            else if( events[i].events & EPOLLOUT ) 
+            if( ! w->conns[ index ].connected )
             {
-                if ( ! write_nbytes( sockfd, request, strlen( request ) ) )
-                {
-                    close_conn( epoll_fd, sockfd );
-                }
-                struct epoll_event event;
-                event.events = EPOLLIN | EPOLLET | EPOLLERR;
-                event.data.fd = sockfd;
-                epoll_ctl( epoll_fd, EPOLL_CTL_MOD, sockfd, &event );
+                on_connected( w, index );
             }
-            else if( events[i].events & EPOLLERR )
+            else
             {
-                close_conn( epoll_fd, sockfd );
+                on_readable( w, index, buffer, now );
             }
         }
+        if( now >= next_scan )
+        {
+            expire( w, now );
+            next_scan = now + SCAN_INTERVAL;
+        }
     }
+    delete [] buffer;
+    return NULL;
 }
 
+void print_percentiles( const char* name, const hdr_histogram& h )
+{
+    printf( "  %-12s %10lld %10lld %10lld %10lld %10lld\n", name,
+            ( long long )h.value_at_percentile( 50 ), ( long long )h.value_at_percentile( 90 ),
+            ( long long )h.value_at_percentile( 99 ), ( long long )h.value_at_percentile( 99.9 ),
+            ( long long )h.max() );
+}
+
+int main( int argc, char* argv[] )
+{
+    int thread_number = 1;
+    double rate = 0;
+    int duration = -1;
+    const char* output = NULL;
+    const char* url_file = NULL;
+    const char* log_file = NULL;
+    bool json = false;
+    bool usage = false;
+    int opt;
+    while( ( opt = getopt( argc, argv, "t:r:d:o:m:p:u:T:w:l:s:j" ) ) != -1 )
+    {
+        switch( opt )
+        {
+            case 't': thread_number = atoi( optarg ); break;
+            case 'r': rate = atof( optarg ); break;
+            case 'd': duration = atoi( optarg ); break;
+            case 'o': output = optarg; break;
+            case 'p': depth = atoi( optarg ); break;
+            case 'u': url = optarg; break;
+            case 'T': timeout = ( int64_t )( atof( optarg ) * 1e9 ); break;
+            case 'w': url_file = optarg; break;
+            case 'l': log_file = optarg; break;
+            case 's': speed = atof( optarg ); break;
+            case 'j': json = true; break;
+            case 'm':
+                if( strcmp( optarg, "fixed" ) == 0 ) mode = FIXED;
+                else if( strcmp( optarg, "keepalive" ) == 0 ) mode = KEEP_ALIVE;
+                else if( strcmp( optarg, "close" ) == 0 ) mode = CLOSE;
+                else usage = true;
+                break;
+            default: usage = true; break;
+        }
+    }
+    if( duration < 0 )
+    {
+        duration = log_file ? 0 : 10;
+    }
+    if( usage || argc - optind != 3 || thread_number <= 0 || ( duration == 0 && ! log_file ) || rate < 0
+        || depth <= 0 || timeout <= 0 || speed <= 0 || ( url_file && log_file ) )
+    {
+        printf( "usage: %s [-t threads] [-r requests_per_second] [-d seconds] [-o hgrm_file] [-m fixed|keepalive|close] "
+                "[-p pipeline_depth] [-T timeout_seconds] [-j] [-u url | -w url_list | -l access_log [-s speed]] "
+                "ip_address port_number connections\n",
+                basename( argv[0] ) );
+        return 1;
+    }
+    if( url_file || log_file )
+    {
+        source = new workload;
+        if( ! source->open( url_file ? url_file : log_file, url_file ? workload::URL_LIST : workload::ACCESS_LOG ) )
+        {
+            printf( "cannot load workload %s\n", url_file ? url_file : log_file );
+            return 1;
+        }
+    }
+    int conn_number = atoi( argv[ optind + 2 ] );
+    if( conn_number < thread_number )
+    {
+        thread_number = conn_number > 0 ? conn_number : 1;
+    }
+
+    bzero( &address, sizeof( address ) );
+    address.sin_family = AF_INET;
+    inet_pton( AF_INET, argv[ optind ], &address.sin_addr );
+    address.sin_port = htons( atoi( argv[ optind + 1 ] ) );
+    url_len = strlen( url );
+    request_tail_len = snprintf( request_tail, sizeof( request_tail ), " HTTP/1.1\r\nHost: %s:%s\r\nConnection: %s\r\n\r\n",
+                                 argv[ optind ], argv[ optind + 1 ], mode == CLOSE ? "close" : "keep-alive" );
+    if( url_len > workload::MAX_URL || request_tail_len >= ( int )sizeof( request_tail ) )
+    {
+        printf( "url too long\n" );
+        return 1;
+    }
+    signal( SIGPIPE, SIG_IGN );
+
+    // fixed模式的连接在计时开始前建立好；各线程的计划时刻错开，合起来是均匀的rate。
+    // 回放日志时各线程轮流取日志行，计划时刻由行号或日志时间决定，不需要错开
+    worker* workers = new worker[ thread_number ];
+    for( int i = 0; i < thread_number; ++i )
+    {
+        worker* w = &workers[i];
+        memset( w, 0, sizeof( *w ) );
+        w->epollfd = epoll_create( 5 );
+        w->conn_number = conn_number / thread_number + ( i < conn_number % thread_number ? 1 : 0 );
+        w->conns = new client_conn[ w->conn_number ];
+        w->ready = new int[ w->conn_number ];
+        w->spare = new int[ w->conn_number ];
+        w->interval = rate > 0 ? 1e9 * thread_number / rate : 0;
+        if( log_file )
+        {
+            w->cursor = new workload::cursor( source, i, thread_number );
+            w->interval = rate > 0 ? 1e9 / rate : 0;
+        }
+        w->rng = 0x9e3779b97f4a7c15ull * ( i + 1 );
+        w->latency = new hdr_histogram( 1, LATENCY_MAX_US, 3 );
+        w->service = new hdr_histogram( 1, LATENCY_MAX_US, 3 );
+        for( int j = 0; j < w->conn_number; ++j )
+        {
+            client_conn* conn = &w->conns[j];
+            conn->sockfd = -1;
+            conn->connected = false;
+            conn->ready = false;
+            conn->unsent = 0;
+            conn->inflight = new pending[ conn_depth() ];
+            conn->head = conn->count = 0;
+            if( mode == FIXED )
+            {
+                open_conn( w, j, true );
+            }
+            else
+            {
+                w->spare[ w->spare_count++ ] = j;
+            }
+        }
+    }
+    int64_t start = now_ns();
+    for( int i = 0; i < thread_number; ++i )
+    {
+        workers[i].start = log_file ? start : start + ( int64_t )( i * workers[i].interval / thread_number );
+        workers[i].end = duration > 0 ? start + duration * 1000000000ll : INT64_MAX;
+        if( pthread_create( &workers[i].tid, NULL, worker_main, &workers[i] ) != 0 )
+        {
+            printf( "cannot create thread\n" );
+            return 1;
+        }
+    }
+
+    hdr_histogram latency( 1, LATENCY_MAX_US, 3 );
+    hdr_histogram service( 1, LATENCY_MAX_US, 3 );
+    worker total;
+    memset( &total, 0, sizeof( total ) );
+    int64_t unfinished = 0;
+    for( int i = 0; i < thread_number; ++i )
+    {
+        worker* w = &workers[i];
+        pthread_join( w->tid, NULL );
+        latency.add( *w->latency );
+        service.add( *w->service );
+        total.issued += w->issued;
+        total.responses += w->responses;
+        total.ok += w->ok;
+        total.errors += w->errors;
+        total.timeouts += w->timeouts;
+        total.bad += w->bad;
+        total.conn_errors += w->conn_errors;
+        total.connects += w->connects;
+        total.bytes += w->bytes;
+        total.max_lag = w->max_lag > total.max_lag ? w->max_lag : total.max_lag;
+        for( int j = 0; j < 600; ++j )
+        {
+            total.status[j] += w->status[j];
+        }
+        for( int j = 0; j < w->conn_number; ++j )
+        {
+            unfinished += w->conns[j].count;
+            if( w->conns[j].sockfd >= 0 )
+            {
+                close( w->conns[j].sockfd );
+            }
+            delete [] w->conns[j].inflight;
+        }
+        close( w->epollfd );
+        delete w->latency;
+        delete w->service;
+        delete [] w->conns;
+        delete [] w->ready;
+        delete [] w->spare;
+        delete w->cursor;
+    }
+    delete [] workers;
+
+    static const char* mode_names[] = { "fixed", "keepalive", "close" };
+    double seconds = ( now_ns() - start ) / 1e9;
+    bool open_loop = rate > 0 || log_file;
+    if( output )
+    {
+        FILE* fp = fopen( output, "w" );
+        if( fp )
+        {
+            ( open_loop ? latency : service ).print_distribution( fp, 5, 1000.0 );
+            fclose( fp );
+        }
+    }
+    if( json )
+    {
+        const hdr_histogram& h = open_loop ? latency : service;
+        printf( "{\"requests\":%lld,\"responses\":%lld,\"ok\":%lld,\"errors\":%lld,\"timeouts\":%lld,\"bad\":%lld,"
+                "\"seconds\":%.3f,\"throughput\":%.1f,\"mb_per_sec\":%.2f,\"p50_us\":%lld,\"p90_us\":%lld,"
+                "\"p99_us\":%lld,\"p999_us\":%lld,\"max_us\":%lld}\n",
+                ( long long )total.issued, ( long long )total.responses, ( long long )total.ok, ( long long )total.errors,
+                ( long long )total.timeouts, ( long long )total.bad, seconds, total.ok / seconds,
+                total.bytes / seconds / ( 1024 * 1024 ), ( long long )h.value_at_percentile( 50 ),
+                ( long long )h.value_at_percentile( 90 ), ( long long )h.value_at_percentile( 99 ),
+                ( long long )h.value_at_percentile( 99.9 ), ( long long )h.max() );
+        delete source;
+        return 0;
+    }
+    printf( "%d threads, %d connections (%s, pipeline %d), %.1fs, ", thread_number, conn_number,
+            mode_names[ mode ], conn_depth(), seconds );
+    if( log_file )
+    {
+        printf( "replay %s ", log_file );
+    }
+    else if( url_file )
+    {
+        printf( "%d urls from %s, ", source->url_count(), url_file );
+    }
+    if( rate > 0 )
+    {
+        printf( "target %.0f req/s\n", rate );
+    }
+    else if( log_file )
+    {
+        printf( "at %gx original timing\n", speed );
+    }
+    else
+    {
+        printf( "closed loop\n" );
+    }
+    printf( "  requests: %lld sent, %lld responses (%lld ok), %lld errors, %lld timeouts, %lld bad responses, "
+            "%lld unfinished\n",
+            ( long long )total.issued, ( long long )total.responses, ( long long )total.ok, ( long long )total.errors,
+            ( long long )total.timeouts, ( long long )total.bad, ( long long )unfinished );
+    if( open_loop )
+    {
+        printf( "  max send lag: %.3f ms\n", total.max_lag / 1e6 );
+    }
+    printf( "  connections: %lld opened, %lld failed\n", ( long long )total.connects, ( long long )total.conn_errors );
+    printf( "  status:" );
+    for( int j = 0; j < 600; ++j )
+    {
+        if( total.status[j] )
+        {
+            printf( " %d=%lld", j, ( long long )total.status[j] );
+        }
+    }
+    printf( "\n" );
+    printf( "  throughput: %.1f ok/s, %.1f responses/s, %.2f MB/s body\n", total.ok / seconds,
+            total.responses / seconds, total.bytes / seconds / ( 1024 * 1024 ) );
+    printf( "  %-12s %10s %10s %10s %10s %10s\n", "latency(us)", "p50", "p90", "p99", "p99.9", "max" );
+    if( open_loop )
+    {
+        print_percentiles( "corrected", latency );
+    }
+    print_percentiles( "service", service );
+    if( latency.overflows() )
+    {
+        printf( "  %lld samples above %llds\n", ( long long )latency.overflows(), ( long long )( LATENCY_MAX_US / 1000000 ) );
+    }
+
+    delete source;
+    return 0;
+}
@@ -0,0 +1,281 @@
+#ifndef HDR_HISTOGRAM_H
+#define HDR_HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <exception>
+
+// HDR（High Dynamic Range）直方图：在[lowest, highest]范围内以固定的有效数字精度记录数值，
+// 内存与记录个数无关。桶按2的幂分段，每段再等分为sub_bucket_count个子桶
+class hdr_histogram
+{
+public:
+    hdr_histogram( int64_t lowest, int64_t highest, int significant_figures )
+    {
+        if( lowest < 1 || highest < 2 * lowest || significant_figures < 1 || significant_figures > 5 )
+        {
+            throw std::exception();
+        }
+        m_lowest = lowest;
+        m_highest = highest;
+        int64_t largest_single_unit = 2;
+        for( int i = 0; i < significant_figures; ++i )
+        {
+            largest_single_unit *= 10;
+        }
+        m_unit_magnitude = ( int )floor( log2( ( double )lowest ) );
+        int sub_bucket_count_magnitude = ( int )ceil( log2( ( double )largest_single_unit ) );
+        m_sub_bucket_half_count_magnitude = ( sub_bucket_count_magnitude > 1 ? sub_bucket_count_magnitude : 1 ) - 1;
+        m_sub_bucket_count = 1 << ( m_sub_bucket_half_count_magnitude + 1 );
+        m_sub_bucket_half_count = m_sub_bucket_count / 2;
+        m_sub_bucket_mask = ( ( int64_t )m_sub_bucket_count - 1 ) << m_unit_magnitude;
+
+        int64_t smallest_untrackable = ( int64_t )m_sub_bucket_count << m_unit_magnitude;
+        m_bucket_count = 1;
+        while( smallest_untrackable <= highest )
+        {
+            if( smallest_untrackable > INT64_MAX / 2 )
+            {
+                ++m_bucket_count;
+                break;
+            }
+            smallest_untrackable <<= 1;
+            ++m_bucket_count;
+        }
+        m_counts_len = ( m_bucket_count + 1 ) * m_sub_bucket_half_count;
+        m_counts = new int64_t[ m_counts_len ];
+        reset();
+    }
+    ~hdr_histogram()
+    {
+        delete [] m_counts;
+    }
+
+    void reset()
+    {
+        memset( m_counts, 0, sizeof( int64_t ) * m_counts_len );
+        m_total = 0;
+        m_min = INT64_MAX;
+        m_max = 0;
+        m_overflows = 0;
+    }
+
+    // 超出范围的值计入overflows()，按highest记录
+    void record( int64_t value, int64_t count = 1 )
+    {
+        if( value < 0 )
+        {
+            value = 0;
+        }
+        if( value > m_highest )
+        {
+            m_overflows += count;
+            value = m_highest;
+        }
+        m_counts[ counts_index_for( value ) ] += count;
+        m_total += count;
+        if( value < m_min )
+        {
+            m_min = value;
+        }
+        if( value > m_max )
+        {
+            m_max = value;
+        }
+    }
+
+    // 合并另一个参数相同的直方图
+    bool add( const hdr_histogram& other )
+    {
+        if( other.m_counts_len != m_counts_len || other.m_unit_magnitude != m_unit_magnitude
+            || other.m_sub_bucket_count != m_sub_bucket_count )
+        {
+            return false;
+        }
+        for( int i = 0; i < m_counts_len; ++i )
+        {
+            m_counts[i] += other.m_counts[i];
+        }
+        m_total += other.m_total;
+        m_overflows += other.m_overflows;
+        if( other.m_total )
+        {
+            m_min = other.m_min < m_min ? other.m_min : m_min;
+            m_max = other.m_max > m_max ? other.m_max : m_max;
+        }
+        return true;
+    }
+
+    int64_t count() const { return m_total; }
+    int64_t overflows() const { return m_overflows; }
+    int64_t min() const { return m_total ? lowest_equivalent( m_min ) : 0; }
+    int64_t max() const { return m_total ? highest_equivalent( m_max ) : 0; }
+    double mean() const
+    {
+        if( ! m_total )
+        {
+            return 0;
+        }
+        double sum = 0;
+        for( int i = 0; i < m_counts_len; ++i )
+        {
+            if( m_counts[i] )
+            {
+                int64_t v = value_at_index( i );
+                sum += m_counts[i] * ( double )( lowest_equivalent( v ) + ( size_of_equivalent_range( v ) >> 1 ) );
+            }
+        }
+        return sum / m_total;
+    }
+
+    // 返回不小于percentile%记录值的最小值（在精度范围内）
+    int64_t value_at_percentile( double percentile ) const
+    {
+        if( ! m_total )
+        {
+            return 0;
+        }
+        if( percentile > 100 )
+        {
+            percentile = 100;
+        }
+        int64_t count_at = ( int64_t )( percentile / 100 * m_total + 0.5 );
+        if( count_at < 1 )
+        {
+            count_at = 1;
+        }
+        int64_t seen = 0;
+        for( int i = 0; i < m_counts_len; ++i )
+        {
+            seen += m_counts[i];
+            if( seen >= count_at )
+            {
+                return highest_equivalent( value_at_index( i ) );
+            }
+        }
+        return max();
+    }
+
+    // 按HdrHistogram的百分位分布格式输出（可直接用其绘图工具画图），数值除以scale
+    void print_distribution( FILE* out, int ticks_per_half_distance, double scale ) const
+    {
+        fprintf( out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)" );
+        double percentile = 0;
+        while( m_total )
+        {
+            int64_t value = value_at_percentile( percentile );
+            int64_t below = 0;
+            for( int i = 0; i < m_counts_len && value_at_index( i ) <= value; ++i )
+            {
+                below += m_counts[i];
+            }
+            if( percentile >= 100 )
+            {
+                fprintf( out, "%12.3f %14.12f %10lld\n", value / scale, 1.0, ( long long )below );
+                break;
+            }
+            fprintf( out, "%12.3f %14.12f %10lld %14.2f\n", value / scale, percentile / 100, ( long long )below,
+                     1 / ( 1 - percentile / 100 ) );
+            // 越靠近100%，步长越小
+            double reporting_ticks = ticks_per_half_distance * pow( 2, floor( log2( 100 / ( 100 - percentile ) ) ) + 1 );
+            percentile += 100 / reporting_ticks;
+            if( below >= m_total && percentile < 100 )
+            {
+                percentile = 100;
+            }
+        }
+        fprintf( out, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean() / scale, stddev() / scale );
+        fprintf( out, "#[Max     = %12.3f, Total count    = %12lld]\n", max() / scale, ( long long )m_total );
+        fprintf( out, "#[Buckets = %12d, SubBuckets     = %12d]\n", m_bucket_count, m_sub_bucket_count );
+    }
+
+private:
+    double stddev() const
+    {
+        if( ! m_total )
+        {
+            return 0;
+        }
+        double m = mean();
+        double sum = 0;
+        for( int i = 0; i < m_counts_len; ++i )
+        {
+            if( m_counts[i] )
+            {
+                int64_t v = value_at_index( i );
+                double dev = lowest_equivalent( v ) + ( size_of_equivalent_range( v ) >> 1 ) - m;
+                sum += dev * dev * m_counts[i];
+            }
+        }
+        return sqrt( sum / m_total );
+    }
+
+    int bucket_index( int64_t value ) const
+    {
+        int pow2ceiling = 64 - __builtin_clzll( ( uint64_t )( value | m_sub_bucket_mask ) );
+        return pow2ceiling - m_unit_magnitude - ( m_sub_bucket_half_count_magnitude + 1 );
+    }
+    int sub_bucket_index( int64_t value, int bucket ) const
+    {
+        return ( int )( value >> ( bucket + m_unit_magnitude ) );
+    }
+    int counts_index( int bucket, int sub_bucket ) const
+    {
+        return ( ( bucket + 1 ) << m_sub_bucket_half_count_magnitude ) + ( sub_bucket - m_sub_bucket_half_count );
+    }
+    int counts_index_for( int64_t value ) const
+    {
+        int bucket = bucket_index( value );
+        return counts_index( bucket, sub_bucket_index( value, bucket ) );
+    }
+    int64_t value_at_index( int index ) const
+    {
+        int bucket = ( index >> m_sub_bucket_half_count_magnitude ) - 1;
+        int sub_bucket = ( index & ( m_sub_bucket_half_count - 1 ) ) + m_sub_bucket_half_count;
+        if( bucket < 0 )
+        {
+            sub_bucket -= m_sub_bucket_half_count;
+            bucket = 0;
+        }
+        return ( int64_t )sub_bucket << ( bucket + m_unit_magnitude );
+    }
+    int64_t size_of_equivalent_range( int64_t value ) const
+    {
+        int bucket = bucket_index( value );
+        int sub_bucket = sub_bucket_index( value, bucket );
+        int adjusted = sub_bucket >= m_sub_bucket_count ? bucket + 1 : bucket;
+        return ( int64_t )1 << ( m_unit_magnitude + adjusted );
+    }
+    int64_t lowest_equivalent( int64_t value ) const
+    {
+        int bucket = bucket_index( value );
+        return ( int64_t )sub_bucket_index( value, bucket ) << ( bucket + m_unit_magnitude );
+    }
+    int64_t highest_equivalent( int64_t value ) const
+    {
+        return lowest_equivalent( value ) + size_of_equivalent_range( value ) - 1;
+    }
+
+private:
+    hdr_histogram( const hdr_histogram& );
+    hdr_histogram& operator=( const hdr_histogram& );
+
+    int64_t m_lowest;
+    int64_t m_highest;
+    int m_unit_magnitude;
+    int m_sub_bucket_half_count_magnitude;
+    int m_sub_bucket_count;
+    int m_sub_bucket_half_count;
+    int64_t m_sub_bucket_mask;
+    int m_bucket_count;
+    int m_counts_len;
+    int64_t* m_counts;
+    int64_t m_total;
+    int64_t m_min;
+    int64_t m_max;
+    int64_t m_overflows;
+};
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+
+// 增量式HTTP应答解析器：数据可以任意切分后分多次送入，状态在调用之间保留。
+// 支持Content-Length、chunked以及以关闭连接结束的应答体；应答体只计数，不保存
+class http_response
+{
+public:
+    enum RESULT { INCOMPLETE = 0, COMPLETE, BAD_RESPONSE };
+
+    http_response() { reset(); }
+
+    void reset()
+    {
+        m_state = STATUS_LINE;
+        m_line_len = 0;
+        m_status = 0;
+        m_keep_alive = false;
+        m_chunked = false;
+        m_content_length = -1;
+        m_remaining = 0;
+        m_body_bytes = 0;
+    }
+
+    // 解析data[0, len)，*used返回消耗的字节数。返回COMPLETE时一个应答已结束，
+    // data中剩下的字节属于下一个（流水线）应答，调用者reset()之后接着送入
+    RESULT parse( const char* data, int len, int* used )
+    {
+        int pos = 0;
+        RESULT ret = INCOMPLETE;
+        while( pos < len && ret == INCOMPLETE )
+        {
+            if( m_state == BODY || m_state == CHUNK_DATA || m_state == UNTIL_CLOSE )
+            {
+                int64_t n = len - pos;
+                if( m_state != UNTIL_CLOSE && n > m_remaining )
+                {
+                    n = m_remaining;
+                }
+                pos += n;
+                m_body_bytes += n;
+                m_remaining -= n;
+                if( m_state == BODY && m_remaining == 0 )
+                {
+                    ret = COMPLETE;
+                }
+                else if( m_state == CHUNK_DATA && m_remaining == 0 )
+                {
+                    m_state = CHUNK_CRLF;
+                }
+                continue;
+            }
+
+            // 其余状态都按行处理，行不完整时先攒在m_line里
+            const char* eol = ( const char* )memchr( data + pos, '\n', len - pos );
+            int n = eol ? eol - ( data + pos ) + 1 : len - pos;
+            append( data + pos, n );
+            pos += n;
+            if( eol )
+            {
+                ret = parse_line();
+                m_line_len = 0;
+            }
+        }
+        *used = pos;
+        return ret;
+    }
+
+    // 连接被对端关闭时调用：没有长度信息的应答体以关闭为结束
+    RESULT finish()
+    {
+        return m_state == UNTIL_CLOSE ? COMPLETE : BAD_RESPONSE;
+    }
+
+    // 是否已读到应答的第一个字节
+    bool started() const { return m_state != STATUS_LINE || m_line_len > 0; }
+    int status() const { return m_status; }
+    bool keep_alive() const { return m_keep_alive; }
+    int64_t body_bytes() const { return m_body_bytes; }
+
+private:
+    enum STATE { STATUS_LINE = 0, HEADER, BODY, CHUNK_SIZE, CHUNK_DATA, CHUNK_CRLF, TRAILER, UNTIL_CLOSE };
+    static const int LINE_SIZE = 256;
+
+    // 只关心行首的少量内容，超长的行截断
+    void append( const char* data, int len )
+    {
+        int n = LINE_SIZE - 1 - m_line_len;
+        n = len < n ? len : n;
+        memcpy( m_line + m_line_len, data, n );
+        m_line_len += n;
+    }
+
+    RESULT parse_line()
+    {
+        while( m_line_len > 0 && ( m_line[ m_line_len - 1 ] == '\n' || m_line[ m_line_len - 1 ] == '\r' ) )
+        {
+            --m_line_len;
+        }
+        m_line[ m_line_len ] = '\0';
+
+        switch( m_state )
+        {
+            case STATUS_LINE:
+            {
+                // HTTP/1.x SP 状态码 SP 原因短语
+                if( strncasecmp( m_line, "HTTP/1.", 7 ) != 0 || m_line_len < 12 || m_line[8] != ' ' )
+                {
+                    return BAD_RESPONSE;
+                }
+                m_keep_alive = m_line[7] == '1';
+                m_status = atoi( m_line + 9 );
+                if( m_status < 100 || m_status > 599 )
+                {
+                    return BAD_RESPONSE;
+                }
+                m_state = HEADER;
+                return INCOMPLETE;
+            }
+            case HEADER:
+            {
+                if( m_line_len == 0 )
+                {
+                    return headers_done();
+                }
+                parse_header();
+                return INCOMPLETE;
+            }
+            case CHUNK_SIZE:
+            {
+                char* end = NULL;
+                m_remaining = strtoll( m_line, &end, 16 );
+                if( end == m_line || m_remaining < 0 )
+                {
+                    return BAD_RESPONSE;
+                }
+                m_state = m_remaining == 0 ? TRAILER : CHUNK_DATA;
+                return INCOMPLETE;
+            }
+            case CHUNK_CRLF:
+            {
+                if( m_line_len != 0 )
+                {
+                    return BAD_RESPONSE;
+                }
+                m_state = CHUNK_SIZE;
+                return INCOMPLETE;
+            }
+            case TRAILER:
+            {
+                return m_line_len == 0 ? COMPLETE : INCOMPLETE;
+            }
+            default:
+                return BAD_RESPONSE;
+        }
+    }
+
+    void parse_header()
+    {
+        const char* value = strchr( m_line, ':' );
+        if( ! value )
+        {
+            return;
+        }
+        int name_len = value - m_line;
+        value += strspn( value + 1, " \t" ) + 1;
+        if( name_len == 10 && strncasecmp( m_line, "Connection", 10 ) == 0 )
+        {
+            if( strcasecmp( value, "close" ) == 0 )
+            {
+                m_keep_alive = false;
+            }
+            else if( strcasecmp( value, "keep-alive" ) == 0 )
+            {
+                m_keep_alive = true;
+            }
+        }
+        else if( name_len == 14 && strncasecmp( m_line, "Content-Length", 14 ) == 0 )
+        {
+            m_content_length = atoll( value );
+        }
+        else if( name_len == 17 && strncasecmp( m_line, "Transfer-Encoding", 17 ) == 0 )
+        {
+            m_chunked = strcasestr( value, "chunked" ) != NULL;
+        }
+    }
+
+    RESULT headers_done()
+    {
+        // 1xx是中间应答，丢掉后继续等最终应答；不支持协议升级
+        if( m_status < 200 )
+        {
+            int status = m_status;
+            reset();
+            return status == 101 ? BAD_RESPONSE : INCOMPLETE;
+        }
+        // 204、304没有应答体
+        if( m_status == 204 || m_status == 304 )
+        {
+            return COMPLETE;
+        }
+        if( m_chunked )
+        {
+            m_state = CHUNK_SIZE;
+            return INCOMPLETE;
+        }
+        if( m_content_length >= 0 )
+        {
+            m_remaining = m_content_length;
+            m_state = BODY;
+            return m_remaining == 0 ? COMPLETE : INCOMPLETE;
+        }
+        m_state = UNTIL_CLOSE;
+        m_keep_alive = false;
+        return INCOMPLETE;
+    }
+
+private:
+    STATE m_state;
+    char m_line[ LINE_SIZE ];
+    int m_line_len;
+    int m_status;
+    bool m_keep_alive;
+    bool m_chunked;
+    int64_t m_content_length;
+    int64_t m_remaining;
+    int64_t m_body_bytes;
+};
+
+#endif
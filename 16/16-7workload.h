@@ -0,0 +1,335 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+
+// 压测的请求来源。文件用mmap映射，按需分页读入，几个GB的日志也不会整体加载到内存：
+//   URL列表   每行"路径 [权重]"，权重缺省为1，#开头为注释；按权重随机抽取
+//   访问日志  Common/Combined Log Format，或每行"时间戳(秒，可带小数) 路径"；只回放GET请求，
+//             按原始时间间隔（可缩放）或指定速率依次发出
+class workload
+{
+public:
+    enum TYPE { URL_LIST = 0, ACCESS_LOG };
+    static const int MAX_URL = 2048;
+
+    workload() : m_type( URL_LIST ), m_data( NULL ), m_size( 0 ), m_total_weight( 0 ), m_first_timestamp( 0 ) {}
+    ~workload()
+    {
+        if( m_data )
+        {
+            munmap( ( void* )m_data, m_size );
+        }
+    }
+
+    bool open( const char* path, TYPE type )
+    {
+        int fd = ::open( path, O_RDONLY );
+        if( fd < 0 )
+        {
+            return false;
+        }
+        struct stat st;
+        if( fstat( fd, &st ) < 0 || st.st_size == 0 )
+        {
+            close( fd );
+            return false;
+        }
+        void* data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        close( fd );
+        if( data == MAP_FAILED )
+        {
+            return false;
+        }
+        m_data = ( const char* )data;
+        m_size = st.st_size;
+        m_type = type;
+        if( type == ACCESS_LOG )
+        {
+            madvise( data, m_size, MADV_SEQUENTIAL );
+            cursor first( this, 0, 1 );
+            const char* url;
+            int len;
+            int64_t index;
+            double timestamp;
+            m_first_timestamp = 0;
+            if( ! first.next( &url, &len, &index, &timestamp ) )
+            {
+                return false;
+            }
+            m_first_timestamp = timestamp;
+            return true;
+        }
+        return load_urls();
+    }
+
+    TYPE type() const { return m_type; }
+    int url_count() const { return m_entries.size(); }
+    double first_timestamp() const { return m_first_timestamp; }
+
+    // 按权重抽取一个URL，rng是调用者线程私有的随机数状态
+    void pick( uint64_t* rng, const char** url, int* len ) const
+    {
+        // xorshift64*
+        *rng ^= *rng >> 12;
+        *rng ^= *rng << 25;
+        *rng ^= *rng >> 27;
+        double r = ( ( *rng * 2685821657736338717ull ) >> 11 ) * ( 1.0 / 9007199254740992.0 ) * m_total_weight;
+        int lo = 0, hi = m_entries.size() - 1;
+        while( lo < hi )
+        {
+            int mid = ( lo + hi ) / 2;
+            if( m_entries[ mid ].cumulative > r )
+            {
+                hi = mid;
+            }
+            else
+            {
+                lo = mid + 1;
+            }
+        }
+        *url = m_entries[ lo ].url;
+        *len = m_entries[ lo ].len;
+    }
+
+    // 访问日志的顺序读取器，每个线程一个。有效行按序号轮流分给各线程：第offset, offset + stride, ...行
+    class cursor
+    {
+    public:
+        cursor( const workload* w, int offset, int stride )
+            : m_pos( w->m_data ), m_end( w->m_data + w->m_size ), m_offset( offset ),
+              m_stride( stride ), m_index( 0 ), m_group( -1 ), m_group_size( 0 ), m_group_pos( 0 ) {}
+
+        // 日志读完时返回false。index为请求在整个日志有效行中的序号，timestamp以秒计
+        bool next( const char** url, int* len, int64_t* index, double* timestamp )
+        {
+            while( m_pos < m_end )
+            {
+                const char* line = m_pos;
+                const char* eol = ( const char* )memchr( line, '\n', m_end - line );
+                eol = eol ? eol : m_end;
+                m_pos = eol + 1;
+                bool whole_second = false;
+                if( ! parse_line( line, eol, url, len, timestamp, &whole_second ) )
+                {
+                    continue;
+                }
+                // 日志时间只精确到秒时，把同一秒内的请求均匀摊开
+                if( whole_second )
+                {
+                    if( *timestamp != m_group || m_group_pos >= m_group_size )
+                    {
+                        m_group = *timestamp;
+                        m_group_pos = 0;
+                        m_group_size = count_second( line, *timestamp );
+                    }
+                    *timestamp += ( double )m_group_pos++ / m_group_size;
+                }
+                *index = m_index++;
+                if( *index % m_stride == m_offset )
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+        // 从line开始、时间戳同为second的连续有效行数
+        int count_second( const char* line, double second ) const
+        {
+            int count = 0;
+            while( line < m_end && count < 1000000 )
+            {
+                const char* eol = ( const char* )memchr( line, '\n', m_end - line );
+                eol = eol ? eol : m_end;
+                const char* url;
+                int len;
+                double timestamp;
+                bool whole_second;
+                if( parse_line( line, eol, &url, &len, &timestamp, &whole_second ) )
+                {
+                    if( timestamp != second )
+                    {
+                        break;
+                    }
+                    ++count;
+                }
+                line = eol + 1;
+            }
+            return count > 0 ? count : 1;
+        }
+
+        const char* m_pos;
+        const char* m_end;
+        int m_offset;
+        int m_stride;
+        int64_t m_index;
+        double m_group;
+        int m_group_size;
+        int m_group_pos;
+    };
+
+    // 解析一行日志。CLF格式：host ident user [10/Oct/2000:13:55:36 -0700] "GET /path HTTP/1.0" ...
+    static bool parse_line( const char* line, const char* eol, const char** url, int* len,
+                            double* timestamp, bool* whole_second )
+    {
+        const char* bracket = ( const char* )memchr( line, '[', eol - line );
+        if( bracket )
+        {
+            int64_t seconds;
+            if( ! parse_clf_time( bracket + 1, eol, &seconds ) )
+            {
+                return false;
+            }
+            const char* quote = ( const char* )memchr( bracket, '"', eol - bracket );
+            if( ! quote || eol - quote < 6 || memcmp( quote + 1, "GET ", 4 ) != 0 )
+            {
+                return false;
+            }
+            *url = quote + 5;
+            *len = token_length( *url, eol );
+            *timestamp = ( double )seconds;
+            *whole_second = true;
+        }
+        else
+        {
+            // 映射区末尾没有'\0'，先拷出来再转换
+            char buf[ 32 ];
+            int n = eol - line < ( int )sizeof( buf ) - 1 ? eol - line : ( int )sizeof( buf ) - 1;
+            memcpy( buf, line, n );
+            buf[ n ] = '\0';
+            char* stop = NULL;
+            *timestamp = strtod( buf, &stop );
+            if( stop == buf || ( *stop != ' ' && *stop != '\t' ) )
+            {
+                return false;
+            }
+            const char* end = line + ( stop - buf );
+            while( end < eol && ( *end == ' ' || *end == '\t' ) )
+            {
+                ++end;
+            }
+            *url = end;
+            *len = token_length( end, eol );
+            *whole_second = false;
+        }
+        return *len > 0 && *len <= MAX_URL;
+    }
+
+private:
+    bool load_urls()
+    {
+        const char* pos = m_data;
+        const char* end = m_data + m_size;
+        while( pos < end )
+        {
+            const char* eol = ( const char* )memchr( pos, '\n', end - pos );
+            eol = eol ? eol : end;
+            const char* p = pos;
+            pos = eol + 1;
+            while( p < eol && ( *p == ' ' || *p == '\t' ) )
+            {
+                ++p;
+            }
+            if( p == eol || *p == '#' || *p == '\r' )
+            {
+                continue;
+            }
+            entry e;
+            e.url = p;
+            e.len = token_length( p, eol );
+            p += e.len;
+            double weight = 1;
+            if( p < eol && *p != '\r' )
+            {
+                char buf[ 32 ];
+                int n = eol - p < ( int )sizeof( buf ) - 1 ? eol - p : ( int )sizeof( buf ) - 1;
+                memcpy( buf, p, n );
+                buf[ n ] = '\0';
+                char* end_weight = NULL;
+                weight = strtod( buf, &end_weight );
+                if( end_weight == buf )
+                {
+                    weight = 1;
+                }
+            }
+            if( weight <= 0 || e.len > MAX_URL )
+            {
+                continue;
+            }
+            m_total_weight += weight;
+            e.cumulative = m_total_weight;
+            m_entries.push_back( e );
+        }
+        return ! m_entries.empty();
+    }
+
+    static int token_length( const char* p, const char* eol )
+    {
+        const char* q = p;
+        while( q < eol && *q != ' ' && *q != '\t' && *q != '"' && *q != '\r' )
+        {
+            ++q;
+        }
+        return q - p;
+    }
+
+    // 10/Oct/2000:13:55:36 -0700]，换算成UTC秒数
+    static bool parse_clf_time( const char* p, const char* eol, int64_t* seconds )
+    {
+        static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+        if( eol - p < 26 || p[2] != '/' || p[6] != '/' || p[11] != ':' || p[20] != ' ' )
+        {
+            return false;
+        }
+        int day = atoi( p );
+        int month = 0;
+        for( int i = 0; i < 12 && ! month; ++i )
+        {
+            month = memcmp( months + i * 3, p + 3, 3 ) == 0 ? i + 1 : 0;
+        }
+        if( ! month )
+        {
+            return false;
+        }
+        int year = atoi( p + 7 );
+        int hour = atoi( p + 12 ), minute = atoi( p + 15 ), second = atoi( p + 18 );
+        int zone = atoi( p + 21 );
+        int zone_seconds = ( zone / 100 * 60 + zone % 100 ) * 60;
+
+        // 公历日期到1970-01-01的天数
+        year -= month <= 2;
+        int64_t era = ( year >= 0 ? year : year - 399 ) / 400;
+        int64_t yoe = year - era * 400;
+        int64_t doy = ( 153 * ( month + ( month > 2 ? -3 : 9 ) ) + 2 ) / 5 + day - 1;
+        int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        int64_t days = era * 146097 + doe - 719468;
+        *seconds = days * 86400 + hour * 3600 + minute * 60 + second - zone_seconds;
+        return true;
+    }
+
+private:
+    struct entry
+    {
+        const char* url;
+        int len;
+        double cumulative;
+    };
+
+    TYPE m_type;
+    const char* m_data;
+    size_t m_size;
+    std::vector< entry > m_entries;
+    double m_total_weight;
+    double m_first_timestamp;
+};
+
+#endif
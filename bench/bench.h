@@ -0,0 +1,37 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// 微基准框架：BENCH( name ) { ... } 定义并注册一个基准，函数体把被测操作执行iters次。
+// 框架自动增加iters直到单次运行超过最短时间，输出ns/op和allocs/op（operator new次数）
+typedef void ( *bench_fn )( long iters );
+
+struct bench_case
+{
+    const char* name;
+    bench_fn fn;
+    bench_case* next;
+};
+
+struct bench_registrar
+{
+    bench_registrar( bench_case* c );
+};
+
+#define BENCH( name ) \
+    static void bench_##name( long iters ); \
+    static bench_case bench_case_##name = { #name, bench_##name, 0 }; \
+    static bench_registrar bench_reg_##name( &bench_case_##name ); \
+    static void bench_##name( long iters )
+
+// 暂停/恢复计时（同时暂停分配计数），用于把准备和清理工作排除在外
+void bench_pause();
+void bench_resume();
+
+// 阻止编译器把结果当作无用代码删掉
+template< typename T >
+inline void bench_keep( const T& value )
+{
+    __asm__ __volatile__( "" : : "g"( &value ) : "memory" );
+}
+
+#endif
@@ -0,0 +1,197 @@
+// 15-11 executor：在threadpool的工作线程上执行闭包。线程池用无锁环形队列，
+// 小闭包的post不应分配内存；同时检查结果和异常是否传回调用线程，不对时退出
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <future>
+#include <stdexcept>
+#include <vector>
+#include "executor.h"
+#include "bench.h"
+
+static const int WORKERS = 4;
+static const int NODES = 1024;
+
+struct idle
+{
+    void process() {}
+};
+typedef threadpool< idle, mpmc_ring > exec_pool;
+typedef executor< idle, mpmc_ring > exec;
+
+static void check( bool ok, const char* what )
+{
+    if( ! ok )
+    {
+        fprintf( stderr, "executor: %s\n", what );
+        exit( 1 );
+    }
+}
+
+// 吞吐：投递iters个捕获两个指针的小闭包。在途任务不超过预分配的节点数，不应溢出到堆上
+BENCH( executor_post )
+{
+    bench_pause();
+    exec_pool* pool = new exec_pool( WORKERS, 10000 );
+    exec* ex = new exec( *pool, 0, NODES );
+    std::atomic< long > sum( 0 );
+    long one = 1;
+    long* step = &one;
+    std::atomic< long >* total = &sum;
+    bench_resume();
+    for( long i = 0; i < iters; ++i )
+    {
+        while( ex->pending() >= NODES || ! ex->post( [ total, step ]() { total->fetch_add( *step ); } ) )
+        {
+            sched_yield();
+        }
+    }
+    while( ex->pending() > 0 )
+    {
+        sched_yield();
+    }
+    bench_pause();
+    check( sum.load() == iters, "post lost tasks" );
+    check( ex->spills() == 0, "post spilled nodes to the heap" );
+    delete ex;
+    delete pool;
+    bench_resume();
+}
+
+struct add_one
+{
+    std::atomic< long >* total;
+    void operator()() const { total->fetch_add( 1 ); }
+};
+
+// 每次post_bulk 64个任务，只唤醒一次
+BENCH( executor_post_bulk )
+{
+    bench_pause();
+    exec_pool* pool = new exec_pool( WORKERS, 10000 );
+    exec* ex = new exec( *pool, 0, NODES );
+    std::atomic< long > sum( 0 );
+    add_one job = { &sum };
+    std::vector< add_one > batch( 64, job );
+    bench_resume();
+    for( long i = 0; i < iters; i += 64 )
+    {
+        long n = iters - i < 64 ? iters - i : 64;
+        long posted = 0;
+        while( posted < n )
+        {
+            if( ex->pending() > NODES - 64 )
+            {
+                sched_yield();
+                continue;
+            }
+            posted += ex->post_bulk( batch.begin() + posted, batch.begin() + n );
+        }
+    }
+    while( ex->pending() > 0 )
+    {
+        sched_yield();
+    }
+    bench_pause();
+    check( sum.load() == iters, "post_bulk lost tasks" );
+    check( ex->spills() == 0, "post_bulk spilled nodes to the heap" );
+    delete ex;
+    delete pool;
+    bench_resume();
+}
+
+// 往返：每批提交64个返回值的任务再逐个取结果，分配主要来自future的共享状态
+BENCH( executor_submit )
+{
+    bench_pause();
+    exec_pool* pool = new exec_pool( WORKERS, 10000 );
+    exec* ex = new exec( *pool, 0, NODES );
+    std::future< long > thrown = ex->submit( []() -> long { throw std::runtime_error( "submit" ); } );
+    bool caught = false;
+    try
+    {
+        thrown.get();
+    }
+    catch( const std::runtime_error& )
+    {
+        caught = true;
+    }
+    check( caught, "submit did not propagate the exception" );
+    std::vector< std::future< long > > results( 64 );
+    bench_resume();
+    for( long i = 0; i < iters; i += 64 )
+    {
+        long n = iters - i < 64 ? iters - i : 64;
+        for( long k = 0; k < n; ++k )
+        {
+            long v = i + k;
+            results[k] = ex->submit( [ v ]() { return v * 2; } );
+        }
+        for( long k = 0; k < n; ++k )
+        {
+            check( results[k].get() == ( i + k ) * 2, "submit returned a wrong value" );
+        }
+    }
+    bench_pause();
+    delete ex;
+    delete pool;
+    bench_resume();
+}
+
+// 每次对4096个元素求和，按线程数自动切块，调用线程也参与。
+// 调用线程可能独自做完所有块，没抢到块的辅助任务滞后执行，积压到节点快用完时先等一等
+BENCH( executor_parallel_for )
+{
+    bench_pause();
+    exec_pool* pool = new exec_pool( WORKERS, 10000 );
+    exec* ex = new exec( *pool, 0, NODES );
+    std::vector< long > values( 4096 );
+    for( size_t i = 0; i < values.size(); ++i )
+    {
+        values[i] = i;
+    }
+    long expected = ( long )values.size() * ( values.size() - 1 ) / 2;
+    const long* data = &values[0];
+    bool caught = false;
+    try
+    {
+        ex->parallel_for( 0, values.size(), 64, []( long lo, long hi )
+        {
+            if( lo <= 1000 && 1000 < hi )
+            {
+                throw std::runtime_error( "parallel_for" );
+            }
+        } );
+    }
+    catch( const std::runtime_error& )
+    {
+        caught = true;
+    }
+    check( caught, "parallel_for did not propagate the exception" );
+    bench_resume();
+    for( long i = 0; i < iters; ++i )
+    {
+        while( ex->pending() > NODES - WORKERS )
+        {
+            sched_yield();
+        }
+        std::atomic< long > sum( 0 );
+        std::atomic< long >* total = &sum;
+        ex->parallel_for( 0, values.size(), 0, [ data, total ]( long lo, long hi )
+        {
+            long s = 0;
+            for( long k = lo; k < hi; ++k )
+            {
+                s += data[k];
+            }
+            total->fetch_add( s );
+        } );
+        check( sum.load() == expected, "parallel_for returned a wrong sum" );
+    }
+    bench_pause();
+    check( ex->spills() == 0, "parallel_for spilled nodes to the heap" );
+    delete ex;
+    delete pool;
+    bench_resume();
+}
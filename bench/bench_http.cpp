@@ -0,0 +1,181 @@
+// http_conn请求热路径：逐行切分、解析状态机、响应组包
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "http_conn.h"
+#include "bench.h"
+
+class http_conn_bench
+{
+public:
+    // 样本文件中请求之间用单独一行%%分隔。头部的\n在加载时换成\r\n，
+    // 空行之后是请求体，原样保留（去掉分隔符前的换行）
+    static const std::vector< std::string >& corpus()
+    {
+        static std::vector< std::string > requests;
+        if( requests.empty() )
+        {
+            load( getenv( "BENCH_CORPUS" ) ? getenv( "BENCH_CORPUS" ) : "corpus/requests.txt", requests );
+        }
+        return requests;
+    }
+
+    // 去掉init()里对读写缓冲区的memset，只重置解析状态，并放入一个请求
+    static void reset( http_conn& conn, const std::string& request )
+    {
+        conn.m_check_state = http_conn::CHECK_STATE_REQUESTLINE;
+        conn.m_linger = false;
+        conn.m_method = http_conn::GET;
+        conn.m_url = 0;
+        conn.m_version = 0;
+        conn.m_content_length = 0;
+        conn.m_host = 0;
+        conn.m_deferred = false;
+        conn.m_start_line = 0;
+        conn.m_checked_idx = 0;
+        conn.m_write_idx = 0;
+        size_t len = request.size() < http_conn::READ_BUFFER_SIZE - 1 ? request.size() : http_conn::READ_BUFFER_SIZE - 1;
+        memcpy( conn.m_read_buf, request.data(), len );
+        conn.m_read_buf[ len ] = '\0';
+        conn.m_read_idx = len;
+    }
+
+    static int parse_lines( http_conn& conn )
+    {
+        int lines = 0;
+        while( conn.parse_line() == http_conn::LINE_OK )
+        {
+            ++lines;
+        }
+        return lines;
+    }
+
+    static http_conn::HTTP_CODE process_read( http_conn& conn )
+    {
+        return conn.process_read();
+    }
+
+    static bool add_status( http_conn& conn )
+    {
+        conn.m_write_idx = 0;
+        return conn.add_status_line( 200, "OK" );
+    }
+
+    static bool process_write( http_conn& conn, http_conn::HTTP_CODE code, char* file, int size )
+    {
+        conn.m_write_idx = 0;
+        conn.m_linger = true;
+        conn.m_file_address = file;
+        conn.m_file_stat.st_size = size;
+        return conn.process_write( code );
+    }
+
+private:
+    static void load( const char* path, std::vector< std::string >& requests )
+    {
+        FILE* fp = fopen( path, "r" );
+        if( ! fp )
+        {
+            fprintf( stderr, "cannot open corpus %s\n", path );
+            exit( 1 );
+        }
+        std::string request;
+        size_t body = std::string::npos;     // 请求体的起始位置
+        char line[ 4096 ];
+        while( fgets( line, sizeof( line ), fp ) )
+        {
+            if( strcmp( line, "%%\n" ) == 0 )
+            {
+                finish( request, body, requests );
+                body = std::string::npos;
+                continue;
+            }
+            size_t len = strlen( line );
+            if( body != std::string::npos || len == 0 || line[ len - 1 ] != '\n' )
+            {
+                request.append( line, len );
+                continue;
+            }
+            request.append( line, len - 1 );
+            request += "\r\n";
+            if( len == 1 )
+            {
+                body = request.size();
+            }
+        }
+        finish( request, body, requests );
+        fclose( fp );
+    }
+
+    static void finish( std::string& request, size_t body, std::vector< std::string >& requests )
+    {
+        if( body != std::string::npos && request.size() > body && request[ request.size() - 1 ] == '\n' )
+        {
+            request.erase( request.size() - 1 );
+        }
+        if( ! request.empty() )
+        {
+            requests.push_back( request );
+        }
+        request.clear();
+    }
+};
+
+// 每个op切分一个完整请求的所有行（含拷贝请求到读缓冲区）
+BENCH( http_parse_line )
+{
+    const std::vector< std::string >& corpus = http_conn_bench::corpus();
+    static http_conn conn;
+    int lines = 0;
+    for( long i = 0; i < iters; ++i )
+    {
+        http_conn_bench::reset( conn, corpus[ i % corpus.size() ] );
+        lines += http_conn_bench::parse_lines( conn );
+    }
+    bench_keep( lines );
+}
+
+// 每个op解析样本中的一个请求，直到GET_REQUEST或出错
+BENCH( http_process_read )
+{
+    const std::vector< std::string >& corpus = http_conn_bench::corpus();
+    static http_conn conn;
+    int ok = 0;
+    for( long i = 0; i < iters; ++i )
+    {
+        http_conn_bench::reset( conn, corpus[ i % corpus.size() ] );
+        ok += http_conn_bench::process_read( conn ) == http_conn::GET_REQUEST;
+    }
+    bench_keep( ok );
+}
+
+BENCH( http_add_response )
+{
+    static http_conn conn;
+    for( long i = 0; i < iters; ++i )
+    {
+        http_conn_bench::add_status( conn );
+    }
+}
+
+// 200响应：状态行+头部写入写缓冲区，文件内容挂到第二个iovec
+BENCH( http_process_write_file )
+{
+    static char file[ 4096 ];
+    static http_conn conn;
+    for( long i = 0; i < iters; ++i )
+    {
+        http_conn_bench::process_write( conn, http_conn::FILE_REQUEST, file, sizeof( file ) );
+    }
+}
+
+BENCH( http_process_write_404 )
+{
+    static http_conn conn;
+    for( long i = 0; i < iters; ++i )
+    {
+        http_conn_bench::process_write( conn, http_conn::NO_RESOURCE, NULL, 0 );
+    }
+}
@@ -0,0 +1,207 @@
+// 微基准入口
+// 用法: micro_bench [-f 名字子串] [-t 最短运行毫秒] [-j] [-c 基线结果文件]
+//   -j  每个基准输出一行JSON（便于按提交保存结果）
+//   -c  与之前用-j保存的结果比较，给出ns/op的变化
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <new>
+#include <atomic>
+#include <string>
+#include <map>
+#include "bench.h"
+
+static std::atomic< unsigned long > g_allocs( 0 );
+// 工作线程里的operator new也会读它
+static std::atomic< bool > g_counting( true );
+
+void* operator new( size_t size )
+{
+    if( g_counting.load( std::memory_order_relaxed ) )
+    {
+        g_allocs.fetch_add( 1, std::memory_order_relaxed );
+    }
+    void* p = malloc( size ? size : 1 );
+    if( ! p )
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[]( size_t size )
+{
+    return operator new( size );
+}
+
+void operator delete( void* p ) noexcept
+{
+    free( p );
+}
+
+void operator delete[]( void* p ) noexcept
+{
+    free( p );
+}
+
+void operator delete( void* p, size_t ) noexcept
+{
+    free( p );
+}
+
+void operator delete[]( void* p, size_t ) noexcept
+{
+    free( p );
+}
+
+static bench_case* g_cases = NULL;
+static bench_case** g_tail = &g_cases;
+
+bench_registrar::bench_registrar( bench_case* c )
+{
+    // 按注册顺序（即各文件内的定义顺序）运行
+    c->next = NULL;
+    *g_tail = c;
+    g_tail = &c->next;
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double g_start = 0;
+static double g_elapsed = 0;
+static unsigned long g_alloc_start = 0;
+static unsigned long g_alloc_total = 0;
+
+void bench_pause()
+{
+    g_elapsed += now_ns() - g_start;
+    g_alloc_total += g_allocs.load() - g_alloc_start;
+    g_counting.store( false, std::memory_order_relaxed );
+}
+
+void bench_resume()
+{
+    g_counting.store( true, std::memory_order_relaxed );
+    g_alloc_start = g_allocs.load();
+    g_start = now_ns();
+}
+
+static void run_case( bench_case* c, long iters, double* ns, double* allocs )
+{
+    g_elapsed = 0;
+    g_alloc_total = 0;
+    bench_resume();
+    c->fn( iters );
+    bench_pause();
+    g_counting.store( true, std::memory_order_relaxed );
+    *ns = g_elapsed;
+    *allocs = ( double )g_alloc_total;
+}
+
+static void load_baseline( const char* path, std::map< std::string, double >& baseline )
+{
+    FILE* fp = fopen( path, "r" );
+    if( ! fp )
+    {
+        return;
+    }
+    char line[ 512 ];
+    while( fgets( line, sizeof( line ), fp ) )
+    {
+        char name[ 128 ];
+        long iters = 0;
+        double ns = 0;
+        if( sscanf( line, "{\"name\":\"%127[^\"]\",\"iterations\":%ld,\"ns_per_op\":%lf", name, &iters, &ns ) == 3 )
+        {
+            baseline[ name ] = ns;
+        }
+    }
+    fclose( fp );
+}
+
+int main( int argc, char* argv[] )
+{
+    const char* filter = NULL;
+    const char* compare = NULL;
+    double min_ns = 200 * 1e6;
+    bool json = false;
+    int opt;
+    while( ( opt = getopt( argc, argv, "f:t:jc:" ) ) != -1 )
+    {
+        switch( opt )
+        {
+            case 'f': filter = optarg; break;
+            case 't': min_ns = atof( optarg ) * 1e6; break;
+            case 'j': json = true; break;
+            case 'c': compare = optarg; break;
+            default:
+                fprintf( stderr, "usage: %s [-f filter] [-t min_ms] [-j] [-c baseline.jsonl]\n", argv[0] );
+                return 1;
+        }
+    }
+    std::map< std::string, double > baseline;
+    if( compare )
+    {
+        load_baseline( compare, baseline );
+    }
+
+    // 被测代码里的printf不计入输出
+    fflush( stdout );
+    FILE* report = fdopen( dup( 1 ), "w" );
+    if( ! report || ! freopen( "/dev/null", "w", stdout ) )
+    {
+        return 1;
+    }
+
+    if( ! json )
+    {
+        fprintf( report, "%-28s %12s %12s %12s%s\n", "benchmark", "iterations", "ns/op", "allocs/op",
+                 compare ? "        delta" : "" );
+    }
+    for( bench_case* c = g_cases; c; c = c->next )
+    {
+        if( filter && ! strstr( c->name, filter ) )
+        {
+            continue;
+        }
+        long iters = 1;
+        double ns = 0, allocs = 0;
+        for( ; ; )
+        {
+            run_case( c, iters, &ns, &allocs );
+            if( ns >= min_ns || iters >= 1000000000l )
+            {
+                break;
+            }
+            // 按已测速度估算下一轮次数，每轮最多放大100倍
+            double scale = ns > 0 ? min_ns * 1.2 / ns : 100;
+            long next = ( long )( iters * ( scale < 100 ? scale : 100 ) );
+            iters = next > iters ? next : iters + 1;
+        }
+        double per_op = ns / iters;
+        if( json )
+        {
+            fprintf( report, "{\"name\":\"%s\",\"iterations\":%ld,\"ns_per_op\":%.2f,\"allocs_per_op\":%.3f}\n",
+                     c->name, iters, per_op, allocs / iters );
+        }
+        else
+        {
+            fprintf( report, "%-28s %12ld %12.2f %12.3f", c->name, iters, per_op, allocs / iters );
+            std::map< std::string, double >::const_iterator it = baseline.find( c->name );
+            if( it != baseline.end() && it->second > 0 )
+            {
+                fprintf( report, "  %+10.1f%%", ( per_op - it->second ) * 100 / it->second );
+            }
+            fprintf( report, "\n" );
+        }
+        fflush( report );
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+// threadpool投递到执行的往返开销
+#include <sched.h>
+#include <atomic>
+#include "threadpool.h"
+#include "bench.h"
+
+struct ping
+{
+    std::atomic< long > done;
+    void process()
+    {
+        done.fetch_add( 1, std::memory_order_release );
+    }
+};
+
+static void wait_done( ping& p, long n )
+{
+    while( p.done.load( std::memory_order_acquire ) < n )
+    {
+        sched_yield();
+    }
+}
+
+// 吞吐：连续投递iters个任务，直到全部执行完
+BENCH( pool_append_run )
+{
+    bench_pause();
+    threadpool< ping >* pool = new threadpool< ping >( 4, 10000 );
+    ping p;
+    p.done.store( 0 );
+    bench_resume();
+    for( long i = 0; i < iters; ++i )
+    {
+        while( ! pool->append( &p ) )
+        {
+            sched_yield();
+        }
+    }
+    wait_done( p, iters );
+    bench_pause();
+    delete pool;
+    bench_resume();
+}
+
+// 延迟：投递一个任务并等它执行完再投下一个（含一次唤醒）
+BENCH( pool_round_trip )
+{
+    bench_pause();
+    threadpool< ping >* pool = new threadpool< ping >( 1, 16 );
+    ping p;
+    p.done.store( 0 );
+    bench_resume();
+    for( long i = 0; i < iters; ++i )
+    {
+        pool->append( &p );
+        wait_done( p, i + 1 );
+    }
+    bench_pause();
+    delete pool;
+    bench_resume();
+}
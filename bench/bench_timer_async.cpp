@@ -0,0 +1,186 @@
+// 15-12跨线程定时器：工作线程设置定时器，事件循环线程到期后把回调送回设置它的工作线程。
+// 每个到期的定时器算一次操作，另有同样多个设置后立即取消。
+// 同时检查回调都在设置者线程中执行、取消了的都没有执行，不满足时退出
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include "event_loop.h"
+#include "async_timer.h"
+#include "bench.h"
+
+static const int WORKERS = 4;
+// 每轮最多这么多个定时器到期
+static const int ROUND = 500;
+
+struct idle
+{
+    void process() {}
+};
+typedef threadpool< idle > timer_pool;
+
+struct async_timer_bench;
+
+// 在一个工作线程中设置本轮属于它的定时器
+struct starter : public runnable
+{
+    async_timer_bench* bench;
+    int worker;
+};
+
+struct async_timer_bench
+{
+    timer_pool* pool;
+    async_timer_service< timer_pool >* service;
+    std::atomic< event_loop* > loop;    // 在事件循环线程中创建
+    event_handler requests;
+    event_handler expired;
+    pthread_t thread;
+    starter starters[ WORKERS ];
+    // 定时器2k和2k + 1属于工作线程k % WORKERS，前者到期，后者取消
+    async_timer timers[ 2 * ROUND ];
+    int owner[ 2 * ROUND ];
+    int count;                          // 本轮用前2 * count个定时器
+    std::atomic< long > fired;
+    std::atomic< long > misplaced;      // 回调不在设置者线程中执行
+    std::atomic< long > cancelled;      // 取消了的定时器仍执行了回调
+};
+
+static void on_requests( event_handler* handler, uint32_t /* events */ )
+{
+    static_cast< async_timer_bench* >( handler->user_data )->service->handle_requests();
+}
+
+static void on_expired( event_handler* handler, uint32_t /* events */ )
+{
+    static_cast< async_timer_bench* >( handler->user_data )->service->handle_expired();
+}
+
+// 事件循环只能在构造它的线程中运行，注册也在这里做
+static void* run_loop( void* arg )
+{
+    async_timer_bench* b = static_cast< async_timer_bench* >( arg );
+    event_loop* loop = new event_loop;
+    loop->add( &b->requests, EPOLLIN );
+    loop->add( &b->expired, EPOLLIN );
+    b->loop.store( loop );
+    loop->run();
+    return NULL;
+}
+
+static void on_timer( async_timer* timer )
+{
+    async_timer_bench* b = static_cast< async_timer_bench* >( timer->user_data );
+    int i = timer - b->timers;
+    if( b->pool->worker_index() != b->owner[i] )
+    {
+        b->misplaced.fetch_add( 1 );
+    }
+    if( i % 2 == 1 )
+    {
+        b->cancelled.fetch_add( 1 );
+    }
+    b->fired.fetch_add( 1, std::memory_order_release );
+}
+
+static void start( runnable* job )
+{
+    starter* s = static_cast< starter* >( job );
+    async_timer_bench* b = s->bench;
+    for( int k = s->worker; k < b->count; k += WORKERS )
+    {
+        for( int i = 2 * k; i < 2 * k + 2; ++i )
+        {
+            b->owner[i] = b->pool->worker_index();
+            b->service->schedule( &b->timers[i], 0 );
+        }
+        b->service->cancel( &b->timers[ 2 * k + 1 ] );
+    }
+}
+
+static async_timer_bench* create_bench()
+{
+    async_timer_bench* b = new async_timer_bench;
+    b->pool = new timer_pool( WORKERS, 10000 );
+    // m_head按缓存行对齐，C++11的new不保证，和threadpool的工作线程一样用posix_memalign
+    void* mem = NULL;
+    if( posix_memalign( &mem, 64, sizeof( async_timer_service< timer_pool > ) ) != 0 )
+    {
+        fprintf( stderr, "async timer: out of memory\n" );
+        exit( 1 );
+    }
+    b->service = new ( mem ) async_timer_service< timer_pool >( *b->pool );
+    b->requests.fd = b->service->event_fd();
+    b->requests.handle_event = on_requests;
+    b->requests.user_data = b;
+    b->expired.fd = b->service->timer_fd();
+    b->expired.handle_event = on_expired;
+    b->expired.user_data = b;
+    for( int i = 0; i < WORKERS; ++i )
+    {
+        b->starters[i].invoke = start;
+        b->starters[i].bench = b;
+        b->starters[i].worker = i;
+    }
+    for( int i = 0; i < 2 * ROUND; ++i )
+    {
+        b->timers[i].cb_func = on_timer;
+        b->timers[i].user_data = b;
+    }
+    b->count = 0;
+    b->fired.store( 0 );
+    b->misplaced.store( 0 );
+    b->cancelled.store( 0 );
+    b->loop.store( NULL );
+    pthread_create( &b->thread, NULL, run_loop, b );
+    while( ! b->loop.load() )
+    {
+        sched_yield();
+    }
+    return b;
+}
+
+// 先等工作线程退出，之后不会再有回调执行，再检查计数
+static void destroy_bench( async_timer_bench* b, long expected )
+{
+    b->loop.load()->quit();
+    pthread_join( b->thread, NULL );
+    delete b->pool;
+    if( b->fired.load() != expected || b->misplaced.load() != 0 || b->cancelled.load() != 0 )
+    {
+        fprintf( stderr, "async timer: fired %ld/%ld, %ld on another worker, %ld after cancel\n",
+                 b->fired.load(), expected, b->misplaced.load(), b->cancelled.load() );
+        exit( 1 );
+    }
+    delete b->loop.load();
+    b->service->~async_timer_service();
+    free( b->service );
+    delete b;
+}
+
+// 设置到期（延迟0）再送回工作线程的往返，每轮全部到期后才开始下一轮
+BENCH( timer_async_round_trip )
+{
+    bench_pause();
+    async_timer_bench* b = create_bench();
+    bench_resume();
+    long target = 0;
+    while( target < iters )
+    {
+        b->count = iters - target < ROUND ? iters - target : ROUND;
+        target += b->count;
+        for( int i = 0; i < WORKERS; ++i )
+        {
+            b->pool->append_job_to( &b->starters[i], i );
+        }
+        while( b->fired.load( std::memory_order_acquire ) < target )
+        {
+            sched_yield();
+        }
+    }
+    bench_pause();
+    destroy_bench( b, iters );
+    bench_resume();
+}
@@ -0,0 +1,33 @@
+// 11-6最小堆定时器：插入/弹出O(log n)，删除为惰性删除
+#include <iostream>
+#include <time.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+namespace
+{
+#include "time_heap.h"
+}
+#include "bench.h"
+
+static const int LIVE_TIMERS = 1000;
+
+// 堆中保持LIVE_TIMERS个定时器：插入一个随机超时的定时器，再弹出堆顶
+BENCH( timer_heap_add_pop )
+{
+    bench_pause();
+    time_heap* heap = new time_heap( LIVE_TIMERS * 2 );
+    srand( 1 );
+    for( int i = 0; i < LIVE_TIMERS; ++i )
+    {
+        heap->add_timer( new heap_timer( rand() % 3600 ) );
+    }
+    bench_resume();
+    for( long i = 0; i < iters; ++i )
+    {
+        heap->add_timer( new heap_timer( rand() % 3600 ) );
+        heap->pop_timer();
+    }
+    bench_pause();
+    delete heap;
+    bench_resume();
+}
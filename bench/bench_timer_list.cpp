@@ -0,0 +1,40 @@
+// 11-2升序链表定时器：插入O(n)，删除O(1)
+// 三种定时器头文件各自定义了client_data，分别放在独立的编译单元和匿名名字空间里
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+namespace
+{
+#include "lst_timer.h"
+}
+#include "bench.h"
+
+static const int LIVE_TIMERS = 1000;
+
+// 在已有LIVE_TIMERS个定时器的链表中插入一个随机超时的定时器再删除
+BENCH( timer_list_add_del )
+{
+    bench_pause();
+    sort_timer_lst* list = new sort_timer_lst;
+    srand( 1 );
+    time_t now = time( NULL );
+    for( int i = 0; i < LIVE_TIMERS; ++i )
+    {
+        util_timer* t = new util_timer;
+        t->expire = now + rand() % 3600;
+        list->add_timer( t );
+    }
+    bench_resume();
+    for( long i = 0; i < iters; ++i )
+    {
+        util_timer* t = new util_timer;
+        t->expire = now + rand() % 3600;
+        list->add_timer( t );
+        list->del_timer( t );
+    }
+    bench_pause();
+    delete list;
+    bench_resume();
+}
@@ -0,0 +1,63 @@
+// 11-5时间轮：插入/删除O(1)，tick遍历一个槽
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+namespace
+{
+#include "tw_timer.h"
+}
+#include "bench.h"
+
+static const int LIVE_TIMERS = 1000;
+
+static void expire_noop( client_data* )
+{
+}
+
+static tw_timer* add( time_wheel* wheel, int timeout )
+{
+    tw_timer* timer = wheel->add_timer( timeout );
+    timer->cb_func = expire_noop;
+    timer->user_data = NULL;
+    return timer;
+}
+
+BENCH( timer_wheel_add_del )
+{
+    bench_pause();
+    time_wheel* wheel = new time_wheel;
+    srand( 1 );
+    for( int i = 0; i < LIVE_TIMERS; ++i )
+    {
+        add( wheel, rand() % 3600 );
+    }
+    bench_resume();
+    for( long i = 0; i < iters; ++i )
+    {
+        wheel->del_timer( add( wheel, rand() % 3600 ) );
+    }
+    bench_pause();
+    delete wheel;
+    bench_resume();
+}
+
+// 每个op推进一个槽；定时器的超时足够长，测试期间不会到期，只统计遍历和轮数递减
+BENCH( timer_wheel_tick )
+{
+    bench_pause();
+    time_wheel* wheel = new time_wheel;
+    srand( 1 );
+    for( int i = 0; i < LIVE_TIMERS; ++i )
+    {
+        add( wheel, 1000000000 + rand() % 3600 );
+    }
+    bench_resume();
+    for( long i = 0; i < iters; ++i )
+    {
+        wheel->tick();
+    }
+    bench_pause();
+    delete wheel;
+    bench_resume();
+}
@@ -0,0 +1,599 @@
+// 端到端回环压测：启动15章的服务器（可选在前面加一层springsnail），生成指定大小的文档，
+// 用16章的stress_client压测，扫描服务器线程数和CPU集合，收集吞吐、延迟百分位、CPU占用和RSS
+// 用法: e2e_bench [-w 线程数列表] [-c CPU集合列表] [-P none|core|physical|numa] [-f 大小:权重列表]
+//                 [-n 连接数] [-t 客户端线程数] [-r 速率] [-d 秒数] [-W 预热秒数] [-C 客户端CPU集合]
+//                 [-p 起始端口] [-S] [-L 标签] [-j 报告文件] [-b 基线报告]
+//   -w 1,2,4,8           服务器工作线程数
+//   -c 0/0-1/0-3         以/分隔的多个CPU集合（cpulist格式），服务器进程限制在其中运行，缺省不限制
+//   -f 1k:5,64k:3,1m:1   生成的文件大小及访问权重
+//   -r                   每秒请求数，0为闭环压测
+//   -S                   在服务器前加springsnail（需先make -C ../springsnail）
+//   -j                   JSON报告，每个run一行，可以作为之后的-b基线
+// 需要先make e2e_server stress_client
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <map>
+
+struct run_result
+{
+    std::string name;
+    int workers;
+    std::string cpus;
+    bool ok;
+    double throughput;
+    double mb_per_sec;
+    double p50, p90, p99, p999, max;
+    double errors;
+    double timeouts;
+    double server_cpu;      // 百分比，100表示占满一个CPU
+    double client_cpu;
+    long server_rss_kb;     // VmHWM
+};
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static std::vector< std::string > split( const char* s, char sep )
+{
+    std::vector< std::string > parts;
+    std::string cur;
+    for( ; *s; ++s )
+    {
+        if( *s == sep )
+        {
+            parts.push_back( cur );
+            cur.clear();
+        }
+        else
+        {
+            cur += *s;
+        }
+    }
+    parts.push_back( cur );
+    return parts;
+}
+
+// 1k、64k、1m这样的大小
+static long parse_size( const std::string& s )
+{
+    char* end = NULL;
+    double v = strtod( s.c_str(), &end );
+    switch( *end )
+    {
+        case 'k': case 'K': v *= 1024; break;
+        case 'm': case 'M': v *= 1024 * 1024; break;
+        case 'g': case 'G': v *= 1024 * 1024 * 1024; break;
+        default: break;
+    }
+    return ( long )v;
+}
+
+// cpulist格式：0-3,6,8-9
+static bool parse_cpulist( const std::string& s, cpu_set_t* mask )
+{
+    CPU_ZERO( mask );
+    std::vector< std::string > ranges = split( s.c_str(), ',' );
+    for( size_t i = 0; i < ranges.size(); ++i )
+    {
+        int lo = 0, hi = 0;
+        int n = sscanf( ranges[i].c_str(), "%d-%d", &lo, &hi );
+        if( n < 1 || lo < 0 )
+        {
+            return false;
+        }
+        if( n == 1 )
+        {
+            hi = lo;
+        }
+        for( int c = lo; c <= hi && c < CPU_SETSIZE; ++c )
+        {
+            CPU_SET( c, mask );
+        }
+    }
+    return CPU_COUNT( mask ) > 0;
+}
+
+// 在dir/www下生成文件，dir/urls.txt为带权重的URL列表
+static bool make_docroot( const std::string& dir, const char* spec )
+{
+    std::string root = dir + "/www";
+    if( mkdir( root.c_str(), 0755 ) < 0 )
+    {
+        return false;
+    }
+    FILE* urls = fopen( ( dir + "/urls.txt" ).c_str(), "w" );
+    if( ! urls )
+    {
+        return false;
+    }
+    std::vector< std::string > files = split( spec, ',' );
+    for( size_t i = 0; i < files.size(); ++i )
+    {
+        std::vector< std::string > kv = split( files[i].c_str(), ':' );
+        long size = parse_size( kv[0] );
+        double weight = kv.size() > 1 ? atof( kv[1].c_str() ) : 1;
+        char name[ 64 ];
+        snprintf( name, sizeof( name ), "/f%zu_%s.bin", i, kv[0].c_str() );
+        FILE* fp = fopen( ( root + name ).c_str(), "w" );
+        if( ! fp )
+        {
+            fclose( urls );
+            return false;
+        }
+        char block[ 4096 ];
+        for( size_t j = 0; j < sizeof( block ); ++j )
+        {
+            block[j] = 'a' + j % 26;
+        }
+        for( long left = size; left > 0; left -= sizeof( block ) )
+        {
+            fwrite( block, 1, left < ( long )sizeof( block ) ? left : sizeof( block ), fp );
+        }
+        fclose( fp );
+        fprintf( urls, "%s %g\n", name, weight );
+    }
+    fclose( urls );
+    return true;
+}
+
+// 子进程放到自己的进程组里（springsnail会再fork），结束时整组杀掉
+static pid_t spawn( const std::vector< std::string >& args, const cpu_set_t* mask, int out_fd )
+{
+    pid_t pid = fork();
+    if( pid != 0 )
+    {
+        return pid;
+    }
+    setpgid( 0, 0 );
+    if( mask )
+    {
+        sched_setaffinity( 0, sizeof( *mask ), mask );
+    }
+    int null_fd = open( "/dev/null", O_WRONLY );
+    dup2( out_fd >= 0 ? out_fd : null_fd, 1 );
+    dup2( null_fd, 2 );
+    std::vector< char* > argv;
+    for( size_t i = 0; i < args.size(); ++i )
+    {
+        argv.push_back( const_cast< char* >( args[i].c_str() ) );
+    }
+    argv.push_back( NULL );
+    execv( argv[0], &argv[0] );
+    _exit( 127 );
+}
+
+static void stop( pid_t pid )
+{
+    if( pid > 0 )
+    {
+        kill( -pid, SIGKILL );
+        waitpid( pid, NULL, 0 );
+    }
+}
+
+static bool wait_port( int port, double seconds )
+{
+    struct sockaddr_in address;
+    memset( &address, 0, sizeof( address ) );
+    address.sin_family = AF_INET;
+    inet_pton( AF_INET, "127.0.0.1", &address.sin_addr );
+    address.sin_port = htons( port );
+    double deadline = now_sec() + seconds;
+    while( now_sec() < deadline )
+    {
+        int fd = socket( PF_INET, SOCK_STREAM, 0 );
+        int ret = connect( fd, ( struct sockaddr* )&address, sizeof( address ) );
+        close( fd );
+        if( ret == 0 )
+        {
+            return true;
+        }
+        usleep( 20000 );
+    }
+    return false;
+}
+
+// /proc/<pid>/stat中的utime+stime，单位为时钟滴答
+static long cpu_ticks( pid_t pid )
+{
+    char path[ 64 ], buf[ 1024 ];
+    snprintf( path, sizeof( path ), "/proc/%d/stat", pid );
+    FILE* fp = fopen( path, "r" );
+    if( ! fp )
+    {
+        return 0;
+    }
+    size_t n = fread( buf, 1, sizeof( buf ) - 1, fp );
+    fclose( fp );
+    buf[n] = '\0';
+    // 进程名可能含空格，从最后一个')'之后开始数，utime、stime是第14、15个字段
+    const char* p = strrchr( buf, ')' );
+    long utime = 0, stime = 0;
+    if( ! p || sscanf( p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %ld %ld", &utime, &stime ) != 2 )
+    {
+        return 0;
+    }
+    return utime + stime;
+}
+
+static long peak_rss_kb( pid_t pid )
+{
+    char path[ 64 ], line[ 256 ];
+    snprintf( path, sizeof( path ), "/proc/%d/status", pid );
+    FILE* fp = fopen( path, "r" );
+    long kb = 0;
+    while( fp && fgets( line, sizeof( line ), fp ) )
+    {
+        if( sscanf( line, "VmHWM: %ld", &kb ) == 1 )
+        {
+            break;
+        }
+    }
+    if( fp )
+    {
+        fclose( fp );
+    }
+    return kb;
+}
+
+// 从一行JSON里取数值字段
+static double json_number( const std::string& line, const char* key )
+{
+    std::string pattern = std::string( "\"" ) + key + "\":";
+    size_t pos = line.find( pattern );
+    return pos == std::string::npos ? 0 : atof( line.c_str() + pos + pattern.size() );
+}
+
+static std::string json_string( const std::string& line, const char* key )
+{
+    std::string pattern = std::string( "\"" ) + key + "\":\"";
+    size_t pos = line.find( pattern );
+    if( pos == std::string::npos )
+    {
+        return "";
+    }
+    pos += pattern.size();
+    return line.substr( pos, line.find( '"', pos ) - pos );
+}
+
+// 运行一次stress_client -j，返回它输出的JSON行和消耗的CPU秒数
+static bool run_client( const std::vector< std::string >& args, const cpu_set_t* mask,
+                        std::string* output, double* cpu_seconds )
+{
+    int fds[2];
+    if( pipe( fds ) < 0 )
+    {
+        return false;
+    }
+    pid_t pid = spawn( args, mask, fds[1] );
+    close( fds[1] );
+    char buf[ 4096 ];
+    ssize_t n;
+    output->clear();
+    while( ( n = read( fds[0], buf, sizeof( buf ) ) ) > 0 || ( n < 0 && errno == EINTR ) )
+    {
+        if( n > 0 )
+        {
+            output->append( buf, n );
+        }
+    }
+    close( fds[0] );
+    int status = 0;
+    struct rusage usage;
+    if( wait4( pid, &status, 0, &usage ) < 0 )
+    {
+        return false;
+    }
+    *cpu_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+                 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    return WIFEXITED( status ) && WEXITSTATUS( status ) == 0 && output->find( "\"throughput\"" ) != std::string::npos;
+}
+
+static bool write_springsnail_config( const std::string& path, int listen_port, int backend_port, int conns )
+{
+    FILE* fp = fopen( path.c_str(), "w" );
+    if( ! fp )
+    {
+        return false;
+    }
+    fprintf( fp, "Listen 127.0.0.1:%d\n\n<logical_host>\n  <name>127.0.0.1</name>\n  <port>%d</port>\n"
+             "  <conns>%d</conns>\n</logical_host>\n", listen_port, backend_port, conns );
+    fclose( fp );
+    return true;
+}
+
+static void load_baseline( const char* path, std::map< std::string, run_result >& baseline )
+{
+    FILE* fp = fopen( path, "r" );
+    if( ! fp )
+    {
+        fprintf( stderr, "cannot open baseline %s\n", path );
+        return;
+    }
+    char line[ 2048 ];
+    while( fgets( line, sizeof( line ), fp ) )
+    {
+        std::string s( line );
+        std::string name = json_string( s, "name" );
+        if( name.empty() )
+        {
+            continue;
+        }
+        run_result& r = baseline[ name ];
+        r.throughput = json_number( s, "throughput" );
+        r.p99 = json_number( s, "p99_us" );
+        r.server_cpu = json_number( s, "server_cpu_pct" );
+        r.server_rss_kb = ( long )json_number( s, "server_rss_kb" );
+    }
+    fclose( fp );
+}
+
+static double delta( double now, double base )
+{
+    return base > 0 ? ( now - base ) * 100 / base : 0;
+}
+
+int main( int argc, char* argv[] )
+{
+    const char* workers_arg = "1,2,4,8";
+    const char* cpus_arg = NULL;
+    const char* placement = "none";
+    const char* files_arg = "1k:5,64k:3,1m:1";
+    const char* client_cpus = NULL;
+    const char* label = "";
+    const char* report_path = NULL;
+    const char* baseline_path = NULL;
+    int connections = 64;
+    int client_threads = 2;
+    double rate = 0;
+    int duration = 5;
+    int warmup = 1;
+    int base_port = 18080;
+    bool springsnail = false;
+    int opt;
+    while( ( opt = getopt( argc, argv, "w:c:P:f:n:t:r:d:W:C:p:SL:j:b:" ) ) != -1 )
+    {
+        switch( opt )
+        {
+            case 'w': workers_arg = optarg; break;
+            case 'c': cpus_arg = optarg; break;
+            case 'P': placement = optarg; break;
+            case 'f': files_arg = optarg; break;
+            case 'n': connections = atoi( optarg ); break;
+            case 't': client_threads = atoi( optarg ); break;
+            case 'r': rate = atof( optarg ); break;
+            case 'd': duration = atoi( optarg ); break;
+            case 'W': warmup = atoi( optarg ); break;
+            case 'C': client_cpus = optarg; break;
+            case 'p': base_port = atoi( optarg ); break;
+            case 'S': springsnail = true; break;
+            case 'L': label = optarg; break;
+            case 'j': report_path = optarg; break;
+            case 'b': baseline_path = optarg; break;
+            default:
+                fprintf( stderr, "usage: %s [-w workers] [-c cpuset/cpuset...] [-P placement] [-f size:weight,...] "
+                         "[-n connections] [-t client_threads] [-r rate] [-d seconds] [-W warmup_seconds] "
+                         "[-C client_cpus] [-p port] [-S] [-L label] [-j report.json] [-b baseline.json]\n", argv[0] );
+                return 1;
+        }
+    }
+    if( access( "./e2e_server", X_OK ) < 0 || access( "./stress_client", X_OK ) < 0
+        || ( springsnail && access( "../springsnail/springsnail", X_OK ) < 0 ) )
+    {
+        fprintf( stderr, "build ./e2e_server and ./stress_client first (make e2e_server stress_client)\n" );
+        return 1;
+    }
+
+    cpu_set_t client_mask;
+    if( client_cpus && ! parse_cpulist( client_cpus, &client_mask ) )
+    {
+        fprintf( stderr, "bad cpu list %s\n", client_cpus );
+        return 1;
+    }
+    std::vector< std::string > cpu_sets;
+    if( cpus_arg )
+    {
+        cpu_sets = split( cpus_arg, '/' );
+    }
+    else
+    {
+        cpu_sets.push_back( "all" );
+    }
+    std::vector< std::string > worker_counts = split( workers_arg, ',' );
+
+    char dir_template[] = "/tmp/e2e_bench.XXXXXX";
+    if( ! mkdtemp( dir_template ) || ! make_docroot( dir_template, files_arg ) )
+    {
+        fprintf( stderr, "cannot create doc root\n" );
+        return 1;
+    }
+    std::string dir = dir_template;
+    signal( SIGPIPE, SIG_IGN );
+
+    std::map< std::string, run_result > baseline;
+    if( baseline_path )
+    {
+        load_baseline( baseline_path, baseline );
+    }
+
+    printf( "%-22s %10s %10s %8s %8s %8s %9s %9s %10s%s\n", "run", "req/s", "MB/s", "p50us", "p99us", "p99.9us",
+            "srv_cpu%", "cli_cpu%", "srv_rss_kb", baseline_path ? "   d_req/s   d_p99" : "" );
+    std::vector< run_result > results;
+    int run_index = 0;
+    for( size_t c = 0; c < cpu_sets.size(); ++c )
+    {
+        cpu_set_t mask;
+        bool pinned = cpu_sets[c] != "all";
+        if( pinned && ! parse_cpulist( cpu_sets[c], &mask ) )
+        {
+            fprintf( stderr, "bad cpu list %s\n", cpu_sets[c].c_str() );
+            continue;
+        }
+        for( size_t w = 0; w < worker_counts.size(); ++w, ++run_index )
+        {
+            run_result r;
+            r.workers = atoi( worker_counts[w].c_str() );
+            r.cpus = cpu_sets[c];
+            r.name = "w" + worker_counts[w] + "-cpu" + cpu_sets[c] + ( springsnail ? "-lb" : "" );
+            r.ok = false;
+            r.throughput = r.mb_per_sec = r.p50 = r.p90 = r.p99 = r.p999 = r.max = r.errors = r.timeouts = 0;
+            r.server_cpu = r.client_cpu = 0;
+            r.server_rss_kb = 0;
+
+            // 每次换端口，避免上一轮TIME_WAIT的连接影响bind
+            int port = base_port + run_index * 2;
+            char port_str[ 16 ], workers_str[ 16 ];
+            snprintf( port_str, sizeof( port_str ), "%d", port );
+            snprintf( workers_str, sizeof( workers_str ), "%d", r.workers );
+            std::vector< std::string > server_args;
+            server_args.push_back( "./e2e_server" );
+            server_args.push_back( "127.0.0.1" );
+            server_args.push_back( port_str );
+            server_args.push_back( workers_str );
+            server_args.push_back( placement );
+            server_args.push_back( dir + "/www" );
+            pid_t server = spawn( server_args, pinned ? &mask : NULL, -1 );
+            pid_t balancer = -1;
+            int target_port = port;
+            bool up = wait_port( port, 5 );
+            if( up && springsnail )
+            {
+                target_port = port + 1;
+                std::string config = dir + "/springsnail.conf";
+                write_springsnail_config( config, target_port, port, connections );
+                std::vector< std::string > lb_args;
+                lb_args.push_back( "../springsnail/springsnail" );
+                lb_args.push_back( "-f" );
+                lb_args.push_back( config );
+                balancer = spawn( lb_args, pinned ? &mask : NULL, -1 );
+                up = wait_port( target_port, 5 );
+            }
+
+            char target_str[ 16 ], conns_str[ 16 ], threads_str[ 16 ], rate_str[ 32 ], duration_str[ 16 ];
+            snprintf( target_str, sizeof( target_str ), "%d", target_port );
+            snprintf( conns_str, sizeof( conns_str ), "%d", connections );
+            snprintf( threads_str, sizeof( threads_str ), "%d", client_threads );
+            snprintf( rate_str, sizeof( rate_str ), "%g", rate );
+            std::vector< std::string > client_args;
+            client_args.push_back( "./stress_client" );
+            client_args.push_back( "-j" );
+            client_args.push_back( "-t" );
+            client_args.push_back( threads_str );
+            client_args.push_back( "-w" );
+            client_args.push_back( dir + "/urls.txt" );
+            if( rate > 0 )
+            {
+                client_args.push_back( "-r" );
+                client_args.push_back( rate_str );
+            }
+            client_args.push_back( "-d" );
+            client_args.push_back( "" );
+            client_args.push_back( "127.0.0.1" );
+            client_args.push_back( target_str );
+            client_args.push_back( conns_str );
+            size_t duration_arg = client_args.size() - 4;
+
+            std::string output;
+            double client_seconds = 0;
+            if( up && warmup > 0 )
+            {
+                snprintf( duration_str, sizeof( duration_str ), "%d", warmup );
+                client_args[ duration_arg ] = duration_str;
+                run_client( client_args, client_cpus ? &client_mask : NULL, &output, &client_seconds );
+            }
+            if( up )
+            {
+                snprintf( duration_str, sizeof( duration_str ), "%d", duration );
+                client_args[ duration_arg ] = duration_str;
+                long ticks = cpu_ticks( server ) + ( balancer > 0 ? cpu_ticks( balancer ) : 0 );
+                double start = now_sec();
+                r.ok = run_client( client_args, client_cpus ? &client_mask : NULL, &output, &client_seconds );
+                double wall = now_sec() - start;
+                ticks = cpu_ticks( server ) + ( balancer > 0 ? cpu_ticks( balancer ) : 0 ) - ticks;
+                r.server_cpu = ticks * 100.0 / sysconf( _SC_CLK_TCK ) / wall;
+                r.client_cpu = client_seconds * 100 / wall;
+                r.server_rss_kb = peak_rss_kb( server );
+            }
+            stop( balancer );
+            stop( server );
+
+            if( r.ok )
+            {
+                r.throughput = json_number( output, "throughput" );
+                r.mb_per_sec = json_number( output, "mb_per_sec" );
+                r.p50 = json_number( output, "p50_us" );
+                r.p90 = json_number( output, "p90_us" );
+                r.p99 = json_number( output, "p99_us" );
+                r.p999 = json_number( output, "p999_us" );
+                r.max = json_number( output, "max_us" );
+                r.errors = json_number( output, "errors" ) + json_number( output, "bad" );
+                r.timeouts = json_number( output, "timeouts" );
+            }
+            results.push_back( r );
+
+            if( ! r.ok )
+            {
+                printf( "%-22s failed (%s)\n", r.name.c_str(), up ? "client error" : "server did not start" );
+                continue;
+            }
+            printf( "%-22s %10.1f %10.2f %8.0f %8.0f %8.0f %9.1f %9.1f %10ld", r.name.c_str(), r.throughput,
+                    r.mb_per_sec, r.p50, r.p99, r.p999, r.server_cpu, r.client_cpu, r.server_rss_kb );
+            std::map< std::string, run_result >::const_iterator it = baseline.find( r.name );
+            if( it != baseline.end() )
+            {
+                printf( "  %+8.1f%% %+6.1f%%", delta( r.throughput, it->second.throughput ), delta( r.p99, it->second.p99 ) );
+            }
+            printf( "\n" );
+            fflush( stdout );
+        }
+    }
+
+    if( report_path )
+    {
+        FILE* fp = fopen( report_path, "w" );
+        if( ! fp )
+        {
+            fprintf( stderr, "cannot write %s\n", report_path );
+            return 1;
+        }
+        fprintf( fp, "{\"label\":\"%s\",\"files\":\"%s\",\"placement\":\"%s\",\"connections\":%d,\"client_threads\":%d,"
+                 "\"rate\":%g,\"duration\":%d,\"springsnail\":%s,\n\"runs\":[\n", label, files_arg, placement,
+                 connections, client_threads, rate, duration, springsnail ? "true" : "false" );
+        for( size_t i = 0; i < results.size(); ++i )
+        {
+            const run_result& r = results[i];
+            fprintf( fp, "{\"name\":\"%s\",\"workers\":%d,\"cpus\":\"%s\",\"ok\":%s,\"throughput\":%.1f,"
+                     "\"mb_per_sec\":%.2f,\"p50_us\":%.0f,\"p90_us\":%.0f,\"p99_us\":%.0f,\"p999_us\":%.0f,"
+                     "\"max_us\":%.0f,\"errors\":%.0f,\"timeouts\":%.0f,\"server_cpu_pct\":%.1f,"
+                     "\"client_cpu_pct\":%.1f,\"server_rss_kb\":%ld}%s\n",
+                     r.name.c_str(), r.workers, r.cpus.c_str(), r.ok ? "true" : "false", r.throughput,
+                     r.mb_per_sec, r.p50, r.p90, r.p99, r.p999, r.max, r.errors, r.timeouts, r.server_cpu,
+                     r.client_cpu, r.server_rss_kb, i + 1 < results.size() ? "," : "" );
+        }
+        fprintf( fp, "]}\n" );
+        fclose( fp );
+    }
+
+    std::string cleanup = "rm -rf " + dir;
+    return system( cleanup.c_str() ) == 0 ? 0 : 1;
+}
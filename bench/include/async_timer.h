@@ -0,0 +1,2 @@
+// 按书中的逻辑文件名转发到各章目录下的实际文件
+#include "../../15/15-12async_timer.h"
@@ -0,0 +1,2 @@
+// 按书中的逻辑文件名转发到各章目录下的实际文件
+#include "../../springsnail/balancer.h"
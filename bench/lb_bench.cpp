@@ -0,0 +1,259 @@
+// 负载均衡策略对比：用springsnail的balancer，在后端速度不均的情况下模拟请求的响应时间分布。
+// n个后端，每个有c个并发处理槽，槽满了就在后端排队（先来先服务）；服务时间服从指数分布，
+// 均值为1ms / speed。请求按泊松过程到达，速率为总处理能力的load倍，来自C个随机IP的客户。
+// 分配请求时outstanding加1，完成时减1并按1/8的权重更新延迟EWMA，相当于子进程的报告立即到达父进程。
+// 场景：
+//   uniform   所有后端速度相同
+//   one_slow  第0个后端慢5倍
+//   graded    速度从0.25线性增加到1.75
+// 策略的权重全为1，即配置里没写<weight>；名字带/w的按速度设置权重，相当于运维事先知道各后端的能力。
+// 结果是前10%请求之后的响应时间百分位（毫秒）和最慢后端分到的请求比例。时间是逻辑时间，不需要真的等待
+// 用法: lb_bench [-n 后端数] [-c 每个后端的并发数] [-l 负载] [-r 请求数] [-C 客户数] [-f 策略名子串] [-j]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <deque>
+#include <queue>
+#include <vector>
+#include "balancer.h"
+#include "hdr_histogram.h"
+
+static const double SERVICE_MS = 1.0;       // 速度为1的后端的平均服务时间
+
+static uint64_t g_rng = 88172645463325252ull;
+
+// (0, 1)上的均匀分布
+static double uniform()
+{
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+    return ( ( g_rng >> 11 ) + 0.5 ) / 9007199254740992.0;
+}
+
+static double exponential( double mean )
+{
+    return -mean * log( uniform() );
+}
+
+struct completion
+{
+    double time;
+    double arrive;
+    int backend;
+    bool operator<( const completion& other ) const { return time > other.time; }
+};
+
+struct server
+{
+    double speed;
+    int busy;
+    std::deque< double > queue;     // 排队请求的到达时刻
+};
+
+struct result
+{
+    double p50, p90, p99, p999, max;
+    double slow_share;
+};
+
+struct sim
+{
+    int n;
+    int slots;
+    double load;
+    long requests;
+    int clients;
+};
+
+static result run( const sim& cfg, const std::vector< double >& speeds, balancer* lb )
+{
+    std::vector< server > servers( cfg.n );
+    double capacity = 0;
+    int slowest = 0;
+    for( int i = 0; i < cfg.n; ++i )
+    {
+        servers[i].speed = speeds[i];
+        servers[i].busy = 0;
+        capacity += speeds[i] * cfg.slots / SERVICE_MS;
+        if( speeds[i] < speeds[ slowest ] )
+        {
+            slowest = i;
+        }
+    }
+    std::vector< uint32_t > ips( cfg.clients );
+    for( int i = 0; i < cfg.clients; ++i )
+    {
+        ips[i] = ( uint32_t )( uniform() * 4294967296.0 );
+    }
+
+    // 微秒，1us到1000s
+    hdr_histogram hist( 1, 1000000000ll, 3 );
+    std::priority_queue< completion > events;
+    double rate = capacity * cfg.load;
+    double now = 0;
+    double next_arrival = exponential( 1 / rate );
+    long warmup = cfg.requests / 10;
+    long arrived = 0, done = 0, slow_hits = 0;
+
+    while( done < cfg.requests )
+    {
+        if( arrived < cfg.requests && ( events.empty() || next_arrival < events.top().time ) )
+        {
+            now = next_arrival;
+            next_arrival += exponential( 1 / rate );
+            int idx = lb->pick( ips[ ( int )( uniform() * cfg.clients ) ] );
+            server& s = servers[ idx ];
+            if( ++arrived > warmup && idx == slowest )
+            {
+                ++slow_hits;
+            }
+            if( s.busy < cfg.slots )
+            {
+                ++s.busy;
+                completion c = { now + exponential( SERVICE_MS / s.speed ), now, idx };
+                events.push( c );
+            }
+            else
+            {
+                s.queue.push_back( now );
+            }
+            continue;
+        }
+
+        completion c = events.top();
+        events.pop();
+        now = c.time;
+        ++done;
+        double latency_ms = now - c.arrive;
+        if( done > warmup )
+        {
+            hist.record( ( int64_t )( latency_ms * 1000 ) + 1 );
+        }
+        backend_state& state = lb->backend( c.backend );
+        --state.outstanding;
+        int64_t latency_ns = ( int64_t )( latency_ms * 1000000 );
+        state.latency = state.latency == 0 ? latency_ns : state.latency + ( latency_ns - state.latency ) / 8;
+
+        server& s = servers[ c.backend ];
+        if( s.queue.empty() )
+        {
+            --s.busy;
+        }
+        else
+        {
+            completion next = { now + exponential( SERVICE_MS / s.speed ), s.queue.front(), c.backend };
+            s.queue.pop_front();
+            events.push( next );
+        }
+    }
+
+    result r;
+    r.p50 = hist.value_at_percentile( 50 ) / 1000.0;
+    r.p90 = hist.value_at_percentile( 90 ) / 1000.0;
+    r.p99 = hist.value_at_percentile( 99 ) / 1000.0;
+    r.p999 = hist.value_at_percentile( 99.9 ) / 1000.0;
+    r.max = hist.max() / 1000.0;
+    r.slow_share = 100.0 * slow_hits / ( cfg.requests - warmup );
+    return r;
+}
+
+static void report( FILE* out, bool json, const char* scenario, const char* policy, const sim& cfg, const result& r )
+{
+    if( json )
+    {
+        fprintf( out, "{\"name\":\"lb\",\"scenario\":\"%s\",\"policy\":\"%s\",\"backends\":%d,\"load\":%g,"
+                 "\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f,"
+                 "\"slow_share\":%.1f}\n", scenario, policy, cfg.n, cfg.load, r.p50, r.p90, r.p99, r.p999, r.max,
+                 r.slow_share );
+    }
+    else
+    {
+        fprintf( out, "%-9s %-10s %9.3f %9.3f %9.3f %9.3f %10.3f %8.1f\n", scenario, policy, r.p50, r.p90, r.p99,
+                 r.p999, r.max, r.slow_share );
+    }
+    fflush( out );
+}
+
+int main( int argc, char* argv[] )
+{
+    sim cfg;
+    cfg.n = 8;
+    cfg.slots = 4;
+    cfg.load = 0.8;
+    cfg.requests = 500000;
+    cfg.clients = 10000;
+    const char* filter = NULL;
+    bool json = false;
+    int opt;
+    while( ( opt = getopt( argc, argv, "n:c:l:r:C:f:j" ) ) != -1 )
+    {
+        switch( opt )
+        {
+            case 'n': cfg.n = atoi( optarg ); break;
+            case 'c': cfg.slots = atoi( optarg ); break;
+            case 'l': cfg.load = atof( optarg ); break;
+            case 'r': cfg.requests = atol( optarg ); break;
+            case 'C': cfg.clients = atoi( optarg ); break;
+            case 'f': filter = optarg; break;
+            case 'j': json = true; break;
+            default:
+                fprintf( stderr, "usage: %s [-n backends] [-c slots] [-l load] [-r requests] [-C clients] "
+                         "[-f policy] [-j]\n", argv[0] );
+                return 1;
+        }
+    }
+    if( cfg.n < 2 || cfg.slots <= 0 || cfg.load <= 0 || cfg.requests <= 0 || cfg.clients <= 0 )
+    {
+        return 1;
+    }
+
+    const char* scenarios[] = { "uniform", "one_slow", "graded" };
+    const char* policies[] = { "least_conn", "wrr", "wrr/w", "p2c", "maglev", "maglev/w" };
+    if( ! json )
+    {
+        fprintf( stdout, "%-9s %-10s %9s %9s %9s %9s %10s %8s\n", "scenario", "policy", "p50 ms", "p90 ms", "p99 ms",
+                 "p99.9 ms", "max ms", "slow %" );
+    }
+    for( size_t k = 0; k < sizeof( scenarios ) / sizeof( scenarios[0] ); ++k )
+    {
+        std::vector< double > speeds( cfg.n, 1.0 );
+        if( k == 1 )
+        {
+            speeds[0] = 0.2;
+        }
+        else if( k == 2 )
+        {
+            for( int i = 0; i < cfg.n; ++i )
+            {
+                speeds[i] = 0.25 + 1.5 * i / ( cfg.n - 1 );
+            }
+        }
+        for( size_t p = 0; p < sizeof( policies ) / sizeof( policies[0] ); ++p )
+        {
+            if( filter && ! strstr( policies[p], filter ) )
+            {
+                continue;
+            }
+            char name[32];
+            snprintf( name, sizeof( name ), "%s", policies[p] );
+            std::vector< int > weights( cfg.n, 1 );
+            char* suffix = strstr( name, "/w" );
+            if( suffix )
+            {
+                *suffix = '\0';
+                for( int i = 0; i < cfg.n; ++i )
+                {
+                    weights[i] = ( int )( speeds[i] * 20 + 0.5 );
+                }
+            }
+            balancer* lb = balancer::create( name, weights );
+            g_rng = 88172645463325252ull;
+            report( stdout, json, scenarios[k], policies[p], cfg, run( cfg, speeds, lb ) );
+            delete lb;
+        }
+    }
+    return 0;
+}
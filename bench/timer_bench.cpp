@@ -0,0 +1,519 @@
+// 定时器容器对比：11章的升序链表、时间轮、最小堆，以及多级时间轮和带索引的4叉堆，
+// 在n个连接的场景下分别测：
+//   refresh   每个请求把该连接的超时往后推（keep-alive），ns/op
+//   cancel    随机关闭一个连接并为新连接注册定时器，ns/op
+//   expire    n个定时器在1秒窗口内全部到期，平均每个到期定时器的ns
+//   tick      n个远未到期的定时器，推进一个时间单位的tick开销，ns
+// 以及每个定时器占用的内存（建好时和refresh/cancel之后，含节点、容器数组和连接里保存的定时器指针）。
+// 最后是coalesce：n个空闲连接在4叉堆上按不同的slack模拟60秒，统计每秒唤醒次数、每次唤醒处理的定时器数、
+// 平均延迟，以及每模拟秒的堆操作耗时（不含每次唤醒本身的系统调用和上下文切换）。
+// 时间是逻辑时间，不需要真的等待；链表插入是O(n)，超过-L个连接时只用-L个连接测它
+// 用法: timer_bench [-n 连接数] [-o 操作数] [-L 链表最多连接数] [-t 每项最长秒数] [-f 名字子串] [-j]
+// 注意旧头文件在add_timer/tick里有printf，输出被重定向到/dev/null，格式化的开销仍计入结果
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <iostream>
+#include <new>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+// 逻辑时间，毫秒
+static long g_now_ms = 0;
+
+// 三个旧头文件各自定义了client_data，分别放进自己的名字空间。
+// 链表和堆用time(NULL)判断到期，名字空间里的time()遮住了系统的，让它们也使用逻辑时间
+namespace lst
+{
+static time_t time( time_t* ) { return g_now_ms / 1000; }
+#include "lst_timer.h"
+}
+namespace tw
+{
+#include "tw_timer.h"
+}
+namespace th
+{
+static time_t time( time_t* ) { return g_now_ms / 1000; }
+#include "time_heap.h"
+}
+#include "hwheel_timer.h"
+#include "dheap_timer.h"
+
+// 统计当前存活的堆内存字节数
+static long g_live_bytes = 0;
+
+void* operator new( size_t size )
+{
+    void* p = malloc( size ? size : 1 );
+    if( ! p )
+    {
+        throw std::bad_alloc();
+    }
+    g_live_bytes += malloc_usable_size( p );
+    return p;
+}
+
+void* operator new[]( size_t size )
+{
+    return operator new( size );
+}
+
+void operator delete( void* p ) noexcept
+{
+    if( p )
+    {
+        g_live_bytes -= malloc_usable_size( p );
+        free( p );
+    }
+}
+
+void operator delete[]( void* p ) noexcept
+{
+    operator delete( p );
+}
+
+void operator delete( void* p, size_t ) noexcept
+{
+    operator delete( p );
+}
+
+void operator delete[]( void* p, size_t ) noexcept
+{
+    operator delete( p );
+}
+
+static const long KEEPALIVE_MS = 30000;     // 刷新后的超时
+static const long EXPIRE_WINDOW_MS = 1000;  // expire场景中定时器分布的窗口
+static const long FAR_MS = 3600 * 1000;     // tick场景中定时器的超时，测试期间不会到期
+static const int OPS_PER_MS = 100;          // 逻辑时间每100个操作前进1毫秒，即每秒10万个请求
+
+static unsigned long g_rng = 88172645463325252ull;
+
+static long rnd( long n )
+{
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+    return ( long )( g_rng % n );
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long g_fired = 0;
+
+// 每种容器包装成同样的接口，时间参数都是逻辑毫秒：
+//   add( i, now, timeout )  为第i个连接注册定时器
+//   refresh( i, now )       第i个连接有请求，超时推后KEEPALIVE_MS
+//   cancel( i, now )        关闭第i个连接，同一位置换成一个新连接
+//   tick( now )             推进到now，执行到期定时器
+struct list_impl
+{
+    static const char* name() { return "list"; }
+    static const char* resolution() { return "1s"; }
+    static void expired( lst::client_data* ) { ++g_fired; }
+
+    list_impl( int n ) : timers( n ) {}
+    void add( int i, long now, long timeout )
+    {
+        timers[i] = new lst::util_timer;
+        timers[i]->expire = ( now + timeout ) / 1000;
+        timers[i]->cb_func = expired;
+        timers[i]->user_data = NULL;
+        list.add_timer( timers[i] );
+    }
+    void refresh( int i, long now )
+    {
+        timers[i]->expire = ( now + KEEPALIVE_MS ) / 1000;
+        list.adjust_timer( timers[i] );
+    }
+    void cancel( int i, long now )
+    {
+        list.del_timer( timers[i] );
+        add( i, now, KEEPALIVE_MS );
+    }
+    void tick( long now )
+    {
+        g_now_ms = now;
+        list.tick();
+    }
+
+    std::vector< lst::util_timer* > timers;
+    lst::sort_timer_lst list;
+};
+
+struct wheel_impl
+{
+    static const char* name() { return "wheel"; }
+    static const char* resolution() { return "1s"; }
+    static void expired( tw::client_data* ) { ++g_fired; }
+
+    wheel_impl( int n ) : timers( n ), now_sec( 0 ) {}
+    void add( int i, long now, long timeout )
+    {
+        timers[i] = wheel.add_timer( ( now + timeout ) / 1000 - now_sec );
+        timers[i]->cb_func = expired;
+        timers[i]->user_data = NULL;
+    }
+    // 没有调整操作，只能删掉重新分配一个
+    void refresh( int i, long now )
+    {
+        wheel.del_timer( timers[i] );
+        add( i, now, KEEPALIVE_MS );
+    }
+    void cancel( int i, long now )
+    {
+        refresh( i, now );
+    }
+    // 每秒一个槽
+    void tick( long now )
+    {
+        while( now_sec < now / 1000 )
+        {
+            wheel.tick();
+            ++now_sec;
+        }
+    }
+
+    std::vector< tw::tw_timer* > timers;
+    long now_sec;
+    tw::time_wheel wheel;
+};
+
+struct heap_impl
+{
+    static const char* name() { return "heap"; }
+    static const char* resolution() { return "1s"; }
+    static void expired( th::client_data* ) { ++g_fired; }
+
+    heap_impl( int n ) : timers( n ), heap( n ) {}
+    void add( int i, long now, long timeout )
+    {
+        timers[i] = new th::heap_timer( 0 );
+        timers[i]->expire = ( now + timeout ) / 1000;
+        timers[i]->cb_func = expired;
+        timers[i]->user_data = NULL;
+        heap.add_timer( timers[i] );
+    }
+    // 惰性删除：旧节点留在堆里直到到期
+    void refresh( int i, long now )
+    {
+        heap.del_timer( timers[i] );
+        add( i, now, KEEPALIVE_MS );
+    }
+    void cancel( int i, long now )
+    {
+        refresh( i, now );
+    }
+    void tick( long now )
+    {
+        g_now_ms = now;
+        heap.tick();
+    }
+
+    std::vector< th::heap_timer* > timers;
+    th::time_heap heap;
+};
+
+struct hwheel_impl
+{
+    static const char* name() { return "hwheel"; }
+    static const char* resolution() { return "1ms"; }
+    static void expired( hw_timer* ) { ++g_fired; }
+
+    // 定时器节点嵌在连接里，这里用一个数组代替连接；数组在轮子之后析构
+    hwheel_impl( int n ) : timers( n ), wheel( 0 ) {}
+    void add( int i, long now, long timeout )
+    {
+        timers[i].cb_func = expired;
+        wheel.add_timer( &timers[i], now + timeout - clock );
+    }
+    void refresh( int i, long now )
+    {
+        wheel.add_timer( &timers[i], now + KEEPALIVE_MS - clock );
+    }
+    void cancel( int i, long now )
+    {
+        wheel.del_timer( &timers[i] );
+        add( i, now, KEEPALIVE_MS );
+    }
+    void tick( long now )
+    {
+        wheel.tick( now );
+        clock = now + 1;
+    }
+
+    std::vector< hw_timer > timers;
+    hw_wheel wheel;
+    long clock = 0;         // 轮子的当前时刻，add_timer的超时相对于它
+};
+
+struct dheap_impl
+{
+    static const char* name() { return "dheap"; }
+    static const char* resolution() { return "1ns"; }
+    static void expired( dheap_timer* ) { ++g_fired; }
+
+    dheap_impl( int n ) : timers( n ) {}
+    void add( int i, long now, long timeout )
+    {
+        timers[i] = heap.create( expired, NULL );
+        heap.set_expire( timers[i], ( now + timeout ) * 1000000ll );
+    }
+    void refresh( int i, long now )
+    {
+        heap.set_expire( timers[i], ( now + KEEPALIVE_MS ) * 1000000ll );
+    }
+    void cancel( int i, long now )
+    {
+        heap.destroy( timers[i] );
+        add( i, now, KEEPALIVE_MS );
+    }
+    void tick( long now )
+    {
+        heap.tick( now * 1000000ll );
+    }
+
+    std::vector< dheap_timer* > timers;
+    dheap heap;
+};
+
+struct result
+{
+    int n;
+    double mem, mem_after;
+    double refresh_ns, cancel_ns, expire_ns, tick_ns;
+    long refresh_ops, cancel_ops;
+};
+
+// 在time_limit秒内最多执行ops次op(i, now)，返回平均ns/op
+template< typename T, typename OP >
+static double churn( T* c, int n, long ops, double time_limit, long* done, OP op )
+{
+    double start = now_ns();
+    long i = 0;
+    for( ; i < ops; ++i )
+    {
+        if( ( i & 1023 ) == 0 && now_ns() - start > time_limit * 1e9 )
+        {
+            break;
+        }
+        op( c, ( int )rnd( n ), i / OPS_PER_MS );
+    }
+    *done = i;
+    return i > 0 ? ( now_ns() - start ) / i : 0;
+}
+
+template< typename T >
+static result run( int n, long ops, double time_limit )
+{
+    result r;
+    r.n = n;
+
+    // 内存与refresh/cancel：初始超时分布在[KEEPALIVE_MS, 2 * KEEPALIVE_MS)
+    long live = g_live_bytes;
+    T* c = new T( n );
+    for( int i = 0; i < n; ++i )
+    {
+        c->add( i, 0, KEEPALIVE_MS + rnd( KEEPALIVE_MS ) );
+    }
+    r.mem = ( double )( g_live_bytes - live ) / n;
+    r.refresh_ns = churn( c, n, ops, time_limit, &r.refresh_ops,
+                          []( T* c, int i, long now ) { c->refresh( i, now ); } );
+    r.cancel_ns = churn( c, n, ops, time_limit, &r.cancel_ops,
+                         []( T* c, int i, long now ) { c->cancel( i, now ); } );
+    r.mem_after = ( double )( g_live_bytes - live ) / n;
+    delete c;
+
+    // 集中到期：n个定时器分布在1秒窗口内，推进时间直到全部执行
+    c = new T( n );
+    for( int i = 0; i < n; ++i )
+    {
+        c->add( i, 0, 1 + rnd( EXPIRE_WINDOW_MS ) );
+    }
+    g_fired = 0;
+    double start = now_ns();
+    for( long now = 0; now <= EXPIRE_WINDOW_MS + 2000; now += 1 )
+    {
+        c->tick( now );
+    }
+    r.expire_ns = g_fired > 0 ? ( now_ns() - start ) / g_fired : 0;
+    delete c;
+
+    // 空闲tick：按各自的分辨率推进一个单位
+    c = new T( n );
+    for( int i = 0; i < n; ++i )
+    {
+        c->add( i, 0, FAR_MS + rnd( FAR_MS ) );
+    }
+    long step = strcmp( T::resolution(), "1s" ) == 0 ? 1000 : 1;
+    long ticks = 0;
+    start = now_ns();
+    for( long now = step; now < FAR_MS && now_ns() - start < time_limit * 1e9 / 4 && ticks < 100000; now += step )
+    {
+        c->tick( now );
+        ++ticks;
+    }
+    r.tick_ns = ( now_ns() - start ) / ticks;
+    delete c;
+    return r;
+}
+
+static void report( FILE* out, bool json, const char* name, const char* resolution, const result& r )
+{
+    if( json )
+    {
+        fprintf( out, "{\"name\":\"%s\",\"resolution\":\"%s\",\"timers\":%d,\"bytes_per_timer\":%.1f,"
+                 "\"bytes_per_timer_after_churn\":%.1f,\"refresh_ns\":%.1f,\"refresh_ops\":%ld,"
+                 "\"cancel_ns\":%.1f,\"cancel_ops\":%ld,\"expire_ns\":%.1f,\"tick_ns\":%.1f}\n",
+                 name, resolution, r.n, r.mem, r.mem_after, r.refresh_ns, r.refresh_ops,
+                 r.cancel_ns, r.cancel_ops, r.expire_ns, r.tick_ns );
+    }
+    else
+    {
+        fprintf( out, "%-8s %5s %8d %9.1f %9.1f %12.1f %12.1f %11.1f %11.1f\n", name, resolution, r.n,
+                 r.mem, r.mem_after, r.refresh_ns, r.cancel_ns, r.expire_ns, r.tick_ns );
+    }
+    fflush( out );
+}
+
+// 空闲连接的超时在[0, IDLE_NS)内均匀分布，到期后换成新连接，IDLE_NS后再到期
+static const int64_t IDLE_NS = 60 * 1000000000ll;
+static const int SIM_SECONDS = 60;
+static int64_t g_sim_ns = 0;
+static dheap* g_sim_heap = NULL;
+static std::vector< int64_t > g_requested;
+static double g_delay_ns = 0;
+
+static void sim_expired( dheap_timer* timer )
+{
+    long i = ( long )timer->user_data;
+    g_delay_ns += g_sim_ns - g_requested[i];
+    ++g_fired;
+    g_requested[i] = g_sim_ns + IDLE_NS;
+    g_sim_heap->set_expire( timer, g_requested[i] );
+}
+
+static void coalesce( FILE* out, bool json, int n )
+{
+    static const int64_t slacks[] = { 0, 1000000, 10000000, 100000000, 1000000000 };
+    if( ! json )
+    {
+        fprintf( out, "%-8s %8s %12s %12s %14s %14s\n", "slack ms", "timers", "wakeups/s", "timers/wake",
+                 "avg delay us", "heap us/sec" );
+    }
+    for( size_t k = 0; k < sizeof( slacks ) / sizeof( slacks[0] ); ++k )
+    {
+        dheap heap;
+        g_sim_heap = &heap;
+        g_requested.assign( n, 0 );
+        for( int i = 0; i < n; ++i )
+        {
+            dheap_timer* timer = heap.create( sim_expired, ( void* )( long )i, slacks[k] );
+            g_requested[i] = rnd( IDLE_NS );
+            heap.set_expire( timer, g_requested[i] );
+        }
+        g_fired = 0;
+        g_delay_ns = 0;
+        long wakeups = 0;
+        double start = now_ns();
+        // 每次唤醒时间直接跳到堆顶，相当于timerfd总是设置为最早的到期时刻
+        while( heap.top()->expire <= SIM_SECONDS * 1000000000ll )
+        {
+            g_sim_ns = heap.top()->expire;
+            heap.tick( g_sim_ns );
+            ++wakeups;
+        }
+        double cpu_us = ( now_ns() - start ) / 1000 / SIM_SECONDS;
+        double per_sec = ( double )wakeups / SIM_SECONDS;
+        double per_wake = wakeups > 0 ? ( double )g_fired / wakeups : 0;
+        double delay_us = g_fired > 0 ? g_delay_ns / g_fired / 1000 : 0;
+        if( json )
+        {
+            fprintf( out, "{\"name\":\"coalesce\",\"slack_ms\":%g,\"timers\":%d,\"wakeups_per_sec\":%.1f,"
+                     "\"timers_per_wakeup\":%.1f,\"avg_delay_us\":%.1f,\"heap_us_per_sec\":%.1f}\n",
+                     slacks[k] / 1e6, n, per_sec, per_wake, delay_us, cpu_us );
+        }
+        else
+        {
+            fprintf( out, "%-8g %8d %12.1f %12.1f %14.1f %14.1f\n", slacks[k] / 1e6, n, per_sec, per_wake,
+                     delay_us, cpu_us );
+        }
+        fflush( out );
+    }
+}
+
+static bool g_header = false;
+
+template< typename T >
+static void bench( FILE* out, bool json, const char* filter, int n, long ops, double time_limit )
+{
+    if( filter && ! strstr( T::name(), filter ) )
+    {
+        return;
+    }
+    if( ! json && ! g_header )
+    {
+        fprintf( out, "%-8s %5s %8s %9s %9s %12s %12s %11s %11s\n", "timer", "res", "timers", "B/timer",
+                 "B/churned", "refresh ns", "cancel ns", "expire ns", "tick ns" );
+        g_header = true;
+    }
+    report( out, json, T::name(), T::resolution(), run< T >( n, ops, time_limit ) );
+}
+
+int main( int argc, char* argv[] )
+{
+    int n = 100000;
+    long ops = 1000000;
+    int list_max = 20000;
+    double time_limit = 2;
+    const char* filter = NULL;
+    bool json = false;
+    int opt;
+    while( ( opt = getopt( argc, argv, "n:o:L:t:f:j" ) ) != -1 )
+    {
+        switch( opt )
+        {
+            case 'n': n = atoi( optarg ); break;
+            case 'o': ops = atol( optarg ); break;
+            case 'L': list_max = atoi( optarg ); break;
+            case 't': time_limit = atof( optarg ); break;
+            case 'f': filter = optarg; break;
+            case 'j': json = true; break;
+            default:
+                fprintf( stderr, "usage: %s [-n timers] [-o ops] [-L list_max] [-t seconds] [-f filter] [-j]\n", argv[0] );
+                return 1;
+        }
+    }
+    if( n <= 0 )
+    {
+        return 1;
+    }
+
+    // 被测代码里的printf不计入输出
+    fflush( stdout );
+    FILE* out = fdopen( dup( 1 ), "w" );
+    if( ! out || ! freopen( "/dev/null", "w", stdout ) )
+    {
+        return 1;
+    }
+    bench< list_impl >( out, json, filter, n < list_max ? n : list_max, ops, time_limit );
+    bench< wheel_impl >( out, json, filter, n, ops, time_limit );
+    bench< heap_impl >( out, json, filter, n, ops, time_limit );
+    bench< hwheel_impl >( out, json, filter, n, ops, time_limit );
+    bench< dheap_impl >( out, json, filter, n, ops, time_limit );
+    if( ! filter || strstr( "coalesce", filter ) )
+    {
+        coalesce( out, json, n );
+    }
+    return 0;
+}
@@ -0,0 +1,279 @@
+#include <string.h>
+#include "balancer.h"
+
+balancer::balancer( const vector< int >& weights )
+{
+    for( size_t i = 0; i < weights.size(); ++i )
+    {
+        backend_state state;
+        state.weight = weights[i] > 0 ? weights[i] : 1;
+        state.outstanding = 0;
+        state.latency = 0;
+        state.available = true;
+        m_backends.push_back( state );
+    }
+}
+
+int balancer::pick( uint32_t client_ip )
+{
+    if( m_backends.empty() )
+    {
+        return -1;
+    }
+    int idx = select( client_ip, false );
+    if( idx < 0 )
+    {
+        idx = select( client_ip, true );
+    }
+    ++m_backends[ idx ].outstanding;
+    return idx;
+}
+
+// 32位整数的混合函数（murmur3的finalizer）
+static uint32_t mix( uint32_t h )
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+// 连接数相同时从上次选中的下一个开始，避免总是落到下标最小的后端
+class least_conn_balancer : public balancer
+{
+public:
+    explicit least_conn_balancer( const vector< int >& weights ) : balancer( weights ), m_next( 0 ) {}
+    const char* name() const { return "least_conn"; }
+
+protected:
+    int select( uint32_t client_ip, bool all )
+    {
+        int n = size();
+        int idx = -1;
+        for( int k = 0; k < n; ++k )
+        {
+            int i = ( m_next + k ) % n;
+            if( eligible( i, all ) && ( idx == -1 || m_backends[i].outstanding < m_backends[ idx ].outstanding ) )
+            {
+                idx = i;
+            }
+        }
+        if( idx != -1 )
+        {
+            m_next = idx + 1;
+        }
+        return idx;
+    }
+
+private:
+    int m_next;
+};
+
+// 平滑加权轮询：每次每个后端的current加上自己的权重，选current最大的，再减去总权重。
+// 权重5:1:1时顺序是a a b a c a a，不会连续把一串请求都给权重大的
+class wrr_balancer : public balancer
+{
+public:
+    explicit wrr_balancer( const vector< int >& weights ) : balancer( weights ), m_current( weights.size(), 0 ) {}
+    const char* name() const { return "wrr"; }
+    void changed()
+    {
+        m_current.assign( m_current.size(), 0 );
+    }
+
+protected:
+    int select( uint32_t client_ip, bool all )
+    {
+        int idx = -1;
+        int total = 0;
+        for( int i = 0; i < size(); ++i )
+        {
+            if( ! eligible( i, all ) )
+            {
+                continue;
+            }
+            m_current[i] += m_backends[i].weight;
+            total += m_backends[i].weight;
+            if( idx == -1 || m_current[i] > m_current[ idx ] )
+            {
+                idx = i;
+            }
+        }
+        if( idx != -1 )
+        {
+            m_current[ idx ] -= total;
+        }
+        return idx;
+    }
+
+private:
+    vector< int > m_current;
+};
+
+// 两个随机选择：只比较两个后端就避开了慢的和忙的，又不会像全局取最小那样让所有连接同时涌向同一个后端。
+// 开销是延迟EWMA乘以(outstanding + 1)，即大致的排队时间；还没有延迟样本的后端开销最小，先去试探
+class p2c_balancer : public balancer
+{
+public:
+    explicit p2c_balancer( const vector< int >& weights ) : balancer( weights ), m_rng( 0x9e3779b97f4a7c15ull ) {}
+    const char* name() const { return "p2c"; }
+
+protected:
+    int select( uint32_t client_ip, bool all )
+    {
+        m_candidates.clear();
+        for( int i = 0; i < size(); ++i )
+        {
+            if( eligible( i, all ) )
+            {
+                m_candidates.push_back( i );
+            }
+        }
+        int n = m_candidates.size();
+        if( n == 0 )
+        {
+            return -1;
+        }
+        if( n == 1 )
+        {
+            return m_candidates[0];
+        }
+        // 不重复地取两个
+        int i = random() % n;
+        int j = random() % ( n - 1 );
+        if( j >= i )
+        {
+            ++j;
+        }
+        int a = m_candidates[i];
+        int b = m_candidates[j];
+        return cost( a ) <= cost( b ) ? a : b;
+    }
+
+private:
+    double cost( int i ) const
+    {
+        return ( double )( m_backends[i].latency + 1 ) * ( m_backends[i].outstanding + 1 );
+    }
+    // xorshift64*
+    uint64_t random()
+    {
+        m_rng ^= m_rng >> 12;
+        m_rng ^= m_rng << 25;
+        m_rng ^= m_rng >> 27;
+        return m_rng * 2685821657736338717ull;
+    }
+
+private:
+    uint64_t m_rng;
+    vector< int > m_candidates;
+};
+
+// Maglev一致性哈希（Eisenbud et al., NSDI 2016）：每个后端按自己的(offset, skip)生成一个表项排列，
+// 各后端轮流认领自己排列中下一个空闲的表项直到填满，权重为w的后端每轮认领w个。
+// 查找是一次取模；一个后端被摘除后重建，大部分表项仍归原来的后端，只有它的客户被分散到其他后端
+class maglev_balancer : public balancer
+{
+public:
+    explicit maglev_balancer( const vector< int >& weights ) : balancer( weights )
+    {
+        // 表长取不小于后端数100倍的质数，各后端分到的表项数量误差在1%左右
+        static const int primes[] = { 251, 1021, 4093, 16381, 65521 };
+        int count = sizeof( primes ) / sizeof( primes[0] );
+        m_size = primes[ count - 1 ];
+        for( int i = 0; i < count; ++i )
+        {
+            if( primes[i] >= 100 * size() )
+            {
+                m_size = primes[i];
+                break;
+            }
+        }
+        m_table.resize( m_size );
+        changed();
+    }
+    const char* name() const { return "maglev"; }
+
+    void changed()
+    {
+        int n = size();
+        vector< int > offset( n ), skip( n ), next( n, 0 );
+        bool any = false;
+        for( int i = 0; i < n; ++i )
+        {
+            // 后端的名字就是它的下标，配置中的顺序不变，各次重建得到的排列就相同
+            offset[i] = mix( 2 * i + 1 ) % m_size;
+            skip[i] = mix( 2 * i + 2 ) % ( m_size - 1 ) + 1;
+            any = any || m_backends[i].available;
+        }
+        m_table.assign( m_size, -1 );
+        if( ! any )
+        {
+            return;
+        }
+        int filled = 0;
+        while( true )
+        {
+            for( int i = 0; i < n; ++i )
+            {
+                if( ! m_backends[i].available )
+                {
+                    continue;
+                }
+                for( int w = 0; w < m_backends[i].weight; ++w )
+                {
+                    int c = ( offset[i] + ( int64_t )next[i] * skip[i] ) % m_size;
+                    while( m_table[c] >= 0 )
+                    {
+                        ++next[i];
+                        c = ( offset[i] + ( int64_t )next[i] * skip[i] ) % m_size;
+                    }
+                    m_table[c] = i;
+                    ++next[i];
+                    if( ++filled == m_size )
+                    {
+                        return;
+                    }
+                }
+            }
+        }
+    }
+
+protected:
+    int select( uint32_t client_ip, bool all )
+    {
+        uint32_t h = mix( client_ip );
+        if( all )
+        {
+            return h % size();
+        }
+        return m_table[ h % m_size ];
+    }
+
+private:
+    int m_size;
+    vector< int > m_table;
+};
+
+balancer* balancer::create( const char* name, const vector< int >& weights )
+{
+    if( strcmp( name, "least_conn" ) == 0 )
+    {
+        return new least_conn_balancer( weights );
+    }
+    else if( strcmp( name, "wrr" ) == 0 )
+    {
+        return new wrr_balancer( weights );
+    }
+    else if( strcmp( name, "p2c" ) == 0 )
+    {
+        return new p2c_balancer( weights );
+    }
+    else if( strcmp( name, "maglev" ) == 0 )
+    {
+        return new maglev_balancer( weights );
+    }
+    return NULL;
+}
@@ -0,0 +1,49 @@
+#ifndef BALANCER_H
+#define BALANCER_H
+
+#include <stdint.h>
+#include <vector>
+
+using std::vector;
+
+// 父进程眼中的一个后端（即一个子进程）。outstanding在分配连接时加1，之后由子进程的报告校正
+struct backend_state
+{
+    int weight;
+    int outstanding;        // 正在服务的客户连接数
+    int64_t latency;        // 响应延迟的EWMA，纳秒，0表示还没有样本
+    bool available;         // 后端没有被摘除，子进程也还在
+};
+
+// 负载均衡策略，为新的客户连接选择后端。配置文件中用"Balance 名字"选择：
+//   least_conn  正在服务的连接最少，相同时轮流（默认）
+//   wrr         平滑加权轮询（nginx的算法），权重来自<weight>
+//   p2c         随机取两个后端，选 延迟EWMA * (outstanding + 1) 较小的
+//   maglev      按客户IP一致性哈希（Maglev查找表，按权重分配表项），同一客户总到同一后端，
+//               后端摘除或恢复时只有少量客户被迁移
+class balancer
+{
+public:
+    // 不认识的名字返回NULL
+    static balancer* create( const char* name, const vector< int >& weights );
+    virtual ~balancer() {}
+    virtual const char* name() const = 0;
+
+    int size() const { return m_backends.size(); }
+    backend_state& backend( int idx ) { return m_backends[ idx ]; }
+    // 修改了某个后端的available后调用
+    virtual void changed() {}
+    // 返回选中的后端下标并把它的outstanding加1。只在可用的后端中选，都不可用时在全部后端中选，总比直接拒绝客户好
+    int pick( uint32_t client_ip );
+
+protected:
+    explicit balancer( const vector< int >& weights );
+    // all为false时只考虑available的后端，没有可选的返回-1
+    virtual int select( uint32_t client_ip, bool all ) = 0;
+    bool eligible( int idx, bool all ) const { return all || m_backends[ idx ].available; }
+
+protected:
+    vector< backend_state > m_backends;
+};
+
+#endif
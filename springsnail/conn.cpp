@@ -46,6 +46,7 @@ void conn::reset()
     m_srv_read_idx = 0;
     m_srv_write_idx = 0;
     m_srv_closed = false;
+    m_sent_at = 0;
     m_cltfd = -1;
     memset( m_clt_buf, '\0', BUF_SIZE );
     memset( m_srv_buf, '\0', BUF_SIZE );
@@ -3,6 +3,7 @@
 
 #include <arpa/inet.h>
 #include "fdwrapper.h"
+#include "event_loop.h"
 
 class conn
 {
@@ -33,6 +34,11 @@ public:
     int m_srvfd;
 
     bool m_srv_closed;
+    int64_t m_sent_at;      // 请求发给服务器的时刻（纳秒），收到响应后清0
+
+    // 两端fd注册到事件循环用，user_data指向mgr
+    event_handler m_clt_handler;
+    event_handler m_srv_handler;
 };
 
 #endif
@@ -4,6 +4,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <string.h>
 
 int setnonblocking( int fd )
 {
@@ -50,4 +52,67 @@ void modfd( int epollfd, int fd, int ev )
     epoll_ctl( epollfd, EPOLL_CTL_MOD, fd, &event );
 }
 
+// 在UNIX域socket上传递文件描述符（13-5passfd.cpp），附带1字节数据
+bool send_fd( int fd, int fd_to_send )
+{
+    char data = 0;
+    struct iovec iov;
+    iov.iov_base = &data;
+    iov.iov_len = 1;
+    union
+    {
+        cmsghdr cm;
+        char space[ CMSG_SPACE( sizeof( int ) ) ];
+    } control;
+    memset( &control, 0, sizeof( control ) );
+
+    struct msghdr msg;
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof( control.space );
+
+    cmsghdr* cm = CMSG_FIRSTHDR( &msg );
+    cm->cmsg_len = CMSG_LEN( sizeof( int ) );
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    memcpy( CMSG_DATA( cm ), &fd_to_send, sizeof( int ) );
+    return sendmsg( fd, &msg, 0 ) == 1;
+}
+
+// 没有可读的消息或消息中没有描述符时返回-1
+int recv_fd( int fd )
+{
+    char data;
+    struct iovec iov;
+    iov.iov_base = &data;
+    iov.iov_len = 1;
+    union
+    {
+        cmsghdr cm;
+        char space[ CMSG_SPACE( sizeof( int ) ) ];
+    } control;
+
+    struct msghdr msg;
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof( control.space );
+
+    if( recvmsg( fd, &msg, 0 ) <= 0 )
+    {
+        return -1;
+    }
+    cmsghdr* cm = CMSG_FIRSTHDR( &msg );
+    if( !cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS )
+    {
+        return -1;
+    }
+    int fd_to_read;
+    memcpy( &fd_to_read, CMSG_DATA( cm ), sizeof( int ) );
+    return fd_to_read;
+}
+
 #endif
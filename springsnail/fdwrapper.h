@@ -9,5 +9,7 @@ void add_write_fd( int epollfd, int fd );
 void removefd( int epollfd, int fd );
 void closefd( int epollfd, int fd );
 void modfd( int epollfd, int fd, int ev );
+bool send_fd( int fd, int fd_to_send );
+int recv_fd( int fd );
 
 #endif
@@ -0,0 +1,283 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+#include "mgr.h"
+#include "health.h"
+
+// 以下时间单位都是纳秒
+static const int64_t PROBE_INTERVAL = 2000000000ll;
+static const int64_t PROBE_TIMEOUT = 1000000000ll;
+// 第n次摘除持续EJECT_BASE * 2^(n-1)，最多EJECT_MAX
+static const int64_t EJECT_BASE = 5000000000ll;
+static const int64_t EJECT_MAX = 60000000000ll;
+// 连续这么多次被动失败就摘除；主动探测失败一次就摘除，流量在一个探测周期内转走
+static const int FAILURE_THRESHOLD = 5;
+// HALF_OPEN时连续成功这么多次恢复
+static const int RECOVER_THRESHOLD = 2;
+
+health::health( event_loop* loop, const host& srv, const sockaddr_in& address )
+    : m_loop( loop ), m_address( address ), m_state( HEALTHY ), m_failures( 0 ), m_successes( 0 ), m_ejections( 0 ),
+      m_latency( 0 ), m_max_latency( srv.m_max_latency * 1000000ll ), m_callback( NULL ), m_callback_arg( NULL ),
+      m_probe_sent( false ), m_response_idx( 0 )
+{
+    m_request[0] = '\0';
+    if( srv.m_check_uri[0] != '\0' )
+    {
+        snprintf( m_request, sizeof( m_request ), "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n",
+                  srv.m_check_uri, srv.m_hostname );
+    }
+    m_probe.fd = -1;
+    m_probe.handle_event = on_probe_event;
+    m_probe.user_data = this;
+    m_probe_timer = m_loop->create_timer( on_probe_timer, this );
+    m_timeout_timer = m_loop->create_timer( on_probe_timeout, this );
+    m_eject_timer = m_loop->create_timer( on_eject_timeout, this );
+    // 启动后马上探测一次
+    m_loop->add_timer( m_probe_timer, 0 );
+}
+
+health::~health()
+{
+    if( m_probe.fd >= 0 )
+    {
+        m_loop->remove( &m_probe );
+        close( m_probe.fd );
+    }
+    m_loop->destroy_timer( m_probe_timer );
+    m_loop->destroy_timer( m_timeout_timer );
+    m_loop->destroy_timer( m_eject_timer );
+}
+
+void health::set_state_callback( void ( *callback )( void* arg ), void* arg )
+{
+    m_callback = callback;
+    m_callback_arg = arg;
+}
+
+void health::record_success( int64_t latency )
+{
+    m_latency = m_latency == 0 ? latency : m_latency + ( latency - m_latency ) / 8;
+    if( m_state == EJECTED )
+    {
+        return;
+    }
+    if( m_max_latency > 0 && m_latency > m_max_latency )
+    {
+        eject( "latency outlier" );
+        return;
+    }
+    m_failures = 0;
+    if( m_state == HALF_OPEN && ++m_successes >= RECOVER_THRESHOLD )
+    {
+        set_state( HEALTHY );
+    }
+}
+
+void health::record_failure()
+{
+    if( m_state == HALF_OPEN || ( m_state == HEALTHY && ++m_failures >= FAILURE_THRESHOLD ) )
+    {
+        eject( "consecutive failures" );
+    }
+}
+
+void health::eject( const char* reason )
+{
+    int shift = m_ejections < 16 ? m_ejections : 16;
+    int64_t duration = EJECT_BASE << shift;
+    if( duration > EJECT_MAX )
+    {
+        duration = EJECT_MAX;
+    }
+    ++m_ejections;
+    log( LOG_INFO, __FILE__, __LINE__, "eject server (%s) for %lld ms: %s", inet_ntoa( m_address.sin_addr ),
+         ( long long )( duration / 1000000 ), reason );
+    // 摘除期间不探测，到期进入HALF_OPEN后立即探测
+    m_loop->del_timer( m_probe_timer );
+    m_loop->add_timer( m_eject_timer, duration );
+    set_state( EJECTED );
+}
+
+void health::set_state( HEALTH_STATE state )
+{
+    if( state == m_state )
+    {
+        return;
+    }
+    m_state = state;
+    m_failures = 0;
+    m_successes = 0;
+    if( state == HEALTHY )
+    {
+        // 恢复后重新统计延迟，不受摘除前的慢响应影响
+        m_latency = 0;
+    }
+    if( m_callback )
+    {
+        m_callback( m_callback_arg );
+    }
+}
+
+void health::on_eject_timeout( dheap_timer* timer )
+{
+    health* self = static_cast< health* >( timer->user_data );
+    log( LOG_INFO, __FILE__, __LINE__, "server (%s) half open", inet_ntoa( self->m_address.sin_addr ) );
+    self->set_state( HALF_OPEN );
+    self->m_loop->add_timer( self->m_probe_timer, 0 );
+}
+
+void health::on_probe_timer( dheap_timer* timer )
+{
+    health* self = static_cast< health* >( timer->user_data );
+    self->m_loop->add_timer( timer, PROBE_INTERVAL );
+    if( self->m_probe.fd < 0 )
+    {
+        self->start_probe();
+    }
+}
+
+void health::on_probe_timeout( dheap_timer* timer )
+{
+    health* self = static_cast< health* >( timer->user_data );
+    log( LOG_ERR, __FILE__, __LINE__, "%s", "health probe timeout" );
+    self->finish_probe( false );
+}
+
+void health::start_probe()
+{
+    int sockfd = socket( PF_INET, SOCK_STREAM, 0 );
+    if( sockfd < 0 )
+    {
+        // 本地资源不足，不算后端的错
+        log( LOG_ERR, __FILE__, __LINE__, "create probe socket failed: %s", strerror( errno ) );
+        return;
+    }
+    setnonblocking( sockfd );
+    if( connect( sockfd, ( struct sockaddr* )&m_address, sizeof( m_address ) ) < 0 && errno != EINPROGRESS )
+    {
+        log( LOG_ERR, __FILE__, __LINE__, "health probe connect failed: %s", strerror( errno ) );
+        close( sockfd );
+        finish_probe( false );
+        return;
+    }
+    m_probe.fd = sockfd;
+    m_probe_sent = false;
+    m_response_idx = 0;
+    m_loop->add( &m_probe, EPOLLOUT | EPOLLET );
+    m_loop->add_timer( m_timeout_timer, PROBE_TIMEOUT );
+}
+
+void health::on_probe_event( event_handler* handler, uint32_t events )
+{
+    health* self = static_cast< health* >( handler->user_data );
+    if( self->m_probe_sent )
+    {
+        self->read_probe();
+        return;
+    }
+
+    int error = 0;
+    socklen_t length = sizeof( error );
+    if( getsockopt( handler->fd, SOL_SOCKET, SO_ERROR, &error, &length ) < 0 )
+    {
+        error = errno;
+    }
+    if( error != 0 )
+    {
+        log( LOG_ERR, __FILE__, __LINE__, "health probe connect failed: %s", strerror( error ) );
+        self->finish_probe( false );
+        return;
+    }
+    if( self->m_request[0] == '\0' )
+    {
+        self->finish_probe( true );
+        return;
+    }
+    // 请求很短，一次发不完也当作失败
+    int len = strlen( self->m_request );
+    if( send( handler->fd, self->m_request, len, 0 ) != len )
+    {
+        self->finish_probe( false );
+        return;
+    }
+    self->m_probe_sent = true;
+    self->m_loop->modify( handler, EPOLLIN | EPOLLET );
+}
+
+// 只看状态行"HTTP/1.x NNN"
+void health::read_probe()
+{
+    bool eof = false;
+    while( m_response_idx < RESPONSE_SIZE - 1 )
+    {
+        int ret = recv( m_probe.fd, m_response + m_response_idx, RESPONSE_SIZE - 1 - m_response_idx, 0 );
+        if( ret < 0 )
+        {
+            if( errno != EAGAIN && errno != EWOULDBLOCK )
+            {
+                eof = true;
+            }
+            break;
+        }
+        else if( ret == 0 )
+        {
+            eof = true;
+            break;
+        }
+        m_response_idx += ret;
+    }
+    m_response[ m_response_idx ] = '\0';
+
+    if( m_response_idx >= 12 )
+    {
+        int status = strncmp( m_response, "HTTP/1.", 7 ) == 0 ? atoi( m_response + 9 ) : 0;
+        if( status < 200 || status >= 400 )
+        {
+            log( LOG_ERR, __FILE__, __LINE__, "health probe got bad response: %.12s", m_response );
+        }
+        finish_probe( status >= 200 && status < 400 );
+    }
+    else if( eof )
+    {
+        log( LOG_ERR, __FILE__, __LINE__, "%s", "health probe closed without response" );
+        finish_probe( false );
+    }
+}
+
+void health::finish_probe( bool ok )
+{
+    if( m_probe.fd >= 0 )
+    {
+        m_loop->remove( &m_probe );
+        close( m_probe.fd );
+        m_probe.fd = -1;
+    }
+    m_loop->del_timer( m_timeout_timer );
+
+    if( m_state == EJECTED )
+    {
+        return;
+    }
+    if( ! ok )
+    {
+        eject( "health probe failed" );
+        return;
+    }
+    if( m_state == HALF_OPEN )
+    {
+        if( ++m_successes >= RECOVER_THRESHOLD )
+        {
+            log( LOG_INFO, __FILE__, __LINE__, "server (%s) recovered", inet_ntoa( m_address.sin_addr ) );
+            set_state( HEALTHY );
+        }
+    }
+    else if( m_ejections > 0 )
+    {
+        --m_ejections;
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <stdint.h>
+#include <arpa/inet.h>
+#include "event_loop.h"
+
+class host;
+
+// 熔断器的三个状态：HEALTHY正常接收流量；EJECTED被摘除，父进程不再把连接分给它；
+// HALF_OPEN摘除到期，连续探测成功后恢复，再失败就重新摘除且摘除时间加倍
+enum HEALTH_STATE { HEALTHY = 0, EJECTED, HALF_OPEN };
+
+// 一个后端的健康检查。主动检查：定期connect一次，配置了<health_check>时再发一个HTTP GET，
+// 2xx/3xx算成功；被动检查：mgr报告每次转发的结果和首字节延迟，连续失败或平均延迟超过<max_latency>时摘除
+class health
+{
+public:
+    health( event_loop* loop, const host& srv, const sockaddr_in& address );
+    ~health();
+    HEALTH_STATE state() const { return m_state; }
+    // 响应延迟的EWMA，纳秒
+    int64_t latency() const { return m_latency; }
+    // 状态变化后调用
+    void set_state_callback( void ( *callback )( void* arg ), void* arg );
+    void record_success( int64_t latency );
+    void record_failure();
+
+private:
+    static void on_probe_timer( dheap_timer* timer );
+    static void on_probe_timeout( dheap_timer* timer );
+    static void on_eject_timeout( dheap_timer* timer );
+    static void on_probe_event( event_handler* handler, uint32_t events );
+    void start_probe();
+    void read_probe();
+    void finish_probe( bool ok );
+    void eject( const char* reason );
+    void set_state( HEALTH_STATE state );
+
+private:
+    static const int RESPONSE_SIZE = 64;
+
+    event_loop* m_loop;
+    sockaddr_in m_address;
+    HEALTH_STATE m_state;
+    int m_failures;             // HEALTHY时连续的被动失败次数
+    int m_successes;            // HALF_OPEN时连续的成功次数
+    int m_ejections;            // 决定下次摘除多久，健康时每次探测成功减1
+    int64_t m_latency;
+    int64_t m_max_latency;      // 纳秒，0表示不按延迟摘除
+    void ( *m_callback )( void* arg );
+    void* m_callback_arg;
+
+    // 进行中的探测，fd为-1表示没有
+    event_handler m_probe;
+    bool m_probe_sent;
+    char m_request[ 1400 ];     // 为空时只做TCP探测
+    char m_response[ RESPONSE_SIZE ];
+    int m_response_idx;
+    dheap_timer* m_probe_timer;
+    dheap_timer* m_timeout_timer;
+    dheap_timer* m_eject_timer;
+};
+
+#endif
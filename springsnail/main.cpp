@@ -99,6 +99,11 @@ int main( int argc, char* argv[] )
     char* tmp_hostname;
     char* tmp_port;
     char* tmp_conncnt;
+    char* tmp_min_idle;
+    char* tmp_check_uri;
+    char* tmp_max_latency;
+    char* tmp_weight;
+    char balance_name[64] = "least_conn";
     bool opentag = false;
     char* tmp = buf;
     char* tmp2 = NULL;
@@ -115,6 +120,10 @@ int main( int argc, char* argv[] )
                 return 1;
             }
             opentag = true;
+            tmp_host.m_min_idle = -1;
+            tmp_host.m_check_uri[0] = '\0';
+            tmp_host.m_max_latency = 0;
+            tmp_host.m_weight = 1;
         }
         else if( strstr( tmp, "</logical_host>" ) )
         {
@@ -163,6 +172,62 @@ int main( int argc, char* argv[] )
             *tmp4 = '\0';
             tmp_host.m_conncnt = atoi( tmp_conncnt );
         }
+        else if( tmp3 = strstr( tmp, "<min_idle>" ) )
+        {
+            tmp_min_idle = tmp3 + 10;
+            tmp4 = strstr( tmp_min_idle, "</min_idle>" );
+            if( !tmp4 )
+            {
+                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
+                return 1;
+            }
+            *tmp4 = '\0';
+            tmp_host.m_min_idle = atoi( tmp_min_idle );
+        }
+        else if( tmp3 = strstr( tmp, "<health_check>" ) )
+        {
+            tmp_check_uri = tmp3 + 14;
+            tmp4 = strstr( tmp_check_uri, "</health_check>" );
+            if( !tmp4 || tmp4 - tmp_check_uri >= 256 )
+            {
+                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
+                return 1;
+            }
+            *tmp4 = '\0';
+            memcpy( tmp_host.m_check_uri, tmp_check_uri, tmp4 - tmp_check_uri + 1 );
+        }
+        else if( tmp3 = strstr( tmp, "<max_latency>" ) )
+        {
+            tmp_max_latency = tmp3 + 13;
+            tmp4 = strstr( tmp_max_latency, "</max_latency>" );
+            if( !tmp4 )
+            {
+                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
+                return 1;
+            }
+            *tmp4 = '\0';
+            tmp_host.m_max_latency = atoi( tmp_max_latency );
+        }
+        else if( tmp3 = strstr( tmp, "<weight>" ) )
+        {
+            tmp_weight = tmp3 + 8;
+            tmp4 = strstr( tmp_weight, "</weight>" );
+            if( !tmp4 )
+            {
+                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
+                return 1;
+            }
+            *tmp4 = '\0';
+            tmp_host.m_weight = atoi( tmp_weight );
+        }
+        else if( tmp3 = strstr( tmp, "Balance" ) )
+        {
+            if( sscanf( tmp3 + 7, "%63s", balance_name ) != 1 )
+            {
+                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
+                return 1;
+            }
+        }
         else if( tmp3 = strstr( tmp, "Listen" ) )
         {
             tmp_hostname = tmp3 + 6;
@@ -186,6 +251,19 @@ int main( int argc, char* argv[] )
         log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
         return 1;
     }
+    vector< int > weights;
+    for( size_t i = 0; i < logical_srv.size(); ++i )
+    {
+        weights.push_back( logical_srv[i].m_weight );
+    }
+    balancer* lb = balancer::create( balance_name, weights );
+    if( !lb )
+    {
+        log( LOG_ERR, __FILE__, __LINE__, "unknown balance policy: %s", balance_name );
+        return 1;
+    }
+    log( LOG_INFO, __FILE__, __LINE__, "balance policy: %s", lb->name() );
+
     const char* ip = balance_srv[0].m_hostname;
     int port = balance_srv[0].m_port;
 
@@ -212,9 +290,10 @@ int main( int argc, char* argv[] )
     processpool< conn, host, mgr >* pool = processpool< conn, host, mgr >::create( listenfd, logical_srv.size() );
     if( pool )
     {
-        pool->run( logical_srv );
+        pool->run( logical_srv, lb );
         delete pool;
     }
+    delete lb;
 
     close( listenfd );
     return 0;
@@ -20,68 +20,257 @@
 
 using std::pair;
 
-int mgr::m_epollfd = -1;
-int mgr::conn2srv( const sockaddr_in& address )
+// 单次connect的超时，单位纳秒
+static const int64_t CONNECT_TIMEOUT = 3000000000ll;
+// 连接失败后的重试间隔从RETRY_BASE开始每轮翻倍，最多RETRY_MAX；实际等待在[d/2, d)内随机，
+// 各子进程不会同时冲向刚恢复的服务器
+static const int64_t RETRY_BASE = 100000000ll;
+static const int64_t RETRY_MAX = 30000000000ll;
+
+mgr::mgr( event_loop* loop, const host& srv )
+    : m_loop( loop ), m_notify_callback( NULL ), m_notify_arg( NULL ), m_failures( 0 ), m_logic_srv( srv )
 {
-    int sockfd = socket( PF_INET, SOCK_STREAM, 0 );
-    if( sockfd < 0 )
+    bzero( &m_srv_address, sizeof( m_srv_address ) );
+    m_srv_address.sin_family = AF_INET;
+    inet_pton( AF_INET, srv.m_hostname, &m_srv_address.sin_addr );
+    m_srv_address.sin_port = htons( srv.m_port );
+    log( LOG_INFO, __FILE__, __LINE__, "logcial srv host info: (%s, %d)", srv.m_hostname, srv.m_port );
+
+    m_min_idle = srv.m_min_idle >= 0 ? srv.m_min_idle : srv.m_conncnt;
+    m_seed = getpid() ^ ( unsigned int )dheap::now_ns();
+    m_retry_timer = m_loop->create_timer( on_retry, this );
+    m_health = new health( m_loop, srv, m_srv_address );
+
+    // 所有连接同时发起，在事件循环中完成，子进程不用等它们建立就能开始服务
+    replenish();
+}
+
+mgr::~mgr()
+{
+    while( ! m_connecting.empty() )
     {
-        return -1;
+        finish_connect( *m_connecting.begin(), false );
     }
-
-    if ( connect( sockfd, ( struct sockaddr* )&address, sizeof( address ) ) != 0  )
+    m_loop->destroy_timer( m_retry_timer );
+    delete m_health;
+    for( size_t i = 0; i < m_freed.size(); ++i )
     {
-        close( sockfd );
-        return -1;
+        delete m_freed[i];
     }
-    return sockfd;
 }
 
-mgr::mgr( int epollfd, const host& srv ) : m_logic_srv( srv )
+conn* mgr::alloc_conn()
 {
-    m_epollfd = epollfd;
-    int ret = 0;
-    struct sockaddr_in address;
-    bzero( &address, sizeof( address ) );
-    address.sin_family = AF_INET;
-    inet_pton( AF_INET, srv.m_hostname, &address.sin_addr );
-    address.sin_port = htons( srv.m_port );
-    log( LOG_INFO, __FILE__, __LINE__, "logcial srv host info: (%s, %d)", srv.m_hostname, srv.m_port );
+    if( ! m_freed.empty() )
+    {
+        conn* tmp = m_freed.back();
+        m_freed.pop_back();
+        return tmp;
+    }
+    try
+    {
+        return new conn;
+    }
+    catch( ... )
+    {
+        return NULL;
+    }
+}
 
-    for( int i = 0; i < srv.m_conncnt; ++i )
+// 空闲和正在建立的连接加起来不到m_min_idle时发起新的连接；退避期间什么也不做，由m_retry_timer再调用
+void mgr::replenish()
+{
+    if( m_retry_timer->pending() )
     {
-        sleep( 1 );
-        int sockfd = conn2srv( address );
-        if( sockfd < 0 )
+        return;
+    }
+    int deficit = m_min_idle - ( int )m_conns.size() - ( int )m_connecting.size();
+    for( int i = 0; i < deficit; ++i )
+    {
+        conn* tmp = alloc_conn();
+        if( !tmp )
         {
-            log( LOG_ERR, __FILE__, __LINE__, "build connection %d failed", i );
+            break;
         }
-        else
+        connect_async( tmp );
+        if( m_retry_timer->pending() )
         {
-            log( LOG_INFO, __FILE__, __LINE__, "build connection %d to server success", i );
-            conn* tmp = NULL;
-            try
-            {
-                tmp = new conn;
-            }
-            catch( ... )
-            {
-                close( sockfd );
-                continue;
-            }
-            tmp->init_srv( sockfd, address );
-            m_conns.insert( pair< int, conn* >( sockfd, tmp ) );
+            break;
         }
     }
 }
 
-mgr::~mgr()
+void mgr::on_retry( dheap_timer* timer )
 {
+    static_cast< mgr* >( timer->user_data )->replenish();
 }
 
+void mgr::connect_async( conn* connection )
+{
+    int sockfd = socket( PF_INET, SOCK_STREAM, 0 );
+    if( sockfd < 0 )
+    {
+        log( LOG_ERR, __FILE__, __LINE__, "create socket failed: %s", strerror( errno ) );
+        connect_failed( connection );
+        return;
+    }
+    setnonblocking( sockfd );
+    if( connect( sockfd, ( struct sockaddr* )&m_srv_address, sizeof( m_srv_address ) ) == 0 )
+    {
+        connected( connection, sockfd );
+        return;
+    }
+    if( errno != EINPROGRESS )
+    {
+        log( LOG_ERR, __FILE__, __LINE__, "build connection to server failed: %s", strerror( errno ) );
+        close( sockfd );
+        connect_failed( connection );
+        return;
+    }
+
+    connecting* pending = new connecting;
+    pending->handler.fd = sockfd;
+    pending->handler.handle_event = on_connect_event;
+    pending->handler.user_data = pending;
+    pending->connection = connection;
+    pending->owner = this;
+    pending->timer = m_loop->create_timer( on_connect_timeout, pending );
+    m_loop->add( &pending->handler, EPOLLOUT | EPOLLET );
+    m_loop->add_timer( pending->timer, CONNECT_TIMEOUT );
+    m_connecting.insert( pending );
+}
+
+// fd可写说明连接已有结果，用SO_ERROR区分成功和失败（9-5unblockconnect.cpp）
+void mgr::on_connect_event( event_handler* handler, uint32_t events )
+{
+    connecting* pending = static_cast< connecting* >( handler->user_data );
+    int error = 0;
+    socklen_t length = sizeof( error );
+    if( getsockopt( handler->fd, SOL_SOCKET, SO_ERROR, &error, &length ) < 0 )
+    {
+        error = errno;
+    }
+    if( error != 0 )
+    {
+        log( LOG_ERR, __FILE__, __LINE__, "build connection to server failed: %s", strerror( error ) );
+    }
+    pending->owner->finish_connect( pending, error == 0 );
+}
+
+void mgr::on_connect_timeout( dheap_timer* timer )
+{
+    connecting* pending = static_cast< connecting* >( timer->user_data );
+    log( LOG_ERR, __FILE__, __LINE__, "%s", "build connection to server timeout" );
+    pending->owner->finish_connect( pending, false );
+}
+
+void mgr::finish_connect( connecting* pending, bool ok )
+{
+    int sockfd = pending->handler.fd;
+    m_loop->remove( &pending->handler );
+    m_loop->destroy_timer( pending->timer );
+    m_connecting.erase( pending );
+    if( ok )
+    {
+        connected( pending->connection, sockfd );
+    }
+    else
+    {
+        close( sockfd );
+        connect_failed( pending->connection );
+    }
+    delete pending;
+}
+
+void mgr::connected( conn* connection, int sockfd )
+{
+    log( LOG_INFO, __FILE__, __LINE__, "build connection %d to server success", sockfd );
+    connection->init_srv( sockfd, m_srv_address );
+    m_conns.insert( pair< int, conn* >( sockfd, connection ) );
+    m_failures = 0;
+}
+
+// 同一轮中同时失败的多个连接只退避一次
+void mgr::connect_failed( conn* connection )
+{
+    m_freed.push_back( connection );
+    m_health->record_failure();
+    if( m_retry_timer->pending() )
+    {
+        return;
+    }
+    int shift = m_failures < 20 ? m_failures : 20;
+    int64_t delay = RETRY_BASE << shift;
+    if( delay > RETRY_MAX )
+    {
+        delay = RETRY_MAX;
+    }
+    delay = delay / 2 + ( int64_t )( rand_r( &m_seed ) / ( RAND_MAX + 1.0 ) * ( delay / 2 ) );
+    ++m_failures;
+    log( LOG_INFO, __FILE__, __LINE__, "retry connecting to server in %lld ms", ( long long )( delay / 1000000 ) );
+    m_loop->add_timer( m_retry_timer, delay );
+}
+
+void mgr::set_notify_callback( void ( *callback )( void* arg ), void* arg )
+{
+    m_notify_callback = callback;
+    m_notify_arg = arg;
+    m_health->set_state_callback( callback, arg );
+}
+
+void mgr::add_fd( event_handler* handler, int fd )
+{
+    handler->fd = fd;
+    handler->handle_event = handle_event;
+    handler->user_data = this;
+    m_loop->add( handler, EPOLLIN | EPOLLET );
+    setnonblocking( fd );
+}
+
+void mgr::close_fd( event_handler* handler )
+{
+    m_loop->remove( handler );
+    close( handler->fd );
+}
+
+void mgr::modfd( conn* connection, int fd, int ev )
+{
+    event_handler* handler = fd == connection->m_cltfd ? &connection->m_clt_handler : &connection->m_srv_handler;
+    m_loop->modify( handler, ev | EPOLLET );
+}
+
+void mgr::handle_event( event_handler* handler, uint32_t events )
+{
+    mgr* manager = static_cast< mgr* >( handler->user_data );
+    RET_CODE result = NOTHING;
+    if( events & EPOLLIN )
+    {
+        result = manager->process( handler->fd, READ );
+    }
+    else if( events & EPOLLOUT )
+    {
+        result = manager->process( handler->fd, WRITE );
+    }
+    if( result == CLOSED && manager->m_notify_callback )
+    {
+        manager->m_notify_callback( manager->m_notify_arg );
+    }
+}
+
+// m_used中每个客户连接有客户端和服务器端两项
 int mgr::get_used_conn_cnt()
 {
-    return m_used.size();
+    return m_used.size() / 2;
+}
+
+bool mgr::healthy() const
+{
+    return m_health->state() == HEALTHY;
+}
+
+int64_t mgr::latency() const
+{
+    return m_health->latency();
 }
 
 conn* mgr::pick_conn( int cltfd  )
@@ -103,9 +292,10 @@ conn* mgr::pick_conn( int cltfd  )
     m_conns.erase( iter );
     m_used.insert( pair< int, conn* >( cltfd, tmp ) );
     m_used.insert( pair< int, conn* >( srvfd, tmp ) );
-    add_read_fd( m_epollfd, cltfd );
-    add_read_fd( m_epollfd, srvfd );
+    add_fd( &tmp->m_clt_handler, cltfd );
+    add_fd( &tmp->m_srv_handler, srvfd );
     log( LOG_INFO, __FILE__, __LINE__, "bind client sock %d with server sock %d", cltfd, srvfd );
+    replenish();
     return tmp;
 }
 
@@ -113,38 +303,13 @@ void mgr::free_conn( conn* connection )
 {
     int cltfd = connection->m_cltfd;
     int srvfd = connection->m_srvfd;
-    closefd( m_epollfd, cltfd );
-    closefd( m_epollfd, srvfd );
+    close_fd( &connection->m_clt_handler );
+    close_fd( &connection->m_srv_handler );
     m_used.erase( cltfd );
     m_used.erase( srvfd );
     connection->reset();
-    m_freed.insert( pair< int, conn* >( srvfd, connection ) );
-}
-
-void mgr::recycle_conns()
-{
-    if( m_freed.empty() )
-    {
-        return;
-    }
-    for( map< int, conn* >::iterator iter = m_freed.begin(); iter != m_freed.end(); iter++ )
-    {
-        sleep( 1 );
-        int srvfd = iter->first;
-        conn* tmp = iter->second;
-        srvfd = conn2srv( tmp->m_srv_address );
-        if( srvfd < 0 )
-        {
-            log( LOG_ERR, __FILE__, __LINE__, "%s", "fix connection failed");
-        }
-        else
-        {
-            log( LOG_INFO, __FILE__, __LINE__, "%s", "fix connection success" );
-            tmp->init_srv( srvfd, tmp->m_srv_address );
-            m_conns.insert( pair< int, conn* >( srvfd, tmp ) );
-        }
-    }
-    m_freed.clear();
+    m_freed.push_back( connection );
+    replenish();
 }
 
 RET_CODE mgr::process( int fd, OP_TYPE type )
@@ -170,7 +335,7 @@ RET_CODE mgr::process( int fd, OP_TYPE type )
                     }
                     case BUFFER_FULL:
                     {
-                        modfd( m_epollfd, srvfd, EPOLLOUT );
+                        modfd( connection, srvfd, EPOLLOUT );
                         break;
                     }
                     case IOERR:
@@ -196,13 +361,13 @@ RET_CODE mgr::process( int fd, OP_TYPE type )
                 {
                     case TRY_AGAIN:
                     {
-                        modfd( m_epollfd, fd, EPOLLOUT );
+                        modfd( connection, fd, EPOLLOUT );
                         break;
                     }
                     case BUFFER_EMPTY:
                     {
-                        modfd( m_epollfd, srvfd, EPOLLIN );
-                        modfd( m_epollfd, fd, EPOLLIN );
+                        modfd( connection, srvfd, EPOLLIN );
+                        modfd( connection, fd, EPOLLIN );
                         break;
                     }
                     case IOERR:
@@ -244,13 +409,24 @@ RET_CODE mgr::process( int fd, OP_TYPE type )
                     }
                     case BUFFER_FULL:
                     {
-                        modfd( m_epollfd, cltfd, EPOLLOUT );
+                        // 被动健康检查：请求发出到响应首字节的延迟
+                        if( connection->m_sent_at != 0 )
+                        {
+                            m_health->record_success( dheap::now_ns() - connection->m_sent_at );
+                            connection->m_sent_at = 0;
+                        }
+                        modfd( connection, cltfd, EPOLLOUT );
                         break;
                     }
                     case IOERR:
                     case CLOSED:
                     {
-                        modfd( m_epollfd, cltfd, EPOLLOUT );
+                        // 空闲时被服务器关闭不算失败，请求没有得到响应或者出错才算
+                        if( res == IOERR || connection->m_sent_at != 0 )
+                        {
+                            m_health->record_failure();
+                        }
+                        modfd( connection, cltfd, EPOLLOUT );
                         connection->m_srv_closed = true;
                         break;
                     }
@@ -261,18 +437,22 @@ RET_CODE mgr::process( int fd, OP_TYPE type )
             }
             case WRITE:
             {
+                if( connection->m_sent_at == 0 && connection->m_clt_read_idx > connection->m_clt_write_idx )
+                {
+                    connection->m_sent_at = dheap::now_ns();
+                }
                 RET_CODE res = connection->write_srv();
                 switch( res )
                 {
                     case TRY_AGAIN:
                     {
-                        modfd( m_epollfd, fd, EPOLLOUT );
+                        modfd( connection, fd, EPOLLOUT );
                         break;
                     }
                     case BUFFER_EMPTY:
                     {
-                        modfd( m_epollfd, cltfd, EPOLLIN );
-                        modfd( m_epollfd, fd, EPOLLIN );
+                        modfd( connection, cltfd, EPOLLIN );
+                        modfd( connection, fd, EPOLLIN );
                         break;
                     }
                     case IOERR:
@@ -285,10 +465,11 @@ RET_CODE mgr::process( int fd, OP_TYPE type )
                         }
                         else
                         {
-                            modfd( m_epollfd, cltfd, EPOLLOUT );
+                            modfd( connection, cltfd, EPOLLOUT );
                         }
                         */
-                        modfd( m_epollfd, cltfd, EPOLLOUT );
+                        m_health->record_failure();
+                        modfd( connection, cltfd, EPOLLOUT );
                         connection->m_srv_closed = true;
                         break;
                     }
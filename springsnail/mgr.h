@@ -2,11 +2,16 @@
 #define SRVMGR_H
 
 #include <map>
+#include <set>
+#include <vector>
 #include <arpa/inet.h>
 #include "fdwrapper.h"
 #include "conn.h"
+#include "health.h"
 
 using std::map;
+using std::set;
+using std::vector;
 
 class host
 {
@@ -14,26 +19,69 @@ public:
     char m_hostname[1024];
     int m_port;
     int m_conncnt;
+    int m_min_idle;     // 至少保持多少条空闲连接，配置中没有<min_idle>时为-1，取m_conncnt
+    char m_check_uri[256];  // <health_check>，健康检查用的HTTP路径，为空时只做TCP探测
+    int m_max_latency;      // <max_latency>，平均响应延迟超过它（毫秒）时摘除，0表示不检查
+    int m_weight;           // <weight>，加权轮询和一致性哈希用，默认1
 };
 
 class mgr
 {
 public:
-    mgr( int epollfd, const host& srv );
+    mgr( event_loop* loop, const host& srv );
     ~mgr();
-    int conn2srv( const sockaddr_in& address );
     conn* pick_conn( int sockfd );
     void free_conn( conn* connection );
+    // 正在服务的客户连接数
     int get_used_conn_cnt();
-    void recycle_conns();
+    // 后端没有被摘除，可以分配新的客户连接
+    bool healthy() const;
+    // 后端响应延迟的EWMA，纳秒
+    int64_t latency() const;
     RET_CODE process( int fd, OP_TYPE type );
+    // 客户连接关闭、服务器连接被释放或后端健康状态变化后调用，进程池借此向父进程报告
+    void set_notify_callback( void ( *callback )( void* arg ), void* arg );
 
 private:
-    static int m_epollfd;
+    // 一次进行中的connect：fd以EPOLLOUT注册，连接建立或失败时可写，超时由定时器处理
+    struct connecting
+    {
+        event_handler handler;
+        dheap_timer* timer;
+        conn* connection;
+        mgr* owner;
+    };
+
+    static void handle_event( event_handler* handler, uint32_t events );
+    static void on_connect_event( event_handler* handler, uint32_t events );
+    static void on_connect_timeout( dheap_timer* timer );
+    static void on_retry( dheap_timer* timer );
+    void replenish();
+    void connect_async( conn* connection );
+    void finish_connect( connecting* pending, bool ok );
+    void connected( conn* connection, int sockfd );
+    void connect_failed( conn* connection );
+    conn* alloc_conn();
+    void add_fd( event_handler* handler, int fd );
+    void close_fd( event_handler* handler );
+    void modfd( conn* connection, int fd, int ev );
+
+private:
+    event_loop* m_loop;
+    void ( *m_notify_callback )( void* arg );
+    void* m_notify_arg;
     map< int, conn* > m_conns;
     map< int, conn* > m_used;
-    map< int, conn* > m_freed;
+    vector< conn* > m_freed;        // 没有服务器连接的conn对象，留着重用
+    set< connecting* > m_connecting;
+    // 空闲连接少于m_min_idle时补充；连接失败后按带抖动的指数退避等待m_retry_timer再试
+    int m_min_idle;
+    int m_failures;                 // 连续失败的轮数，成功后清零
+    unsigned int m_seed;
+    dheap_timer* m_retry_timer;
+    health* m_health;
     host m_logic_srv;
+    sockaddr_in m_srv_address;
 };
 
 #endif
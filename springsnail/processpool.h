@@ -19,6 +19,8 @@
 #include <vector>
 #include "log.h"
 #include "fdwrapper.h"
+#include "event_loop.h"
+#include "balancer.h"
 
 using std::vector;
 
@@ -28,11 +30,18 @@ public:
     process() : m_pid( -1 ){}
 
 public:
-    int m_busy_ratio;
     pid_t m_pid;
     int m_pipefd[2];
 };
 
+// 子进程向父进程报告的状态，每次一条消息
+struct child_status
+{
+    int outstanding;    // 正在服务的客户连接数
+    int healthy;        // 后端没有被摘除
+    int64_t latency;    // 后端响应延迟的EWMA，纳秒
+};
+
 template< typename C, typename H, typename M >
 class processpool
 {
@@ -51,14 +60,20 @@ public:
     {
         delete [] m_sub_process;
     }
-    void run( const vector<H>& arg );
+    // lb只在父进程中使用，由调用者释放
+    void run( const vector<H>& arg, balancer* lb );
 
 private:
-    void notify_parent_busy_ratio( int pipefd, M* manager );
-    int get_most_free_srv();
-    void setup_sig_pipe();
+    void notify_parent_status( int pipefd, M* manager );
+    void setup_loop();
     void run_parent();
     void run_child( const vector<H>& arg );
+    static void on_new_conn( event_handler* handler, uint32_t events );
+    static void on_status_changed( void* arg );
+    static void on_child_signal( int sig, void* arg );
+    static void on_listen( event_handler* handler, uint32_t events );
+    static void on_child_status( event_handler* handler, uint32_t events );
+    static void on_parent_signal( int sig, void* arg );
 
 private:
     static const int MAX_PROCESS_NUMBER = 16;
@@ -66,25 +81,17 @@ private:
     static const int MAX_EVENT_NUMBER = 10000;
     int m_process_number;
     int m_idx;
-    int m_epollfd;
     int m_listenfd;
-    int m_stop;
+    event_loop* m_loop;
+    M* m_manager;
+    balancer* m_balancer;
+    int m_pipefd;
     process* m_sub_process;
     static processpool< C, H, M >* m_instance;
 };
 template< typename C, typename H, typename M >
 processpool< C, H, M >* processpool< C, H, M >::m_instance = NULL;
 
-static int EPOLL_WAIT_TIME = 5000;
-static int sig_pipefd[2];
-static void sig_handler( int sig )
-{
-    int save_errno = errno;
-    int msg = sig;
-    send( sig_pipefd[1], ( char* )&msg, 1, 0 );
-    errno = save_errno;
-}
-
 static void addsig( int sig, void( handler )(int), bool restart = true )
 {
     struct sigaction sa;
@@ -100,7 +107,8 @@ static void addsig( int sig, void( handler )(int), bool restart = true )
 
 template< typename C, typename H, typename M >
 processpool< C, H, M >::processpool( int listenfd, int process_number ) 
-    : m_listenfd( listenfd ), m_process_number( process_number ), m_idx( -1 ), m_stop( false )
+    : m_process_number( process_number ), m_idx( -1 ), m_listenfd( listenfd ), m_loop( NULL ), m_manager( NULL ),
+      m_balancer( NULL ), m_pipefd( -1 )
 {
     assert( ( process_number > 0 ) && ( process_number <= MAX_PROCESS_NUMBER ) );
 
@@ -109,7 +117,9 @@ processpool< C, H, M >::processpool( int listenfd, int process_number )
 
     for( int i = 0; i < process_number; ++i )
     {
-        int ret = socketpair( PF_UNIX, SOCK_STREAM, 0, m_sub_process[i].m_pipefd );
+        // 父进程经它把客户连接的fd交给子进程，子进程经它报告状态。SOCK_SEQPACKET保持消息边界，
+        // 又不像SOCK_DGRAM那样受net.unix.max_dgram_qlen（默认10）限制，一批连接同时到达时不会发送失败
+        int ret = socketpair( PF_UNIX, SOCK_SEQPACKET, 0, m_sub_process[i].m_pipefd );
         assert( ret == 0 );
 
         m_sub_process[i].m_pid = fork();
@@ -117,7 +127,6 @@ processpool< C, H, M >::processpool( int listenfd, int process_number )
         if( m_sub_process[i].m_pid > 0 )
         {
             close( m_sub_process[i].m_pipefd[1] );
-            m_sub_process[i].m_busy_ratio = 0;
             continue;
         }
         else
@@ -129,343 +138,294 @@ processpool< C, H, M >::processpool( int listenfd, int process_number )
     }
 }
 
+// 父子进程各自有一个事件循环，信号通过signalfd变成普通事件
 template< typename C, typename H, typename M >
-int processpool< C, H, M >::get_most_free_srv()
+void processpool< C, H, M >::setup_loop()
 {
-    int ratio = m_sub_process[0].m_busy_ratio;
-    int idx = 0;
-    for( int i = 0; i < m_process_number; ++i )
-    {
-        if( m_sub_process[i].m_busy_ratio < ratio )
-        {
-            idx = i;
-            ratio = m_sub_process[i].m_busy_ratio;
-        }
-    }
-    return idx;
-}
-
-template< typename C, typename H, typename M >
-void processpool< C, H, M >::setup_sig_pipe()
-{
-    m_epollfd = epoll_create( 5 );
-    assert( m_epollfd != -1 );
-
-    int ret = socketpair( PF_UNIX, SOCK_STREAM, 0, sig_pipefd );
-    assert( ret != -1 );
-
-    setnonblocking( sig_pipefd[1] );
-    add_read_fd( m_epollfd, sig_pipefd[0] );
-
-    addsig( SIGCHLD, sig_handler );
-    addsig( SIGTERM, sig_handler );
-    addsig( SIGINT, sig_handler );
+    m_loop = new event_loop( MAX_EVENT_NUMBER );
+    event_loop::signal_func func = m_idx == -1 ? on_parent_signal : on_child_signal;
+    m_loop->add_signal( SIGCHLD, func, this );
+    m_loop->add_signal( SIGTERM, func, this );
+    m_loop->add_signal( SIGINT, func, this );
     addsig( SIGPIPE, SIG_IGN );
 }
 
 template< typename C, typename H, typename M >
-void processpool< C, H, M >::run( const vector<H>& arg )
+void processpool< C, H, M >::run( const vector<H>& arg, balancer* lb )
 {
     if( m_idx != -1 )
     {
         run_child( arg );
         return;
     }
+    m_balancer = lb;
     run_parent();
 }
 
+// 父进程只关心最新的状态，发送缓冲区满时丢掉这一条，下一条会更正
 template< typename C, typename H, typename M >
-void processpool< C, H, M >::notify_parent_busy_ratio( int pipefd, M* manager )
+void processpool< C, H, M >::notify_parent_status( int pipefd, M* manager )
 {
-    int msg = manager->get_used_conn_cnt();
-    send( pipefd, ( char* )&msg, 1, 0 );    
+    child_status status;
+    status.outstanding = manager->get_used_conn_cnt();
+    status.healthy = manager->healthy() ? 1 : 0;
+    status.latency = manager->latency();
+    send( pipefd, ( char* )&status, sizeof( status ), 0 );
 }
 
+// 父进程传来了客户连接：为它绑定一个到服务器的连接
 template< typename C, typename H, typename M >
-void processpool< C, H, M >::run_child( const vector<H>& arg )
+void processpool< C, H, M >::on_new_conn( event_handler* handler, uint32_t events )
 {
-    setup_sig_pipe();
-
-    int pipefd_read = m_sub_process[m_idx].m_pipefd[ 1 ];
-    add_read_fd( m_epollfd, pipefd_read );
-
-    epoll_event events[ MAX_EVENT_NUMBER ];
-
-    M* manager = new M( m_epollfd, arg[m_idx] );
-    assert( manager );
-
-    int number = 0;
-    int ret = -1;
-
-    while( ! m_stop )
+    processpool< C, H, M >* pool = static_cast< processpool< C, H, M >* >( handler->user_data );
+    // 边沿触发，把等待的连接全部取出
+    int connfd;
+    while( ( connfd = recv_fd( handler->fd ) ) >= 0 )
     {
-        number = epoll_wait( m_epollfd, events, MAX_EVENT_NUMBER, EPOLL_WAIT_TIME );
-        if ( ( number < 0 ) && ( errno != EINTR ) )
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof( client_address );
+        if( getpeername( connfd, ( struct sockaddr* )&client_address, &client_addrlength ) < 0 )
         {
-            log( LOG_ERR, __FILE__, __LINE__, "%s", "epoll failure" );
-            break;
+            close( connfd );
+            continue;
         }
-
-        if( number == 0 )
+        C* conn = pool->m_manager->pick_conn( connfd );
+        if( !conn )
         {
-            manager->recycle_conns();
+            close( connfd );
             continue;
         }
+        conn->init_clt( connfd, client_address );
+    }
+    pool->notify_parent_status( pool->m_pipefd, pool->m_manager );
+}
+
+template< typename C, typename H, typename M >
+void processpool< C, H, M >::on_status_changed( void* arg )
+{
+    processpool< C, H, M >* pool = static_cast< processpool< C, H, M >* >( arg );
+    pool->notify_parent_status( pool->m_pipefd, pool->m_manager );
+}
 
-        for ( int i = 0; i < number; i++ )
+template< typename C, typename H, typename M >
+void processpool< C, H, M >::on_child_signal( int sig, void* arg )
+{
+    processpool< C, H, M >* pool = static_cast< processpool< C, H, M >* >( arg );
+    switch( sig )
+    {
+        case SIGCHLD:
         {
-            int sockfd = events[i].data.fd;
-            if( ( sockfd == pipefd_read ) && ( events[i].events & EPOLLIN ) )
-            {
-                int client = 0;
-                ret = recv( sockfd, ( char* )&client, sizeof( client ), 0 );
-                if( ( ( ret < 0 ) && ( errno != EAGAIN ) ) || ret == 0 ) 
-                {
-                    continue;
-                }
-                else
-                {
-                    struct sockaddr_in client_address;
-                    socklen_t client_addrlength = sizeof( client_address );
-                    int connfd = accept( m_listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
-                    if ( connfd < 0 )
-                    {
-                        log( LOG_ERR, __FILE__, __LINE__, "errno: %s", strerror( errno ) );
-                        continue;
-                    }
-                    add_read_fd( m_epollfd, connfd );
-                    C* conn = manager->pick_conn( connfd );
-                    if( !conn )
-                    {
-                        closefd( m_epollfd, connfd );
-                        continue;
-                    }
-                    conn->init_clt( connfd, client_address );
-                    notify_parent_busy_ratio( pipefd_read, manager );
-                }
-            }
-            else if( ( sockfd == sig_pipefd[0] ) && ( events[i].events & EPOLLIN ) )
-            {
-                int sig;
-                char signals[1024];
-                ret = recv( sig_pipefd[0], signals, sizeof( signals ), 0 );
-                if( ret <= 0 )
-                {
-                    continue;
-                }
-                else
-                {
-                    for( int i = 0; i < ret; ++i )
-                    {
-                        switch( signals[i] )
-                        {
-                            case SIGCHLD:
-                            {
-                                pid_t pid;
-                                int stat;
-                                while ( ( pid = waitpid( -1, &stat, WNOHANG ) ) > 0 )
-                                {
-                                    continue;
-                                }
-                                break;
-                            }
-                            case SIGTERM:
-                            case SIGINT:
-                            {
-                                m_stop = true;
-                                break;
-                            }
-                            default:
-                            {
-                                break;
-                            }
-                        }
-                    }
-                }
-            }
-            else if( events[i].events & EPOLLIN )
-            {
-                 RET_CODE result = manager->process( sockfd, READ );
-                 switch( result )
-                 {
-                     case CLOSED:
-                     {
-                         notify_parent_busy_ratio( pipefd_read, manager );
-                         break;
-                     }
-                     default:
-                         break;
-                 }
-            }
-            else if( events[i].events & EPOLLOUT )
-            {
-                 RET_CODE result = manager->process( sockfd, WRITE );
-                 switch( result )
-                 {
-                     case CLOSED:
-                     {
-                         notify_parent_busy_ratio( pipefd_read, manager );
-                         break;
-                     }
-                     default:
-                         break;
-                 }
-            }
-            else
+            pid_t pid;
+            int stat;
+            while ( ( pid = waitpid( -1, &stat, WNOHANG ) ) > 0 )
             {
                 continue;
             }
+            break;
+        }
+        case SIGTERM:
+        case SIGINT:
+        {
+            pool->m_loop->quit();
+            break;
+        }
+        default:
+        {
+            break;
         }
     }
-
-    close( pipefd_read );
-    close( m_epollfd );
 }
 
 template< typename C, typename H, typename M >
-void processpool< C, H, M >::run_parent()
+void processpool< C, H, M >::run_child( const vector<H>& arg )
 {
-    setup_sig_pipe();
-
-    for( int i = 0; i < m_process_number; ++i )
+    setup_loop();
+
+    // 连接由父进程accept后传过来
+    close( m_listenfd );
+    m_pipefd = m_sub_process[m_idx].m_pipefd[ 1 ];
+    event_handler pipe_handler;
+    pipe_handler.fd = m_pipefd;
+    pipe_handler.handle_event = on_new_conn;
+    pipe_handler.user_data = this;
+    setnonblocking( m_pipefd );
+    m_loop->add( &pipe_handler, EPOLLIN | EPOLLET );
+
+    // 客户和服务器两端的fd由manager注册到事件循环，服务器连接的建立和补充也在其中异步进行
+    m_manager = new M( m_loop, arg[m_idx] );
+    assert( m_manager );
+    m_manager->set_notify_callback( on_status_changed, this );
+
+    if( ! m_loop->run() )
     {
-        add_read_fd( m_epollfd, m_sub_process[i].m_pipefd[ 0 ] );
+        log( LOG_ERR, __FILE__, __LINE__, "%s", "epoll failure" );
     }
 
-    add_read_fd( m_epollfd, m_listenfd );
-
-    epoll_event events[ MAX_EVENT_NUMBER ];
-    int sub_process_counter = 0;
-    int new_conn = 1;
-    int number = 0;
-    int ret = -1;
+    delete m_manager;
+    m_manager = NULL;
+    close( m_pipefd );
+    delete m_loop;
+    m_loop = NULL;
+}
 
-    while( ! m_stop )
+// 新连接由父进程accept，按负载均衡策略（一致性哈希需要客户地址）选一个子进程，把fd传给它
+template< typename C, typename H, typename M >
+void processpool< C, H, M >::on_listen( event_handler* handler, uint32_t events )
+{
+    processpool< C, H, M >* pool = static_cast< processpool< C, H, M >* >( handler->user_data );
+    while( true )
     {
-        number = epoll_wait( m_epollfd, events, MAX_EVENT_NUMBER, EPOLL_WAIT_TIME );
-        if ( ( number < 0 ) && ( errno != EINTR ) )
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof( client_address );
+        int connfd = accept( handler->fd, ( struct sockaddr* )&client_address, &client_addrlength );
+        if( connfd < 0 )
         {
-            log( LOG_ERR, __FILE__, __LINE__, "%s", "epoll failure" );
+            if( errno != EAGAIN && errno != EWOULDBLOCK )
+            {
+                log( LOG_ERR, __FILE__, __LINE__, "errno: %s", strerror( errno ) );
+            }
             break;
         }
+        int idx = pool->m_balancer->pick( client_address.sin_addr.s_addr );
+        if( ! send_fd( pool->m_sub_process[idx].m_pipefd[0], connfd ) )
+        {
+            log( LOG_ERR, __FILE__, __LINE__, "send connection to child %d failed: %s", idx, strerror( errno ) );
+            --pool->m_balancer->backend( idx ).outstanding;
+        }
+        else
+        {
+            log( LOG_INFO, __FILE__, __LINE__, "send request to child %d", idx );
+        }
+        close( connfd );
+    }
+}
 
-        for ( int i = 0; i < number; i++ )
+template< typename C, typename H, typename M >
+void processpool< C, H, M >::on_child_status( event_handler* handler, uint32_t events )
+{
+    processpool< C, H, M >* pool = static_cast< processpool< C, H, M >* >( handler->user_data );
+    int idx = 0;
+    while( idx < pool->m_process_number && pool->m_sub_process[idx].m_pipefd[0] != handler->fd )
+    {
+        ++idx;
+    }
+    // 边沿触发，读完所有报告，只用最后一条
+    child_status status;
+    bool got = false;
+    while( recv( handler->fd, ( char* )&status, sizeof( status ), 0 ) == sizeof( status ) )
+    {
+        got = true;
+    }
+    if( ! got || idx == pool->m_process_number || pool->m_sub_process[idx].m_pid == -1 )
+    {
+        return;
+    }
+    backend_state& state = pool->m_balancer->backend( idx );
+    state.outstanding = status.outstanding;
+    state.latency = status.latency;
+    if( state.available != ( status.healthy != 0 ) )
+    {
+        state.available = status.healthy != 0;
+        log( LOG_INFO, __FILE__, __LINE__, "child %d %s", idx, state.available ? "available" : "unavailable" );
+        pool->m_balancer->changed();
+    }
+}
+
+template< typename C, typename H, typename M >
+void processpool< C, H, M >::on_parent_signal( int sig, void* arg )
+{
+    processpool< C, H, M >* pool = static_cast< processpool< C, H, M >* >( arg );
+    switch( sig )
+    {
+        case SIGCHLD:
         {
-            int sockfd = events[i].data.fd;
-            if( sockfd == m_listenfd )
+            pid_t pid;
+            int stat;
+            while ( ( pid = waitpid( -1, &stat, WNOHANG ) ) > 0 )
             {
-                /*
-                int i =  sub_process_counter;
-                do
+                for( int i = 0; i < pool->m_process_number; ++i )
                 {
-                    if( m_sub_process[i].m_pid != -1 )
+                    if( pool->m_sub_process[i].m_pid == pid )
                     {
-                        break;
+                        log( LOG_INFO, __FILE__, __LINE__, "child %d join", i );
+                        pool->m_sub_process[i].m_pid = -1;
+                        pool->m_balancer->backend( i ).available = false;
+                        pool->m_balancer->changed();
                     }
-                    i = (i+1)%m_process_number;
                 }
-                while( i != sub_process_counter );
-                
-                if( m_sub_process[i].m_pid == -1 )
-                {
-                    m_stop = true;
-                    break;
-                }
-                sub_process_counter = (i+1)%m_process_number;
-                */
-                int idx = get_most_free_srv();
-                send( m_sub_process[idx].m_pipefd[0], ( char* )&new_conn, sizeof( new_conn ), 0 );
-                log( LOG_INFO, __FILE__, __LINE__, "send request to child %d", idx );
             }
-            else if( ( sockfd == sig_pipefd[0] ) && ( events[i].events & EPOLLIN ) )
+            // 所有子进程都退出了，父进程也退出
+            bool alive = false;
+            for( int i = 0; i < pool->m_process_number; ++i )
             {
-                int sig;
-                char signals[1024];
-                ret = recv( sig_pipefd[0], signals, sizeof( signals ), 0 );
-                if( ret <= 0 )
+                if( pool->m_sub_process[i].m_pid != -1 )
                 {
-                    continue;
-                }
-                else
-                {
-                    for( int i = 0; i < ret; ++i )
-                    {
-                        switch( signals[i] )
-                        {
-                            case SIGCHLD:
-                            {
-                                pid_t pid;
-                                int stat;
-                                while ( ( pid = waitpid( -1, &stat, WNOHANG ) ) > 0 )
-                                {
-                                    for( int i = 0; i < m_process_number; ++i )
-                                    {
-                                        if( m_sub_process[i].m_pid == pid )
-                                        {
-                                            log( LOG_INFO, __FILE__, __LINE__, "child %d join", i );
-                                            close( m_sub_process[i].m_pipefd[0] );
-                                            m_sub_process[i].m_pid = -1;
-                                        }
-                                    }
-                                }
-                                m_stop = true;
-                                for( int i = 0; i < m_process_number; ++i )
-                                {
-                                    if( m_sub_process[i].m_pid != -1 )
-                                    {
-                                        m_stop = false;
-                                    }
-                                }
-                                break;
-                            }
-                            case SIGTERM:
-                            case SIGINT:
-                            {
-                                log( LOG_INFO, __FILE__, __LINE__, "%s", "kill all the clild now" );
-                                for( int i = 0; i < m_process_number; ++i )
-                                {
-                                    int pid = m_sub_process[i].m_pid;
-                                    if( pid != -1 )
-                                    {
-                                        kill( pid, SIGTERM );
-                                    }
-                                }
-                                break;
-                            }
-                            default:
-                            {
-                                break;
-                            }
-                        }
-                    }
+                    alive = true;
                 }
             }
-            else if( events[i].events & EPOLLIN )
+            if( ! alive )
             {
-                int busy_ratio = 0;
-                ret = recv( sockfd, ( char* )&busy_ratio, sizeof( busy_ratio ), 0 );
-                if( ( ( ret < 0 ) && ( errno != EAGAIN ) ) || ret == 0 )
-                {
-                    continue;
-                }
-                for( int i = 0; i < m_process_number; ++i )
+                pool->m_loop->quit();
+            }
+            break;
+        }
+        case SIGTERM:
+        case SIGINT:
+        {
+            log( LOG_INFO, __FILE__, __LINE__, "%s", "kill all the clild now" );
+            for( int i = 0; i < pool->m_process_number; ++i )
+            {
+                int pid = pool->m_sub_process[i].m_pid;
+                if( pid != -1 )
                 {
-                    if( sockfd == m_sub_process[i].m_pipefd[0] )
-                    {
-                        m_sub_process[i].m_busy_ratio = busy_ratio;
-                        break;
-                    }
+                    kill( pid, SIGTERM );
                 }
-                continue;
             }
+            break;
         }
+        default:
+        {
+            break;
+        }
+    }
+}
+
+template< typename C, typename H, typename M >
+void processpool< C, H, M >::run_parent()
+{
+    setup_loop();
+
+    event_handler* pipe_handlers = new event_handler[ m_process_number ];
+    for( int i = 0; i < m_process_number; ++i )
+    {
+        pipe_handlers[i].fd = m_sub_process[i].m_pipefd[ 0 ];
+        pipe_handlers[i].handle_event = on_child_status;
+        pipe_handlers[i].user_data = this;
+        setnonblocking( pipe_handlers[i].fd );
+        m_loop->add( &pipe_handlers[i], EPOLLIN | EPOLLET );
+    }
+
+    event_handler listen_handler;
+    listen_handler.fd = m_listenfd;
+    listen_handler.handle_event = on_listen;
+    listen_handler.user_data = this;
+    setnonblocking( m_listenfd );
+    m_loop->add( &listen_handler, EPOLLIN | EPOLLET );
+
+    if( ! m_loop->run() )
+    {
+        log( LOG_ERR, __FILE__, __LINE__, "%s", "epoll failure" );
     }
 
     for( int i = 0; i < m_process_number; ++i )
     {
-        closefd( m_epollfd, m_sub_process[i].m_pipefd[ 0 ] );
+        m_loop->remove( &pipe_handlers[i] );
+        close( pipe_handlers[i].fd );
     }
-    close( m_epollfd );
+    delete [] pipe_handlers;
+    m_loop->remove( &listen_handler );
+    delete m_loop;
+    m_loop = NULL;
 }
 
 #endif